@@ -18,6 +18,8 @@
 #define __KM_HCALLS_H__
 
 #include <stdint.h>
+#include <time.h>
+#include <sys/syscall.h>
 
 /*
  * Definitions of hypercalls guest code (payload) can make into the KontainVM.
@@ -54,15 +56,7 @@ typedef enum {
 typedef km_hc_ret_t (*km_hcall_fn_t)(void* vcpu,
                                      int hc __attribute__((__unused__)),
                                      km_hc_args_t* guest_addr);
-typedef struct {
-   uint64_t count;   // times called
-   uint64_t total;   // usecs in hypercall
-   uint64_t min;     // min usecs
-   uint64_t max;     // max usecs
-} km_hc_stats_t;
-
 extern const km_hcall_fn_t km_hcalls_table[];
-extern km_hc_stats_t* km_hcalls_stats;
 
 /*
  * Maximum hypercall number, defines the size of the km_hcalls_table
@@ -73,7 +67,7 @@ extern km_hc_stats_t* km_hcalls_stats;
  * Hypercalls that don't translate directly into system calls.
  */
 enum km_internal_hypercalls {
-   HC_reserved1 = KM_MAX_HCALL - 1,
+   HC_hcall_ring = KM_MAX_HCALL - 1,
    HC_reserved2 = KM_MAX_HCALL - 2,
    HC_guest_interrupt = KM_MAX_HCALL - 3,
    HC_reserved3 = KM_MAX_HCALL - 5,
@@ -87,6 +81,306 @@ enum km_internal_hypercalls {
 
 extern const char* const km_hc_name_get(int hc);
 
+/*
+ * Hypercall submission ring.
+ *
+ * Every vcpu has a ring of km_hc_args_t in km guest memory, next to km_hcargs. The guest address of
+ * the ring is stored in the second pointer of the vcpu km_hcargs cache line, i.e. at
+ * %gs:KM_HC_RING_GS_OFFSET. The guest queues non-blocking calls into the ring and makes a single
+ * HC_hcall_ring hypercall (the doorbell) to have km execute all of them in order. Results are left in
+ * hc_ret of each entry. km also drains the ring before executing any other hypercall from the same
+ * vcpu, so queued calls are always ordered before the next synchronous one.
+ *
+ * Only the calls listed in km_hcall_ring_allowed() (km_hcalls.c) can be queued, others complete with
+ * -ENOSYS. Pointers in the queued args must stay valid until the ring is flushed.
+ */
+#define KM_HC_RING_ENTRIES 16
+#define KM_HC_RING_GS_OFFSET 8
+
+typedef struct km_hc_ring_entry {
+   uint64_t hc;
+   km_hc_args_t args;
+} km_hc_ring_entry_t;
+
+typedef struct km_hc_ring {
+   uint32_t head;   // next entry to be executed by km
+   uint32_t tail;   // next entry to be filled by the guest
+   uint8_t pad[56];
+   km_hc_ring_entry_t entries[KM_HC_RING_ENTRIES];
+} km_hc_ring_t;
+
+static inline km_hc_ring_t* km_hcall_ring(void)
+{
+   km_hc_ring_t* ring;
+   __asm__ __volatile__("mov %%gs:%c1,%0" : "=r"(ring) : "i"(KM_HC_RING_GS_OFFSET));
+   return ring;
+}
+
+/*
+ * Ring the doorbell. Returns the number of entries km executed.
+ */
+static inline long km_hcall_ring_flush(void)
+{
+   km_hc_args_t arg;
+   km_hcall(HC_hcall_ring, &arg);
+   return arg.hc_ret;
+}
+
+/*
+ * Queue a hypercall, flushing the ring first if it is full. Returns the ring slot, to be passed to
+ * km_hcall_ring_result() after the next flush.
+ */
+static inline int
+km_hcall_ring_queue(int hc, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4, uint64_t a5, uint64_t a6)
+{
+   km_hc_ring_t* ring = km_hcall_ring();
+   uint32_t tail = ring->tail;
+
+   if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) >= KM_HC_RING_ENTRIES) {
+      km_hcall_ring_flush();
+   }
+   km_hc_ring_entry_t* e = &ring->entries[tail % KM_HC_RING_ENTRIES];
+   e->hc = hc;
+   e->args = (km_hc_args_t){.arg1 = a1, .arg2 = a2, .arg3 = a3, .arg4 = a4, .arg5 = a5, .arg6 = a6};
+   __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+   return tail % KM_HC_RING_ENTRIES;
+}
+
+static inline long km_hcall_ring_result(int slot)
+{
+   return km_hcall_ring()->entries[slot].args.hc_ret;
+}
+
+/*
+ * Values km publishes so getpid() and friends can be answered without a hypercall, either by
+ * __km_syscall_handler for SYSCALL instruction or by the runtime directly. km keeps it current with
+ * km_guest_info_update(), the guest can only read it. Guest address is at %gs:KM_GS_INFO_OFFSET.
+ * Field offsets are mirrored in km_guest.asmh.
+ */
+typedef struct km_guest_info {
+   uint64_t valid;   // fast path is disabled when 0
+   uint64_t pid;
+   uint64_t ppid;
+   uint64_t uid;
+   uint64_t euid;
+   uint64_t gid;
+   uint64_t egid;
+   uint64_t umask;
+   uint64_t async;   // km_hc_async_t[KM_HC_ASYNC_QUEUES] gva, 0 if async hypercalls are off
+} km_guest_info_t;
+
+// Per vcpu values in the vcpu km_hcargs cache line, after the hcargs pointer and the ring pointer
+#define KM_GS_TID_OFFSET 16
+#define KM_GS_INFO_OFFSET 24
+#define KM_GS_TIME_OFFSET 32   // km_guest_time_t*
+
+/*
+ * Time page. km keeps clock values at a guest TSC reading (tsc_base) and the TSC to nsec conversion,
+ * so the guest can compute the time with rdtsc and no exit. The page is rebased by the
+ * clock_gettime() hypercall, which the guest falls back to when the base is older than max_delta
+ * TSC ticks. Updates are under the seq seqlock. The hypercall returns at least what the page
+ * gives, so the clocks don't go back when the guest switches between the two.
+ *
+ * CPU time clocks always make the hypercall, TSC time isn't CPU time.
+ */
+#define KM_TIME_MAX_NSEC 1000000000UL
+
+typedef struct km_guest_time {
+   uint32_t seq;     // odd while km is updating
+   uint32_t valid;   // 0 if the TSC can't be used, always use the hypercall
+   uint64_t mult;    // nsec = (tsc delta * mult) >> shift
+   uint32_t shift;
+   uint32_t pad;
+   uint64_t tsc_base;
+   uint64_t max_delta;   // TSC ticks since tsc_base the values are good for
+   uint64_t realtime;    // nsecs at tsc_base
+   uint64_t monotonic;
+   uint64_t monotonic_raw;
+   uint64_t boottime;
+   uint64_t tai;
+} km_guest_time_t;
+
+static inline uint64_t km_rdtsc(void)
+{
+   uint32_t lo, hi;
+   __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+   return (uint64_t)hi << 32 | lo;
+}
+
+static inline uint64_t km_gs_read(int offset)
+{
+   uint64_t v;
+   __asm__ __volatile__("mov %%gs:(%1),%0" : "=r"(v) : "r"((uint64_t)offset));
+   return v;
+}
+
+static inline uint64_t km_tsc_to_nsec(const km_guest_time_t* t, uint64_t delta)
+{
+   return (uint64_t)(((unsigned __int128)delta * t->mult) >> t->shift);
+}
+
+/*
+ * Guest side clock_gettime() from the time page. Returns 0 on success, -1 if the caller needs to
+ * make the hypercall.
+ */
+static inline int km_guest_clock_gettime(clockid_t clk, struct timespec* ts)
+{
+   const volatile km_guest_time_t* t = (km_guest_time_t*)km_gs_read(KM_GS_TIME_OFFSET);
+   uint32_t seq;
+   uint64_t ns;
+
+   if (t == NULL || t->valid == 0) {
+      return -1;
+   }
+   do {
+      seq = __atomic_load_n(&t->seq, __ATOMIC_ACQUIRE);
+      uint64_t tsc = km_rdtsc();
+      uint64_t delta = tsc - t->tsc_base;
+      if ((seq & 1) != 0 || tsc < t->tsc_base || delta > t->max_delta) {
+         return -1;
+      }
+      switch (clk) {
+         case CLOCK_REALTIME:
+         case CLOCK_REALTIME_COARSE:
+            ns = t->realtime;
+            break;
+         case CLOCK_MONOTONIC:
+         case CLOCK_MONOTONIC_COARSE:
+            ns = t->monotonic;
+            break;
+         case CLOCK_MONOTONIC_RAW:
+            ns = t->monotonic_raw;
+            break;
+         case CLOCK_BOOTTIME:
+            ns = t->boottime;
+            break;
+         case CLOCK_TAI:
+            ns = t->tai;
+            break;
+         default:
+            return -1;
+      }
+      ns += km_tsc_to_nsec((const km_guest_time_t*)t, delta);
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+   } while (__atomic_load_n(&t->seq, __ATOMIC_RELAXED) != seq);
+   ts->tv_sec = ns / 1000000000UL;
+   ts->tv_nsec = ns % 1000000000UL;
+   return 0;
+}
+
+/*
+ * Asynchronous hypercalls (km --async-hcalls). Short writes to stdout and stderr are queued into
+ * one of KM_HC_ASYNC_QUEUES queues in guest memory, picked by fd so calls on an fd stay ordered,
+ * and executed by a km worker thread per queue. The doorbell is an OUT to
+ * KM_HC_ASYNC_PORT_BASE + queue, which km registers as KVM ioeventfd, so the vcpu doesn't exit to
+ * km, and the guest only rings it when the worker is asleep. The data is copied into the entry, so
+ * the guest gets the full count back right away. Errors are returned by the next synchronous
+ * write/fsync/close/dup2 etc. on the same fd, and km waits for queued calls on that fd before
+ * executing those (see km_hc_async_fence()). While a queue has an error pending the guest doesn't
+ * queue to it, so the next write gets the error, and EPIPE raises SIGPIPE like a synchronous write.
+ *
+ * Queues are multi producer: a slot at position pos is free when seq == pos, filled when
+ * seq == pos + 1, and reused by the worker with seq = pos + KM_HC_ASYNC_ENTRIES.
+ */
+#define KM_HC_ASYNC_PORT_BASE (KM_HCALL_PORT_BASE + KM_MAX_HCALL)
+#define KM_HC_ASYNC_QUEUES 4
+#define KM_HC_ASYNC_ENTRIES 64
+#define KM_HC_ASYNC_DATA 440
+
+typedef struct km_hc_async_entry {
+   uint64_t seq;
+   uint64_t hc;
+   km_hc_args_t args;
+   uint8_t data[KM_HC_ASYNC_DATA];   // copy of the write buffer, args.arg2 points here
+} km_hc_async_entry_t;
+
+typedef struct km_hc_async {
+   uint64_t tail;   // next slot for the guest
+   uint8_t pad1[56];
+   uint64_t head;       // next slot for the worker
+   uint32_t sleeping;   // worker waits for the doorbell
+   uint32_t error;      // a queued call failed and the error wasn't returned yet
+   uint8_t pad2[48];
+   km_hc_async_entry_t entries[KM_HC_ASYNC_ENTRIES];
+} km_hc_async_t;
+
+/*
+ * Queue write()/writev() of up to KM_HC_ASYNC_DATA bytes to stdout or stderr. Returns 1 and sets
+ * *ret if queued, 0 if the caller needs to make the hypercall.
+ */
+static inline int km_hcall_async_write(long n, long fd, long a2, long a3, long* ret)
+{
+   km_guest_info_t* gi = (km_guest_info_t*)km_gs_read(KM_GS_INFO_OFFSET);
+   km_hc_async_t* q;
+   size_t len = 0;
+
+   if (gi == NULL || gi->async == 0 || (fd != 1 && fd != 2)) {
+      return 0;
+   }
+   if (n == SYS_write) {
+      len = a3;
+   } else if (n == SYS_writev) {
+      const uint64_t* iov = (const uint64_t*)a2;   // struct iovec pairs
+      if (a3 <= 0 || a3 > KM_HC_ASYNC_DATA) {
+         return 0;
+      }
+      for (int i = 0; i < a3 && len <= KM_HC_ASYNC_DATA; i++) {
+         if (iov[2 * i + 1] > KM_HC_ASYNC_DATA) {
+            return 0;   // can't be queued, and the sum could wrap. The hypercall checks the total
+         }
+         len += iov[2 * i + 1];
+      }
+   } else {
+      return 0;
+   }
+   if (len == 0 || len > KM_HC_ASYNC_DATA) {
+      return 0;
+   }
+   q = (km_hc_async_t*)gi->async + fd % KM_HC_ASYNC_QUEUES;
+   if (__atomic_load_n(&q->error, __ATOMIC_ACQUIRE) != 0) {
+      return 0;   // the hypercall returns the error
+   }
+   uint64_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+   km_hc_async_entry_t* e;
+   while (1) {
+      e = &q->entries[pos % KM_HC_ASYNC_ENTRIES];
+      int64_t diff = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) - pos;
+      if (diff == 0) {
+         if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+         }
+      } else if (diff < 0) {
+         return 0;   // full
+      } else {
+         pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+      }
+   }
+   if (n == SYS_write) {
+      __builtin_memcpy(e->data, (void*)a2, len);
+   } else {
+      const uint64_t* iov = (const uint64_t*)a2;
+      size_t off = 0;
+      for (int i = 0; i < a3; i++) {
+         __builtin_memcpy(e->data + off, (void*)iov[2 * i], iov[2 * i + 1]);
+         off += iov[2 * i + 1];
+      }
+   }
+   e->hc = SYS_write;
+   e->args.arg1 = fd;
+   e->args.arg2 = (uint64_t)e->data;
+   e->args.arg3 = len;
+   __atomic_store_n(&e->seq, pos + 1, __ATOMIC_RELEASE);
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);   // pairs with the worker setting sleeping
+   if (__atomic_load_n(&q->sleeping, __ATOMIC_RELAXED) != 0) {
+      __asm__ __volatile__("outl %0, %1"
+                           :
+                           : "a"(0), "d"((uint16_t)(KM_HC_ASYNC_PORT_BASE + fd % KM_HC_ASYNC_QUEUES))
+                           : "memory");
+   }
+   *ret = len;
+   return 1;
+}
+
 #define KM_TRACE_HC "hypercall"
 #define KM_TRACE_SCHED "sched"
 
@@ -152,8 +152,8 @@ typedef struct km_vcpu {
    uint16_t hypercall;                 // hypercall #
    uint8_t restart;                    // hypercall needs restarting
    km_vcpu_state_t state;              // state
-   uint8_t regs_valid;                 // Are registers valid?
-   uint8_t sregs_valid;                // Are segment registers valid?
+   uint8_t regs_valid;                 // Are cached registers valid? (see km_vcpu_sync_regs())
+   uint8_t sregs_valid;                // Are cached segment registers valid?
    uint8_t in_sigsuspend;              // if true thread is running in the sigsuspend() hypercall
    uint8_t hypercall_returns_signal;   // if true a hypercall is returning a signal directly to the
                                        // caller so there is no need to setup the signal handler
@@ -176,6 +176,7 @@ typedef struct km_vcpu {
    pthread_cond_t signal_wait_cv;      // wait for signals with this cv
    km_sigset_t saved_sigmask;          // sigmask saved by sigsuspend()
    TAILQ_ENTRY(km_vcpu) signal_link;   // link for signal waiting queue
+   km_gva_t pt_stale_cr2;              // page fault retried as stale, see km_mem_pt_fault_stale()
    /*
     * Linux/Pthread handshake hacks. These are actually part of the standard.
     */
@@ -208,6 +209,14 @@ typedef enum {
    KM_FLAG_FORCE_KEEP = 0,
 } km_flag_force_t;
 
+// --hugepages, what backs guest memory regions
+typedef enum {
+   KM_HUGEPAGES_NONE = 0,
+   KM_HUGEPAGES_THP,   // transparent huge pages, madvise(MADV_HUGEPAGE)
+   KM_HUGEPAGES_2M,    // hugetlb 2MB pages
+   KM_HUGEPAGES_1G,    // hugetlb 1GB pages, 2MB for regions smaller than 1GB
+} km_hugepages_t;
+
 // struct for passing command line / config information into different inits.
 typedef struct km_machine_init_params {
    uint64_t guest_physmem;         // Requested size of guest physical memory in bytes
@@ -215,6 +224,7 @@ typedef struct km_machine_init_params {
    km_flag_force_t overcommit_memory;   // memory overcommit (i.e. MAP_NORESERVE in mmap)
                                         // Note: if too much of it is accessed, we expect Linux
                                         // OOM killer to kick in
+   km_hugepages_t hugepages;            // huge pages for guest memory
    char* vdev_name;   // Device name. Virtualization type is defined by ioctl after this file is open
 } km_machine_init_params_t;
 extern km_machine_init_params_t km_machine_init_params;
@@ -241,6 +251,18 @@ void km_signal_passthru(int signo, siginfo_t* sinfo, void* ucontext);
 
 void km_hcalls_init(void);
 void km_hcalls_fini(void);
+int km_hcall_ring_drain(km_vcpu_t* vcpu);
+void km_hcall_ring_drain_all(void);
+void km_guest_info_update(void);
+void km_hc_async_init(void);
+void km_hc_async_fini(void);
+void km_hc_async_fork_child(void);
+void km_hc_async_drain(void);
+int km_hc_async_fence(int hc, km_hc_args_t* arg);
+void km_guest_time_update(void);
+void km_guest_time_refresh(void);
+void km_guest_time_clamp(clockid_t clk, struct timespec* ts);
+uint64_t km_guest_rdtsc(void);
 
 /*
  * Actual `struct km_filesys` format is private to km_filesys.c
@@ -273,14 +295,25 @@ typedef struct km_mmap_reg {
    char* filename;
    off_t offset;   // offset into fd (if it exists).
    TAILQ_ENTRY(km_mmap_reg) link;
+   // index tree of the list, see km_mmap.c
+   struct km_mmap_reg* parent;
+   struct km_mmap_reg* left;
+   struct km_mmap_reg* right;
+   size_t max_size;   // largest region size in this subtree
+   int height;
 } km_mmap_reg_t;
 
 // mmaps control block
-typedef struct km_mmap_cb {   // control block
-   km_mmap_list_t free;       // list of free regions
-   km_mmap_list_t busy;       // list of mapped regions
-   pthread_mutex_t mutex;     // global map lock
-   int recovery_mode;         // disable region consolidation
+typedef struct km_mmap_cb {    // control block
+   km_mmap_list_t free;        // list of free regions
+   km_mmap_list_t busy;        // list of mapped regions
+   km_mmap_reg_t* free_root;   // index trees of the above, same regions
+   km_mmap_reg_t* busy_root;
+   void* pool;                 // slabs of region descriptors
+   km_mmap_reg_t* pool_free;   // unused region descriptors
+   pthread_mutex_t mutex;      // global map lock
+   uint64_t seq;               // odd while mutex holder changes regions, see km_mmap.c
+   int recovery_mode;          // disable region consolidation
 } km_mmap_cb_t;
 
 // enumerate type of virtual machine
@@ -304,8 +337,10 @@ static const int CPUID_ENTRIES = 100;   // A little padding, kernel says 80
  * tables and some other things slot 41 is used to map the vdso and vvar pages into the payload
  * address space
  * Slot 42 is used to map code that is part of km into the guest address space.
+ * Slot 43 holds guest page table pages for --pt-mprotect.
+ * Slot 44 holds all of the guest memory regions with --single-memslot.
  */
-#define KM_MEM_SLOTS 43
+#define KM_MEM_SLOTS 45
 
 typedef struct km_machine {
    int kvm_fd;                                // /dev/kvm file descriptor
@@ -320,6 +355,7 @@ typedef struct km_machine {
    km_vcpu_list_t vm_idle_vcpus;              // Parked vcpu ready for reuse
                                               //
    kvm_mem_reg_t vm_mem_regs[KM_MEM_SLOTS];   // guest physical memory regions
+   pthread_rwlock_t vm_mem_regs_rwlock;       // see km_mem_regions_pin()
    km_gva_t brk;                 // program break (highest address in bottom VA, i.e. txt/data)
    km_gva_t tbrk;                // top break (lowest address in top VA)
    pthread_mutex_t brk_mutex;    // protects the two above
@@ -359,14 +395,16 @@ typedef struct km_machine {
    union {
       // KVM specific data
       struct {
-         uint8_t xsave;   // Is KVM_GET_XSAVE supported.
+         uint8_t xsave;       // Is KVM_GET_XSAVE supported.
+         uint8_t sync_regs;   // Is KVM_CAP_SYNC_REGS supported for KM_SYNC_REGS_FIELDS.
       } kvm;
       // TBD Add KKM specific data (if any).
       int dummy;
    } vmtype_u;
 
    uint64_t xcr0;
-   int overcommit_memory;   // controls how we request memory for payload from Linux
+   int overcommit_memory;      // controls how we request memory for payload from Linux
+   km_hugepages_t hugepages;   // same, huge pages, see km_mem.c
 } km_machine_t;
 
 extern km_machine_t machine;
@@ -418,22 +456,35 @@ void km_vcpu_pause_all(km_vcpu_t* vcpu, km_pause_t type);
 void km_vcpu_resume_all(void);
 km_vcpu_t* km_vcpu_fetch_by_tid(int tid);
 
-static inline void km_vcpu_sync_rip(km_vcpu_t* vcpu)
+/*
+ * With KVM_CAP_SYNC_REGS KVM stores registers in cpu_run->s.regs on every KVM_RUN exit, and loads
+ * the ones marked in cpu_run->kvm_dirty_regs on the next entry. km_read_registers() and friends
+ * then copy to/from the run area instead of doing KVM_GET/SET_REGS ioctls, so regs_valid and
+ * sregs_valid only track the cached copy, and kvm_dirty_regs tracks what has to go back to KVM.
+ */
+#define KM_SYNC_REGS_FIELDS (KVM_SYNC_X86_REGS | KVM_SYNC_X86_SREGS | KVM_SYNC_X86_EVENTS)
+
+/*
+ * Called right before KVM_RUN. Requests register sync on exit if the VM supports it.
+ */
+static inline void km_vcpu_sync_regs_request(km_vcpu_t* vcpu)
 {
-   /*
-    * This is to sync the registers, specifically RIP, with KVM.
-    * Turns out there is a difference between KVM or azure and local machines. When we are in
-    * hypercall the RIP points to the OUT instruction (local machine) or the next one (azure).
-    * To return from signal handler, or to start new thread in clone, we need to get consistent RIP
-    * to the next instruction. The ioctl() with immediate_exit doesn't execute any guest code but
-    * sets the registers, advancing RIP to the right location.
-    */
-   vcpu->cpu_run->immediate_exit = 1;
-   (void)ioctl(vcpu->kvm_vcpu_fd, KVM_RUN, NULL);
-   errno = 0;   // reset EINTR from ioctl above
-   vcpu->cpu_run->immediate_exit = 0;
+   if (machine.vm_type == VM_TYPE_KVM && machine.vmtype_u.kvm.sync_regs != 0) {
+      vcpu->cpu_run->kvm_valid_regs = KM_SYNC_REGS_FIELDS;
+   }
+}
+
+/*
+ * Returns 1 if vcpu->cpu_run->s.regs holds the vcpu state, i.e. the vcpu went through KVM_RUN with
+ * sync requested. Before the very first KVM_RUN the run area is empty and we use ioctls.
+ */
+static inline int km_vcpu_sync_regs(km_vcpu_t* vcpu)
+{
+   return vcpu->cpu_run->kvm_valid_regs != 0;
 }
 
+void km_vcpu_sync_rip(km_vcpu_t* vcpu);
+
 extern FILE* km_log_file;
 
 void __km_trace(int errnum, const char* function, int linenumber, const char* fmt, ...);
@@ -478,6 +529,7 @@ static const_string_t KM_LOGTO = "KM_LOGTO";
 static const_string_t KM_MGTPIPE = "KM_MGTPIPE";
 static const_string_t KM_MGTDIR = "KM_MGTDIR";
 static const_string_t KM_KILL_UNIMPL_SCALL = "KM_KILL_UNIMPL_SCALL";
+static const_string_t KM_PREFAULT = "KM_PREFAULT";
 static const_string_t KM_SNAP_LISTEN_TIMEOUT = "SNAP_LISTEN_TIMEOUT";
 static const_string_t KM_GDB_WAIT_BEFORE_SNAP_RESUME = "KM_GDB_WAIT_BEFORE_SNAP_RESUME";
 
@@ -512,6 +564,9 @@ void km_trace_setup(int argc, char* argv[]);
 void km_pathetic_stacktrace(void);
 
 extern int km_collect_hc_stats;
+void km_hc_stats_record(km_vcpu_t* vcpu, int hc, uint64_t nsecs);
+void km_hc_stats_print(void);
+void km_hc_stats_send(int fd);
 
 static inline int km_trace_enabled()
 {
@@ -768,6 +823,21 @@ static inline void km_mem_unlock(void)
    km_mutex_unlock(&machine.brk_mutex);
 }
 
+/*
+ * Keeps the host mappings of memory regions in place for host calls made without brk_mutex, such
+ * as guest madvise(). km_free_region() takes it for writing, and isn't starved by a stream of
+ * readers.
+ */
+static inline void km_mem_regions_pin(void)
+{
+   pthread_rwlock_rdlock(&machine.vm_mem_regs_rwlock);
+}
+
+static inline void km_mem_regions_unpin(void)
+{
+   pthread_rwlock_unlock(&machine.vm_mem_regs_rwlock);
+}
+
 static inline void km_signal_lock(void)
 {
    km_mutex_lock(&machine.signal_mutex);
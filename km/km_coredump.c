@@ -24,11 +24,14 @@
  * TODO: Buffer management for PT_NOTES is vulnerable to overruns. Need to fix.
  */
 
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/procfs.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include <arpa/inet.h>
 #include <linux/aio_abi.h>
 #include <netinet/in.h>
@@ -42,6 +45,8 @@
 #include "km_iocontext.h"
 #include "km_mem.h"
 #include "km_signal.h"
+#include "km_snapshot.h"
+#include "km_uring.h"
 
 // TODO: Need to figure out where the corefile and snapshotdefault should go.
 static char* coredump_path = "./kmcore";
@@ -60,7 +65,8 @@ char* km_get_coredump_path()
 }
 
 /*
- * Write a buffer in KM memory.
+ * Write a buffer in KM memory. Doesn't log, the background snapshot writer runs it, the callers
+ * report the errno returned.
  */
 static inline int km_core_write_mem(int fd, void* buffer, size_t length, int is_guestmem)
 {
@@ -72,16 +78,10 @@ static inline int km_core_write_mem(int fd, void* buffer, size_t length, int is_
       if ((rc = write(fd, cur, remain)) == -1) {
          if (errno == EFAULT && is_guestmem) {
             if (lseek(fd, remain, SEEK_CUR) < 0) {
-               km_warn("lseek error fd=%d cur=%p remain=0x%lx, exiting", fd, cur, remain);
                return errno;
             }
             rc = remain;
          } else {
-            km_warn("write error - cur=%p remain=0x%lx buffer=%p length=0x%lx, exiting",
-                    cur,
-                    remain,
-                    buffer,
-                    length);
             return errno;
          }
       }
@@ -93,7 +93,12 @@ static inline int km_core_write_mem(int fd, void* buffer, size_t length, int is_
 
 static inline int km_core_write(int fd, void* buffer, size_t length)
 {
-   return km_core_write_mem(fd, buffer, length, 0);
+   int rc = km_core_write_mem(fd, buffer, length, 0);
+
+   if (rc != 0) {
+      km_warnx("write error fd=%d length=0x%lx, %s", fd, length, strerror(rc));
+   }
+   return rc;
 }
 
 static inline int km_core_write_elf_header(int fd, int phnum)
@@ -139,6 +144,18 @@ static inline int km_core_write_load_header(int fd, off_t offset, km_gva_t base,
    phdr.p_memsz = size;
    phdr.p_flags = flags;
 
+   if (km_ss_layer_active() != 0) {
+      int rc = km_ss_layer_add(base, size, offset);
+      if (rc != 0) {
+         return rc;
+      }
+   }
+   if (km_ss_compress_active() != 0) {
+      int rc = km_ss_compress_add(roundup(size, KM_PAGE_SIZE));
+      if (rc != 0) {
+         return rc;
+      }
+   }
    return km_core_write(fd, &phdr, sizeof(Elf64_Phdr));
 }
 
@@ -621,6 +638,75 @@ static inline int km_core_write_notes(km_vcpu_t* vcpu,
    return 0;
 }
 
+/*
+ * Write guest memory, with holes in the file for the zero pages. The memory the host can't read,
+ * which we only know from the last km_ss_maps_read(), is left to km_core_write_mem().
+ */
+static int km_core_write_sparse(int fd, km_kma_t start, size_t length)
+{
+   char* cur = start;
+   char* end = cur + length;
+   int readable;
+   int rc = 0;
+
+   while (cur < end) {
+      char* run_end = cur + km_ss_maps_run(cur, end - cur, &readable);
+      if (readable == 0) {
+         if ((rc = km_core_write_mem(fd, cur, run_end - cur, 1)) != 0) {
+            return rc;
+         }
+         cur = run_end;
+         continue;
+      }
+      while (cur < run_end) {
+         int zero = km_mem_is_zero(cur, KM_PAGE_SIZE);
+         char* next = cur + KM_PAGE_SIZE;
+         while (next < run_end && km_mem_is_zero(next, KM_PAGE_SIZE) == zero) {
+            next += KM_PAGE_SIZE;
+         }
+         if (zero == 0) {
+            rc = km_core_write_mem(fd, cur, next - cur, 1);
+         } else if (lseek(fd, next - cur, SEEK_CUR) < 0) {
+            rc = errno;
+         }
+         if (rc != 0) {
+            return rc;
+         }
+         cur = next;
+      }
+   }
+   return 0;
+}
+
+/*
+ * Incremental snapshot: write the pages of [base, base + size) the snapshot has, seek over the ones
+ * its parent has.
+ */
+static inline int km_core_write_layer(int fd, km_gva_t base, size_t size)
+{
+   static uint8_t own[KM_SS_LAYER_SELECT_MAX];
+   size_t npages = size / KM_PAGE_SIZE;
+   size_t n;
+   int rc;
+
+   if ((rc = km_ss_layer_select(base, npages, own)) != 0) {
+      return rc;
+   }
+   for (size_t i = 0; i < npages; i += n) {
+      for (n = 1; i + n < npages && own[i + n] == own[i]; n++) {
+      }
+      if (own[i] != 0) {
+         km_kma_t start = km_gva_to_kma_nocheck(base + i * KM_PAGE_SIZE);
+         if ((rc = km_core_write_sparse(fd, start, n * KM_PAGE_SIZE)) != 0) {
+            return rc;
+         }
+      } else if (lseek(fd, n * KM_PAGE_SIZE, SEEK_CUR) < 0) {
+         return errno;
+      }
+   }
+   return 0;
+}
+
 /*
  * Write a contiguous area in guest memory. Since write can
  * be very large, break it up into reasonably sized pieces (1MB).
@@ -634,24 +720,29 @@ static inline int km_guestmem_write(int fd, km_gva_t base, size_t length)
    size_t remain = roundup(length, KM_PAGE_SIZE);
    static size_t maxwrite = MIB;
 
+   if (km_ss_compress_active() != 0) {
+      return km_ss_compress_write(fd, base, remain);
+   }
    // Page Align
    off_t off = lseek(fd, 0, SEEK_CUR);
    if (off == (off_t)-1) {
-      km_warn("lseek( SEEK_CUR ) failed");
       return errno;
    }
    if (off != roundup(off, KM_PAGE_SIZE)) {
       off = roundup(off, KM_PAGE_SIZE);
       if (lseek(fd, off, SEEK_SET) == (off_t)-1) {
-         km_warn("lseek to %ld failed", off);
          return errno;
       }
    }
-   km_infox(KM_TRACE_COREDUMP, "base=0x%lx length=0x%lx off=0x%lx", base, remain, off);
    while (remain > 0) {
       size_t wsz = MIN(remain, maxwrite);
 
-      int rc = km_core_write_mem(fd, km_gva_to_kma_nocheck(current), wsz, 1);
+      int rc;
+      if (km_ss_layer_active() != 0) {
+         rc = km_core_write_layer(fd, current, wsz);
+      } else {
+         rc = km_core_write_sparse(fd, km_gva_to_kma_nocheck(current), wsz);
+      }
       if (rc != 0) {
          return rc;
       }
@@ -850,6 +941,91 @@ static inline int km_core_write_phdrs(km_vcpu_t* vcpu,
    return 0;
 }
 
+/*
+ * Make the guest mmaps the host can't read (e.g. EXEC only) readable, or with 'restore' put their
+ * protection back, in case it's a live coredump and we are not exiting yet. It's done before
+ * km_ss_maps_read() so the sparse and compressed writes copy these pages rather than take them for
+ * holes. Returns 0 or errno.
+ */
+static int km_core_guestmem_readable(int restore)
+{
+   km_mmap_reg_t* ptr;
+
+   TAILQ_FOREACH (ptr, &machine.mmaps.busy, link) {
+      int prot = km_mem_host_prot(ptr->protection);
+      if (ptr->protection == PROT_NONE || ptr->km_flags.km_mmap_part_of_monitor != 0 ||
+          (prot & PROT_READ) != 0) {
+         continue;
+      }
+      if (mprotect(km_gva_to_kma_nocheck(ptr->start),
+                   ptr->size,
+                   restore != 0 ? prot : prot | PROT_READ) != 0) {
+         return errno;
+      }
+   }
+   return 0;
+}
+
+/*
+ * Write the guest memory of all the PT_LOADs, in program header order. This is what the background
+ * snapshot writer runs, a clone of a threaded process, so it and its callees only make async signal
+ * safe calls: no logging or tracing (stdio locks), no memory allocation. Returns 0 or errno for the
+ * caller to report.
+ */
+static int km_core_write_guestmem(int fd, km_gva_t end_load)
+{
+   int rc;
+   km_mmap_reg_t* ptr;
+
+   for (int i = 0; i < km_guest.km_ehdr.e_phnum; i++) {
+      Elf64_Phdr* phdr = &km_guest.km_phdr[i];
+      if (phdr->p_type != PT_LOAD) {
+         continue;
+      }
+      size_t write_size = phdr->p_memsz;
+      write_size += km_core_last_load_adjust(phdr, end_load);
+      size_t extra = phdr->p_vaddr - rounddown(phdr->p_vaddr, KM_PAGE_SIZE);
+      rc = km_guestmem_write(fd,
+                             rounddown(phdr->p_vaddr + km_guest.km_load_adjust, KM_PAGE_SIZE),
+                             write_size + extra);
+      if (rc != 0) {
+         return rc;
+      }
+   }
+   if (km_dynlinker.km_filename != NULL) {
+      for (int i = 0; i < km_dynlinker.km_ehdr.e_phnum; i++) {
+         Elf64_Phdr* phdr = &km_dynlinker.km_phdr[i];
+         if (phdr->p_type != PT_LOAD) {
+            continue;
+         }
+         size_t write_size = phdr->p_memsz;
+         write_size += km_core_last_load_adjust(phdr, end_load);
+         size_t extra = phdr->p_vaddr - rounddown(phdr->p_vaddr, KM_PAGE_SIZE);
+         rc = km_guestmem_write(fd,
+                                rounddown(phdr->p_vaddr + km_dynlinker.km_load_adjust, KM_PAGE_SIZE),
+                                write_size + extra);
+         if (rc != 0) {
+            return rc;
+         }
+      }
+   }
+   TAILQ_FOREACH (ptr, &machine.mmaps.busy, link) {
+      if (ptr->protection == PROT_NONE) {
+         continue;
+      }
+      rc = km_guestmem_write(fd, ptr->start, ptr->size);
+      if (rc != 0) {
+         return rc;
+      }
+   }
+   // the last pages may be a hole, the file still has to cover them
+   off_t end = lseek(fd, 0, SEEK_CUR);
+   if (end < 0 || ftruncate(fd, end) != 0) {
+      return errno;
+   }
+   return 0;
+}
+
 /*
  * Verify that a snapshot is possible.  We only check for active interval timers
  * at this time.  We don't snapshot interval timers yet, so if there are active timers
@@ -885,7 +1061,49 @@ static int km_snapshot_ok(void)
 }
 
 /*
- * Drop a core file containing the guest image.
+ * The clone writing the guest memory of a background snapshot, and the snapshot file.
+ */
+static pid_t km_core_writer;
+static char km_core_writer_path[PATH_MAX];
+
+/*
+ * Wait for the writer of a KM_DO_SNAP_BACKGROUND snapshot to finish.
+ * Returns:
+ *  0 - success, or there is no writer
+ *  != 0 - failure, unix errno values are returned. The snapshot file is removed.
+ */
+int km_dump_core_wait(void)
+{
+   int status;
+   int rc;
+
+   if (km_core_writer == 0) {
+      return 0;
+   }
+   while (waitpid(km_core_writer, &status, __WCLONE) < 0) {
+      if (errno != EINTR) {
+         km_warn("wait for snapshot writer pid %d", km_core_writer);
+         km_core_writer = 0;
+         return errno;
+      }
+   }
+   if (WIFEXITED(status) != 0) {
+      rc = WEXITSTATUS(status);
+   } else {
+      km_warnx("snapshot writer pid %d killed by signal %d", km_core_writer, WTERMSIG(status));
+      rc = EIO;
+   }
+   if (rc != 0) {
+      km_warnx("Cannot write snapshot '%s', %s", km_core_writer_path, strerror(rc));
+      (void)unlink(km_core_writer_path);
+   }
+   km_core_writer = 0;
+   return rc;
+}
+
+/*
+ * Drop a core file containing the guest image. With KM_DO_SNAP_BACKGROUND the guest memory is
+ * written by a clone after we return, km_dump_core_wait() gets the result.
  * Returns:
  *  0 - success
  *  != 0 - failure, unix errno values are returned.
@@ -901,11 +1119,30 @@ int km_dump_core(char* core_path,
    int fd;
    int rc = 0;
    size_t offset;   // Data offset
-   km_mmap_reg_t* ptr;
    char* notes_buffer = NULL;
+   int readable = 0;   // km_core_guestmem_readable() was done
+   // a background snapshot only differs in who writes the guest memory
+   int background = dumptype == KM_DO_SNAP_BACKGROUND;
+   if (background != 0) {
+      dumptype = KM_DO_SNAP;
+   }
    size_t notes_length = km_core_notes_length(vcpu, label, description, dumptype);
    km_gva_t end_load = 0;
-   int phnum = km_core_count_phdrs(vcpu, &end_load);
+   // incremental snapshots have a second PT_NOTE for the memory layer, after the memory
+   int layer = dumptype == KM_DO_SNAP && km_ss_layer_wanted() != 0;
+   // and compressed ones for the chunk index, the two don't go together
+   int compress = dumptype == KM_DO_SNAP && km_snapshot_compress != 0 && layer == 0;
+   int phnum = km_core_count_phdrs(vcpu, &end_load) + layer + compress;
+
+   if (background != 0 && layer != 0) {
+      // the page hashes of the new layer have to end up in this process
+      km_infox(KM_TRACE_SNAPSHOT, "incremental snapshot, writing guest memory in the foreground");
+      background = 0;
+   }
+   if (dumptype == KM_DO_SNAP && km_core_writer != 0) {
+      km_warnx("Cannot create snapshot '%s' while one is being written", core_path);
+      return EBUSY;
+   }
 
    if ((fd = open(core_path, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0) {
       km_warn("Cannot create %s '%s'", dumptype == KM_DO_SNAP ? "snapshot" : "corefile", core_path);
@@ -931,6 +1168,14 @@ int km_dump_core(char* core_path,
          rc = EAGAIN;
          goto out;
       }
+      if (km_uring_count > 0) {
+         // io_uring rings live in the kernel, we can't recreate them with what's in flight
+         km_warnx("Can't take a snapshot, %d io_uring instances are open", km_uring_count);
+         rc = EAGAIN;
+         goto out;
+      }
+      // Queued hypercalls live in km memory which is not in the snapshot, execute them now.
+      km_hcall_ring_drain_all();
    }
 
    if ((notes_buffer = (char*)calloc(1, notes_length)) == NULL) {
@@ -939,82 +1184,95 @@ int km_dump_core(char* core_path,
       goto out;
    }
    offset = sizeof(Elf64_Ehdr) + phnum * sizeof(Elf64_Phdr);
+   if ((rc = km_core_guestmem_readable(0)) != 0) {
+      km_warnx("cannot make guest memory readable, %s", strerror(rc));
+      goto out;
+   }
+   readable = 1;
+   // which guest memory the host can read, for the zero page holes
+   if ((rc = -km_ss_maps_read()) != 0) {
+      km_warnx("cannot read km mappings, %s", strerror(rc));
+      goto out;
+   }
+   if (layer != 0 && (rc = km_ss_layer_begin()) != 0) {
+      layer = 0;
+      goto out;
+   }
+   // the background writer is a copy of this process without its threads, it can't start any
+   if (compress != 0 && (rc = km_ss_compress_begin(background != 0 ? 1 : 0)) != 0) {
+      goto out;
+   }
 
    rc = km_core_write_phdrs(
        vcpu, fd, phnum, end_load, notes_buffer, notes_length, label, description, &offset, dumptype);
    if (rc != 0) {
       goto out;
    }
+   if (layer != 0 || compress != 0) {
+      Elf64_Phdr phdr = {};   // filled in by km_ss_layer_finish() or km_ss_compress_finish()
+      rc = km_core_write(fd, &phdr, sizeof(Elf64_Phdr));
+      if (rc != 0) {
+         goto out;
+      }
+   }
 
    // Write the actual data.
    rc = km_core_write(fd, notes_buffer, notes_length);
    if (rc != 0) {
       goto out;
    }
-   km_infox(KM_TRACE_COREDUMP, "Dump executable");
-   for (int i = 0; i < km_guest.km_ehdr.e_phnum; i++) {
-      Elf64_Phdr* phdr = &km_guest.km_phdr[i];
-      if (phdr->p_type != PT_LOAD) {
-         continue;
+   if (background != 0) {
+      /*
+       * The clone has a copy-on-write view of guest memory as it is now and writes it while the
+       * vcpus run. It has no exit signal so the payload's wait() never sees it,
+       * km_dump_core_wait() reaps it. MAP_SHARED guest mappings are not copied, the writer may see
+       * later changes to them.
+       */
+      pid_t pid = syscall(SYS_clone, 0, NULL, NULL, NULL, 0);
+      if (pid == 0) {
+         if ((rc = km_core_write_guestmem(fd, end_load)) == 0 && compress != 0) {
+            rc = km_ss_compress_finish(fd, sizeof(Elf64_Ehdr) + (phnum - 1) * sizeof(Elf64_Phdr));
+         }
+         _exit(rc);
       }
-      size_t write_size = phdr->p_memsz;
-      write_size += km_core_last_load_adjust(phdr, end_load);
-      size_t extra = phdr->p_vaddr - rounddown(phdr->p_vaddr, KM_PAGE_SIZE);
-      rc = km_guestmem_write(fd,
-                             rounddown(phdr->p_vaddr + km_guest.km_load_adjust, KM_PAGE_SIZE),
-                             write_size + extra);
-      if (rc != 0) {
+      if (pid < 0) {
+         km_warn("cannot start snapshot writer");
+         rc = errno;
          goto out;
       }
+      km_infox(KM_TRACE_COREDUMP, "snapshot writer pid %d", pid);
+      km_core_writer = pid;
+      strncpy(km_core_writer_path, core_path, sizeof(km_core_writer_path) - 1);
+      goto out;
    }
-   if (km_dynlinker.km_filename != NULL) {
-      km_infox(KM_TRACE_COREDUMP, "Dump dynlinker");
-      for (int i = 0; i < km_dynlinker.km_ehdr.e_phnum; i++) {
-         Elf64_Phdr* phdr = &km_dynlinker.km_phdr[i];
-         if (phdr->p_type != PT_LOAD) {
-            continue;
-         }
-         size_t write_size = phdr->p_memsz;
-         write_size += km_core_last_load_adjust(phdr, end_load);
-         size_t extra = phdr->p_vaddr - rounddown(phdr->p_vaddr, KM_PAGE_SIZE);
-         rc = km_guestmem_write(fd,
-                                rounddown(phdr->p_vaddr + km_dynlinker.km_load_adjust, KM_PAGE_SIZE),
-                                write_size + extra);
-         if (rc != 0) {
-            goto out;
-         }
-      }
+   km_infox(KM_TRACE_COREDUMP, "Dump guest memory");
+   if ((rc = km_core_write_guestmem(fd, end_load)) != 0) {
+      km_warnx("Cannot write guest memory to '%s', %s", core_path, strerror(rc));
+      goto out;
    }
-   km_infox(KM_TRACE_COREDUMP, "Dump mmaps");
-   TAILQ_FOREACH (ptr, &machine.mmaps.busy, link) {
-      if (ptr->protection == PROT_NONE) {
-         continue;
-      }
-      km_kma_t start = km_gva_to_kma_nocheck(ptr->start);
-      // make sure we can read the mapped memory (e.g. it can be EXEC only)
-      if (ptr->km_flags.km_mmap_part_of_monitor == 0 && (ptr->protection & PROT_READ) != PROT_READ) {
-         if (mprotect(start, ptr->size, ptr->protection | PROT_READ) != 0) {
-            km_warn("failed to make %p,0x%lx readable for dump, exiting", start, ptr->size);
-            rc = errno;
-            goto out;
-         }
-      }
-      rc = km_guestmem_write(fd, ptr->start, ptr->size);
+   if (layer != 0) {
+      rc = km_ss_layer_finish(fd, sizeof(Elf64_Ehdr) + (phnum - 1) * sizeof(Elf64_Phdr));
+   }
+   if (compress != 0) {
+      rc = km_ss_compress_finish(fd, sizeof(Elf64_Ehdr) + (phnum - 1) * sizeof(Elf64_Phdr));
       if (rc != 0) {
-         goto out;
-      }
-      // recover protection, in case it's a live coredump and we are not exiting yet
-      if (ptr->km_flags.km_mmap_part_of_monitor == 0 && (ptr->protection & PROT_READ) != PROT_READ &&
-          mprotect(start, ptr->size, ptr->protection) != 0) {
-         km_warn("failed to set %p,0x%lx prot to 0x%x, exiting", start, ptr->size, ptr->protection);
-         rc = errno;
-         goto out;
+         km_warnx("Cannot write snapshot chunk index to '%s', %s", core_path, strerror(rc));
       }
    }
 
 out:;
    free(notes_buffer);
    (void)close(fd);
+   // the background writer has its own copy of the mappings
+   if (readable != 0 && km_core_guestmem_readable(1) != 0) {
+      km_warn("cannot restore guest memory protection");
+   }
+   if (layer != 0) {
+      km_ss_layer_end(core_path, rc);
+   }
+   if (compress != 0) {
+      km_ss_compress_end();
+   }
    if (rc != 0) {
       (void)unlink(core_path);
    }
@@ -264,14 +264,52 @@ typedef struct km_nt_iocontexts {
 } km_nt_iocontexts_t;
 #define NT_KM_IOCONTEXTS 0x4b4d4358   // "KMCX"
 
+/*
+ * Guest memory layer of a snapshot, in a PT_NOTE of its own after the memory. Pages are the
+ * KM_PAGE_SIZE pages of all PT_LOADs in program header order. A snapshot with a parent only has
+ * the pages in the bitmap, the rest are holes in the file and come from the parent. See
+ * km_snapshot_layer.c
+ */
+typedef struct km_nt_layer {
+   Elf64_Word size;         // Size of record
+   Elf64_Word namelength;   // parent file name length with the null, 0 if there is no parent
+   Elf64_Xword id;          // hash of the page hashes, identifies the memory image
+   Elf64_Xword parent_id;   // id of the parent, 0 if there is no parent
+   Elf64_Xword npages;      // number of pages
+   // Followed by npages page hashes
+   // Followed by the bitmap of pages in this file, (npages + 63) / 64 words, if there is a parent
+   // Followed by the parent file name
+} km_nt_layer_t;
+#define NT_KM_LAYER 0x4b4d4c59   // "KMLY"
+
+/*
+ * Guest memory of a compressed snapshot, in a PT_NOTE of its own after the memory. The memory of
+ * the PT_LOADs, in program header order, is cut in chunks that follow the notes in the file
+ * instead of the raw memory, the PT_LOAD offsets are not used. See km_snapshot_compress.c
+ */
+typedef struct km_nt_chunk {
+   Elf64_Addr gva;
+   Elf64_Off offset;    // in the file
+   Elf64_Word length;   // in the file, 0 if the chunk is all zeroes, size if it isn't compressed
+   Elf64_Word size;     // of guest memory
+} km_nt_chunk_t;
+typedef struct km_nt_chunks {
+   Elf64_Word size;        // Size of record
+   Elf64_Word chunksize;   // guest memory in a chunk, but the last one of a PT_LOAD
+   Elf64_Xword nchunks;    // number of chunks in chunks[]
+   km_nt_chunk_t chunks[0];
+} km_nt_chunks_t;
+#define NT_KM_CHUNKS 0x4b4d434b   // "KMCK"
+
 // Core dump guest.
-typedef enum { KM_DO_CORE, KM_DO_SNAP } km_coredump_type_t;
+typedef enum { KM_DO_CORE, KM_DO_SNAP, KM_DO_SNAP_BACKGROUND } km_coredump_type_t;
 int km_dump_core(char* filename,
                  km_vcpu_t* vcpu,
                  x86_interrupt_frame_t* iframe,
                  const char* label,
                  const char* description,
                  km_coredump_type_t dumptype);
+int km_dump_core_wait(void);
 void km_set_coredump_path(char* path);
 char* km_get_coredump_path();
 size_t km_note_header_size(char* owner);
@@ -48,6 +48,7 @@ km_machine_t machine = {
     .mach_fd = -1,
     .vm_idle_vcpus.head = SLIST_HEAD_INITIALIZER(machine.vm_idle_vcpus.head),
     .vm_vcpu_mtx = PTHREAD_MUTEX_INITIALIZER,
+    .vm_mem_regs_rwlock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP,
     .brk_mutex = PTHREAD_MUTEX_INITIALIZER,
     .signal_mutex = PTHREAD_MUTEX_INITIALIZER,
     .sigpending.head = TAILQ_HEAD_INITIALIZER(machine.sigpending.head),
@@ -104,6 +105,8 @@ void km_vcpu_fini(km_vcpu_t* vcpu)
  */
 void km_machine_fini(void)
 {
+   km_hc_async_fini();   // workers use guest memory and guest fds
+   km_mem_reclaim_fini();
    for (int i = 0; i < KVM_MAX_VCPUS; i++) {
       km_vcpu_t* vcpu;
 
@@ -132,7 +135,7 @@ void km_machine_fini(void)
    for (int i = KM_MEM_SLOTS - 1; i >= 0; i--) {
       kvm_mem_reg_t* mr = &machine.vm_mem_regs[i];
 
-      if (mr->memory_size != 0) {
+      if (km_memslot_plugged(i) != 0) {
          uint64_t mem_siz = mr->memory_size;
          mr->memory_size = 0;
          if (ioctl(machine.mach_fd, KVM_SET_USER_MEMORY_REGION, mr) < 0) {
@@ -187,6 +190,169 @@ static inline uint64_t rdtsc(void)
    return edx << 32 | eax;
 }
 
+/*
+ * Time page, see km_guest_time_t. Guest TSC runs at the host TSC rate, km_guest_tsc_offset ahead of
+ * it, so km takes the TSC and the clocks on the host side and publishes them in guest TSC terms.
+ */
+static int64_t km_guest_tsc_offset;
+static pthread_mutex_t km_guest_time_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+_Static_assert(sizeof(km_guest_time_t) <= 128, "GUEST_TIME_SIZE in km_guest.asmh");
+
+// The TSC value the guest would read now
+uint64_t km_guest_rdtsc(void)
+{
+   return rdtsc() + km_guest_tsc_offset;
+}
+
+static inline uint64_t km_timespec_nsec(struct timespec* ts)
+{
+   return ts->tv_sec * 1000000000UL + ts->tv_nsec;
+}
+
+/*
+ * Take new clock values for the time page, with km_guest_time_mtx held. Clocks that can't go back
+ * are not allowed to go below what the guest could have computed from the old base.
+ */
+static void km_guest_time_rebase(void)
+{
+   km_guest_time_t* t = &km_guest_time;
+   struct timespec real, mono, raw, boot, tai;
+
+   uint64_t tsc1 = rdtsc();
+   clock_gettime(CLOCK_MONOTONIC, &mono);
+   clock_gettime(CLOCK_REALTIME, &real);
+   clock_gettime(CLOCK_MONOTONIC_RAW, &raw);
+   clock_gettime(CLOCK_BOOTTIME, &boot);
+   clock_gettime(CLOCK_TAI, &tai);
+   uint64_t tsc = (tsc1 + rdtsc()) / 2 + km_guest_tsc_offset;
+
+   uint64_t monotonic = km_timespec_nsec(&mono);
+   uint64_t monotonic_raw = km_timespec_nsec(&raw);
+   uint64_t boottime = km_timespec_nsec(&boot);
+   uint64_t mult = t->mult;
+   if (t->tsc_base != 0 && tsc > t->tsc_base) {
+      uint64_t delta = tsc - t->tsc_base;
+      uint64_t elapsed = km_tsc_to_nsec(t, delta);
+      monotonic = MAX(monotonic, t->monotonic + elapsed);
+      monotonic_raw = MAX(monotonic_raw, t->monotonic_raw + elapsed);
+      boottime = MAX(boottime, t->boottime + elapsed);
+      // Track the (NTP adjusted) monotonic rate once we have a long enough interval
+      if (delta > t->max_delta / 4 && km_timespec_nsec(&mono) > t->monotonic) {
+         mult = (((unsigned __int128)(km_timespec_nsec(&mono) - t->monotonic)) << t->shift) / delta;
+      }
+   }
+   __atomic_add_fetch(&t->seq, 1, __ATOMIC_ACQ_REL);
+   t->mult = mult;
+   t->tsc_base = tsc;
+   t->realtime = km_timespec_nsec(&real);
+   t->monotonic = monotonic;
+   t->monotonic_raw = monotonic_raw;
+   t->boottime = boottime;
+   t->tai = km_timespec_nsec(&tai);
+   __atomic_add_fetch(&t->seq, 1, __ATOMIC_ACQ_REL);
+}
+
+// Concurrent callers just skip, one rebase is enough
+void km_guest_time_update(void)
+{
+   if (km_guest_time.mult == 0 || pthread_mutex_trylock(&km_guest_time_mtx) != 0) {
+      return;
+   }
+   km_guest_time_rebase();
+   pthread_mutex_unlock(&km_guest_time_mtx);
+}
+
+/*
+ * Is the time page base old enough to be worth refreshing? The guest stops using it at max_delta.
+ */
+void km_guest_time_refresh(void)
+{
+   km_guest_time_t* t = &km_guest_time;
+
+   if (t->valid != 0 && km_guest_rdtsc() - t->tsc_base > t->max_delta / 2) {
+      km_guest_time_update();
+   }
+}
+
+/*
+ * 'ts' is the host value of clock 'clk' for the clock_gettime() hypercall. The guest may have read
+ * a larger one from the time page just before, and reads after this one have to be larger.
+ * Rebase the page, it is now at least the host value and what the guest could have computed, and
+ * return that.
+ */
+void km_guest_time_clamp(clockid_t clk, struct timespec* ts)
+{
+   km_guest_time_t* t = &km_guest_time;
+   uint64_t ns;
+
+   if (t->valid == 0) {
+      return;
+   }
+   if (clk != CLOCK_MONOTONIC && clk != CLOCK_MONOTONIC_COARSE && clk != CLOCK_MONOTONIC_RAW &&
+       clk != CLOCK_BOOTTIME) {
+      km_guest_time_refresh();
+      return;
+   }
+   pthread_mutex_lock(&km_guest_time_mtx);
+   km_guest_time_rebase();
+   ns = clk == CLOCK_MONOTONIC_RAW ? t->monotonic_raw
+        : clk == CLOCK_BOOTTIME    ? t->boottime
+                                   : t->monotonic;
+   pthread_mutex_unlock(&km_guest_time_mtx);
+   if (ns > km_timespec_nsec(ts)) {
+      ts->tv_sec = ns / 1000000000UL;
+      ts->tv_nsec = ns % 1000000000UL;
+   }
+}
+
+/*
+ * Set up the time page, once. Later vcpus find it valid, updates after that are rebases under
+ * km_guest_time_mtx, so the page never loses what the guest could have computed from it.
+ */
+static void km_guest_time_init(km_vcpu_t* vcpu)
+{
+   km_guest_time_t* t = &km_guest_time;
+   char tmp[sizeof(struct kvm_msrs) + sizeof(struct kvm_msr_entry)] = {};
+   struct kvm_msrs* msrs = (struct kvm_msrs*)tmp;
+   uint32_t eax, ebx, ecx, edx;
+   int64_t tsc_khz;
+
+   // No invariant TSC - no time page, the guest will make hypercalls
+   if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) == 0 || (edx & (1 << 8)) == 0) {
+      km_infox(KM_TRACE_VCPU, "no invariant TSC, time page disabled");
+      return;
+   }
+   pthread_mutex_lock(&km_guest_time_mtx);
+   if (t->valid != 0) {
+      pthread_mutex_unlock(&km_guest_time_mtx);
+      return;
+   }
+   msrs->nmsrs = 1;
+   msrs->entries[0].index = MSR_IA32_TSC;
+   uint64_t tsc1 = rdtsc();
+   if (ioctl(vcpu->kvm_vcpu_fd, KVM_GET_MSRS, msrs) == 1) {
+      km_guest_tsc_offset = msrs->entries[0].data - (tsc1 + rdtsc()) / 2;
+   }
+   if ((tsc_khz = ioctl(vcpu->kvm_vcpu_fd, KVM_GET_TSC_KHZ, 0)) <= 0) {
+      // No TSC frequency from the driver, measure it. km_guest_time_update() refines it later.
+      struct timespec start, now, ms = {.tv_nsec = 1000000};
+      clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+      tsc1 = rdtsc();
+      nanosleep(&ms, NULL);
+      clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+      tsc_khz = (rdtsc() - tsc1) * 1000000 / (km_timespec_nsec(&now) - km_timespec_nsec(&start));
+   }
+   t->shift = 32;
+   t->mult = (1000000UL << t->shift) / tsc_khz;
+   t->max_delta = KM_TIME_MAX_NSEC / 1000000 * tsc_khz;
+   t->tsc_base = 0;
+   km_guest_time_rebase();
+   __atomic_store_n(&t->valid, 1, __ATOMIC_RELEASE);
+   pthread_mutex_unlock(&km_guest_time_mtx);
+   km_infox(KM_TRACE_VCPU, "time page: tsc %ld kHz, offset %ld", tsc_khz, km_guest_tsc_offset);
+}
+
 // Set the TSC value to that of the physical machine to make clock_gettime VDSO logic happy
 static void km_init_tsc(km_vcpu_t* vcpu)
 {
@@ -200,6 +366,7 @@ static void km_init_tsc(km_vcpu_t* vcpu)
    if (ioctl(vcpu->kvm_vcpu_fd, KVM_SET_MSRS, msrs) < 0) {
       km_err(1, "KVM_SET_MSRS for TSC");
    }
+   km_guest_time_init(vcpu);
 }
 
 void kvm_vcpu_init_sregs(km_vcpu_t* vcpu)
@@ -517,7 +684,6 @@ void km_vcpu_clone_to_run(km_vcpu_t* vcpu, km_vcpu_t* new_vcpu)
     */
    km_gva_t sp = new_vcpu->stack_top - km_vmdriver_stack_adjustment(vcpu);
    km_vcpu_sync_rip(vcpu);
-   vcpu->regs_valid = 0;
    km_read_registers(vcpu);
    new_vcpu->regs = vcpu->regs;
    new_vcpu->regs.rsp = sp;
@@ -695,12 +861,14 @@ void km_machine_setup(km_machine_init_params_t* params)
             break;
       }
    }
-   if (machine.guest_max_physmem > GUEST_MAX_PHYSMEM_SUPPORTED) {
+   // Above the default only when asked for, see GUEST_MAX_PHYSMEM_SUPPORTED
+   uint64_t host_max_physmem = machine.guest_max_physmem;
+   if (machine.guest_max_physmem > GUEST_MAX_PHYSMEM_DEFAULT) {
       km_infox(KM_TRACE_MEM,
                "Scaling down guest max phys mem to %#lx from %#lx",
-               GUEST_MAX_PHYSMEM_SUPPORTED,
+               GUEST_MAX_PHYSMEM_DEFAULT,
                machine.guest_max_physmem);
-      machine.guest_max_physmem = GUEST_MAX_PHYSMEM_SUPPORTED;
+      machine.guest_max_physmem = GUEST_MAX_PHYSMEM_DEFAULT;
    }
    if (machine.pdpe1g == 0) {
       /*
@@ -710,18 +878,19 @@ void km_machine_setup(km_machine_init_params_t* params)
       km_infox(KM_TRACE_MEM,
                "KVM: 1gb pages are not supported (pdpe1g=0), setting VM max mem to 2 GiB");
       machine.guest_max_physmem = MIN(2 * GIB, machine.guest_max_physmem);
+      host_max_physmem = machine.guest_max_physmem;
    }
    if (params->guest_physmem != 0) {
-      if ((machine.vm_type == VM_TYPE_KKM) && (params->guest_physmem != GUEST_MAX_PHYSMEM_SUPPORTED)) {
+      if (machine.vm_type == VM_TYPE_KKM && params->guest_physmem != GUEST_MAX_PHYSMEM_DEFAULT) {
          km_errx(1,
                  "Only %ldGiB physical memory supported with KKM driver",
-                 GUEST_MAX_PHYSMEM_SUPPORTED / GIB);
+                 GUEST_MAX_PHYSMEM_DEFAULT / GIB);
       } else {
-         if (params->guest_physmem > machine.guest_max_physmem) {
+         if (params->guest_physmem > MIN(host_max_physmem, GUEST_MAX_PHYSMEM_SUPPORTED)) {
             km_errx(1,
                     "Cannot set guest memory size to '0x%lx'. Max supported=0x%lx",
                     params->guest_physmem,
-                    machine.guest_max_physmem);
+                    MIN(host_max_physmem, GUEST_MAX_PHYSMEM_SUPPORTED));
          }
          machine.guest_max_physmem = params->guest_physmem;
       }
@@ -756,4 +925,7 @@ void km_machine_init(km_machine_init_params_t* params)
    km_mem_init(params);
    km_signal_init();
    km_init_guest_idt();
+   km_guest_info_update();
+   km_hc_async_init();
+   km_mem_reclaim_init();
 }
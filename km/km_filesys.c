@@ -926,8 +926,8 @@ uint64_t km_fs_prw(km_vcpu_t* vcpu, int scall, int fd, void* buf, size_t count,
 // ssize_t writev(int fd, const struct iovec *iov, int iovcnt);
 // ssize_t preadv(int fd, const struct iovec* iov, int iovcnt, off_t offset);
 // ssize_t pwritev(int fd, const struct iovec* iov, int iovcnt, off_t offset);
-uint64_t
-km_fs_prwv(km_vcpu_t* vcpu, int scall, int fd, const struct iovec* guest_iov, size_t iovcnt, off_t offset)
+// iov is the host iovecs, see km_iovec.h
+uint64_t km_fs_prwv(km_vcpu_t* vcpu, int scall, int fd, const struct iovec* iov, int iovcnt, off_t offset)
 {
    int host_fd;
    km_file_ops_t* ops;
@@ -942,18 +942,6 @@ km_fs_prwv(km_vcpu_t* vcpu, int scall, int fd, const struct iovec* guest_iov, si
       km_warnx("unsupported %s", km_hc_name_get(scall));
       return -EINVAL;
    }
-   // ssize_t readv(int fd, const struct iovec *iov, int iovcnt);
-   // ssize_t writev(int fd, const struct iovec *iov, int iovcnt);
-   // ssize_t preadv(int fd, const struct iovec* iov, int iovcnt, off_t offset);
-   // ssize_t pwritev(int fd, const struct iovec* iov, int iovcnt, off_t offset);
-   //
-   // need to convert not only the address of iov,
-   // but also pointers to individual buffers in it
-   struct iovec iov[iovcnt];
-   for (int i = 0; i < iovcnt; i++) {
-      iov[i].iov_base = km_gva_to_kma((long)guest_iov[i].iov_base);
-      iov[i].iov_len = guest_iov[i].iov_len;
-   }
    ret = __syscall_4(scall, host_fd, (uintptr_t)iov, iovcnt, offset);
    return ret;
 }
@@ -2413,6 +2401,12 @@ uint64_t km_fs_timerfd_create(km_vcpu_t* vcpu, int clockid, int flags)
    return ret;
 }
 
+// Adds the fd returned by io_uring_setup(), see km_uring.c
+int km_fs_add_io_uring_fd(km_vcpu_t* vcpu, int hostfd)
+{
+   return km_add_guest_fd_internal(vcpu, hostfd, NULL, O_RDWR, KM_FILE_HOW_IO_URING, NULL);
+}
+
 static inline int
 km_fs_event_check_errors(km_vcpu_t* vcpu, km_file_t* file, struct epoll_event* events, int maxevents)
 {
@@ -119,8 +119,7 @@ uint64_t km_fs_prw(km_vcpu_t* vcpu, int scall, int fd, void* buf, size_t count,
 // ssize_t writev(int fd, const struct iovec *iov, int iovcnt);
 // ssize_t preadv(int fd, const struct iovec* iov, int iovcnt, off_t offset);
 // ssize_t pwritev(int fd, const struct iovec* iov, int iovcnt, off_t offset);
-uint64_t
-km_fs_prwv(km_vcpu_t* vcpu, int scall, int fd, const struct iovec* guest_iov, size_t iovcnt, off_t offset);
+uint64_t km_fs_prwv(km_vcpu_t* vcpu, int scall, int fd, const struct iovec* iov, int iovcnt, off_t offset);
 // int ioctl(int fd, unsigned long request, void *arg);
 uint64_t km_fs_ioctl(km_vcpu_t* vcpu, int fd, unsigned long request, void* arg);
 // int fcntl(int fd, int cmd, ... /* arg */ );
@@ -322,6 +321,7 @@ uint64_t km_fs_prlimit64(km_vcpu_t* vcpu,
                          struct rlimit* old_limit);
 
 uint64_t km_fs_timerfd_create(km_vcpu_t* vcpu, int clockid, int flags);
+int km_fs_add_io_uring_fd(km_vcpu_t* vcpu, int hostfd);
 
 size_t km_fs_dup_notes_length(void);
 size_t km_fs_core_dup_write(char* buf, size_t length);
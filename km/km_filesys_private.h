@@ -60,7 +60,8 @@ typedef enum km_file_how {
    KM_FILE_HOW_SOCKETPAIR1 = 7,
    KM_FILE_HOW_RECVMSG = 8,
    KM_FILE_HOW_EVENTFD = 9, /* eventfd() */
-   KM_FILE_HOW_TIMERFD = 10
+   KM_FILE_HOW_TIMERFD = 10,
+   KM_FILE_HOW_IO_URING = 11 /* io_uring_setup() */
 } km_file_how_t;
 
 // Each file opened by the guest has one of these structures.
@@ -31,6 +31,7 @@
 #include "km_gdb.h"
 #include "km_kkm.h"
 #include "km_mem.h"
+#include "km_uring.h"
 
 /*
  * fork() or clone() state from the parent process thread that needs to be present in the thread in
@@ -102,11 +103,13 @@ static void km_fork_setup_child_vmstate(sigset_t* formermask)
    machine.vm_vcpu_run_cnt = 0;
    SLIST_INIT(&machine.vm_idle_vcpus.head);
    machine.vm_vcpu_mtx = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+   machine.vm_mem_regs_rwlock = (pthread_rwlock_t)PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
    machine.brk_mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
    machine.signal_mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
    TAILQ_INIT(&machine.sigpending.head);
    TAILQ_INIT(&machine.sigfree.head);
    machine.mmaps.mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+   machine.mmaps.seq = 0;
    machine.pause_mtx = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
    machine.pause_cv = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
 
@@ -120,7 +123,7 @@ static void km_fork_setup_child_vmstate(sigset_t* formermask)
     * parent. We just need to tell kvm how the memory looks.
     */
    for (int i = 0; i < KM_MEM_SLOTS; i++) {
-      if (machine.vm_mem_regs[i].memory_size != 0) {
+      if (km_memslot_plugged(i) != 0) {
          if (ioctl(machine.mach_fd, KVM_SET_USER_MEMORY_REGION, &machine.vm_mem_regs[i]) < 0) {
             km_err(2, "KVM: failed to plug in memory region %d", i);
          }
@@ -128,6 +131,8 @@ static void km_fork_setup_child_vmstate(sigset_t* formermask)
    }
 
    km_signal_init();   // initialize signal wait queue and the signal entry free list
+   km_hc_async_init();
+   km_mem_reclaim_init();
 
    // km signal system is ready to handle signals
    int rc = sigprocmask(SIG_SETMASK, formermask, NULL);
@@ -179,6 +184,8 @@ static void km_fork_remove_parent_vmstate(void)
    close(machine.shutdown_fd);
    machine.shutdown_fd = -1;
    km_signal_fini();
+   km_hc_async_fork_child();
+   km_uring_fork_child();
 
    // Should try to free all of the stacks for the now defunt vcpu threads?
    for (int i = 0; i < machine.vm_vcpu_cnt; i++) {
@@ -252,10 +259,12 @@ int km_before_fork(km_vcpu_t* vcpu, km_hc_args_t* arg, uint8_t is_clone)
       km_cond_wait(&km_fork_state.cond, &km_fork_state.mutex);
    }
 
-   if (ioctl(vcpu->kvm_vcpu_fd, KVM_GET_REGS, &km_fork_state.regs) < 0) {
+   km_read_registers(vcpu);
+   if (vcpu->regs_valid == 0) {
       km_mutex_unlock(&km_fork_state.mutex);
       return -errno;
    }
+   km_fork_state.regs = vcpu->regs;
    km_vmdriver_save_fork_info(vcpu,
                               &km_fork_state.ksi_valid,
                               &km_fork_state.ksi,
@@ -382,6 +391,7 @@ int km_dofork(int* in_child)
       // Set the child's km pid immediately so km_info() reports correct process id.
       machine.pid = getpid();
       machine.ppid = getppid();
+      km_guest_info_update();
       km_infox(KM_TRACE_FORK, "child: after fork/clone");
       km_fork_state.fork_in_progress = 0;
       km_fork_state.mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
@@ -44,11 +44,24 @@ extern uint8_t km_guest_data_start;
 extern void* __km_interrupt_table[];
 extern uint8_t km_guest_data_rw_start;
 extern km_hc_args_t* km_hcargs[HC_ARGS_INDEX(KVM_MAX_VCPUS)];
+extern km_hc_ring_t km_hcring[KVM_MAX_VCPUS];
+extern km_hc_async_t km_hcasync[KM_HC_ASYNC_QUEUES];
 extern uint8_t __km_handle_interrupt;
 extern uint8_t __km_syscall_handler;
 extern uint8_t __km_sigreturn;
 extern uint8_t km_guest_end;
 
+extern km_guest_info_t km_guest_info;
+extern km_guest_time_t km_guest_time;
+
+/*
+ * Per vcpu value in the vcpu km_hcargs cache line, offset is one of KM_GS_*_OFFSET.
+ */
+static inline uint64_t* km_hcargs_slot(int vcpu_id, int offset)
+{
+   return (uint64_t*)&km_hcargs[HC_ARGS_INDEX(vcpu_id) + offset / BYTES_PER_POINTER];
+}
+
 /*
  * Compute the guest virtual address of the km addresses that live
  * in km_guest*.[cs]
@@ -62,4 +75,13 @@ static inline km_gva_t km_guest_kma_to_gva(km_kma_t km_guest_addr)
    return gva;
 }
 
+/*
+ * Are there entries in the vcpu hypercall submission ring that km hasn't executed yet?
+ */
+static inline int km_hcall_ring_pending(km_vcpu_t* vcpu)
+{
+   km_hc_ring_t* ring = &km_hcring[vcpu->vcpu_id];
+   return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != ring->head;
+}
+
 #endif /* !defined(__KM_GUEST_H__) */
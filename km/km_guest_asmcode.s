@@ -129,6 +129,26 @@ __km_interrupt_table:
     .quad handlerUNEX       # Rest unexpected
     .quad 0                 # Terminate list
 
+/*
+ * Per process values published by km for the __km_syscall_handler fast path, km_guest_info_t.
+ * This section is read-only in the guest page tables.
+ */
+    .section .km_guest_data, "dwa", @progbits
+    .align 64
+    .type km_guest_info, @object
+    .global km_guest_info
+km_guest_info:
+    .space GUEST_INFO_SIZE, 0
+
+/*
+ * Time page, km_guest_time_t.
+ */
+    .align 64
+    .type km_guest_time, @object
+    .global km_guest_time
+km_guest_time:
+    .space GUEST_TIME_SIZE, 0
+
 /*
  * Array of per vcpu km_hc_args_t structures.
  */
@@ -140,6 +160,26 @@ __km_interrupt_table:
 km_hcargs:
     .space KVM_MAX_VCPUS * CACHE_LINE_LENGTH, 0
 
+/*
+ * Array of per vcpu hypercall submission rings, km_hc_ring_t.
+ */
+    .align 64
+    .type km_hcring, @object
+    .global km_hcring
+    // Changes to the size of km_hcring here should be reflected in km_hcalls.h
+km_hcring:
+    .space KVM_MAX_VCPUS * HC_RING_SIZE, 0
+
+/*
+ * Asynchronous hypercall queues, km_hc_async_t.
+ */
+    .align 64
+    .type km_hcasync, @object
+    .global km_hcasync
+    // Changes to the size of km_hcasync here should be reflected in km_hcalls.h
+km_hcasync:
+    .space HC_ASYNC_QUEUES * HC_ASYNC_SIZE, 0
+
 /*
  * SYSCALL handling. This function converts a syscall into
  * the coresponding KM Hypercall.
@@ -162,6 +202,60 @@ km_hcargs:
 __km_syscall_handler:
     .cfi_startproc
     .cfi_register %rip, %rcx  # old %rip is in %rcx
+    /*
+     * Fast path. Syscalls that only return values km already published in km_guest_info
+     * (or the vcpu km_hcargs line) are answered here without leaving the guest.
+     */
+    cmpq $0, km_guest_info+gi_valid(%rip)
+    je .Lhcall
+    cmp $SYS_getpid, %rax
+    je .Lgetpid
+    cmp $SYS_gettid, %rax
+    je .Lgettid
+    cmp $SYS_getppid, %rax
+    je .Lgetppid
+    cmp $SYS_getuid, %rax
+    je .Lgetuid
+    cmp $SYS_geteuid, %rax
+    je .Lgeteuid
+    cmp $SYS_getgid, %rax
+    je .Lgetgid
+    cmp $SYS_getegid, %rax
+    je .Lgetegid
+    cmp $SYS_umask, %rax
+    jne .Lhcall
+    // umask() that doesn't change the mask, otherwise km has to do it
+    cmp km_guest_info+gi_umask(%rip), %rdi
+    jne .Lhcall
+    mov %rdi, %rax
+    jmp .Lfast_ret
+.Lgetpid:
+    mov km_guest_info+gi_pid(%rip), %rax
+    jmp .Lfast_ret
+.Lgettid:
+    mov %gs:GS_TID_OFFSET, %rax
+    jmp .Lfast_ret
+.Lgetppid:
+    mov km_guest_info+gi_ppid(%rip), %rax
+    jmp .Lfast_ret
+.Lgetuid:
+    mov km_guest_info+gi_uid(%rip), %rax
+    jmp .Lfast_ret
+.Lgeteuid:
+    mov km_guest_info+gi_euid(%rip), %rax
+    jmp .Lfast_ret
+.Lgetgid:
+    mov km_guest_info+gi_gid(%rip), %rax
+    jmp .Lfast_ret
+.Lgetegid:
+    mov km_guest_info+gi_egid(%rip), %rax
+.Lfast_ret:
+    andq $0x3C7FD7, %r11    # restore the flag register
+    push %r11
+    popfq
+    jmp *%rcx
+
+.Lhcall:
     // create a km_hcall_t on the stack.
     push %r9    # arg6
     .cfi_def_cfa rsp, 8
@@ -0,0 +1,337 @@
+/*
+ * Copyright 2021 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Asynchronous hypercalls, see km_hcalls.h for the guest side.
+ *
+ * Each km_hcasync[] queue has a worker thread and an eventfd registered with KVM_IOEVENTFD on the
+ * queue doorbell port. The worker executes queued writes in order and keeps the first error per fd,
+ * which km_hc_async_fence() hands to the next synchronous call on that fd. The queue error flag
+ * stays set while any error is kept, so the guest stops queueing and makes that call right away.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "km.h"
+#include "km_filesys.h"
+#include "km_guest.h"
+#include "km_hcalls.h"
+#include "km_signal.h"
+
+#define KM_HC_ASYNC_ERRORS 8   // fds with a pending error, per queue
+
+typedef struct km_hc_async_worker {
+   pthread_t thread;
+   int efd;                 // doorbell, ioeventfd
+   int stop;                // set by km_hc_async_fini()
+   int waiters;             // threads in km_hc_async_wait()
+   pthread_mutex_t mutex;   // protects errors[] and the wait
+   pthread_cond_t cv;
+   struct {
+      int fd;
+      int error;   // 0 if the slot is free
+   } errors[KM_HC_ASYNC_ERRORS];
+} km_hc_async_worker_t;
+
+int km_hc_async_mode = 0;   // --async-hcalls
+static int km_hc_async_running;
+static km_hc_async_worker_t km_hc_async_workers[KM_HC_ASYNC_QUEUES];
+
+_Static_assert(sizeof(km_hc_async_entry_t) == 512, "km_hc_async_entry_t size");
+_Static_assert(sizeof(km_hc_async_t) == 128 + KM_HC_ASYNC_ENTRIES * 512, "HC_ASYNC_SIZE in km_guest.asmh");
+
+static void km_hc_async_error_set(km_hc_async_worker_t* w, int fd, int error)
+{
+   km_hc_async_t* q = &km_hcasync[w - km_hc_async_workers];
+
+   km_mutex_lock(&w->mutex);
+   for (int i = 0; i < KM_HC_ASYNC_ERRORS; i++) {
+      if (w->errors[i].error != 0 && w->errors[i].fd == fd) {
+         break;   // keep the first one
+      }
+      if (w->errors[i].error == 0) {
+         w->errors[i].fd = fd;
+         w->errors[i].error = error;
+         break;
+      }
+   }
+   __atomic_store_n(&q->error, 1, __ATOMIC_RELEASE);
+   km_mutex_unlock(&w->mutex);
+}
+
+static int km_hc_async_error_take(km_hc_async_worker_t* w, int fd)
+{
+   km_hc_async_t* q = &km_hcasync[w - km_hc_async_workers];
+   int error = 0;
+   int pending = 0;
+
+   km_mutex_lock(&w->mutex);
+   for (int i = 0; i < KM_HC_ASYNC_ERRORS; i++) {
+      if (w->errors[i].error != 0 && w->errors[i].fd == fd && error == 0) {
+         error = w->errors[i].error;
+         w->errors[i].error = 0;
+      } else if (w->errors[i].error != 0) {
+         pending = 1;
+      }
+   }
+   __atomic_store_n(&q->error, pending, __ATOMIC_RELEASE);
+   km_mutex_unlock(&w->mutex);
+   return error;
+}
+
+/*
+ * The guest was told the whole buffer was written, so finish short writes here. The data is our
+ * copy in the entry, which the guest can't pass to a hypercall, so call km_fs_prw() directly.
+ */
+static void km_hc_async_execute(km_hc_async_worker_t* w, km_hc_async_entry_t* e)
+{
+   int fd = e->args.arg1;
+   size_t len = e->args.arg3;
+   int64_t ret;
+
+   if (e->hc != SYS_write || len > KM_HC_ASYNC_DATA) {
+      km_infox(KM_TRACE_HC, "async hc %ld not supported", e->hc);
+      km_hc_async_error_set(w, fd, -ENOSYS);
+      return;
+   }
+   for (size_t off = 0; off < len; off += ret) {
+      ret = km_fs_prw(NULL, SYS_write, fd, e->data + off, len - off, 0);
+      if (ret <= 0) {
+         km_infox(KM_TRACE_HC, "async write fd %d: %ld", fd, ret);
+         km_hc_async_error_set(w, fd, ret == 0 ? -EIO : ret);
+         if (ret == -EPIPE) {   // the host SIGPIPE is blocked in this thread
+            siginfo_t info = {.si_signo = SIGPIPE, .si_code = SI_USER, .si_pid = getpid()};
+            km_post_signal(NULL, &info);
+         }
+         return;
+      }
+   }
+}
+
+static void* km_hc_async_worker(void* data)
+{
+   km_hc_async_worker_t* w = data;
+   km_hc_async_t* q = &km_hcasync[w - km_hc_async_workers];
+   sigset_t all;
+
+   // signals are for vcpu threads
+   sigfillset(&all);
+   pthread_sigmask(SIG_BLOCK, &all, NULL);
+   while (1) {
+      uint64_t head = q->head;
+      km_hc_async_entry_t* e = &q->entries[head % KM_HC_ASYNC_ENTRIES];
+
+      if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) == head + 1) {
+         km_hc_async_execute(w, e);
+         __atomic_store_n(&e->seq, head + KM_HC_ASYNC_ENTRIES, __ATOMIC_RELEASE);
+         __atomic_store_n(&q->head, head + 1, __ATOMIC_SEQ_CST);
+         if (__atomic_load_n(&w->waiters, __ATOMIC_SEQ_CST) != 0) {
+            km_mutex_lock(&w->mutex);
+            km_cond_broadcast(&w->cv);
+            km_mutex_unlock(&w->mutex);
+         }
+         continue;
+      }
+      if (__atomic_load_n(&w->stop, __ATOMIC_ACQUIRE) != 0) {
+         break;
+      }
+      // the guest rings the doorbell only if we say we are sleeping
+      __atomic_store_n(&q->sleeping, 1, __ATOMIC_RELAXED);
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != head + 1 &&
+          __atomic_load_n(&w->stop, __ATOMIC_ACQUIRE) == 0) {
+         uint64_t val;
+         (void)read(w->efd, &val, sizeof(val));
+      }
+      __atomic_store_n(&q->sleeping, 0, __ATOMIC_RELAXED);
+   }
+   return NULL;
+}
+
+/*
+ * Wait for everything queued so far in queue idx to complete.
+ */
+static void km_hc_async_wait(int idx)
+{
+   km_hc_async_worker_t* w = &km_hc_async_workers[idx];
+   km_hc_async_t* q = &km_hcasync[idx];
+   uint64_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+
+   if ((int64_t)(__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) - tail) >= 0) {
+      return;
+   }
+   km_mutex_lock(&w->mutex);
+   __atomic_add_fetch(&w->waiters, 1, __ATOMIC_SEQ_CST);
+   while ((int64_t)(__atomic_load_n(&q->head, __ATOMIC_SEQ_CST) - tail) < 0) {
+      km_cond_wait(&w->cv, &w->mutex);
+   }
+   __atomic_sub_fetch(&w->waiters, 1, __ATOMIC_SEQ_CST);
+   km_mutex_unlock(&w->mutex);
+}
+
+void km_hc_async_drain(void)
+{
+   if (km_hc_async_running == 0) {
+      return;
+   }
+   for (int i = 0; i < KM_HC_ASYNC_QUEUES; i++) {
+      km_hc_async_wait(i);
+   }
+}
+
+/*
+ * Called before synchronous hypercall hc. Waits for queued calls it needs to be ordered after, and
+ * returns the deferred error for its fd, if any.
+ */
+int km_hc_async_fence(int hc, km_hc_args_t* arg)
+{
+   int fd;
+
+   if (km_hc_async_running == 0) {
+      return 0;
+   }
+   switch (hc) {
+      case SYS_exit_group:
+      case SYS_execve:
+      case SYS_fork:
+      case SYS_clone:
+      case HC_snapshot:
+         km_hc_async_drain();
+         return 0;
+
+      case SYS_read:   // like stdio, flush the output before reading stdin
+         if (arg->arg1 == 0) {
+            km_hc_async_drain();
+         }
+         return 0;
+
+      case SYS_write:
+      case SYS_writev:
+      case SYS_pwrite64:
+      case SYS_pwritev:
+      case SYS_sendfile:
+      case SYS_fsync:
+      case SYS_fdatasync:
+      case SYS_ftruncate:
+      case SYS_fcntl:
+      case SYS_ioctl:
+      case SYS_close:
+         fd = arg->arg1;
+         break;
+
+      case SYS_dup2:
+      case SYS_dup3:
+         fd = arg->arg2;
+         break;
+
+      default:
+         return 0;
+   }
+   if (fd < 0) {
+      return 0;
+   }
+   km_hc_async_wait(fd % KM_HC_ASYNC_QUEUES);
+   return km_hc_async_error_take(&km_hc_async_workers[fd % KM_HC_ASYNC_QUEUES], fd);
+}
+
+/*
+ * Start the workers and publish the queues in km_guest_info. Called on machine init and in the
+ * fork child.
+ */
+void km_hc_async_init(void)
+{
+   km_guest_info.async = 0;
+   if (km_hc_async_mode == 0) {
+      return;
+   }
+   if (machine.vm_type != VM_TYPE_KVM) {
+      km_warnx("async hypercalls need KVM ioeventfd, disabled");
+      return;
+   }
+   for (int i = 0; i < KM_HC_ASYNC_QUEUES; i++) {
+      km_hc_async_worker_t* w = &km_hc_async_workers[i];
+      km_hc_async_t* q = &km_hcasync[i];
+
+      q->head = q->tail = 0;
+      q->sleeping = 0;
+      q->error = 0;
+      for (int j = 0; j < KM_HC_ASYNC_ENTRIES; j++) {
+         q->entries[j].seq = j;
+      }
+      *w = (km_hc_async_worker_t){
+          .mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER,
+          .cv = (pthread_cond_t)PTHREAD_COND_INITIALIZER,
+      };
+      if ((w->efd = km_internal_eventfd(0, 0)) < 0) {
+         km_err(1, "KM: Failed to create async hypercall eventfd");
+      }
+      struct kvm_ioeventfd ioe = {
+          .addr = KM_HC_ASYNC_PORT_BASE + i,
+          .len = 4,
+          .fd = w->efd,
+          .flags = KVM_IOEVENTFD_FLAG_PIO,
+      };
+      if (ioctl(machine.mach_fd, KVM_IOEVENTFD, &ioe) < 0) {
+         km_err(1, "KVM: KVM_IOEVENTFD port 0x%llx", ioe.addr);
+      }
+      if (pthread_create(&w->thread, NULL, km_hc_async_worker, w) != 0) {
+         km_err(1, "KM: Failed to create async hypercall worker");
+      }
+   }
+   km_hc_async_running = 1;
+   km_guest_info.async = km_guest_kma_to_gva(km_hcasync);
+   km_infox(KM_TRACE_HC, "async hypercalls at 0x%lx", km_guest_info.async);
+}
+
+/*
+ * Execute what's left in the queues and stop the workers.
+ */
+void km_hc_async_fini(void)
+{
+   if (km_hc_async_running == 0) {
+      return;
+   }
+   km_guest_info.async = 0;
+   for (int i = 0; i < KM_HC_ASYNC_QUEUES; i++) {
+      km_hc_async_worker_t* w = &km_hc_async_workers[i];
+      uint64_t val = 1;
+
+      __atomic_store_n(&w->stop, 1, __ATOMIC_RELEASE);
+      (void)write(w->efd, &val, sizeof(val));
+      pthread_join(w->thread, NULL);
+      close(w->efd);
+   }
+   km_hc_async_running = 0;
+}
+
+/*
+ * Fork child. The workers stayed in the parent, which drained the queues before the fork.
+ */
+void km_hc_async_fork_child(void)
+{
+   if (km_hc_async_running == 0) {
+      return;
+   }
+   for (int i = 0; i < KM_HC_ASYNC_QUEUES; i++) {
+      close(km_hc_async_workers[i].efd);
+   }
+   km_hc_async_running = 0;
+}
@@ -375,7 +375,7 @@ static const char* const hc_name[KM_MAX_HCALL] = {
    // reserved to be compatible with earlier-built payloads.
    // TODO: drop before release, we do not need compat with
    // pre-release payloads
-   [HC_reserved1] = "reserved1",
+   [HC_hcall_ring] = "hcall_ring",
    [HC_reserved2] = "reserved2",
    [HC_guest_interrupt] = "guest_interrupt",
    [HC_reserved3] = "reserved3",
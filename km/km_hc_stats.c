@@ -0,0 +1,212 @@
+/*
+ * Copyright 2021 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Hypercall latency stats (--hcall-stats).
+ *
+ * Each vcpu has its own histogram per hypercall, so recording is a few plain stores by the only
+ * writer. Readers (exit, management requests) sum them up while vcpus keep running, the result is
+ * a close enough snapshot.
+ *
+ * Histograms are log-linear: values below KM_HC_HIST_SUB are exact, above that each power of 2 is
+ * split into KM_HC_HIST_SUB buckets, so a bucket is within 1/KM_HC_HIST_SUB of its values.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "km.h"
+#include "km_guest.h"
+#include "km_hcalls.h"
+
+#define KM_HC_HIST_SUB_BITS 3
+#define KM_HC_HIST_SUB (1 << KM_HC_HIST_SUB_BITS)
+#define KM_HC_HIST_MAX_BITS 36   // 2^36 nsecs (~69 sec) and more go to the last bucket
+#define KM_HC_HIST_BUCKETS ((KM_HC_HIST_MAX_BITS - KM_HC_HIST_SUB_BITS + 1) * KM_HC_HIST_SUB)
+
+typedef struct km_hc_hist {
+   uint64_t count;
+   uint64_t total;   // nsecs
+   uint64_t min;
+   uint64_t max;
+   uint32_t buckets[KM_HC_HIST_BUCKETS];
+} __attribute__((aligned(CACHE_LINE_LENGTH))) km_hc_hist_t;
+
+// [vcpu][hc], allocated by the vcpu on first use
+static km_hc_hist_t** km_hc_hists[KVM_MAX_VCPUS];
+
+static const double km_hc_percentiles[] = {0.5, 0.9, 0.99, 0.999};
+
+static inline int km_hc_hist_idx(uint64_t nsecs)
+{
+   if (nsecs < KM_HC_HIST_SUB) {
+      return nsecs;
+   }
+   if (nsecs >= 1ul << KM_HC_HIST_MAX_BITS) {
+      return KM_HC_HIST_BUCKETS - 1;
+   }
+   int bits = 63 - __builtin_clzl(nsecs);
+   return (bits - KM_HC_HIST_SUB_BITS + 1) * KM_HC_HIST_SUB +
+          ((nsecs >> (bits - KM_HC_HIST_SUB_BITS)) & (KM_HC_HIST_SUB - 1));
+}
+
+// Highest value that goes to bucket idx
+static inline uint64_t km_hc_hist_top(int idx)
+{
+   if (idx < KM_HC_HIST_SUB) {
+      return idx;
+   }
+   int shift = idx / KM_HC_HIST_SUB - 1;
+   return ((uint64_t)(KM_HC_HIST_SUB + idx % KM_HC_HIST_SUB + 1) << shift) - 1;
+}
+
+/*
+ * Called by the vcpu thread after hypercall hc took nsecs.
+ */
+void km_hc_stats_record(km_vcpu_t* vcpu, int hc, uint64_t nsecs)
+{
+   km_hc_hist_t** hists = km_hc_hists[vcpu->vcpu_id];
+   km_hc_hist_t* h;
+
+   if (hists == NULL) {
+      if ((hists = calloc(KM_MAX_HCALL, sizeof(km_hc_hist_t*))) == NULL) {
+         return;
+      }
+      __atomic_store_n(&km_hc_hists[vcpu->vcpu_id], hists, __ATOMIC_RELEASE);
+   }
+   if ((h = hists[hc]) == NULL) {
+      if ((h = aligned_alloc(CACHE_LINE_LENGTH, sizeof(km_hc_hist_t))) == NULL) {
+         return;
+      }
+      memset(h, 0, sizeof(km_hc_hist_t));
+      h->min = UINT64_MAX;
+      __atomic_store_n(&hists[hc], h, __ATOMIC_RELEASE);
+   }
+   // the only writer, readers may see a count that is a little ahead or behind the buckets
+   __atomic_store_n(&h->buckets[km_hc_hist_idx(nsecs)],
+                    h->buckets[km_hc_hist_idx(nsecs)] + 1,
+                    __ATOMIC_RELAXED);
+   __atomic_store_n(&h->total, h->total + nsecs, __ATOMIC_RELAXED);
+   if (nsecs < h->min) {
+      __atomic_store_n(&h->min, nsecs, __ATOMIC_RELAXED);
+   }
+   if (nsecs > h->max) {
+      __atomic_store_n(&h->max, nsecs, __ATOMIC_RELAXED);
+   }
+   __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+}
+
+// Sum of all vcpus histograms for hc
+static void km_hc_stats_merge(int hc, km_hc_hist_t* sum)
+{
+   memset(sum, 0, sizeof(km_hc_hist_t));
+   sum->min = UINT64_MAX;
+   for (int i = 0; i < KVM_MAX_VCPUS; i++) {
+      km_hc_hist_t** hists = __atomic_load_n(&km_hc_hists[i], __ATOMIC_ACQUIRE);
+      km_hc_hist_t* h;
+
+      if (hists == NULL || (h = __atomic_load_n(&hists[hc], __ATOMIC_ACQUIRE)) == NULL) {
+         continue;
+      }
+      sum->count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+      sum->total += __atomic_load_n(&h->total, __ATOMIC_RELAXED);
+      sum->min = MIN(sum->min, __atomic_load_n(&h->min, __ATOMIC_RELAXED));
+      sum->max = MAX(sum->max, __atomic_load_n(&h->max, __ATOMIC_RELAXED));
+      for (int b = 0; b < KM_HC_HIST_BUCKETS; b++) {
+         sum->buckets[b] += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+      }
+   }
+}
+
+static uint64_t km_hc_stats_percentile(km_hc_hist_t* h, double p)
+{
+   uint64_t count = 0;
+   uint64_t seen = 0;
+
+   for (int b = 0; b < KM_HC_HIST_BUCKETS; b++) {
+      count += h->buckets[b];
+   }
+   uint64_t want = count * p;
+   for (int b = 0; b < KM_HC_HIST_BUCKETS; b++) {
+      if ((seen += h->buckets[b]) > want) {
+         return MIN(km_hc_hist_top(b), h->max);
+      }
+   }
+   return h->max;
+}
+
+/*
+ * Calls fn with a line of text for each hypercall that was called. Latencies are in nsecs.
+ */
+static void km_hc_stats_foreach(void (*fn)(const char* line, void* arg), void* arg)
+{
+   km_hc_hist_t* h = aligned_alloc(CACHE_LINE_LENGTH, sizeof(km_hc_hist_t));
+   char line[256];
+
+   if (h == NULL) {
+      return;
+   }
+   for (int hc = 0; hc < KM_MAX_HCALL; hc++) {
+      km_hc_stats_merge(hc, h);
+      if (h->count == 0) {
+         continue;
+      }
+      int len = snprintf(line,
+                         sizeof(line),
+                         "%24s(%3d) called %9ld times, latency nsecs %9ld avg %9ld min",
+                         km_hc_name_get(hc),
+                         hc,
+                         h->count,
+                         h->total / h->count,
+                         h->min);
+      for (int i = 0; i < sizeof(km_hc_percentiles) / sizeof(km_hc_percentiles[0]); i++) {
+         len += snprintf(line + len,
+                         sizeof(line) - len,
+                         " %9ld p%g",
+                         km_hc_stats_percentile(h, km_hc_percentiles[i]),
+                         km_hc_percentiles[i] * 100);
+      }
+      snprintf(line + len, sizeof(line) - len, " %9ld max", h->max);
+      fn(line, arg);
+   }
+   free(h);
+}
+
+static void km_hc_stats_warn(const char* line, void* arg)
+{
+   km_warnx("%s", line);
+}
+
+static void km_hc_stats_write(const char* line, void* arg)
+{
+   char buf[260];
+   int len = snprintf(buf, sizeof(buf), "%s\n", line);
+
+   (void)send(*(int*)arg, buf, len, MSG_NOSIGNAL);
+}
+
+// At exit
+void km_hc_stats_print(void)
+{
+   km_hc_stats_foreach(km_hc_stats_warn, NULL);
+}
+
+// Management request, one line per hypercall
+void km_hc_stats_send(int fd)
+{
+   km_hc_stats_foreach(km_hc_stats_write, &fd);
+}
@@ -42,10 +42,12 @@
 #include "km_guest.h"
 #include "km_hcalls.h"
 #include "km_iocontext.h"
+#include "km_iovec.h"
 #include "km_mem.h"
 #include "km_signal.h"
 #include "km_snapshot.h"
 #include "km_syscall.h"
+#include "km_uring.h"
 
 /*
  * User space (km) implementation of hypercalls.
@@ -164,12 +166,16 @@ static km_hc_ret_t prw_hcall(void* vcpu, int hc, km_hc_args_t* arg)
  */
 static km_hc_ret_t prwv_hcall(void* vcpu, int hc, km_hc_args_t* arg)
 {
-   void* buf = km_gva_to_kma(arg->arg2);
-   if (buf == NULL) {
-      arg->hc_ret = -EFAULT;
-      return HC_CONTINUE;
-   }
-   arg->hc_ret = km_fs_prwv(vcpu, hc, arg->arg1, buf, arg->arg3, arg->arg4);
+   // ssize_t readv(int fd, const struct iovec *iov, int iovcnt);
+   // ssize_t writev(int fd, const struct iovec *iov, int iovcnt);
+   // ssize_t preadv(int fd, const struct iovec* iov, int iovcnt, off_t offset);
+   // ssize_t pwritev(int fd, const struct iovec* iov, int iovcnt, off_t offset);
+   km_iov_t iov;
+
+   km_iov_init(&iov);
+   int rc = km_iov_add_guest(&iov, arg->arg2, arg->arg3, 1);
+   arg->hc_ret = rc != 0 ? rc : km_fs_prwv(vcpu, hc, arg->arg1, iov.iov, iov.cnt, arg->arg4);
+   km_iov_fini(&iov);
    return HC_CONTINUE;
 }
 
@@ -263,114 +269,76 @@ static km_hc_ret_t setsockopt_hcall(void* vcpu, int hc, km_hc_args_t* arg)
    return HC_CONTINUE;
 }
 
-static km_hc_ret_t sendrecvmsg_hcall(void* vcpu, int hc, km_hc_args_t* arg)
+/*
+ * Copy a 'struct msghdr' from <sys/socket.h from guest space to km space.
+ * We need to do this becuase the msghdr passes iovec's between user land and
+ * kernel land and they contain addresses that need translation. The iovecs are appended to kiov,
+ * the caller points km_msg->msg_iov at them once kiov is complete (it may be realloc'ed).
+ */
+static int copyin_msghdr(struct msghdr* km_msg, struct msghdr* guest_msg, km_iov_t* kiov)
 {
-   // ssize_t sendmsg(int sockfd, const struct msghdr *msg, int flags);
-   // ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags);
-   struct msghdr* msg_kma = km_gva_to_kma(arg->arg2);
-   struct msghdr msg;
+   int cnt = kiov->cnt;
+   int rc;
 
-   if (msg_kma == NULL) {
-      arg->hc_ret = -EFAULT;
-      return HC_CONTINUE;
-   }
    // The kernel seems to check the msg_name pointer before looking to see if
    // msg_namelen > 0.  So we validate msg_name first.
-   if (msg_kma->msg_name != NULL) {
-      msg.msg_name = km_gva_to_kma((uint64_t)msg_kma->msg_name);   // optional
-      if (msg.msg_name == NULL) {
-         arg->hc_ret = -EFAULT;
-         return HC_CONTINUE;
-      }
-   } else {
-      msg.msg_name = NULL;
+   km_msg->msg_name = NULL;
+   if (guest_msg->msg_name != NULL &&
+       (km_msg->msg_name = km_gva_range_to_kma((km_gva_t)guest_msg->msg_name,
+                                               guest_msg->msg_namelen)) == NULL) {
+      return -EFAULT;
    }
-   msg.msg_namelen = msg_kma->msg_namelen;
-   msg.msg_iovlen = msg_kma->msg_iovlen;
-   struct iovec iov[msg.msg_iovlen];
-   struct iovec* iov_kma = NULL;
-   // If iovec has no elements the iovec pointer is not validated.
+   km_msg->msg_namelen = guest_msg->msg_namelen;
    // msg_iovlen is unsigned so can never be negative.
-   if (msg.msg_iovlen > 0 && (iov_kma = km_gva_to_kma((uint64_t)msg_kma->msg_iov)) == NULL) {
-      arg->hc_ret = -EFAULT;
-      return HC_CONTINUE;
+   if (guest_msg->msg_iovlen > UIO_MAXIOV) {
+      return -EMSGSIZE;
    }
-   for (int i = 0; i < msg.msg_iovlen; i++) {
-      // Don't validate addresses if the element has a length of zero.
-      if (iov_kma[i].iov_len > 0 &&
-          (iov[i].iov_base = km_gva_to_kma((uint64_t)iov_kma[i].iov_base)) == NULL) {
-         arg->hc_ret = -EFAULT;
-         return HC_CONTINUE;
-      }
-      iov[i].iov_len = iov_kma[i].iov_len;
+   km_iov_break(kiov);
+   if ((rc = km_iov_add_guest(kiov, (km_gva_t)guest_msg->msg_iov, guest_msg->msg_iovlen, 0)) != 0) {
+      return rc;
    }
-   msg.msg_iov = iov;
-   msg.msg_control = msg_kma->msg_control;
+   km_msg->msg_iov = NULL;
+   km_msg->msg_iovlen = kiov->cnt - cnt;
    // If msg_controlen is zero the msg_control pointer is not validated.
-   if (msg_kma->msg_controllen > 0 &&
-       (msg.msg_control = km_gva_to_kma((uint64_t)msg_kma->msg_control)) == NULL) {
-      arg->hc_ret = -EFAULT;
-      return HC_CONTINUE;
-   }
-   msg.msg_controllen = msg_kma->msg_controllen;
-   msg.msg_flags = msg_kma->msg_flags;
-   arg->hc_ret = km_fs_sendrecvmsg(vcpu, hc, arg->arg1, &msg, arg->arg3);
-   if (hc == SYS_recvmsg) {
-      msg_kma->msg_namelen = msg.msg_namelen;
-      msg_kma->msg_controllen = msg.msg_controllen;
-      msg_kma->msg_flags = msg.msg_flags;
+   km_msg->msg_control = NULL;
+   if (guest_msg->msg_controllen > 0 &&
+       (km_msg->msg_control = km_gva_range_to_kma((km_gva_t)guest_msg->msg_control,
+                                                  guest_msg->msg_controllen)) == NULL) {
+      return -EFAULT;
    }
-   return HC_CONTINUE;
+   km_msg->msg_controllen = guest_msg->msg_controllen;
+   km_msg->msg_flags = guest_msg->msg_flags;
+   return 0;
 }
 
-/*
- * Copy a 'struct msghdr' from <sys/socket.h from guest space to km space.
- * We need to do this becuase the msghdr passes iovec's between user land and
- * kernel land and they contain addresses that need translation.
- */
-static int copyin_msghdr(struct msghdr* km_msg, struct msghdr* guest_msg)
+static km_hc_ret_t sendrecvmsg_hcall(void* vcpu, int hc, km_hc_args_t* arg)
 {
-   if (guest_msg->msg_name != NULL) {
-      km_msg->msg_name = km_gva_to_kma((km_gva_t)guest_msg->msg_name);
-      if (km_msg->msg_name == NULL) {
-         return -EFAULT;
-      }
-   } else {
-      km_msg->msg_name = NULL;
-   }
-   km_msg->msg_namelen = guest_msg->msg_namelen;
-   if (guest_msg->msg_iovlen >= UIO_MAXIOV) {
-      return -EINVAL;
-   }
+   // ssize_t sendmsg(int sockfd, const struct msghdr *msg, int flags);
+   // ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags);
+   struct msghdr* msg_kma = km_gva_range_to_kma(arg->arg2, sizeof(struct msghdr));
+   struct msghdr msg;
+   km_iov_t iov;
 
-   if (km_msg->msg_iovlen > 0) {
-      for (int i = 0; i < km_msg->msg_iovlen; i++) {
-         // Don't validate addresses if the element has a length of zero.
-         struct iovec* iov = km_gva_to_kma((km_gva_t)guest_msg->msg_iov);
-         if (iov == NULL) {
-            return -EFAULT;
-         }
-         km_msg->msg_iov[i].iov_len = iov[i].iov_len;
-         if (iov[i].iov_len > 0) {
-            km_msg->msg_iov[i].iov_base = km_gva_to_kma((uintptr_t)iov[i].iov_base);
-            if (km_msg->msg_iov[i].iov_base == NULL) {
-               return -EFAULT;
-            }
-         }
-      }
+   if (msg_kma == NULL) {
+      arg->hc_ret = -EFAULT;
+      return HC_CONTINUE;
    }
-   km_msg->msg_control = NULL;
-   if (guest_msg->msg_control != NULL) {
-      km_msg->msg_control = km_gva_to_kma((km_gva_t)guest_msg->msg_control);
-      if (km_msg->msg_control == NULL) {
-         return -EFAULT;
+   km_iov_init(&iov);
+   if ((arg->hc_ret = copyin_msghdr(&msg, msg_kma, &iov)) == 0) {
+      msg.msg_iov = iov.iov;
+      arg->hc_ret = km_fs_sendrecvmsg(vcpu, hc, arg->arg1, &msg, arg->arg3);
+      if (hc == SYS_recvmsg) {
+         msg_kma->msg_namelen = msg.msg_namelen;
+         msg_kma->msg_controllen = msg.msg_controllen;
+         msg_kma->msg_flags = msg.msg_flags;
       }
    }
-   km_msg->msg_controllen = guest_msg->msg_controllen;
-   km_msg->msg_flags = guest_msg->msg_flags;
-   return 0;
+   km_iov_fini(&iov);
+   return HC_CONTINUE;
 }
 
+#define KM_MMSG_INLINE 8   // translated on the stack, more are malloc'ed
+
 static km_hc_ret_t sendrecvmmsg_hcall(void* vcpu, int hc, km_hc_args_t* arg)
 {
    // int sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags);
@@ -398,42 +366,34 @@ static km_hc_ret_t sendrecvmmsg_hcall(void* vcpu, int hc, km_hc_args_t* arg)
    }
 
    // Is entire mmsghdr array memory valid?
-   if (km_gva_to_kma(arg->arg2 + vlen * sizeof(struct mmsghdr) - 1) == NULL) {
+   if (km_gva_range_to_kma(arg->arg2, vlen * sizeof(struct mmsghdr)) == NULL) {
       arg->hc_ret = -EFAULT;
       return HC_CONTINUE;
    }
 
-   // Pass 1. Count the iovecsc in all the mmsgs.
-   int niovecs = 0;
-   for (int i = 0; i < vlen; i++) {
-      niovecs += guest_mmsghdr[i].msg_hdr.msg_iovlen;
-   }
-
-   // Allocate space on the stack for translated mmsghdrs and iovecs.
-   size_t allocsz = (sizeof(struct mmsghdr) * vlen) + (sizeof(struct iovec) * niovecs);
-   char buffer[allocsz];
-   memset(buffer, 0, allocsz);
-   char* current = buffer;
-
-   // Pass 2. Setup the translated mmsghdrs and iovecs.
-   struct mmsghdr* km_mmsghdr = (struct mmsghdr*)current;
+   // Translated mmsghdrs go on the stack unless there are many. All iovecs go to one km_iov_t.
+   struct mmsghdr mmsghdr[KM_MMSG_INLINE];
+   struct mmsghdr* km_mmsghdr = mmsghdr;
+   km_iov_t iov;
 
-   current += (sizeof(struct mmsghdr) * vlen);
-
-   // Setup buffer space (on stack) for iovecs.
+   if (vlen > KM_MMSG_INLINE && (km_mmsghdr = malloc(vlen * sizeof(struct mmsghdr))) == NULL) {
+      arg->hc_ret = -ENOMEM;
+      return HC_CONTINUE;
+   }
+   km_iov_init(&iov);
    for (int i = 0; i < vlen; i++) {
-      if (guest_mmsghdr[i].msg_hdr.msg_iovlen > 0) {
-         km_mmsghdr[i].msg_hdr.msg_iovlen = guest_mmsghdr[i].msg_hdr.msg_iovlen;
-         km_mmsghdr[i].msg_hdr.msg_iov = (struct iovec*)current;
-         current += sizeof(struct iovec) * guest_mmsghdr[i].msg_hdr.msg_iovlen;
-      }
-
       // copy iovec and other msghdr info into kma copy.
-      int ret = copyin_msghdr(&km_mmsghdr[i].msg_hdr, &guest_mmsghdr[i].msg_hdr);
+      int ret = copyin_msghdr(&km_mmsghdr[i].msg_hdr, &guest_mmsghdr[i].msg_hdr, &iov);
       if (ret < 0) {
          arg->hc_ret = ret;
-         return HC_CONTINUE;
+         goto out;
       }
+      km_mmsghdr[i].msg_len = 0;
+   }
+   struct iovec* next = iov.iov;
+   for (int i = 0; i < vlen; i++) {
+      km_mmsghdr[i].msg_hdr.msg_iov = next;
+      next += km_mmsghdr[i].msg_hdr.msg_iovlen;
    }
 
    // Handle time for recvmmsg.
@@ -442,7 +402,7 @@ static km_hc_ret_t sendrecvmmsg_hcall(void* vcpu, int hc, km_hc_args_t* arg)
       // Translate and validate timer.
       if ((ts = km_gva_to_kma(arg->arg5)) == NULL) {
          arg->hc_ret = -EFAULT;
-         return HC_CONTINUE;
+         goto out;
       }
    }
 
@@ -451,8 +411,18 @@ static km_hc_ret_t sendrecvmmsg_hcall(void* vcpu, int hc, km_hc_args_t* arg)
    // Post syscall processing.
    for (int i = 0; i < vlen; i++) {
       guest_mmsghdr[i].msg_len = km_mmsghdr[i].msg_len;
+      if (hc == SYS_recvmmsg) {
+         guest_mmsghdr[i].msg_hdr.msg_namelen = km_mmsghdr[i].msg_hdr.msg_namelen;
+         guest_mmsghdr[i].msg_hdr.msg_controllen = km_mmsghdr[i].msg_hdr.msg_controllen;
+         guest_mmsghdr[i].msg_hdr.msg_flags = km_mmsghdr[i].msg_hdr.msg_flags;
+      }
    }
 
+out:
+   km_iov_fini(&iov);
+   if (km_mmsghdr != mmsghdr) {
+      free(km_mmsghdr);
+   }
    return HC_CONTINUE;
 }
 
@@ -601,6 +571,7 @@ static km_hc_ret_t getcwd_hcall(void* vcpu, int hc, km_hc_args_t* arg)
 
 static km_hc_ret_t close_hcall(void* vcpu, int hc, km_hc_args_t* arg)
 {
+   km_uring_close(arg->arg1);
    arg->hc_ret = km_fs_close(vcpu, arg->arg1);
    return HC_CONTINUE;
 }
@@ -666,7 +637,9 @@ static km_hc_ret_t mmap_hcall(void* vcpu, int hc, km_hc_args_t* arg)
             arg->arg4,
             arg->arg5,
             arg->arg6);
-   arg->hc_ret = km_guest_mmap(arg->arg1, arg->arg2, arg->arg3, arg->arg4, arg->arg5, arg->arg6);
+   if (km_uring_mmap(arg->arg1, arg->arg2, arg->arg3, arg->arg4, arg->arg5, arg->arg6, &arg->hc_ret) == 0) {
+      arg->hc_ret = km_guest_mmap(arg->arg1, arg->arg2, arg->arg3, arg->arg4, arg->arg5, arg->arg6);
+   }
    return HC_CONTINUE;
 };
 
@@ -718,6 +691,7 @@ static km_hc_ret_t time_hcall(void* vcpu, int hc, km_hc_args_t* arg)
       return HC_CONTINUE;
    }
    int rc = __syscall_2(SYS_clock_gettime, CLOCK_REALTIME, (uint64_t)&ts);
+   km_guest_time_refresh();
    if (rc < 0) {
       arg->hc_ret = rc;
       return HC_CONTINUE;
@@ -741,6 +715,7 @@ static km_hc_ret_t gettimeofday_hcall(void* vcpu, int hc, km_hc_args_t* arg)
       return HC_CONTINUE;
    }
    arg->hc_ret = __syscall_2(SYS_gettimeofday, km_gva_to_kml(arg->arg1), km_gva_to_kml(arg->arg2));
+   km_guest_time_refresh();
    return HC_CONTINUE;
 }
 
@@ -752,6 +727,9 @@ static km_hc_ret_t clock_time_hcall(void* vcpu, int hc, km_hc_args_t* arg)
       return HC_CONTINUE;
    }
    arg->hc_ret = __syscall_2(hc, arg->arg1, km_gva_to_kml(arg->arg2));
+   if (hc == SYS_clock_gettime && arg->hc_ret == 0 && arg->arg2 != 0) {
+      km_guest_time_clamp(arg->arg1, (struct timespec*)km_gva_to_kml(arg->arg2));
+   }
    return HC_CONTINUE;
 }
 
@@ -775,6 +753,7 @@ static km_hc_ret_t umask_hcall(void* vcpu, int hc, km_hc_args_t* arg)
 {
    // mode_t umask(mode_t mask);
    arg->hc_ret = __syscall_1(hc, arg->arg1);
+   km_guest_info.umask = arg->arg1 & 0777;
    return HC_CONTINUE;
 }
 
@@ -1271,6 +1250,30 @@ static km_hc_ret_t gettid_hcall(void* vcpu, int hc, km_hc_args_t* arg)
    return HC_CONTINUE;
 }
 
+/*
+ * Publish the values __km_syscall_handler answers getpid() and friends with. Called when they may have
+ * changed: machine init (which covers exec and snapshot restore), in the fork child, and on set*id().
+ * umask is tracked by umask_hcall() after the initial read.
+ */
+void km_guest_info_update(void)
+{
+   km_guest_info_t* gi = &km_guest_info;
+
+   if (gi->valid == 0) {
+      mode_t mask = umask(0);   // the only way to read it, done before other threads are running
+      umask(mask);
+      gi->umask = mask;
+   }
+   gi->pid = machine.pid;
+   gi->ppid = machine.ppid;
+   gi->uid = getuid();
+   gi->euid = geteuid();
+   gi->gid = getgid();
+   gi->egid = getegid();
+   // with hcall stats on, let everything go through hypercalls so the counts are complete
+   __atomic_store_n(&gi->valid, km_collect_hc_stats == 0, __ATOMIC_RELEASE);
+}
+
 static km_hc_ret_t guest_interrupt_hcall(void* vcpu, int hc, km_hc_args_t* arg)
 {
    km_handle_interrupt(vcpu);
@@ -1657,45 +1660,74 @@ static km_hc_ret_t unmapself_hcall(void* vcpu, int hc, km_hc_args_t* arg)
    return HC_STOP;
 }
 
+/*
+ * sched_{get,set}affinity() on guest thread 'pid'. The calling thread is the vcpu thread itself, so
+ * we make the system call, for other guest threads we go to their vcpu threads. The payload sees
+ * host CPUs, like getcpu() does. Masks larger than cpu_set_t are cut to it, the kernel doesn't look
+ * past its own cpumask either.
+ */
+static km_hc_ret_t sched_affinity(km_vcpu_t* vcpu, int hc, km_hc_args_t* arg)
+{
+   pid_t pid = arg->arg1;
+   size_t size = MIN(arg->arg2, sizeof(cpu_set_t));
+   cpu_set_t* mask = km_gva_range_to_kma(arg->arg3, size);
+   km_vcpu_t* target;
+   int rc;
+
+   if (mask == NULL) {
+      arg->hc_ret = -EFAULT;
+      return HC_CONTINUE;
+   }
+   if (pid == 0 || pid == km_vcpu_get_tid(vcpu)) {
+      arg->hc_ret = __syscall_3(hc, 0, size, (uintptr_t)mask);
+      return HC_CONTINUE;
+   }
+   if ((target = km_vcpu_fetch_by_tid(pid)) == NULL) {
+      arg->hc_ret = -ESRCH;
+      return HC_CONTINUE;
+   }
+   if (hc == SYS_sched_getaffinity) {
+      rc = pthread_getaffinity_np(target->vcpu_thread, size, mask);
+      arg->hc_ret = rc == 0 ? size : -rc;   // the rest of the mask is zeroed
+   } else {
+      rc = pthread_setaffinity_np(target->vcpu_thread, size, mask);
+      arg->hc_ret = -rc;
+   }
+   return HC_CONTINUE;
+}
+
 static km_hc_ret_t sched_getaffinity_hcall(void* vcpu, int hc, km_hc_args_t* arg)
 {
    // int sched_getaffinity(pid_t pid, size_t cpusetsize, const cpu_set_t *mask);
    km_infox(KM_TRACE_SCHED, "(0x%lx, 0x%lx, 0x%lx)", arg->arg1, arg->arg2, arg->arg3);
-   arg->hc_ret = __syscall_3(hc, arg->arg1, arg->arg2, km_gva_to_kml(arg->arg3));
-   return HC_CONTINUE;
+   return sched_affinity(vcpu, hc, arg);
 }
 
 static km_hc_ret_t sched_setaffinity_hcall(void* vcpu, int hc, km_hc_args_t* arg)
 {
    // int sched_setaffinity(pid_t pid, size_t cpusetsize, const cpu_set_t *mask);
    km_infox(KM_TRACE_SCHED, "(0x%lx, 0x%lx, 0x%lx)", arg->arg1, arg->arg2, arg->arg3);
-   arg->hc_ret = 0;
-   return HC_CONTINUE;
+   return sched_affinity(vcpu, hc, arg);
 }
 
 static km_hc_ret_t getcpu_hcall(void* vcpu, int hc, km_hc_args_t* arg)
 {
    // int getcpu(unsigned *cpu, unsigned *node, struct getcpu_cache *tcache)
    km_infox(KM_TRACE_SCHED, "(0x%lx, 0x%lx, 0x%lx)", arg->arg1, arg->arg2, arg->arg3);
-   uint64_t* cpu = NULL;
+   unsigned int* cpu = NULL;
    if (arg->arg1 != 0 && (cpu = km_gva_to_kma(arg->arg1)) == NULL) {
       arg->hc_ret = -EFAULT;
       return HC_CONTINUE;
    }
-   uint64_t* node = NULL;
+   unsigned int* node = NULL;
    if (arg->arg2 != 0 && (node = km_gva_to_kma(arg->arg2)) == NULL) {
       arg->hc_ret = -EFAULT;
       return HC_CONTINUE;
    }
    // arg->arg3 (tchache) is unused and ignored. See 'NOTES' in 'man 2 getcpu'.
 
-   if (cpu != NULL) {
-      *cpu = 0;
-   }
-   if (node != NULL) {
-      *node = 0;
-   }
-   arg->hc_ret = 0;
+   // vcpu thread is where the payload thread runs, see km_numa.c
+   arg->hc_ret = __syscall_3(hc, (uintptr_t)cpu, (uintptr_t)node, 0);
    return HC_CONTINUE;
 }
 
@@ -1953,12 +1985,19 @@ static km_hc_ret_t getXXid_hcall(void* vcpu, int hc, km_hc_args_t* arg)
 }
 
 /*
- * uid_t setuid(void);
- * gid_t setgid(void);
+ * int setuid(uid_t uid);
+ * int setreuid(uid_t ruid, uid_t euid);
+ * int setresuid(uid_t ruid, uid_t euid, uid_t suid);
+ * int setfsuid(uid_t fsuid);
+ * and the gid ones. The fast path in the guest answers getuid() and friends, update it.
  */
 static km_hc_ret_t setXid_hcall(void* vcpu, int hc, km_hc_args_t* arg)
 {
-   arg->hc_ret = __syscall_1(hc, arg->arg1);
+   // raw return to the guest: 0 or -errno, setfsuid() and setfsgid() return the old id instead
+   arg->hc_ret = __syscall_3(hc, arg->arg1, arg->arg2, arg->arg3);
+   if (arg->hc_ret == 0 || hc == SYS_setfsuid || hc == SYS_setfsgid) {
+      km_guest_info_update();
+   }
    return HC_CONTINUE;
 }
 
@@ -2177,7 +2216,6 @@ static km_hc_ret_t snapshot_hcall(void* vcpu, int hc, km_hc_args_t* arg)
 
    // Ensure this VCPU's RIP points at the instruction after the HCALL.
    km_vcpu_sync_rip(vcpu);
-   ((km_vcpu_t*)vcpu)->regs_valid = 0;   // force register reread after the sync_rip
    km_read_registers(vcpu);
 
    if ((arg->hc_ret = km_snapshot_block(vcpu)) != 0) {
@@ -2185,8 +2223,12 @@ static km_hc_ret_t snapshot_hcall(void* vcpu, int hc, km_hc_args_t* arg)
    }
 
    // Create the snapshot.
-   arg->hc_ret = km_snapshot_create(vcpu, label, description, NULL);
+   arg->hc_ret = km_snapshot_create(vcpu, label, description, NULL, live);
    km_snapshot_unblock();
+   if (arg->hc_ret == 0) {
+      // the other vcpus run while a background snapshot is written, this one waits for it
+      arg->hc_ret = km_snapshot_wait();
+   }
    // negative value means EBUSY or other similar condition.
    // TODO: in case of live (non zero last arg) returning HC_CONTINUE should just work
    if (arg->hc_ret < 0 || live != 0) {
@@ -2265,100 +2307,59 @@ static km_hc_ret_t io_setup_hcall(void* vcpu, int hc, km_hc_args_t* arg)
  */
 static km_hc_ret_t io_submit_hcall(void* vcpu, int hc, km_hc_args_t* arg)
 {
-   int needed_iovecs = 0;
-   struct iocb km_iocb_copy[arg->arg2];
-   struct iocb* km_iocb_list[arg->arg2];
-   struct iocb** local_iocbpp = km_gva_to_kma(arg->arg3);
-   if (local_iocbpp == NULL) {
-      arg->hc_ret = -EFAULT;
+   long nr = arg->arg2;
+   struct iocb** local_iocbpp;
+
+   if (nr < 0 || nr > SIZE_MAX / sizeof(struct iocb*)) {
+      arg->hc_ret = -EINVAL;
       return HC_CONTINUE;
    }
-
-   aio_context_t kiocontext;
-   int rv = km_iocontext_xlate_p2k(arg->arg1, &kiocontext);
-   if (rv != 0) {
-      arg->hc_ret = -rv;
+   if (nr == 0) {
+      arg->hc_ret = 0;
       return HC_CONTINUE;
    }
-
-   // xlate guest address in the iocb's to km address
-   for (int i = 0; i < arg->arg2; i++) {
-      struct iocb* iocbp = km_gva_to_kma((km_gva_t)local_iocbpp[i]);
-      if (iocbp == NULL) {
-         arg->hc_ret = -EFAULT;
-         return HC_CONTINUE;
-      }
-      km_iocb_copy[i] = *iocbp;
-      km_iocb_list[i] = &km_iocb_copy[i];
-      switch (km_iocb_copy[i].aio_lio_opcode) {
-         case IOCB_CMD_PWRITE:
-         case IOCB_CMD_PREAD:
-            km_iocb_copy[i].aio_buf = (uint64_t)km_gva_to_kma(iocbp->aio_buf);
-            if (km_iocb_copy[i].aio_buf == (uint64_t)NULL) {
-               arg->hc_ret = -EFAULT;
-               return HC_CONTINUE;
-            }
-            break;
-         case IOCB_CMD_PREADV:
-         case IOCB_CMD_PWRITEV:
-            // add to the total iovec's we will need for this submission.
-            needed_iovecs += km_iocb_copy[i].aio_nbytes;
-            break;
-         case IOCB_CMD_FDSYNC:
-         case IOCB_CMD_FSYNC:
-         case IOCB_CMD_POLL:
-            break;
-         default:
-            km_assert(0);
-            break;
-      }
+   if ((local_iocbpp = km_gva_range_to_kma(arg->arg3, nr * sizeof(struct iocb*))) == NULL) {
+      arg->hc_ret = -EFAULT;
+      return HC_CONTINUE;
    }
-
-   // Now create iovec's with xlated addresses in them (if needed)
-   struct iovec kmiovecs[needed_iovecs];
-   if (needed_iovecs > 0) {
-      int freeiovec_index = 0;
-      for (int i = 0; i < arg->arg2; i++) {
-         if ((km_iocb_copy[i].aio_lio_opcode == IOCB_CMD_PREADV ||
-              km_iocb_copy[i].aio_lio_opcode == IOCB_CMD_PWRITEV) &&
-             km_iocb_copy[i].aio_nbytes > 0) {
-            struct iovec* km_aio_buf = km_gva_to_kma(km_iocb_copy[i].aio_buf);
-            if (km_aio_buf == NULL) {
-               arg->hc_ret = -EFAULT;
-               return HC_CONTINUE;
-            }
-            km_iocb_copy[i].aio_buf = (__u64)&kmiovecs[freeiovec_index];
-            for (int j = 0; j < km_iocb_copy[i].aio_nbytes; j++) {
-               km_assert(freeiovec_index < needed_iovecs);
-               if (km_aio_buf[j].iov_len != 0) {
-                  kmiovecs[freeiovec_index].iov_base = km_gva_to_kma((km_gva_t)km_aio_buf[j].iov_base);
-                  if (kmiovecs[freeiovec_index].iov_base == NULL) {
-                     arg->hc_ret = -EFAULT;
-                     return HC_CONTINUE;
-                  }
-               }
-               kmiovecs[freeiovec_index].iov_len = km_aio_buf[j].iov_len;
-               freeiovec_index++;
-            }
-         }
-      }
-      km_assert(freeiovec_index == needed_iovecs);
+   long rv = km_iocontext_submit(arg->arg1, nr, local_iocbpp);
+   if (rv > 0) {
+      __atomic_add_fetch(&km_io_active_count, rv, __ATOMIC_SEQ_CST);
    }
+   arg->hc_ret = rv;
+   return HC_CONTINUE;
+}
 
-   int reqs_submitted = __syscall_3(SYS_io_submit, kiocontext, arg->arg2, (uint64_t)&km_iocb_list);
-   if (reqs_submitted >= 0) {
-      __atomic_add_fetch(&km_io_active_count, reqs_submitted, __ATOMIC_SEQ_CST);
-      arg->hc_ret = reqs_submitted;
+/*
+ * int io_uring_setup(u32 entries, struct io_uring_params *p);
+ */
+static km_hc_ret_t io_uring_setup_hcall(void* vcpu, int hc, km_hc_args_t* arg)
+{
+   struct io_uring_params* p = km_gva_range_to_kma(arg->arg2, sizeof(struct io_uring_params));
+   if (p == NULL) {
+      arg->hc_ret = -EFAULT;
    } else {
-      arg->hc_ret = -errno;
+      arg->hc_ret = km_uring_setup(vcpu, arg->arg1, p);
    }
+   return HC_CONTINUE;
+}
 
-   // Give back kernel supplied values.
-   for (int i = 0; i < arg->arg2; i++) {
-      struct iocb* iocbp = km_gva_to_kma((km_gva_t)local_iocbpp[i]);
-      iocbp->aio_key = km_iocb_copy[i].aio_key;
-   }
+/*
+ * int io_uring_enter(unsigned int fd, unsigned int to_submit, unsigned int min_complete,
+ *                    unsigned int flags, sigset_t *sig);
+ */
+static km_hc_ret_t io_uring_enter_hcall(void* vcpu, int hc, km_hc_args_t* arg)
+{
+   arg->hc_ret = km_uring_enter(arg->arg1, arg->arg2, arg->arg3, arg->arg4);
+   return HC_CONTINUE;
+}
 
+/*
+ * int io_uring_register(unsigned int fd, unsigned int opcode, void *arg, unsigned int nr_args);
+ */
+static km_hc_ret_t io_uring_register_hcall(void* vcpu, int hc, km_hc_args_t* arg)
+{
+   arg->hc_ret = km_uring_register(arg->arg1, arg->arg2, arg->arg3, arg->arg4);
    return HC_CONTINUE;
 }
 
@@ -2368,28 +2369,22 @@ static km_hc_ret_t io_submit_hcall(void* vcpu, int hc, km_hc_args_t* arg)
  */
 static km_hc_ret_t io_cancel_hcall(void* vcpu, int hc, km_hc_args_t* arg)
 {
-   struct iocb* local_iocbp = km_gva_to_kma(arg->arg2);
    struct io_event* local_resultp = km_gva_to_kma(arg->arg3);
-   if (local_iocbp == NULL || local_resultp == NULL) {
+   if (km_gva_to_kma(arg->arg2) == NULL || local_resultp == NULL) {
       arg->hc_ret = -EFAULT;
       return HC_CONTINUE;
    }
-   km_infox(KM_TRACE_HC, "io context 0x%lx, iocb %p, io_event %p", arg->arg1, local_iocbp, local_resultp);
-
-   aio_context_t kiocontext;
-   int rv = km_iocontext_xlate_p2k(arg->arg1, &kiocontext);
-   if (rv != 0) {
-      arg->hc_ret = -rv;
-      return HC_CONTINUE;
-   }
+   km_infox(KM_TRACE_HC,
+            "io context 0x%lx, iocb 0x%lx, io_event %p",
+            arg->arg1,
+            arg->arg2,
+            local_resultp);
 
-   rv = __syscall_3(SYS_io_cancel, kiocontext, (uint64_t)local_iocbp, (uint64_t)local_resultp);
-   if (rv >= 0) {
-      arg->hc_ret = 0;
+   int rv = km_iocontext_cancel(arg->arg1, arg->arg2, local_resultp);
+   if (rv == 0) {
       __atomic_sub_fetch(&km_io_active_count, 1, __ATOMIC_SEQ_CST);
-   } else {
-      arg->hc_ret = -errno;
    }
+   arg->hc_ret = rv;
    return HC_CONTINUE;
 }
 
@@ -2407,6 +2402,15 @@ static km_hc_ret_t io_destroy_hcall(void* vcpu, int hc, km_hc_args_t* arg)
    return HC_CONTINUE;
 }
 
+/*
+ * Doorbell for the hypercall submission ring, see km_hcalls.h.
+ */
+static km_hc_ret_t hcall_ring_hcall(void* vcpu, int hc, km_hc_args_t* arg)
+{
+   arg->hc_ret = km_hcall_ring_drain(vcpu);
+   return HC_CONTINUE;
+}
+
 static km_hc_ret_t rseq_hcall(void* vcpu, int hc, km_hc_args_t* arg)
 {
    arg->hc_ret = -ENOSYS;
@@ -2420,8 +2424,8 @@ static km_hc_ret_t rseq_hcall(void* vcpu, int hc, km_hc_args_t* arg)
  */
 static km_hc_ret_t io_getevents_hcall(void* vcpu, int hc, km_hc_args_t* arg)
 {
-   struct events* local_eventsp = km_gva_to_kma(arg->arg4);
-   struct timeout* local_timeoutp = NULL;
+   struct io_event* local_eventsp = km_gva_to_kma(arg->arg4);
+   struct timespec* local_timeoutp = NULL;
    if (local_eventsp == NULL) {
       arg->hc_ret = -EFAULT;
       return HC_CONTINUE;
@@ -2446,16 +2450,14 @@ static km_hc_ret_t io_getevents_hcall(void* vcpu, int hc, km_hc_args_t* arg)
                     arg->arg3,
                     (uint64_t)local_eventsp,
                     (uint64_t)local_timeoutp);
-   if (rv >= 0) {
+   if (rv > 0) {
+      km_iocontext_reap(arg->arg1, local_eventsp, rv);
       __atomic_sub_fetch(&km_io_active_count, rv, __ATOMIC_SEQ_CST);
-      arg->hc_ret = rv;
-   } else {
-      arg->hc_ret = -errno;
    }
+   arg->hc_ret = rv;
    return HC_CONTINUE;
 }
 
-km_hc_stats_t* km_hcalls_stats;
 const km_hcall_fn_t km_hcalls_table[KM_MAX_HCALL] = {
     [SYS_arch_prctl] = arch_prctl_hcall,
 
@@ -2584,6 +2586,12 @@ const km_hcall_fn_t km_hcalls_table[KM_MAX_HCALL] = {
     [SYS_getgid] = getXXid_hcall,
     [SYS_setuid] = setXid_hcall,
     [SYS_setgid] = setXid_hcall,
+    [SYS_setreuid] = setXid_hcall,
+    [SYS_setregid] = setXid_hcall,
+    [SYS_setresuid] = setXid_hcall,
+    [SYS_setresgid] = setXid_hcall,
+    [SYS_setfsuid] = setXid_hcall,
+    [SYS_setfsgid] = setXid_hcall,
 
     [SYS_getgroups] = get_set_groups_hcall,
     [SYS_setgroups] = get_set_groups_hcall,
@@ -2645,44 +2653,105 @@ const km_hcall_fn_t km_hcalls_table[KM_MAX_HCALL] = {
     [SYS_io_getevents] = io_getevents_hcall,
     [SYS_io_destroy] = io_destroy_hcall,
 
+    [SYS_io_uring_setup] = io_uring_setup_hcall,
+    [SYS_io_uring_enter] = io_uring_enter_hcall,
+    [SYS_io_uring_register] = io_uring_register_hcall,
+
     [SYS_rseq] = rseq_hcall,
 
     [HC_guest_interrupt] = guest_interrupt_hcall,
     [HC_unmapself] = unmapself_hcall,
     [HC_snapshot] = snapshot_hcall,
     [HC_shrink] = shrink_payload_hcall,
+    [HC_hcall_ring] = hcall_ring_hcall,
 };
 
-static void km_print_hcall_stats(void)
-{
-   for (int hc = 0; hc < KM_MAX_HCALL; hc++) {
-      if (km_hcalls_stats[hc].count != 0) {
-         km_warnx("%24s(%3d) called\t %9ld times, latency usecs %9ld avg %9ld min %9ld max",
-                  km_hc_name_get(hc),
-                  hc,
-                  km_hcalls_stats[hc].count,
-                  km_hcalls_stats[hc].total / km_hcalls_stats[hc].count / 1000,
-                  km_hcalls_stats[hc].min / 1000,
-                  km_hcalls_stats[hc].max / 1000);
+_Static_assert(sizeof(km_hc_ring_t) == 64 + KM_HC_RING_ENTRIES * 64, "HC_RING_SIZE in km_guest.asmh");
+
+/*
+ * Calls that are allowed in the submission ring. They must not block, and must not need the vcpu
+ * registers or change the vcpu state, as they are executed without the guest knowing exactly when.
+ */
+static inline int km_hcall_ring_allowed(int hc, km_hc_args_t* arg)
+{
+   switch (hc) {
+      case SYS_write:
+      case SYS_writev:
+      case SYS_sendmsg:
+      case SYS_epoll_ctl:
+      case SYS_close:
+         return 1;
+      case SYS_fcntl:
+         return arg->arg2 != F_SETLKW && arg->arg2 != F_OFD_SETLKW;
+      default:
+         return 0;
+   }
+}
+
+/*
+ * Execute everything queued in the vcpu submission ring. Returns the number of executed entries or
+ * -EINVAL if the guest corrupted the ring indexes.
+ */
+int km_hcall_ring_drain(km_vcpu_t* vcpu)
+{
+   km_hc_ring_t* ring = &km_hcring[vcpu->vcpu_id];
+   uint32_t head = ring->head;
+   uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+   int count = 0;
+
+   if (tail - head > KM_HC_RING_ENTRIES) {
+      km_infox(KM_TRACE_HC, "vcpu %d bad hcall ring head %u tail %u", vcpu->vcpu_id, head, tail);
+      __atomic_store_n(&ring->head, tail, __ATOMIC_RELEASE);
+      return -EINVAL;
+   }
+   for (; head != tail; head++, count++) {
+      km_hc_ring_entry_t* e = &ring->entries[head % KM_HC_RING_ENTRIES];
+      // The guest can change the entry while we run it, check and run a copy
+      uint64_t hc = __atomic_load_n(&e->hc, __ATOMIC_RELAXED);
+      km_hc_args_t args = e->args;
+
+      if (hc < KM_MAX_HCALL && km_hcalls_table[hc] != NULL &&
+          km_hcall_ring_allowed(hc, &args) != 0) {
+         km_infox(KM_TRACE_HC, "ring hc = %ld (%s)", hc, km_hc_name_get(hc));
+         (void)km_hcalls_table[hc](vcpu, hc, &args);
+         e->args.hc_ret = args.hc_ret;
+      } else {
+         e->args.hc_ret = -ENOSYS;
       }
    }
+   __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+   return count;
+}
+
+static int km_hcall_ring_drain_cb(km_vcpu_t* vcpu, void* data)
+{
+   if (km_hcall_ring_pending(vcpu) != 0) {
+      (void)km_hcall_ring_drain(vcpu);
+   }
+   return 0;
+}
+
+/*
+ * Called with all vcpus paused, so nothing is left behind in the rings when km state is saved.
+ */
+void km_hcall_ring_drain_all(void)
+{
+   km_vcpu_apply_all(km_hcall_ring_drain_cb, NULL);
 }
 
 void km_hcalls_init(void)
 {
-   if (km_collect_hc_stats == 1) {
-      if ((km_hcalls_stats = calloc(KM_MAX_HCALL, sizeof(km_hc_stats_t))) == NULL) {
-         km_err(1, "KVM: no memory for hcall stats");
-      }
-      for (int i = 0; i < KM_MAX_HCALL; i++) {
-         km_hcalls_stats[i].min = UINT64_MAX;
-      }
+   for (int i = 0; i < KVM_MAX_VCPUS; i++) {
+      *km_hcargs_slot(i, KM_HC_RING_GS_OFFSET) = km_guest_kma_to_gva(&km_hcring[i]);
+      *km_hcargs_slot(i, KM_GS_TID_OFFSET) = i + 1;   // matches km_vcpu_get_tid()
+      *km_hcargs_slot(i, KM_GS_INFO_OFFSET) = km_guest_kma_to_gva(&km_guest_info);
+      *km_hcargs_slot(i, KM_GS_TIME_OFFSET) = km_guest_kma_to_gva(&km_guest_time);
    }
 }
 
 void km_hcalls_fini(void)
 {
    if (km_collect_hc_stats == 1) {
-      km_print_hcall_stats();
+      km_hc_stats_print();
    }
 }
@@ -241,12 +241,14 @@ int km_run_vcpu_thread(km_vcpu_t* vcpu)
 
       km_attr_init(&att);
       km_attr_setstacksize(&att, 16 * KM_PAGE_SIZE);
+      km_numa_vcpu_affinity(vcpu, &att);
       vcpu->state = HYPERCALL;
       if ((rc = -pthread_create(&vcpu->vcpu_thread, &att, (void* (*)(void*))km_vcpu_run, vcpu)) != 0) {
          vcpu->state = STARTING;
       }
       km_attr_destroy(&att);
    } else {
+      km_numa_vcpu_affinity(vcpu, NULL);
       vcpu->state = HYPERCALL;
       km_cond_signal(&vcpu->thr_cv);
    }
@@ -210,7 +210,15 @@ void km_handle_interrupt(km_vcpu_t* vcpu)
 
       case X86_INTR_PF:   // Page fault: SIGSEGV
          km_infox(KM_TRACE_SIGNALS, "Page Fault: 0x%llx", vcpu->sregs.cr2);
+         // with --pt-mprotect a TLB entry older than the last mprotect of the page can fault
+         if (km_pt_mprotect != 0 && vcpu->pt_stale_cr2 != vcpu->sregs.cr2 &&
+             km_mem_pt_fault_stale(vcpu->sregs.cr2, error_code) != 0) {
+            vcpu->pt_stale_cr2 = vcpu->sregs.cr2;
+            return;   // registers are restored, the guest retries the access
+         }
+         vcpu->pt_stale_cr2 = 0;
          info.si_signo = SIGSEGV;
+         info.si_code = (error_code & X86_PF_P) != 0 ? SEGV_ACCERR : SEGV_MAPERR;
          info.si_addr = (void*)vcpu->sregs.cr2;
          break;
 
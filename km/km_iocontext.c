@@ -30,9 +30,18 @@
  * NT_KM_IOCONTEXTS elf note.  The resumed snapshot recovers the map from that same note.
  * The note also contains the km io context id counter so the resumed snapshot should not
  * resuse an existing id.
+ *
+ * Each context also has an arena of translated iocbs. The kernel is handed the arena copy, with km
+ * addresses in it, and keeps pointing at it until the request completes, so the copy lives until
+ * io_getevents() or io_cancel() reports it, and the event is changed to point at the payload iocb.
+ * Slots are allocated in chunks that never move and are reused, so there is no allocation on the
+ * io_submit() path once the arena warmed up. The arena is reference counted, so a concurrent
+ * io_destroy() doesn't free it under io_submit(), io_getevents() or io_cancel().
  */
 
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/syscall.h>
 #include <linux/aio_abi.h>
@@ -40,11 +49,36 @@
 #include "bsd_queue.h"
 #include "km.h"
 #include "km_coredump.h"
+#include "km_filesys.h"
+#include "km_iocontext.h"
+#include "km_iovec.h"
+#include "km_mem.h"
+#include "km_syscall.h"
+
+#define KM_IOCB_CHUNK 64   // arena slots allocated at once
+#define KM_IOCB_BATCH 64   // iocbs passed to the kernel in one io_submit()
+
+// The kernel returns the iocb address in io_event.obj, so iocb has to be first
+typedef struct km_iocb_slot {
+   struct iocb iocb;            // translated copy the kernel works with
+   km_gva_t giocb;              // payload iocb, 0 if the slot is free
+   km_iov_t iov;                // translated iovecs for IOCB_CMD_PREADV/PWRITEV
+   struct km_iocb_slot* next;   // free list
+} km_iocb_slot_t;
+
+typedef struct km_iocb_arena {
+   int refs;   // the table entry and km_iocontext_get() callers, protected by km_iocmutex
+   pthread_mutex_t mutex;
+   km_iocb_slot_t* free;
+   km_iocb_slot_t** chunks;
+   size_t nchunks;
+} km_iocb_arena_t;
 
 struct km_iocontext {
    unsigned int kioc_maxevents;
    aio_context_t kioc_kcontext;
    aio_context_t kioc_pcontext;
+   km_iocb_arena_t* kioc_arena;
 };
 typedef struct km_iocontext km_iocontext_t;
 
@@ -53,6 +87,58 @@ size_t km_iocn;            // number of entries in the table km_iocp points to
 km_iocontext_t* km_iocp;   // map of kernel context id's and payload context id's
 aio_context_t km_piocontext = ((unsigned long)'k' << 56) | ((unsigned long)'m' << 48);
 
+static void km_iocb_arena_free(km_iocb_arena_t* arena)
+{
+   for (size_t i = 0; i < arena->nchunks; i++) {
+      for (int j = 0; j < KM_IOCB_CHUNK; j++) {
+         km_iov_fini(&arena->chunks[i][j].iov);
+      }
+      free(arena->chunks[i]);
+   }
+   free(arena->chunks);
+   free(arena);
+}
+
+static km_iocb_slot_t* km_iocb_slot_alloc(km_iocb_arena_t* arena)
+{
+   km_iocb_slot_t* slot;
+
+   km_mutex_lock(&arena->mutex);
+   if (arena->free == NULL) {
+      km_iocb_slot_t** chunks =
+          realloc(arena->chunks, (arena->nchunks + 1) * sizeof(km_iocb_slot_t*));
+      km_iocb_slot_t* chunk = calloc(KM_IOCB_CHUNK, sizeof(km_iocb_slot_t));
+      if (chunks == NULL || chunk == NULL) {
+         if (chunks != NULL) {
+            arena->chunks = chunks;
+         }
+         free(chunk);
+         km_mutex_unlock(&arena->mutex);
+         return NULL;
+      }
+      arena->chunks = chunks;
+      arena->chunks[arena->nchunks++] = chunk;
+      for (int i = 0; i < KM_IOCB_CHUNK; i++) {
+         km_iov_init(&chunk[i].iov);
+         chunk[i].next = arena->free;
+         arena->free = &chunk[i];
+      }
+   }
+   slot = arena->free;
+   arena->free = slot->next;
+   km_mutex_unlock(&arena->mutex);
+   return slot;
+}
+
+static void km_iocb_slot_free(km_iocb_arena_t* arena, km_iocb_slot_t* slot)
+{
+   km_mutex_lock(&arena->mutex);
+   slot->giocb = 0;
+   slot->next = arena->free;
+   arena->free = slot;
+   km_mutex_unlock(&arena->mutex);
+}
+
 // Called when a payload context is being recovered due to a snapshot resume.
 int km_iocontext_recover(unsigned int nr_events, aio_context_t pcontext)
 {
@@ -61,19 +147,25 @@ int km_iocontext_recover(unsigned int nr_events, aio_context_t pcontext)
    if (rc != 0) {
       return errno;
    }
+   km_iocb_arena_t* arena = calloc(1, sizeof(km_iocb_arena_t));
    km_mutex_lock(&km_iocmutex);
-   km_iocontext_t* t = realloc(km_iocp, (km_iocn + 1) * sizeof(km_iocontext_t));
+   km_iocontext_t* t =
+       arena == NULL ? NULL : realloc(km_iocp, (km_iocn + 1) * sizeof(km_iocontext_t));
    if (t == NULL) {
       km_mutex_unlock(&km_iocmutex);
+      free(arena);
       if (syscall(SYS_io_destroy, iocontext) != 0) {
          // Can't allocate memory and can't deallocate the iocontext!
          km_warn("io_destroy() failed, io context 0x%lx orphaned", iocontext);
       }
       return ENOMEM;
    }
+   arena->refs = 1;
+   arena->mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
    t[km_iocn].kioc_maxevents = nr_events;
    t[km_iocn].kioc_kcontext = iocontext;
    t[km_iocn].kioc_pcontext = pcontext;
+   t[km_iocn].kioc_arena = arena;
    km_iocp = t;
    km_iocn++;
    km_mutex_unlock(&km_iocmutex);
@@ -103,12 +195,20 @@ int km_iocontext_remove(aio_context_t pcontext)
             km_warn("Can't delete io context id 0x%lx, kernel context id: 0x%lx",
                     km_iocp[i].kioc_pcontext,
                     km_iocp[i].kioc_kcontext);
-            return errno;
+            rv = errno;
+            km_mutex_unlock(&km_iocmutex);
+            return rv;
          }
+         // io_destroy() waited for the outstanding requests, the kernel is done with the arena
+         km_iocb_arena_t* arena = km_iocp[i].kioc_arena;
          // We don't shrink the memory area when freeing an io context.
-         memcpy(&km_iocp[i], &km_iocp[i + 1], (km_iocn - i - 1) * sizeof(km_iocontext_t));
+         memmove(&km_iocp[i], &km_iocp[i + 1], (km_iocn - i - 1) * sizeof(km_iocontext_t));
          km_iocn--;
+         int refs = --arena->refs;
          km_mutex_unlock(&km_iocmutex);
+         if (refs == 0) {
+            km_iocb_arena_free(arena);
+         }
          return 0;
       }
    }
@@ -137,6 +237,208 @@ int km_iocontext_xlate_p2k(aio_context_t pcontext, aio_context_t* kcontext)
    return EINVAL;
 }
 
+/*
+ * Look up the payload context and take a reference on its arena, which the caller drops with
+ * km_iocontext_put(). 'maxevents' can be NULL.
+ */
+static int km_iocontext_get(aio_context_t pcontext,
+                            aio_context_t* kcontext,
+                            km_iocb_arena_t** arena,
+                            unsigned int* maxevents)
+{
+   km_mutex_lock(&km_iocmutex);
+   for (size_t i = 0; i < km_iocn; i++) {
+      if (km_iocp[i].kioc_pcontext == pcontext) {
+         *kcontext = km_iocp[i].kioc_kcontext;
+         *arena = km_iocp[i].kioc_arena;
+         if (maxevents != NULL) {
+            *maxevents = km_iocp[i].kioc_maxevents;
+         }
+         (*arena)->refs++;
+         km_mutex_unlock(&km_iocmutex);
+         return 0;
+      }
+   }
+   km_mutex_unlock(&km_iocmutex);
+   return EINVAL;
+}
+
+static void km_iocontext_put(km_iocb_arena_t* arena)
+{
+   km_mutex_lock(&km_iocmutex);
+   int refs = --arena->refs;
+   km_mutex_unlock(&km_iocmutex);
+   if (refs == 0) {
+      km_iocb_arena_free(arena);
+   }
+}
+
+/*
+ * Fill the slot with a copy of the payload iocb the kernel can use. Returns 0 or -errno, the same
+ * the kernel would return for the iocb.
+ */
+static int km_iocb_xlate(km_iocb_slot_t* slot, struct iocb* giocb)
+{
+   struct iocb* iocb = &slot->iocb;
+   int rc;
+
+   *iocb = *giocb;
+   if (km_fs_g2h_fd(iocb->aio_fildes, NULL) < 0) {
+      return -EBADF;
+   }
+   if ((iocb->aio_flags & IOCB_FLAG_RESFD) != 0 && km_fs_g2h_fd(iocb->aio_resfd, NULL) < 0) {
+      return -EBADF;
+   }
+   switch (iocb->aio_lio_opcode) {
+      case IOCB_CMD_PREAD:
+      case IOCB_CMD_PWRITE:
+         iocb->aio_buf = (uint64_t)km_gva_range_to_kma(giocb->aio_buf, giocb->aio_nbytes);
+         if (iocb->aio_buf == 0) {
+            return -EFAULT;
+         }
+         break;
+
+      case IOCB_CMD_PREADV:
+      case IOCB_CMD_PWRITEV:
+         km_iov_reset(&slot->iov);
+         if ((rc = km_iov_add_guest(&slot->iov, giocb->aio_buf, giocb->aio_nbytes, 1)) != 0) {
+            return rc == -ENOMEM ? -EAGAIN : rc;
+         }
+         iocb->aio_buf = (uint64_t)slot->iov.iov;
+         iocb->aio_nbytes = slot->iov.cnt;
+         break;
+
+      case IOCB_CMD_FSYNC:
+      case IOCB_CMD_FDSYNC:
+      case IOCB_CMD_POLL:   // aio_buf is the event mask
+         break;
+
+      default:
+         return -EINVAL;
+   }
+   return 0;
+}
+
+/*
+ * io_submit(). iocbpp is the payload array of nr iocb pointers, already checked to be in guest
+ * memory. Only as many as the context has events for are submitted. Returns the number of
+ * submitted iocbs or -errno, like the kernel.
+ */
+long km_iocontext_submit(aio_context_t pcontext, long nr, struct iocb** iocbpp)
+{
+   aio_context_t kcontext;
+   km_iocb_arena_t* arena;
+   km_iocb_slot_t* slots[KM_IOCB_BATCH];
+   struct iocb* kiocbs[KM_IOCB_BATCH];
+   struct iocb* giocbs[KM_IOCB_BATCH];
+   unsigned int maxevents;
+   long done = 0;
+   int rc = 0;
+
+   if ((rc = km_iocontext_get(pcontext, &kcontext, &arena, &maxevents)) != 0) {
+      return -rc;
+   }
+   if (nr > maxevents) {   // like the kernel, no more than the context can complete
+      nr = maxevents;
+   }
+   // Bounded batches, so a large nr doesn't need a large stack
+   while (done < nr && rc == 0) {
+      int n;
+      for (n = 0; n < KM_IOCB_BATCH && done + n < nr; n++) {
+         km_gva_t gva = (km_gva_t)iocbpp[done + n];
+         if ((giocbs[n] = km_gva_range_to_kma(gva, sizeof(struct iocb))) == NULL) {
+            rc = -EFAULT;
+            break;
+         }
+         if ((slots[n] = km_iocb_slot_alloc(arena)) == NULL) {
+            rc = -EAGAIN;
+            break;
+         }
+         if ((rc = km_iocb_xlate(slots[n], giocbs[n])) != 0) {
+            km_iocb_slot_free(arena, slots[n]);
+            break;
+         }
+         slots[n]->giocb = gva;
+         kiocbs[n] = &slots[n]->iocb;
+      }
+      int submitted = 0;
+      if (n > 0 && (submitted = __syscall_3(SYS_io_submit, kcontext, n, (uint64_t)kiocbs)) < 0) {
+         rc = submitted;
+         submitted = 0;
+      }
+      for (int i = 0; i < n; i++) {
+         if (i < submitted) {
+            giocbs[i]->aio_key = slots[i]->iocb.aio_key;
+         } else {
+            km_iocb_slot_free(arena, slots[i]);
+         }
+      }
+      done += submitted;
+      if (submitted < n) {
+         break;
+      }
+   }
+   km_iocontext_put(arena);
+   return done > 0 ? done : rc;
+}
+
+/*
+ * Completions returned by io_getevents() point at the arena, make them point at the payload iocbs
+ * and release the slots.
+ */
+void km_iocontext_reap(aio_context_t pcontext, struct io_event* events, long n)
+{
+   aio_context_t kcontext;
+   km_iocb_arena_t* arena;
+
+   if (km_iocontext_get(pcontext, &kcontext, &arena, NULL) != 0) {
+      return;
+   }
+   for (long i = 0; i < n; i++) {
+      km_iocb_slot_t* slot = (km_iocb_slot_t*)events[i].obj;
+      events[i].obj = slot->giocb;
+      km_iocb_slot_free(arena, slot);
+   }
+   km_iocontext_put(arena);
+}
+
+/*
+ * io_cancel() of the payload iocb at giocb. Returns 0 or -errno.
+ */
+int km_iocontext_cancel(aio_context_t pcontext, km_gva_t giocb, struct io_event* result)
+{
+   aio_context_t kcontext;
+   km_iocb_arena_t* arena;
+   km_iocb_slot_t* slot = NULL;
+   int rc;
+
+   if ((rc = km_iocontext_get(pcontext, &kcontext, &arena, NULL)) != 0) {
+      return -rc;
+   }
+   km_mutex_lock(&arena->mutex);
+   for (size_t i = 0; i < arena->nchunks && slot == NULL; i++) {
+      for (int j = 0; j < KM_IOCB_CHUNK; j++) {
+         if (arena->chunks[i][j].giocb == giocb) {
+            slot = &arena->chunks[i][j];
+            break;
+         }
+      }
+   }
+   if (slot == NULL) {
+      km_mutex_unlock(&arena->mutex);
+      km_iocontext_put(arena);
+      return -EINVAL;
+   }
+   rc = __syscall_3(SYS_io_cancel, kcontext, (uint64_t)&slot->iocb, (uint64_t)result);
+   km_mutex_unlock(&arena->mutex);
+   if (rc == 0) {   // older kernels complete the request here, newer ones in io_getevents()
+      result->obj = giocb;
+      km_iocb_slot_free(arena, slot);
+   }
+   km_iocontext_put(arena);
+   return rc;
+}
+
 // Figure out how much space the io context elf notes will need
 size_t km_fs_iocontext_notes_length(void)
 {
@@ -192,6 +494,9 @@ void km_iocontext_init(void)
 
 void km_iocontext_deinit(void)
 {
+   for (size_t i = 0; i < km_iocn; i++) {
+      km_iocb_arena_free(km_iocp[i].kioc_arena);
+   }
    free(km_iocp);
    km_iocn = 0;
 }
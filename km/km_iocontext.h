@@ -21,6 +21,9 @@ int km_iocontext_recover(unsigned int nr_events, aio_context_t pcontext);
 int km_iocontext_add(unsigned int nr_events, aio_context_t* pcontextp);
 int km_iocontext_remove(aio_context_t pcontext);
 int km_iocontext_xlate_p2k(aio_context_t pcontext, aio_context_t* kcontext);
+long km_iocontext_submit(aio_context_t pcontext, long nr, struct iocb** iocbpp);
+void km_iocontext_reap(aio_context_t pcontext, struct io_event* events, long n);
+int km_iocontext_cancel(aio_context_t pcontext, km_gva_t giocb, struct io_event* result);
 size_t km_fs_iocontext_notes_length(void);
 size_t km_fs_iocontext_notes_write(char* buf, size_t length);
 int km_fs_recover_iocontexts(char* ptr, size_t length);
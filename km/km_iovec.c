@@ -0,0 +1,194 @@
+/*
+ * Copyright 2021 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Guest buffers to host iovecs, see km_iovec.h.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "km.h"
+#include "km_iovec.h"
+#include "km_mem.h"
+
+/*
+ * Finds the extent of guest memory gva is in, valid the same way as for km_gva_to_kma().
+ * Returns 0 or -EFAULT.
+ */
+static int km_gva_extent(km_gva_t gva, km_gva_extent_t* ext)
+{
+   km_gva_t brk = roundup(machine.brk, KM_PAGE_SIZE);
+   km_gva_t tbrk = rounddown(machine.tbrk, KM_PAGE_SIZE);
+
+   if (gva < GUEST_MEM_START_VA || gva >= GUEST_MEM_TOP_VA) {
+      return -EFAULT;
+   }
+   if (km_vdso_gva(gva) != 0) {
+      ext->base = GUEST_VVAR_VDSO_BASE_VA;
+      ext->top = GUEST_VVAR_VDSO_BASE_VA + km_vvar_vdso_size;
+   } else if (km_guestmem_gva(gva) != 0) {
+      ext->base = GUEST_KMGUESTMEM_BASE_VA;
+      ext->top = GUEST_KMGUESTMEM_BASE_VA + machine.vm_mem_regs[KM_RSRV_KMGUESTMEM_SLOT].memory_size;
+   } else if (gva < brk) {
+      ext->base = GUEST_MEM_START_VA;
+      ext->top = brk;
+   } else if (gva >= tbrk) {
+      ext->base = tbrk;
+      ext->top = GUEST_MEM_TOP_VA;
+   } else {
+      return -EFAULT;
+   }
+   ext->kma = km_gva_to_kma_nocheck(ext->base);
+   return 0;
+}
+
+/*
+ * Translates guest range [gva, gva + len) to km, NULL if it isn't all guest memory.
+ */
+km_kma_t km_gva_range_to_kma(km_gva_t gva, size_t len)
+{
+   km_gva_extent_t ext;
+
+   if (gva + len < gva || km_gva_extent(gva, &ext) != 0 || len > ext.top - gva) {
+      return NULL;
+   }
+   return ext.kma + (gva - ext.base);
+}
+
+void km_iov_init(km_iov_t* kiov)
+{
+   kiov->iov = kiov->inl;
+   kiov->max = KM_IOV_INLINE;
+   km_iov_reset(kiov);
+}
+
+// Empty it for reuse, keeping the allocated iovecs
+void km_iov_reset(km_iov_t* kiov)
+{
+   kiov->cnt = 0;
+   kiov->merge = 0;
+   kiov->len = 0;
+   kiov->ext = (km_gva_extent_t){};
+}
+
+void km_iov_fini(km_iov_t* kiov)
+{
+   if (kiov->iov != kiov->inl) {
+      free(kiov->iov);
+   }
+   kiov->iov = NULL;
+   kiov->max = kiov->cnt = 0;
+}
+
+static int km_iov_grow(km_iov_t* kiov)
+{
+   int max = kiov->max * 2;
+   struct iovec* iov;
+
+   if (kiov->iov == kiov->inl) {
+      if ((iov = malloc(max * sizeof(struct iovec))) != NULL) {
+         memcpy(iov, kiov->inl, sizeof(kiov->inl));
+      }
+   } else {
+      iov = realloc(kiov->iov, max * sizeof(struct iovec));
+   }
+   if (iov == NULL) {
+      return -ENOMEM;
+   }
+   kiov->iov = iov;
+   kiov->max = max;
+   return 0;
+}
+
+/*
+ * Appends guest buffer [gva, gva + len). Returns 0 or -errno. On -EFAULT the part of the buffer
+ * before the bad address has been appended. Zero length buffers aren't validated, like the kernel
+ * doesn't.
+ */
+int km_iov_add(km_iov_t* kiov, km_gva_t gva, size_t len)
+{
+   int rc;
+
+   if (gva + len < gva) {
+      return -EFAULT;
+   }
+   while (len != 0) {
+      if (gva < kiov->ext.base || gva >= kiov->ext.top) {
+         if ((rc = km_gva_extent(gva, &kiov->ext)) != 0) {
+            return rc;
+         }
+      }
+      size_t n = MIN(len, kiov->ext.top - gva);
+      km_kma_t kma = kiov->ext.kma + (gva - kiov->ext.base);
+      struct iovec* last = kiov->cnt > 0 ? &kiov->iov[kiov->cnt - 1] : NULL;
+
+      if (kiov->merge != 0 && last != NULL && last->iov_base + last->iov_len == kma) {
+         last->iov_len += n;
+      } else {
+         if (kiov->cnt == kiov->max && (rc = km_iov_grow(kiov)) != 0) {
+            return rc;
+         }
+         kiov->iov[kiov->cnt++] = (struct iovec){.iov_base = kma, .iov_len = n};
+      }
+      kiov->merge = 1;
+      kiov->len += n;
+      gva += n;
+      len -= n;
+   }
+   return 0;
+}
+
+/*
+ * Appends the buffers of guest iovec array giov[cnt]. If partial is set, a bad buffer cuts the
+ * vector short at the bad address, so the call returns a short count the way the kernel does
+ * when it faults part way through. -EFAULT is returned only if nothing was appended then.
+ * -EINVAL if the lengths add up to more than SSIZE_MAX, like the kernel.
+ */
+int km_iov_add_guest(km_iov_t* kiov, km_gva_t giov, size_t cnt, int partial)
+{
+   struct iovec* iov;
+   size_t len = kiov->len;
+   size_t total = 0;
+   int rc;
+
+   if (cnt > UIO_MAXIOV) {
+      return -EINVAL;
+   }
+   if (cnt == 0) {
+      return 0;
+   }
+   if ((iov = km_gva_range_to_kma(giov, cnt * sizeof(struct iovec))) == NULL) {
+      return -EFAULT;
+   }
+   for (size_t i = 0; i < cnt; i++) {
+      if (iov[i].iov_len > SSIZE_MAX - total) {
+         return -EINVAL;
+      }
+      total += iov[i].iov_len;
+   }
+   for (size_t i = 0; i < cnt; i++) {
+      if ((rc = km_iov_add(kiov, (km_gva_t)iov[i].iov_base, iov[i].iov_len)) != 0) {
+         if (rc == -EFAULT && partial != 0 && kiov->len != len) {
+            return 0;
+         }
+         return rc;
+      }
+   }
+   return 0;
+}
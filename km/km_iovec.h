@@ -0,0 +1,67 @@
+/*
+ * Copyright 2021 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Translation of guest buffers and iovecs into host iovecs.
+ *
+ * Guest memory is a few linear extents (bottom and top zone, vdso, km guest code), each contiguous
+ * in km as well. A guest buffer therefore becomes one host iovec, or a few if it crosses extents,
+ * and buffers that are adjacent in km are merged into one host iovec. The extent of the last
+ * translation is cached, so the following buffers usually cost a compare and an add.
+ *
+ * The first KM_IOV_INLINE host iovecs live in km_iov_t itself, more are malloc'ed.
+ */
+
+#ifndef __KM_IOVEC_H__
+#define __KM_IOVEC_H__
+
+#include <sys/uio.h>
+
+#include "km.h"
+
+#define KM_IOV_INLINE 16
+
+// [base, top) in the guest is at kma in km
+typedef struct km_gva_extent {
+   km_gva_t base;
+   km_gva_t top;
+   km_kma_t kma;
+} km_gva_extent_t;
+
+typedef struct km_iov {
+   struct iovec* iov;     // host iovecs, inl[] or malloc'ed
+   int cnt;               // in use
+   int max;               // allocated
+   int merge;             // cleared by km_iov_break()
+   size_t len;            // total bytes
+   km_gva_extent_t ext;   // of the last translation
+   struct iovec inl[KM_IOV_INLINE];
+} km_iov_t;
+
+void km_iov_init(km_iov_t* kiov);
+void km_iov_reset(km_iov_t* kiov);
+void km_iov_fini(km_iov_t* kiov);
+int km_iov_add(km_iov_t* kiov, km_gva_t gva, size_t len);
+int km_iov_add_guest(km_iov_t* kiov, km_gva_t giov, size_t cnt, int partial);
+km_kma_t km_gva_range_to_kma(km_gva_t gva, size_t len);
+
+// The next buffer starts a new host iovec, e.g. for the next msghdr of an mmsghdr vector
+static inline void km_iov_break(km_iov_t* kiov)
+{
+   kiov->merge = 0;
+}
+
+#endif   // !defined(__KM_IOVEC_H__)
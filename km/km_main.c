@@ -90,13 +90,29 @@ static inline void usage()
 "\t--core-on-err                       - generate KM core dump when exiting on err, including guest core dump\n"
 "\t--overcommit-memory                 - Allow huge address allocations for payloads.\n"
 "\t                                      See 'sysctl vm.overcommit_memory'\n"
+"\t--hugepages=thp|2M|1G               - Back guest memory with transparent or hugetlb huge pages\n"
+"\t                                      2M and 1G don't enforce guest mprotect under brk\n"
+"\t                                      unless --pt-mprotect is on\n"
+"\t--prefault                          - Populate guest memory before the payload starts or resumes\n"
+"\t--reclaim                           - Drop freed guest memory when the host is short on memory\n"
+"\t--pt-mprotect                       - Enforce guest mprotect in guest page tables, not host mappings\n"
+"\t--single-memslot                    - Plug all of guest memory into KVM at start, in one memslot\n"
+"\t--numa=interleave|local|node:N      - Place guest memory on host NUMA nodes\n"
+"\t--vcpu-pin=none|node|cpu            - Pin vcpu threads to --numa node CPUs, or one CPU each\n"
 "\t--hcall-stats (-S)                  - Collect and print hypercall stats\n"
 "\t--coredump=file_name                - File name for coredump\n"
 "\t--snapshot=file_name                - File name for snapshot\n"
+"\t--snapshot-incremental              - Later snapshots only have the memory changed since the last\n"
+"\t--snapshot-flatten=file_name        - Write snapshot payload-file merged with its parents, exit\n"
+"\t--snapshot-base=file_name           - Snapshots only have the memory that differs from it\n"
+"\t--snapshot-info                     - Print the snapshot files payload-file needs, exit\n"
+"\t--snapshot-background               - Live snapshots write guest memory while the payload runs\n"
+"\t--snapshot-compress                 - Compress guest memory in snapshots that aren't layers\n"
 "\t--kill-unimpl-hcall                 - Kill guest in unimplemented hypercall.\n"
+"\t--async-hcalls                      - Queue short stdout/stderr writes to km worker threads\n"
 "\n"
 "\tOverride auto detection:\n"
-"\t--membus-width=size (-Psize)        - Set guest physical memory bus size in bits, i.e. 32 means 4GiB, 33 8GiB, 34 16GiB, etc.\n"
+"\t--membus-width=size (-Psize)        - Set guest physical memory bus size in bits, i.e. 32 means 4GiB, 33 8GiB, 34 16GiB, etc. Up to 42, 4TiB\n"
 "\t--enable-1g-pages                   - Force enable 1G pages support (default). Assumes hardware support\n"
 "\t--disable-1g-pages                  - Force disable 1G pages support\n"
 "\t--virt-device=<file-name>  (-Ffile) - Use provided file-name for virtualization device\n"
@@ -138,6 +154,11 @@ static inline void show_version(void)
 // Option names we use elsewhere.
 #define GDB_LISTEN "gdb-listen"
 #define GDB_DYNLINK "gdb-dynlink"
+#define HUGEPAGES "hugepages"
+#define NUMA "numa"
+#define VCPU_PIN "vcpu-pin"
+#define SNAPSHOT_FLATTEN "snapshot-flatten"
+#define SNAPSHOT_BASE "snapshot-base"
 
 km_machine_init_params_t km_machine_init_params = {
     .force_pdpe1g = KM_FLAG_FORCE_ENABLE,
@@ -150,6 +171,9 @@ static char* mgtpipe = NULL;
 static int log_to_fd = -1;
 extern int set_cpu_vendor_id;
 extern int kill_unimpl_hcall;
+extern int km_hc_async_mode;
+extern int km_prefault;
+extern int km_mem_reclaim;
 extern char* km_interp;
 
 struct option km_cmd_long_options[] = {
@@ -168,14 +192,28 @@ struct option km_cmd_long_options[] = {
     {"gdb-server-port", optional_argument, 0, 'g'},
     {GDB_LISTEN, no_argument, NULL, 0},
     {GDB_DYNLINK, no_argument, NULL, 0},
+    {HUGEPAGES, required_argument, NULL, 0},
+    {NUMA, required_argument, NULL, 0},
+    {VCPU_PIN, required_argument, NULL, 0},
     {"verbose", optional_argument, 0, 'V'},
     {"core-on-err", no_argument, &debug_dump_on_err, 1},
     {"version", no_argument, 0, 'v'},
     {"hcall-stats", no_argument, 0, 'S'},
     {"virt-device", required_argument, 0, 'F'},
     {"snapshot", required_argument, 0, 's'},
+    {"snapshot-incremental", no_argument, &(km_snapshot_incremental), 1},
+    {SNAPSHOT_FLATTEN, required_argument, NULL, 0},
+    {SNAPSHOT_BASE, required_argument, NULL, 0},
+    {"snapshot-info", no_argument, &(km_snapshot_info), 1},
+    {"snapshot-background", no_argument, &(km_snapshot_background), 1},
+    {"snapshot-compress", no_argument, &(km_snapshot_compress), 1},
     {"mgtpipe", required_argument, 0, 'm'},
     {"kill-unimpl-scall", no_argument, &(kill_unimpl_hcall), KM_FLAG_FORCE_ENABLE},
+    {"async-hcalls", no_argument, &(km_hc_async_mode), 1},
+    {"prefault", no_argument, &(km_prefault), 1},
+    {"reclaim", no_argument, &(km_mem_reclaim), 1},
+    {"pt-mprotect", no_argument, &(km_pt_mprotect), 1},
+    {"single-memslot", no_argument, &(km_mem_single_slot), 1},
 
     {0, 0, 0, 0},
 };
@@ -327,6 +365,9 @@ km_parse_args(int argc, char* argv[], int* argc_p, char** argv_p[], int* envc_p,
    if (getenv(KM_KILL_UNIMPL_SCALL) != NULL) {
       kill_unimpl_hcall = 1;
    }
+   if (getenv(KM_PREFAULT) != NULL) {
+      km_prefault = 1;
+   }
 
    optind = 0;   // reinit getopt
    while ((opt = getopt_long(argc, argv, km_cmd_short_options, km_cmd_long_options, &longopt_index)) !=
@@ -344,6 +385,35 @@ km_parse_args(int argc, char* argv[], int* argc_p, char** argv_p[], int* envc_p,
             } else if (strcmp(km_cmd_long_options[longopt_index].name, GDB_DYNLINK) == 0) {
                gdbstub.wait_for_attach = GDB_WAIT_FOR_ATTACH_AT_DYNLINK;
                km_gdb_enable(1);
+            } else if (strcmp(km_cmd_long_options[longopt_index].name, HUGEPAGES) == 0) {
+               if (strcmp(optarg, "thp") == 0) {
+                  km_machine_init_params.hugepages = KM_HUGEPAGES_THP;
+               } else if (strcasecmp(optarg, "2M") == 0) {
+                  km_machine_init_params.hugepages = KM_HUGEPAGES_2M;
+               } else if (strcasecmp(optarg, "1G") == 0) {
+                  km_machine_init_params.hugepages = KM_HUGEPAGES_1G;
+               } else {
+                  km_warnx("Invalid --hugepages '%s'", optarg);
+                  usage();
+               }
+            } else if (strcmp(km_cmd_long_options[longopt_index].name, NUMA) == 0) {
+               if (km_numa_parse(optarg) != 0) {
+                  km_warnx("Invalid --numa '%s'", optarg);
+                  usage();
+               }
+            } else if (strcmp(km_cmd_long_options[longopt_index].name, VCPU_PIN) == 0) {
+               if (km_vcpu_pin_parse(optarg) != 0) {
+                  km_warnx("Invalid --vcpu-pin '%s'", optarg);
+                  usage();
+               }
+            } else if (strcmp(km_cmd_long_options[longopt_index].name, SNAPSHOT_FLATTEN) == 0) {
+               if ((km_snapshot_flatten_path = strdup(optarg)) == NULL) {
+                  km_err(1, "Failed to alloc memory for --snapshot-flatten path");
+               }
+            } else if (strcmp(km_cmd_long_options[longopt_index].name, SNAPSHOT_BASE) == 0) {
+               if ((km_snapshot_base = strdup(optarg)) == NULL) {
+                  km_err(1, "Failed to alloc memory for --snapshot-base path");
+               }
             }
             break;
          case 'g':   // enable the gdb server and specify a port to listen on
@@ -620,6 +690,21 @@ int main(int argc, char* argv[])
    }
 
    km_elf_t* elf = km_open_elf_file(km_payload_name);
+   if (km_snapshot_base != NULL && km_ss_layer_set_base(km_snapshot_base) != 0) {
+      km_errx(1, "--snapshot-base: cannot use %s", km_snapshot_base);
+   }
+   if (km_snapshot_info != 0) {
+      if (elf->ehdr.e_type != ET_CORE) {
+         km_errx(1, "--snapshot-info: %s is not a snapshot", km_payload_name);
+      }
+      exit(km_ss_layer_info(km_payload_name) == 0 ? 0 : 1);
+   }
+   if (km_snapshot_flatten_path != NULL) {
+      if (elf->ehdr.e_type != ET_CORE) {
+         km_errx(1, "--snapshot-flatten: %s is not a snapshot", km_payload_name);
+      }
+      exit(km_ss_layer_flatten(km_payload_name, km_snapshot_flatten_path) == 0 ? 0 : 1);
+   }
    if (elf->ehdr.e_type == ET_CORE) {
       // check for incompatible options
       if (envp != NULL) {
@@ -646,6 +731,7 @@ int main(int argc, char* argv[])
          km_err(1, "failed to restore from snapshot %s", km_payload_name);
       }
       km_infox(KM_TRACE_SNAPSHOT, "Snapshot recover complete, pid %d", getpid());
+      km_mem_prefault("restore");
       vcpu = machine.vm_vcpus[0];
       if (getenv(KM_GDB_WAIT_BEFORE_SNAP_RESUME) != NULL) {
          gdbstub.wait_for_attach = GDB_WAIT_FOR_ATTACH_AT_START;
@@ -682,6 +768,7 @@ int main(int argc, char* argv[])
          }
          free(envp);
       }
+      km_mem_prefault("start");
    }
    km_trace_set_noninteractive();
 
@@ -29,6 +29,7 @@
 #include "km_coredump.h"
 #include "km_filesys.h"
 #include "km_management.h"
+#include "km_mem.h"
 #include "km_snapshot.h"
 #include "libkontain_mgmt.h"
 
@@ -60,6 +61,7 @@ static void* mgt_main(void* arg)
       }
 
       // Read the request.
+      memset(&mgmtrequest, 0, sizeof(mgmtrequest));
       br = recv(nfd, &mgmtrequest, sizeof(mgmtrequest), 0);
       if (br < 0) {
          km_warn("recv mgmt request failed");
@@ -73,19 +75,49 @@ static void* mgt_main(void* arg)
       }
 
       needunblock = 0;
+      mgmtreply.pause_usec = 0;
       if (km_vcpus_are_started != 0) {
          switch (mgmtrequest.opcode) {
+            case KM_MGMT_REQ_HC_STATS:
+               mgmtreply.request_status = km_collect_hc_stats != 0 ? 0 : ENOTSUP;
+               break;
+            case KM_MGMT_REQ_MEM_STATS:
+               mgmtreply.request_status = 0;
+               break;
+            case KM_MGMT_REQ_SNAPSHOT_LAYERS:
+               // Snapshots change the layers
+               if ((mgmtreply.request_status = km_snapshot_block(NULL)) == 0) {
+                  needunblock = 1;
+               }
+               break;
             case KM_MGMT_REQ_SNAPSHOT:
                if ((mgmtreply.request_status = km_snapshot_block(NULL)) == 0) {
+                  char* base = mgmtrequest.requests.snapshot_req.base_path;
+                  base[SNAPPATHMAX - 1] = 0;
+                  if (base[0] != 0 &&
+                      (mgmtreply.request_status = -km_ss_layer_set_base(base)) != 0) {
+                     needunblock = 1;
+                     break;
+                  }
                   mgmtreply.request_status =
                       km_snapshot_create(NULL,
                                          mgmtrequest.requests.snapshot_req.label,
                                          mgmtrequest.requests.snapshot_req.description,
-                                         mgmtrequest.requests.snapshot_req.snapshot_path);
-                  if (mgmtreply.request_status == 0 && mgmtrequest.requests.snapshot_req.live == 0) {
-                     machine.exit_group = 1;
+                                         mgmtrequest.requests.snapshot_req.snapshot_path,
+                                         mgmtrequest.requests.snapshot_req.live);
+                  if (mgmtrequest.requests.snapshot_req.live != 0) {
+                     // The payload runs again while a background snapshot is written.
+                     km_snapshot_unblock();
+                     if (mgmtreply.request_status == 0) {
+                        mgmtreply.request_status = km_snapshot_wait();
+                     }
+                  } else {
+                     if (mgmtreply.request_status == 0) {
+                        machine.exit_group = 1;
+                     }
+                     needunblock = 1;
                   }
-                  needunblock = 1;
+                  mgmtreply.pause_usec = km_snapshot_pause_usec();
                }
                break;
             default:
@@ -104,13 +136,21 @@ static void* mgt_main(void* arg)
       bw = send(nfd, &mgmtreply, sizeof(mgmtreply), MSG_NOSIGNAL);
       if (bw != sizeof(mgmtreply)) {
          km_warn("send mgmt reply failed, byteswritten %ld, expected %d", bw, sizeof(mgmtreply));
+      } else if (mgmtrequest.opcode == KM_MGMT_REQ_HC_STATS && mgmtreply.request_status == 0) {
+         km_hc_stats_send(nfd);
+      } else if (mgmtrequest.opcode == KM_MGMT_REQ_MEM_STATS && mgmtreply.request_status == 0) {
+         km_mem_stats_send(nfd);
+      } else if (mgmtrequest.opcode == KM_MGMT_REQ_SNAPSHOT_LAYERS &&
+                 mgmtreply.request_status == 0) {
+         km_ss_layer_send(nfd);
       }
       close(nfd);
       if (needunblock != 0) {
          // We need to send the reply before potentially shutting down the payload threads.
          km_snapshot_unblock();
       }
-      if (mgmtreply.request_status == 0 && mgmtrequest.requests.snapshot_req.live == 0) {
+      if (mgmtrequest.opcode == KM_MGMT_REQ_SNAPSHOT && mgmtreply.request_status == 0 &&
+          mgmtrequest.requests.snapshot_req.live == 0) {
          // Payload threads are terminating, this thread doesn't need to receive any more mgmt requests.
          break;
       }
@@ -21,6 +21,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <immintrin.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -50,12 +51,13 @@
  *
  * When using kvm driver
  * - We are forced to stay within width of the CPU physical memory bus. We determine that by analyzing
- * CPUID and store in machine.guest_max_physmem. Currently the code only supports up to 512GB.
+ * CPUID and store in machine.guest_max_physmem. By default that is up to 512GB, --membus-width
+ * goes up to GUEST_MAX_PHYSMEM_SUPPORTED (4TB), a zone then takes several PML4 entries.
  *
  * When using kkm driver
  * - fixed 512GB of memory is supported.
  *
- * Pagetable implementation in this file assumes physical memory to be linear 0-512GB.
+ * Pagetable implementation in this file assumes physical memory to be linear 0-guest_max_physmem.
  * KKM is running inside linux kernel with demand paging and non linear physical memory.
  * KKM driver implements its page tables in conjunction with kernel paging infrastructure.
  * Manipulating the pagetables is only required when using KVM as virtualization driver.
@@ -68,9 +70,9 @@
 #define PT_ENTRIES (512)
 typedef struct page_tables {
    x86_pml4e_t pml4[PT_ENTRIES];
-   x86_pdpte_t pdpt0[PT_ENTRIES];
-   x86_pdpte_t pdpt1[PT_ENTRIES];
-   x86_pdpte_t pdpt2[PT_ENTRIES];
+   x86_pdpte_t pdpt0[GUEST_MAX_PML4ES][PT_ENTRIES];   // bottom zone, and top without KM_HIGH_GVA
+   x86_pdpte_t pdpt1[PT_ENTRIES];                     // guest private memory
+   x86_pdpte_t pdpt2[GUEST_MAX_PML4ES][PT_ENTRIES];   // top zone with KM_HIGH_GVA
    x86_pde_4k_t pd0[PT_ENTRIES];
    x86_pde_4k_t pd1[PT_ENTRIES];
    x86_pde_4k_t pd2[PT_ENTRIES];
@@ -152,7 +154,7 @@ static void pte_set(x86_pte_4k_t* pte, uint64_t addr)
  * address) of this region is machine.tbrk.
  *
  * Total amount of guest virtual memory (bottom region + top region) is currently limited to
- * 'guest_max_physical_mem-4MB' (i.e. 512GB-4MB).
+ * 'guest_max_physical_mem-4MB' (i.e. 512GB-4MB by default).
  *
  * Virtual to physical is essentially 1:1
  *
@@ -175,8 +177,9 @@ static void pte_set(x86_pte_4k_t* pte, uint64_t addr)
  * Initially there is no memory allocated, then it expands with brk (left to right in the picture
  * below) or with mmap (right to left).
  *
- * If we ever go over the 512GB limit there will be a need for more pdpt pages. The first entry
- * points to the pd page that covers the first GB.
+ * Over 512GB each zone takes guest_max_physmem / 512GB pml4 entries, #0 up and #255 down, with a
+ * pdpt page each (pdpt0[], pdpt2[]). Guest private memory (vdso, km guest code) follows the bottom
+ * zone at GUEST_MEM_SPAN. The first entry points to the pd page that covers the first GB.
  *
  * The picture illustrates layout with the constants values as set.
  * The code below is a little more flexible, allowing one or two pdpt pages and
@@ -211,8 +214,10 @@ static void pte_set(x86_pte_4k_t* pte, uint64_t addr)
  * memory starts at 2MB and ends at 512GB-2MB. Initially there is no memory allocated, then it
  * expands with brk (left to right in the picture below) or with mmap (right to left).
  *
- * If we ever go over the 512GB limit there will be a need for more pdpt pages. The first entry
- * points to the pd page that covers the first GB.
+ * Over 512GB the zone takes guest_max_physmem / 512GB pml4 entries, each with a pdpt page
+ * (pdpt0[]), shared by the bottom and the top region, GUEST_VA_OFFSET is 0 then. Guest private
+ * memory (vdso, km guest code) follows at GUEST_MEM_SPAN. The first entry points to the pd page
+ * that covers the first GB.
  *
  * The picture illustrates layout with the constants values as set.
  * The code below is a little more flexible, allowing one or two pdpt pages and
@@ -288,6 +293,33 @@ static inline int PDPTE_SLOT_ROUNDUP(km_gva_t __addr)
    return slot;
 }
 
+/*
+ * PDPT entry for gva in the bottom (upper_va == 0) or top zone. A zone has a PDPT page per PML4
+ * entry, see init_pml4()
+ */
+static inline x86_pdpte_t* zone_pdpte(km_gva_t gva, int upper_va)
+{
+   page_tables_t* pt = km_page_table();
+   int idx = (gva / PML4E_REGION) % GUEST_MAX_PML4ES;
+
+#ifdef KM_HIGH_GVA
+   if (upper_va != 0) {
+      return &pt->pdpt2[idx][PDPTE_SLOT(gva)];
+   }
+#endif
+   return &pt->pdpt0[idx][PDPTE_SLOT(gva)];
+}
+
+// 1GB page number of gva, counting across PDPT pages. pdpte_1g() is its PDPT entry
+static inline int PDPTE_INDEX(km_gva_t __addr)
+{
+   return __addr / PDPTE_REGION;
+}
+static inline x86_pdpte_1g_t* pdpte_1g(int index, int upper_va)
+{
+   return (x86_pdpte_1g_t*)zone_pdpte(index * PDPTE_REGION, upper_va);
+}
+
 /*
  * Remember these payload virtual addresses for placement in auxv[].
  * Base of [vvar] pages in [0]
@@ -420,6 +452,9 @@ static void km_add_code_to_guest_address_space(void)
       for (uint8_t* p = &km_guest_start; p < &km_guest_end; p += KM_PAGE_SIZE) {
          idx = PTE_SLOT(virtaddr);
          pte_set(pte + idx, physaddr);
+         if (p < &km_guest_data_rw_start) {
+            pte[idx].r_w = 0;   // only .km_guest_data_rw is writable by the guest
+         }
          virtaddr += KM_PAGE_SIZE;
          physaddr += KM_PAGE_SIZE;
       }
@@ -447,36 +482,36 @@ static void init_pml4(km_kma_t mem)
    int idx;
    page_tables_t* pt = mem;
    page_tables_t* pt_phys = (page_tables_t*)(uint64_t)RSV_MEM_START;
+   int pml4es = GUEST_MEM_SPAN / PML4E_REGION;
 
-   // The code assumes that a single PML4 slot can cover all available physical memory.
-   km_assert(machine.guest_max_physmem <= PML4E_REGION);
+   // The code assumes that GUEST_MAX_PML4ES PML4 slots can cover all available physical memory.
+   km_assert(pml4es <= GUEST_MAX_PML4ES && sizeof(page_tables_t) <= RSV_MEM_SIZE);
    // The code assumes that PA and VA are aligned within PDE table (which covers PDPTE_REGION)
    km_assert(GUEST_VA_OFFSET % PDPTE_REGION == 0);
 
    // initialize all page table entries
    memset(pt, 0, sizeof(page_tables_t));
 
-   // covers 0 to 512GB - 1
-   pml4e_set(&pt->pml4[0], (uint64_t)pt_phys->pdpt0);
-   pdpte_set(&pt->pdpt0[0], (uint64_t)pt_phys->pd0);
+   // covers 0 to GUEST_MEM_SPAN - 1
+   for (int i = 0; i < pml4es; i++) {
+      pml4e_set(&pt->pml4[i], (uint64_t)pt_phys->pdpt0[i]);
+   }
+   pdpte_set(&pt->pdpt0[0][0], (uint64_t)pt_phys->pd0);
 
-   // covers 512GB to 1TB - 1
+   // covers GUEST_MEM_SPAN to GUEST_MEM_SPAN + 512GB - 1
    idx = GUEST_PRIVATE_MEM_START_VA / PML4E_REGION;
    pml4e_set(&pt->pml4[idx], (uint64_t)pt_phys->pdpt1);
    pdpte_set(&pt->pdpt1[0], (uint64_t)pt_phys->pd1);
    idx = PDE_SLOT(GUEST_VVAR_VDSO_BASE_VA);
    pde_4k_set(&pt->pd1[idx], (uint64_t)pt_phys->pt1);
 #ifdef KM_HIGH_GVA
-   // 128TB - 512GB to 128TB
-   idx = (GUEST_MEM_TOP_VA - 1) / PML4E_REGION;
-   pml4e_set(&pt->pml4[idx], (uint64_t)pt_phys->pdpt2);
-#endif
-   idx = PDE_SLOT(GUEST_MEM_TOP_VA);
-#ifdef KM_HIGH_GVA
-   pdpte_set(&pt->pdpt2[idx], (uint64_t)pt_phys->pd2);
-#else
-   pdpte_set(&pt->pdpt0[idx], (uint64_t)pt_phys->pd2);
+   // 128TB - GUEST_MEM_SPAN to 128TB
+   for (int i = 0; i < pml4es; i++) {
+      idx = (GUEST_MEM_TOP_VA - 1) / PML4E_REGION - i;
+      pml4e_set(&pt->pml4[idx], (uint64_t)pt_phys->pdpt2[idx % GUEST_MAX_PML4ES]);
+   }
 #endif
+   pdpte_set(zone_pdpte(GUEST_MEM_TOP_VA, 1), (uint64_t)pt_phys->pd2);
 }
 
 static void* km_guest_page_malloc(km_gva_t gpa_hint, size_t size, int prot)
@@ -497,17 +532,486 @@ static void* km_guest_page_malloc(km_gva_t gpa_hint, size_t size, int prot)
    return addr;
 }
 
+/*
+ * Huge pages for guest memory (--hugepages). Regions are naturally aligned powers of 2 (see
+ * memreg_base()), in the guest and in km, so a region at least a huge page big is all huge pages.
+ *
+ * With thp regions are madvise(MADV_HUGEPAGE). With 2M and 1G the brk side regions are hugetlb
+ * mappings. These can't be mprotect'ed or replaced in parts smaller than a huge page, so under brk
+ * everything is read/write for the host, the guest protection isn't enforced there. tbrk side and
+ * the shared middle region, where file mmaps go, use THP. When hugetlb pages run out (see
+ * /proc/sys/vm/nr_hugepages) we fall back to THP.
+ */
+static size_t km_hugetlb_pagesize(int idx, size_t size, int upper_va)
+{
+   if (km_brk_hugetlb() == 0 || upper_va != 0 || idx >= machine.mid_mem_idx) {
+      return 0;
+   }
+   if (machine.hugepages == KM_HUGEPAGES_1G && size >= GIB) {
+      return GIB;
+   }
+   return size >= 2 * MIB ? 2 * MIB : 0;
+}
+
+static void* km_guest_hugetlb_malloc(km_gva_t gpa_hint, size_t size, int prot, size_t pagesize)
+{
+   static int warned;
+   km_kma_t addr;
+   int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+               (__builtin_ctzl(pagesize) << MAP_HUGE_SHIFT) |
+               (machine.overcommit_memory == 1 ? MAP_NORESERVE : 0);
+
+   if ((addr = mmap(gpa_hint + KM_USER_MEM_BASE, size, prot, flags, -1, 0)) == MAP_FAILED) {
+      if (warned == 0) {
+         warned = 1;
+         km_warn("No %ldMB hugetlb pages for 0x%lx of guest memory, using THP", pagesize / MIB, size);
+      }
+      return NULL;
+   }
+   if (addr != gpa_hint + KM_USER_MEM_BASE) {
+      km_errx(1, "Problem getting guest memory, wanted %p, got %p", gpa_hint + KM_USER_MEM_BASE, addr);
+   }
+   return addr;
+}
+
+/*
+ * How much of resident guest memory is in huge pages, per /proc/self/smaps. hugetlb pages aren't
+ * in Rss there.
+ */
+static void km_hugepages_report(void)
+{
+   static const char* const modes[] = {"none", "thp", "2M", "1G"};
+   uint64_t lo = (uint64_t)KM_USER_MEM_BASE;
+   uint64_t hi = lo + machine.guest_max_physmem;
+   uint64_t rss = 0, thp = 0, hugetlb = 0;   // KB
+   uint64_t start, end, kb;
+   char line[256];
+   int guest = 0;
+   FILE* fp;
+
+   if ((fp = fopen("/proc/self/smaps", "r")) == NULL) {
+      km_warn("hugepages: /proc/self/smaps");
+      return;
+   }
+   while (fgets(line, sizeof(line), fp) != NULL) {
+      if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+         guest = start >= lo && end <= hi;
+      } else if (guest == 0) {
+         continue;
+      } else if (sscanf(line, "Rss: %lu kB", &kb) == 1) {
+         rss += kb;
+      } else if (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1) {
+         thp += kb;
+      } else if (sscanf(line, "Private_Hugetlb: %lu kB", &kb) == 1 ||
+                 sscanf(line, "Shared_Hugetlb: %lu kB", &kb) == 1) {
+         hugetlb += kb;
+      }
+   }
+   fclose(fp);
+   km_warnx("hugepages=%s: %ld%% of %ldMB guest memory in huge pages (THP %ldMB, hugetlb %ldMB)",
+            modes[machine.hugepages],
+            rss + hugetlb == 0 ? 0 : (thp + hugetlb) * 100 / (rss + hugetlb),
+            (rss + hugetlb) >> 10,
+            thp >> 10,
+            hugetlb >> 10);
+}
+
 void km_guest_page_free(km_gva_t addr, size_t size)
 {
    munmap(addr + KM_USER_MEM_BASE, size);
 }
 
+/*
+ * Guest mprotect in the guest page tables (--pt-mprotect, KVM only).
+ *
+ * By default guest protection is the protection of the host mapping, so each guest mprotect splits
+ * host VMAs, and a guest write to a read-only page comes back as EFAULT from KVM_RUN with the
+ * address decoded from the instruction (km_decode.c). JITs flip pages between writable and
+ * executable all the time, which takes the VMA count towards vm.max_map_count.
+ *
+ * With --pt-mprotect host mappings of memory regions stay read/write, and km_mem_protect() sets the
+ * present and r_w bits in the guest page tables instead: on a 2MB or 1GB page the range covers
+ * whole, on 4K ptes otherwise, splitting the larger page on demand. The guest runs with CR0.WP, so
+ * a violation is a guest page fault, km_handle_interrupt() gets the address from CR2.
+ *
+ * Table pages come from a pool at GUEST_PT_POOL_GPA. A range that becomes read/write over a whole
+ * 2MB or 1GB is a large page again and its tables go back to the pool. If the pool runs out we
+ * warn and from then on mprotect the host mapping too, as in the default mode.
+ *
+ * Entries that lose access need vcpu TLBs flushed. KVM has no call for that, but it flushes all
+ * vcpus when a guest physical page loses its host mapping, so km_pt_flush() makes the pml4 page,
+ * that every guest page walk reads, read-only and back. Entries that gain access don't need that,
+ * a fault on a stale TLB entry is retried (km_mem_pt_fault_stale()).
+ *
+ * km accesses guest memory through the read/write host mapping, so unlike the default mode a
+ * hypercall can read or write guest memory the guest itself can't.
+ */
+#define KM_PT_POOL_PAGES 256   // 1MB, up to GUEST_VVAR_VDSO_BASE_GPA
+
+int km_pt_mprotect = 0;   // --pt-mprotect
+
+static pthread_mutex_t km_pt_mtx = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t km_pt_used[KM_PT_POOL_PAGES / 64];
+static uint64_t km_pt_stale[KM_PT_POOL_PAGES / 64];   // freed, reusable after a TLB flush
+static int km_pt_host;                                 // pool ran out, host mprotect is on too
+
+static inline uint64_t* km_pt_kma(uint64_t entry)
+{
+   return (uint64_t*)(KM_USER_MEM_BASE + (entry & X86_PTE_ADDR));
+}
+
+// entry points to a table from the pool
+static inline int km_pt_pool_table(uint64_t entry)
+{
+   uint64_t gpa = entry & X86_PTE_ADDR;
+   return (entry & X86_PTE_PS) == 0 && gpa >= GUEST_PT_POOL_GPA &&
+          gpa < GUEST_PT_POOL_GPA + KM_PT_POOL_PAGES * KM_PAGE_SIZE;
+}
+
+static void km_pt_flush(void)
+{
+   if (mprotect(km_page_table(), KM_PAGE_SIZE, PROT_READ) != 0 ||
+       mprotect(km_page_table(), KM_PAGE_SIZE, PROT_READ | PROT_WRITE) != 0) {
+      km_err(1, "pt-mprotect: failed to flush guest TLB");
+   }
+}
+
+// Returns guest physical address of a zeroed table page, or 0 if the pool is used up
+static uint64_t km_pt_alloc(void)
+{
+   for (int flushed = 0; flushed < 2; flushed++) {
+      for (int i = 0; i < KM_PT_POOL_PAGES / 64; i++) {
+         if (km_pt_used[i] != ~0ul) {
+            int bit = __builtin_ctzl(~km_pt_used[i]);
+            uint64_t gpa = GUEST_PT_POOL_GPA + (i * 64 + bit) * KM_PAGE_SIZE;
+
+            km_pt_used[i] |= 1ul << bit;
+            memset(km_pt_kma(gpa), 0, KM_PAGE_SIZE);
+            return gpa;
+         }
+      }
+      // vcpus may have freed tables in their paging structure caches until a flush
+      int stale = 0;
+      for (int i = 0; i < KM_PT_POOL_PAGES / 64; i++) {
+         stale |= km_pt_stale[i] != 0;
+      }
+      if (stale == 0) {
+         break;
+      }
+      km_pt_flush();
+      for (int i = 0; i < KM_PT_POOL_PAGES / 64; i++) {
+         km_pt_used[i] &= ~km_pt_stale[i];
+         km_pt_stale[i] = 0;
+      }
+   }
+   return 0;
+}
+
+// Frees the table 'entry' points to, and the tables under it
+static void km_pt_free(uint64_t entry)
+{
+   if (km_pt_pool_table(entry) == 0) {
+      return;
+   }
+   uint64_t* table = km_pt_kma(entry);
+   for (int i = 0; i < PT_ENTRIES; i++) {
+      km_pt_free(table[i]);
+   }
+   int page = ((entry & X86_PTE_ADDR) - GUEST_PT_POOL_GPA) / KM_PAGE_SIZE;
+   km_pt_stale[page / 64] |= 1ul << (page % 64);
+}
+
+// Before a memory region is (un)mapped at *entry. Page tables of what was there go back to the pool
+static void km_pt_release(void* entry)
+{
+   uint64_t* e = entry;
+
+   if (km_pt_mprotect != 0 && km_pt_pool_table(*e) != 0) {
+      km_mutex_lock(&km_pt_mtx);
+      km_pt_free(*e);
+      *e = 0;
+      km_mutex_unlock(&km_pt_mtx);
+   }
+}
+
+// Replaces a large page entry mapping 'size' bytes with a table of smaller pages, same mapping
+static int km_pt_split(uint64_t* entry, size_t size)
+{
+   uint64_t e = *entry;
+   uint64_t gpa = km_pt_alloc();
+   size_t sub = size / PT_ENTRIES;
+
+   if (gpa == 0) {
+      return -ENOMEM;
+   }
+   uint64_t* table = km_pt_kma(gpa);
+   uint64_t bits = (e & (X86_PTE_P | X86_PTE_RW | X86_PTE_US | X86_PTE_G)) |
+                   (sub > KM_PAGE_SIZE ? X86_PTE_PS : 0);
+   for (int i = 0; i < PT_ENTRIES; i++) {
+      table[i] = ((e & X86_PTE_ADDR) + i * sub) | bits;
+   }
+   __atomic_store_n(entry, gpa | X86_PTE_P | X86_PTE_RW | X86_PTE_US, __ATOMIC_RELEASE);
+   return 0;
+}
+
+/*
+ * Sets 'bits' (X86_PTE_P, X86_PTE_RW) for [gva, end) in 'table', which entries map 'size' bytes
+ * each. Sets *lost if an entry lost access. Returns 0, or -ENOMEM when a large page can't be split,
+ * it gets 'bits' added then.
+ */
+static int
+km_pt_set(uint64_t* table, size_t size, km_gva_t gva, km_gva_t end, uint64_t bits, int* lost)
+{
+   int ret = 0;
+
+   for (km_gva_t next; gva < end; gva = next) {
+      uint64_t* entry = &table[(gva / size) % PT_ENTRIES];
+      km_gva_t base = rounddown(gva, size);
+      uint64_t e = *entry;
+      uint64_t new;
+
+      next = MIN(end, base + size);
+      if ((e & X86_PTE_ADDR) == 0) {
+         continue;   // nothing mapped here
+      }
+      int page = size == KM_PAGE_SIZE || (e & X86_PTE_PS) != 0;
+      if (gva == base && next == base + size && (page != 0 || km_pt_pool_table(e) != 0) &&
+          (size < PDPTE_REGION || (size == PDPTE_REGION && machine.pdpe1g != 0))) {
+         // covers the whole entry, make it a page
+         if (page != 0) {
+            new = (e & ~(X86_PTE_P | X86_PTE_RW)) | bits;
+            *lost |= (e & ~new & (X86_PTE_P | X86_PTE_RW)) != 0;
+         } else {
+            new = gva_to_gpa_nocheck(base) | bits | X86_PTE_US | X86_PTE_G | X86_PTE_PS;
+            *lost |= bits != (X86_PTE_P | X86_PTE_RW);
+            km_pt_free(e);
+         }
+         if (new != e) {
+            __atomic_store_n(entry, new, __ATOMIC_RELEASE);
+         }
+         continue;
+      }
+      if (page != 0 && km_pt_split(entry, size) != 0) {
+         __atomic_store_n(entry, e | bits, __ATOMIC_RELEASE);
+         ret = -ENOMEM;
+         continue;
+      }
+      if (km_pt_set(km_pt_kma(*entry), size / PT_ENTRIES, gva, next, bits, lost) != 0) {
+         ret = -ENOMEM;
+      }
+   }
+   return ret;
+}
+
+/*
+ * Zero page detection for sparse snapshots and compression, 128 bytes at a time. AVX2 if the host
+ * has it, SSE2 is always there on x86_64.
+ */
+__attribute__((target("avx2"))) static int km_mem_is_zero_avx2(const void* buf, size_t size)
+{
+   const __m256i* p = buf;
+
+   for (size_t i = 0; i < size / sizeof(__m256i); i += 4) {
+      __m256i lo = _mm256_or_si256(_mm256_load_si256(p + i), _mm256_load_si256(p + i + 1));
+      __m256i hi = _mm256_or_si256(_mm256_load_si256(p + i + 2), _mm256_load_si256(p + i + 3));
+      __m256i v = _mm256_or_si256(lo, hi);
+      if (_mm256_testz_si256(v, v) == 0) {
+         return 0;
+      }
+   }
+   return 1;
+}
+
+static int km_mem_is_zero_sse2(const void* buf, size_t size)
+{
+   const __m128i* p = buf;
+
+   for (size_t i = 0; i < size / sizeof(__m128i); i += 8) {
+      __m128i lo = _mm_or_si128(_mm_or_si128(p[i], p[i + 1]), _mm_or_si128(p[i + 2], p[i + 3]));
+      __m128i hi = _mm_or_si128(_mm_or_si128(p[i + 4], p[i + 5]), _mm_or_si128(p[i + 6], p[i + 7]));
+      __m128i v = _mm_or_si128(lo, hi);
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xffff) {
+         return 0;
+      }
+   }
+   return 1;
+}
+
+// Returns 1 if the 'size' bytes at 'buf' are all zero. Both are multiples of 128
+int km_mem_is_zero(const void* buf, size_t size)
+{
+   km_assert(((uintptr_t)buf | size) % 128 == 0);
+   if (__builtin_cpu_supports("avx2") != 0) {
+      return km_mem_is_zero_avx2(buf, size);
+   }
+   return km_mem_is_zero_sse2(buf, size);
+}
+
+/*
+ * Host protection of guest memory with guest protection 'prot'. With --pt-mprotect host mappings
+ * stay read/write, a narrower one would fault km on the guest's behalf after a later mprotect
+ * changes only the guest page tables.
+ */
+int km_mem_host_prot(int prot)
+{
+   if (km_pt_mprotect != 0 && km_pt_host == 0) {
+      return PROT_READ | PROT_WRITE;
+   }
+   return protection_adjust(prot);
+}
+
+/*
+ * mmap(MAP_FIXED) of guest memory [gva, gva + size), with guest protection 'prot'. All host
+ * mappings of guest memory after it's allocated go through here, see km_mem_host_prot().
+ */
+void* km_mem_map(km_gva_t gva, size_t size, int prot, int flags, int fd, off_t offset)
+{
+   return mmap(km_gva_to_kma_nocheck(gva),
+               size,
+               km_mem_host_prot(prot),
+               flags | MAP_FIXED,
+               fd,
+               offset);
+}
+
+/*
+ * Sets guest protection of [gva, gva + size), gva page aligned, size rounded up like mprotect()
+ * does, in the host mapping or, with --pt-mprotect, in the guest page tables. Returns 0 or -errno.
+ */
+int km_mem_protect(km_gva_t gva, size_t size, int prot)
+{
+   size = roundup(size, KM_PAGE_SIZE);
+   if (km_pt_mprotect == 0 || km_pt_host != 0) {
+      // hugetlb pages under brk are all read/write, see km_hugetlb_pagesize()
+      if (km_mem_hugetlb(gva) == 0 &&
+          mprotect(km_gva_to_kma_nocheck(gva), size, protection_adjust(prot)) != 0) {
+         return -errno;
+      }
+      if (km_pt_mprotect == 0) {
+         return 0;
+      }
+   }
+   uint64_t bits = (prot != PROT_NONE ? X86_PTE_P : 0) | ((prot & PROT_WRITE) != 0 ? X86_PTE_RW : 0);
+   uint64_t* pml4 = (uint64_t*)km_page_table()->pml4;
+   int lost = 0;
+
+   km_mutex_lock(&km_pt_mtx);
+   int ret = km_pt_set(pml4, PML4E_REGION, gva, gva + size, bits, &lost);
+   if (lost != 0) {
+      km_pt_flush();
+   }
+   km_mutex_unlock(&km_pt_mtx);
+   if (ret != 0 && km_pt_host == 0) {
+      km_warnx("pt-mprotect: out of page table pages, using host mprotect too");
+      km_pt_host = 1;
+      return km_mem_protect(gva, size, prot);
+   }
+   return 0;
+}
+
+/*
+ * Guest page fault on gva with error code 'error'. Returns 1 if the guest page tables allow the
+ * access now, i.e. the fault came from a TLB entry older than km_mem_protect() that gave access.
+ */
+int km_mem_pt_fault_stale(km_gva_t gva, uint64_t error)
+{
+   uint64_t* table = (uint64_t*)km_page_table()->pml4;
+
+   for (size_t size = PML4E_REGION;; size /= PT_ENTRIES) {
+      uint64_t e = __atomic_load_n(&table[(gva / size) % PT_ENTRIES], __ATOMIC_RELAXED);
+
+      if ((e & X86_PTE_P) == 0 || ((error & X86_PF_W) != 0 && (e & X86_PTE_RW) == 0)) {
+         return 0;
+      }
+      if (size == KM_PAGE_SIZE || (e & X86_PTE_PS) != 0) {
+         return 1;
+      }
+      table = km_pt_kma(e);
+   }
+}
+
+static void km_pt_pool_init(void)
+{
+   kvm_mem_reg_t* reg = &machine.vm_mem_regs[KM_RSRV_PTSLOT];
+   size_t size = KM_PT_POOL_PAGES * KM_PAGE_SIZE;
+   void* ptr;
+
+   if ((ptr = km_guest_page_malloc(GUEST_PT_POOL_GPA, size, PROT_READ | PROT_WRITE)) == NULL) {
+      km_err(1, "KVM: no memory for page table pages");
+   }
+   reg->userspace_addr = (typeof(reg->userspace_addr))ptr;
+   reg->slot = KM_RSRV_PTSLOT;
+   reg->guest_phys_addr = GUEST_PT_POOL_GPA;
+   reg->memory_size = size;
+   reg->flags = 0;
+   if (ioctl(machine.mach_fd, KVM_SET_USER_MEMORY_REGION, reg) < 0) {
+      km_err(1, "KVM: set page table region failed");
+   }
+}
+
+/*
+ * Single memslot memory model (--single-memslot, KVM only).
+ *
+ * By default each memory region is a memslot of its own, plugged in when brk or tbrk gets to it,
+ * see the region layout in km_mem.h. With --single-memslot all of the guest memory regions, from
+ * GUEST_MEM_START_VA to the last 2MB of physical memory, are one MAP_NORESERVE mapping that is
+ * plugged in once, here. Memory regions are then bookkeeping only: a new one gets its guest page
+ * table entries, and the host protection of the mapping as usual, a removed one is mapped over with
+ * fresh PROT_NONE memory, which drops its pages. No KVM_SET_USER_MEMORY_REGION after start.
+ *
+ * The slot is as big as guest physical memory. KVM allocates per page metadata (rmap) for it only
+ * with the shadow MMU, with TDP MMU (Linux 5.15 and later) the cost is small and doesn't grow.
+ * hugetlb pages are per region mappings, so --hugepages=2M|1G is THP in this mode.
+ */
+int km_mem_single_slot = 0;   // --single-memslot
+
+static void* km_single_slot_map(km_gva_t gpa, size_t size, int flags)
+{
+   return mmap(KM_USER_MEM_BASE + gpa,
+               size,
+               PROT_NONE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | flags,
+               -1,
+               0);
+}
+
+static void km_single_slot_init(void)
+{
+   kvm_mem_reg_t* reg = &machine.vm_mem_regs[KM_RSRV_SINGLESLOT];
+   size_t size = memreg_top(machine.last_mem_idx - 1) - GUEST_MEM_START_VA;
+   void* ptr;
+
+   if (km_brk_hugetlb() != 0) {
+      km_warnx("--single-memslot: using THP instead of hugetlb pages");
+      machine.hugepages = KM_HUGEPAGES_THP;
+   }
+   if ((ptr = km_single_slot_map(GUEST_MEM_START_VA, size, 0)) == MAP_FAILED) {
+      km_err(1, "KVM: no address space for 0x%lx of guest memory", size);
+   }
+   if (ptr != KM_USER_MEM_BASE + GUEST_MEM_START_VA) {
+      km_errx(1,
+              "Problem getting guest memory, wanted %p, got %p",
+              KM_USER_MEM_BASE + GUEST_MEM_START_VA,
+              ptr);
+   }
+   reg->userspace_addr = (typeof(reg->userspace_addr))ptr;
+   reg->slot = KM_RSRV_SINGLESLOT;
+   reg->guest_phys_addr = GUEST_MEM_START_VA;
+   reg->memory_size = size;
+   reg->flags = 0;
+   if (ioctl(machine.mach_fd, KVM_SET_USER_MEMORY_REGION, reg) < 0) {
+      km_err(1, "KVM: set single memory region failed");
+   }
+}
+
 /*
  * Create reserved memory, initialize PML4 and brk.
  */
 void km_mem_init(km_machine_init_params_t* params)
 {
    machine.overcommit_memory = (params->overcommit_memory == KM_FLAG_FORCE_ENABLE);
+   machine.hugepages = params->hugepages;
+   km_numa_init();
 
    if (machine.vm_type == VM_TYPE_KVM) {
       kvm_mem_reg_t* reg;
@@ -526,6 +1030,18 @@ void km_mem_init(km_machine_init_params_t* params)
          km_err(1, "KVM: set reserved region failed");
       }
       init_pml4((km_kma_t)reg->userspace_addr);
+      if (km_pt_mprotect != 0) {
+         km_pt_pool_init();
+      }
+   } else {
+      if (km_pt_mprotect != 0) {
+         km_warnx("--pt-mprotect needs KVM, using host mprotect");
+         km_pt_mprotect = 0;
+      }
+      if (km_mem_single_slot != 0) {
+         km_warnx("--single-memslot needs KVM, using a memslot per memory region");
+         km_mem_single_slot = 0;
+      }
    }
    /*
     * Move identity map page out of the way. It only gets used if unrestricted_guest support is off,
@@ -542,6 +1058,10 @@ void km_mem_init(km_machine_init_params_t* params)
    machine.mid_mem_idx = MEM_IDX(machine.guest_mid_physmem - 1);
    // Place for the last 2MB of PA. We do not allocate it to make memregs mirrored
    machine.last_mem_idx = (machine.mid_mem_idx << 1) + 1;
+   km_assert(machine.last_mem_idx <= KM_RSRV_VDSOSLOT);   // never allocated, can be a special slot
+   if (km_mem_single_slot != 0) {
+      km_single_slot_init();
+   }
    km_guest_mmap_init();
 
    // Add the [vvar] and [vdso] pages from km into the physical and virtual address space for the payload
@@ -553,11 +1073,14 @@ void km_mem_init(km_machine_init_params_t* params)
 
 void km_mem_fini(void)
 {
+   if (machine.hugepages != KM_HUGEPAGES_NONE) {
+      km_hugepages_report();
+   }
    km_guest_mmap_fini();
 }
 
 #define MAX_PDE_SLOT PDE_SLOT(GUEST_MEM_TOP_VA)
-#define MAX_PDPTE_SLOT PDPTE_SLOT(GUEST_MEM_TOP_VA)
+#define MAX_PDPTE_SLOT PDPTE_INDEX(GUEST_MEM_TOP_VA)
 
 /*
  * fixup_bottom_page_tables() and fixup_top_page_tables() deal
@@ -568,13 +1091,12 @@ static inline void fixup_bottom_page_tables(km_gva_t old_brk, km_gva_t new_brk)
 {
    page_tables_t* pt = km_page_table();
    x86_pde_2m_t* pde = (x86_pde_2m_t*)pt->pd0;
-   x86_pdpte_1g_t* pdpe = (x86_pdpte_1g_t*)pt->pdpt0;
    // - 1 because brk is the fist unusable byte
    // These two are only used in the bottom 1g region. We never operate on the 0 - 2MB page, hence MAX
    int old_2m_slot = MAX(1, PDE_SLOT(old_brk - 1));
    int new_2m_slot = MAX(1, PDE_SLOT(new_brk - 1));
-   int old_1g_slot = PDPTE_SLOT(old_brk - 1);
-   int new_1g_slot = PDPTE_SLOT(new_brk - 1);
+   int old_1g_slot = PDPTE_INDEX(old_brk - 1);
+   int new_1g_slot = PDPTE_INDEX(new_brk - 1);
 
    if (new_brk > old_brk) {
       km_infox(KM_TRACE_MEM,
@@ -596,7 +1118,7 @@ static inline void fixup_bottom_page_tables(km_gva_t old_brk, km_gva_t new_brk)
       if (new_1g_slot > 0) {
          int start = (old_1g_slot == 0) ? 1 : old_1g_slot;
          for (int i = start; i <= new_1g_slot; i++) {
-            pdpe[i].p = 1;
+            pdpte_1g(i, 0)->p = 1;
          }
       }
    } else {
@@ -610,7 +1132,7 @@ static inline void fixup_bottom_page_tables(km_gva_t old_brk, km_gva_t new_brk)
                new_1g_slot);
       if (old_1g_slot > 0) {
          for (int i = new_1g_slot + 1; i <= old_1g_slot; i++) {
-            pdpe[i].p = 0;
+            pdpte_1g(i, 0)->p = 0;
          }
       }
       if (new_1g_slot == 0) {
@@ -633,15 +1155,10 @@ static inline void fixup_top_page_tables(km_gva_t old_brk, km_gva_t new_brk)
 {
    page_tables_t* pt = km_page_table();
    x86_pde_2m_t* pde = (x86_pde_2m_t*)pt->pd2;
-#ifdef KM_HIGH_GVA
-   x86_pdpte_1g_t* pdpe = (x86_pdpte_1g_t*)pt->pdpt2;
-#else
-   x86_pdpte_1g_t* pdpe = (x86_pdpte_1g_t*)pt->pdpt0;
-#endif
    int old_2m_slot = PDE_SLOT(old_brk);
    int new_2m_slot = PDE_SLOT(new_brk);
-   int old_1g_slot = PDPTE_SLOT(old_brk);
-   int new_1g_slot = PDPTE_SLOT(new_brk);
+   int old_1g_slot = PDPTE_INDEX(old_brk);
+   int new_1g_slot = PDPTE_INDEX(new_brk);
 
    if (new_brk < old_brk) {
       km_infox(KM_TRACE_MEM,
@@ -660,7 +1177,7 @@ static inline void fixup_top_page_tables(km_gva_t old_brk, km_gva_t new_brk)
       }
       if (new_1g_slot < MAX_PDPTE_SLOT) {
          for (int i = new_1g_slot; i <= old_1g_slot; i++) {
-            pdpe[i].p = 1;
+            pdpte_1g(i, 1)->p = 1;
          }
       }
    } else {
@@ -674,7 +1191,7 @@ static inline void fixup_top_page_tables(km_gva_t old_brk, km_gva_t new_brk)
                new_1g_slot);
       if (old_1g_slot < MAX_PDPTE_SLOT) {
          for (int i = old_1g_slot; i < new_1g_slot; i++) {
-            pdpe[i].p = 0;
+            pdpte_1g(i, 1)->p = 0;
          }
       }
       if (new_1g_slot == MAX_PDPTE_SLOT) {
@@ -701,18 +1218,15 @@ static void set_pml4_hierarchy(kvm_mem_reg_t* reg, int upper_va)
       x86_pde_2m_t* pde = (x86_pde_2m_t*)(upper_va ? pt->pd2 : pt->pd0);
       for (uint64_t addr = base; addr < base + size; addr += PDE_REGION) {
          // virtual and physical mem aligned the same on PDE_REGION, so we can use use addr for virt.addr
+         km_pt_release(pde + PDE_SLOT(addr));
          pde_2mb_set(pde + PDE_SLOT(addr), addr);
       }
    } else {
       km_assert(machine.pdpe1g != 0);
-#ifdef KM_HIGH_GVA
-      x86_pdpte_1g_t* pdpe = (x86_pdpte_1g_t*)(upper_va ? pt->pdpt2 : pt->pdpt0);
-#else
-      x86_pdpte_1g_t* pdpe = (x86_pdpte_1g_t*)pt->pdpt0;
-#endif
       uint64_t gva = upper_va ? gpa_to_upper_gva(base) : base;
       for (uint64_t addr = gva; addr < gva + size; addr += PDPTE_REGION, base += PDPTE_REGION) {
-         pdpte_1g_set(pdpe + PDPTE_SLOT(addr), base);
+         km_pt_release(pdpte_1g(PDPTE_INDEX(addr), upper_va));
+         pdpte_1g_set(pdpte_1g(PDPTE_INDEX(addr), upper_va), base);
       }
    }
 }
@@ -728,18 +1242,15 @@ static void clear_pml4_hierarchy(kvm_mem_reg_t* reg, int upper_va)
       for (uint64_t addr = base; addr < base + size; addr += PDE_REGION) {
          // virtual and physical mem aligned the same on PDE_REGION, so we can use phys. address in
          // PDE_SLOT()
+         km_pt_release(pde + PDE_SLOT(addr));
          pde[PDE_SLOT(addr)] = (x86_pde_2m_t){0};
       }
    } else {
       km_assert(machine.pdpe1g != 0);   // no 1GB pages support
-#ifdef KM_HIGH_GVA
-      x86_pdpte_1g_t* pdpe = (x86_pdpte_1g_t*)(upper_va ? pt->pdpt2 : pt->pdpt0);
-#else
-      x86_pdpte_1g_t* pdpe = (x86_pdpte_1g_t*)pt->pdpt0;
-#endif
       uint64_t gva = upper_va ? gpa_to_upper_gva(base) : base;
       for (uint64_t addr = gva; addr < gva + size; addr += PDPTE_REGION, base += PDPTE_REGION) {
-         pdpe[PDPTE_SLOT(addr)] = (x86_pdpte_1g_t){0};
+         km_pt_release(pdpte_1g(PDPTE_INDEX(addr), upper_va));
+         *pdpte_1g(PDPTE_INDEX(addr), upper_va) = (x86_pdpte_1g_t){0};
       }
    }
 }
@@ -755,12 +1266,40 @@ static int km_alloc_region(int idx, size_t size, int upper_va)
    void* ptr;
    kvm_mem_reg_t* reg = &machine.vm_mem_regs[idx];
    km_gva_t base = memreg_base(idx);
+   size_t pagesize = km_hugetlb_pagesize(idx, size, upper_va);
+   // guest protection is in the guest page tables or, with hugetlb, not enforced under brk
+   int prot = (km_pt_mprotect != 0 || (km_brk_hugetlb() != 0 && upper_va == 0))
+                  ? PROT_READ | PROT_WRITE
+                  : PROT_NONE;
 
    km_assert(reg->memory_size == 0 && reg->userspace_addr == 0);
    km_assert(machine.pdpe1g || (base < GIB || base >= machine.guest_max_physmem - GIB));
-   if ((ptr = km_guest_page_malloc(base, size, PROT_NONE)) == NULL) {
-      return -ENOMEM;
+   if (km_mem_single_slot != 0) {
+      // already mapped and plugged in, see km_single_slot_init()
+      ptr = KM_USER_MEM_BASE + base;
+      if (prot != PROT_NONE && mprotect(ptr, size, prot) != 0) {
+         return -errno;
+      }
+      if (machine.hugepages != KM_HUGEPAGES_NONE && madvise(ptr, size, MADV_HUGEPAGE) != 0) {
+         km_warn("madvise(MADV_HUGEPAGE) on guest memory region %d", idx);
+      }
+      km_numa_bind(ptr, size, idx);
+      reg->userspace_addr = (typeof(reg->userspace_addr))ptr;
+      reg->slot = idx;
+      reg->guest_phys_addr = base;
+      reg->memory_size = size;
+      set_pml4_hierarchy(reg, upper_va);
+      return 0;
+   }
+   if (pagesize == 0 || (ptr = km_guest_hugetlb_malloc(base, size, prot, pagesize)) == NULL) {
+      if ((ptr = km_guest_page_malloc(base, size, prot)) == NULL) {
+         return -ENOMEM;
+      }
+      if (machine.hugepages != KM_HUGEPAGES_NONE && madvise(ptr, size, MADV_HUGEPAGE) != 0) {
+         km_warn("madvise(MADV_HUGEPAGE) on guest memory region %d", idx);
+      }
    }
+   km_numa_bind(ptr, size, idx);
    reg->userspace_addr = (typeof(reg->userspace_addr))ptr;
    reg->slot = idx;
    reg->guest_phys_addr = base;
@@ -787,13 +1326,23 @@ static void km_free_region(int idx, int upper_va)
    if (machine.vm_type == VM_TYPE_KVM) {
       clear_pml4_hierarchy(reg, upper_va);
    }
+   pthread_rwlock_wrlock(&machine.vm_mem_regs_rwlock);
    reg->memory_size = 0;
-   if (ioctl(machine.mach_fd, KVM_SET_USER_MEMORY_REGION, reg) < 0) {
-      km_err(1, "KVM: failed to unplug memory region %d", idx);
+   if (km_mem_single_slot != 0) {
+      // stays in the memslot, drop the pages and protection
+      if (km_single_slot_map(reg->guest_phys_addr, size, MAP_FIXED) == MAP_FAILED) {
+         km_err(1, "KVM: failed to free memory region %d", idx);
+      }
+   } else {
+      if (ioctl(machine.mach_fd, KVM_SET_USER_MEMORY_REGION, reg) < 0) {
+         km_err(1, "KVM: failed to unplug memory region %d", idx);
+      }
+      km_guest_page_free(reg->guest_phys_addr, size);
    }
-   km_guest_page_free(reg->guest_phys_addr, size);
+   __atomic_add_fetch(&km_mem_stats.unplugged, size, __ATOMIC_RELAXED);
    reg->userspace_addr = 0;
    reg->guest_phys_addr = 0;
+   pthread_rwlock_unlock(&machine.vm_mem_regs_rwlock);
 }
 
 static inline int km_region_allocated(int idx)
@@ -802,6 +1351,30 @@ static inline int km_region_allocated(int idx)
    return (reg->userspace_addr != 0);
 }
 
+/*
+ * Drop brk memory [gva, top) so it reads as zeroes when brk grows back. hugetlb pages can only be
+ * dropped whole, so the partial one is cleared, and if the kernel can't MADV_DONTNEED hugetlb
+ * (before 5.18) all of it is. top is in the region gva is in.
+ */
+static void km_mem_brk_release(km_gva_t gva, km_gva_t top)
+{
+   if (top <= gva) {
+      return;
+   }
+   int idx = gva_to_memreg_idx(gva);
+   size_t pagesize = km_hugetlb_pagesize(idx, memreg_size(idx), 0);
+
+   if (pagesize == 0) {
+      km_mem_release(gva, top - gva, MADV_DONTNEED);
+      return;
+   }
+   km_gva_t huge = MIN(roundup(gva, pagesize), top);
+   memset(km_gva_to_kma_nocheck(gva), 0, huge - gva);
+   if (top > huge && madvise(km_gva_to_kma_nocheck(huge), top - huge, MADV_DONTNEED) != 0) {
+      memset(km_gva_to_kma_nocheck(huge), 0, top - huge);
+   }
+}
+
 /*
  * brk() call implementation.
  *
@@ -856,9 +1429,16 @@ km_gva_t km_mem_brk(km_gva_t brk)
    km_gva_t oldpage = roundup(machine.brk, KM_PAGE_SIZE);
    km_gva_t newpage = roundup(brk, KM_PAGE_SIZE);
    if (oldpage < newpage) {
-      mprotect(km_gva_to_kma_nocheck(oldpage), newpage - oldpage, PROT_READ | PROT_WRITE);
+      km_mem_protect(oldpage, newpage - oldpage, PROT_READ | PROT_WRITE);
+      if (km_pt_mprotect != 0) {
+         // the guest page tables map all of the large page brk is in, keep the guest under brk
+         km_gva_t tail = roundup(newpage, newpage < GIB ? PDE_REGION : PDPTE_REGION);
+         km_mem_protect(newpage, tail - newpage, PROT_NONE);
+      }
    } else if (newpage < oldpage) {
-      mprotect(km_gva_to_kma_nocheck(newpage), oldpage - newpage, PROT_NONE);
+      km_mem_protect(newpage, oldpage - newpage, PROT_NONE);
+      // zeroes when brk grows back. Regions above the new brk are gone already
+      km_mem_brk_release(newpage, MIN(oldpage, memreg_top(gva_to_memreg_idx(brk - 1))));
    }
    machine.brk = brk;
    km_mem_unlock();
@@ -51,21 +51,32 @@ static inline uint64_t RSV_GUEST_PA(uint64_t x)
 static const int KM_RSRV_MEMSLOT = 0;
 static const int KM_RSRV_VDSOSLOT = 41;
 static const int KM_RSRV_KMGUESTMEM_SLOT = 42;
+static const int KM_RSRV_PTSLOT = 43;
+static const int KM_RSRV_SINGLESLOT = 44;
 
 static const km_gva_t GUEST_MEM_START_VA = 2 * MIB;
-static const km_gva_t GUEST_PRIVATE_MEM_START_VA = 512 * GIB;
+/*
+ * Guest VA and PA span of the memory zones (see below), a multiple of the 512GB one PML4 entry
+ * covers. Guest private memory, vdso and km guest code, is right above it in VA, and in the last
+ * 2MB of it in PA, which is never a memory region.
+ */
+#define GUEST_MEM_SPAN (MAX(512 * GIB, machine.guest_max_physmem))
+#define GUEST_PRIVATE_MEM_START_VA GUEST_MEM_SPAN
 // ceiling for guest virt. address. 2MB shift down to make it aligned on GB with physical address
 #ifdef KM_HIGH_GVA
 static const km_gva_t GUEST_MEM_TOP_VA = 128 * 1024 * GIB - GUEST_MEM_START_VA;
 #else
-static const km_gva_t GUEST_MEM_TOP_VA = (512 * GIB - GUEST_MEM_START_VA);
+#define GUEST_MEM_TOP_VA (GUEST_MEM_SPAN - GUEST_MEM_START_VA)
 #endif
 
-static const km_gva_t GUEST_VVAR_VDSO_BASE_VA = GUEST_PRIVATE_MEM_START_VA;
-static const km_gpa_t GUEST_VVAR_VDSO_BASE_GPA = 0x7ffff00000;
+#define GUEST_VVAR_VDSO_BASE_VA GUEST_PRIVATE_MEM_START_VA
+#define GUEST_VVAR_VDSO_BASE_GPA (GUEST_MEM_SPAN - MIB)   // 0x7ffff00000 with 512GB
+
+#define GUEST_KMGUESTMEM_BASE_VA (GUEST_PRIVATE_MEM_START_VA + 32 * KIB)
+#define GUEST_KMGUESTMEM_BASE_GPA (GUEST_VVAR_VDSO_BASE_GPA + 32 * KIB)
 
-static const km_gva_t GUEST_KMGUESTMEM_BASE_VA = GUEST_PRIVATE_MEM_START_VA + (32 * KIB);
-static const km_gpa_t GUEST_KMGUESTMEM_BASE_GPA = 0x7ffff08000;
+// Page table pages for --pt-mprotect, in the free MB of the last 2MB of physical memory
+#define GUEST_PT_POOL_GPA (GUEST_MEM_SPAN - 2 * MIB)
 
 /*
  * There are 2 "zones" of VAs, one on the bottom and one on the top. The bottom has pva == gva, the
@@ -75,8 +86,13 @@ static const km_gpa_t GUEST_KMGUESTMEM_BASE_GPA = 0x7ffff08000;
 
 #define GUEST_VA_OFFSET (GUEST_MEM_TOP_VA + GUEST_MEM_START_VA - GUEST_MEM_ZONE_SIZE_VA)
 
-// We currently only have code with 1 PML4 entry per "zone", so we can't support more than that
-static const uint64_t GUEST_MAX_PHYSMEM_SUPPORTED = 512 * GIB;
+/*
+ * A zone takes up to GUEST_MAX_PML4ES PML4 entries. Above 512GB only with --membus-width, default
+ * layout is the same on all hosts. Memory regions for 4TB are 1 to 40, below the special slots.
+ */
+#define GUEST_MAX_PML4ES 8
+static const uint64_t GUEST_MAX_PHYSMEM_DEFAULT = 512 * GIB;
+static const uint64_t GUEST_MAX_PHYSMEM_SUPPORTED = GUEST_MAX_PML4ES * 512 * GIB;
 
 /*
  * See "Virtual memory layout:" in km_cpu_init.c for details.
@@ -118,8 +134,8 @@ static const uint64_t GUEST_ARG_MAX = 32 * KM_PAGE_SIZE;
  * // clang-format on
  *
  * idx is number of the region, we compute it based on number of leading zeroes
- * in a given address (clz) or in "512GB - address" (clz(end)), using clzl instruction. 'base' is
- * address of the first byte in it. Note size equals base in the first half of the space
+ * in a given address (clz) or in "max_physmem - address" (clz(end)), using clzl instruction. 'base'
+ * is address of the first byte in it. Note size equals base in the first half of the space
  *
  * Memory regions that become guest physical memory are allocated using mmap() with specified
  * address, so that contiguous guest physical memory becomes contiguous in KM space as well.
@@ -283,8 +299,74 @@ static inline int protection_adjust(int prot)
    return prot;
 }
 
+// Memory under brk is hugetlb pages, host doesn't enforce guest protection there. See km_mem.c
+static inline int km_brk_hugetlb(void)
+{
+   return machine.hugepages == KM_HUGEPAGES_2M || machine.hugepages == KM_HUGEPAGES_1G;
+}
+
+// Guest memory at 'gva' is under brk with hugetlb, it can be read or written but not mapped over
+static inline int km_mem_hugetlb(km_gva_t gva)
+{
+   return km_brk_hugetlb() != 0 && gva < machine.brk;
+}
+
 void km_mem_init(km_machine_init_params_t* params);
 void km_mem_fini(void);
+void km_mem_prefault(const char* why);
+extern int km_pt_mprotect;
+int km_mem_protect(km_gva_t gva, size_t size, int prot);
+int km_mem_host_prot(int prot);
+void* km_mem_map(km_gva_t gva, size_t size, int prot, int flags, int fd, off_t offset);
+int km_mem_pt_fault_stale(km_gva_t gva, uint64_t error);
+int km_mem_is_zero(const void* buf, size_t size);
+extern int km_mem_single_slot;
+
+/*
+ * Returns true if machine.vm_mem_regs[idx] is plugged into KVM. With --single-memslot memory
+ * regions are bookkeeping only, KM_RSRV_SINGLESLOT has all of them.
+ */
+static inline int km_memslot_plugged(int idx)
+{
+   return machine.vm_mem_regs[idx].memory_size != 0 &&
+          (km_mem_single_slot == 0 || idx == KM_RSRV_MEMSLOT || idx >= KM_RSRV_VDSOSLOT);
+}
+
+// Guest memory given back to the host, in bytes. See km_reclaim.c
+typedef struct km_mem_stats {
+   uint64_t released;    // freed by the guest and madvise()d
+   uint64_t reclaimed;   // free mmaps MADV_DONTNEED'ed by the reclaimer
+   uint64_t reclaims;    // reclaimer runs
+   uint64_t unplugged;   // memory regions removed
+} km_mem_stats_t;
+extern km_mem_stats_t km_mem_stats;
+
+// NUMA placement of guest memory and vcpu threads, see km_numa.c
+typedef enum {
+   KM_NUMA_NONE,
+   KM_NUMA_INTERLEAVE,   // --numa=interleave
+   KM_NUMA_LOCAL,        // --numa=local
+   KM_NUMA_NODE,         // --numa=node:N
+} km_numa_policy_t;
+
+typedef enum {
+   KM_VCPU_PIN_DEFAULT,   // 'node' with --numa=local or node:N, 'none' otherwise
+   KM_VCPU_PIN_NONE,
+   KM_VCPU_PIN_NODE,
+   KM_VCPU_PIN_CPU,
+} km_vcpu_pin_t;
+
+int km_numa_parse(const char* arg);
+int km_vcpu_pin_parse(const char* arg);
+void km_numa_init(void);
+void km_numa_bind(void* addr, size_t size, int idx);
+void km_numa_vcpu_affinity(km_vcpu_t* vcpu, pthread_attr_t* att);
+
+void km_mem_release(km_gva_t gva, size_t size, int advice);
+void km_mem_reclaim_init(void);
+void km_mem_reclaim_fini(void);
+void km_mem_stats_send(int fd);
+size_t km_mmap_reclaim(void);
 void km_guest_page_free(km_gva_t addr, size_t size);
 void km_guest_mmap_init(void);
 void km_guest_mmap_fini(void);
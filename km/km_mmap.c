@@ -35,20 +35,71 @@
 
 typedef enum { MMAP_ALLOC_GUEST = 0x0, MMAP_ALLOC_MONITOR } mmap_allocation_type_e;
 
+// Writers lock. Odd seq tells lockless readers the regions are changing, see km_mmap_read()
 static inline void mmaps_lock(void)
 {
    km_mutex_lock(&machine.mmaps.mutex);
+   __atomic_store_n(&machine.mmaps.seq, machine.mmaps.seq + 1, __ATOMIC_RELAXED);
+   __atomic_thread_fence(__ATOMIC_RELEASE);
 }
 
 static inline void mmaps_unlock(void)
 {
+   __atomic_store_n(&machine.mmaps.seq, machine.mmaps.seq + 1, __ATOMIC_RELEASE);
    km_mutex_unlock(&machine.mmaps.mutex);
 }
 
+/*
+ * Region descriptors are carved from slabs of KM_MMAP_SLAB_REGS and recycled via
+ * machine.mmaps.pool_free, so mmap heavy payloads don't malloc/free for each region. Slabs are
+ * released in km_guest_mmap_fini(). Protected by mmaps mutex, like the lists.
+ */
+#define KM_MMAP_SLAB_REGS 256
+
+typedef struct km_mmap_slab {
+   struct km_mmap_slab* next;
+   km_mmap_reg_t regs[KM_MMAP_SLAB_REGS];
+} km_mmap_slab_t;
+
+// Returns zeroed region descriptor, or NULL
+static km_mmap_reg_t* km_mmap_reg_alloc(void)
+{
+   km_mmap_reg_t* reg;
+
+   if (machine.mmaps.pool_free == NULL) {
+      km_mmap_slab_t* slab;
+
+      if ((slab = malloc(sizeof(km_mmap_slab_t))) == NULL) {
+         return NULL;
+      }
+      slab->next = machine.mmaps.pool;
+      machine.mmaps.pool = slab;
+      for (int i = 0; i < KM_MMAP_SLAB_REGS; i++) {
+         slab->regs[i].parent = machine.mmaps.pool_free;   // pool_free is linked via 'parent'
+         machine.mmaps.pool_free = &slab->regs[i];
+      }
+   }
+   reg = machine.mmaps.pool_free;
+   machine.mmaps.pool_free = reg->parent;
+   memset(reg, 0, sizeof(km_mmap_reg_t));
+   return reg;
+}
+
+// Returns region descriptor (and its filename) to the pool
+static void km_mmap_reg_free(km_mmap_reg_t* reg)
+{
+   if (reg->filename != NULL) {
+      free(reg->filename);
+   }
+   reg->parent = machine.mmaps.pool_free;
+   machine.mmaps.pool_free = reg;
+}
+
 void km_guest_mmap_init(void)
 {
    TAILQ_INIT(&machine.mmaps.free);
    TAILQ_INIT(&machine.mmaps.busy);
+   machine.mmaps.free_root = machine.mmaps.busy_root = NULL;
 }
 
 static void km_clean_list(km_mmap_list_t* list)
@@ -60,14 +111,194 @@ static void km_clean_list(km_mmap_list_t* list)
       if (reg->filename != NULL) {
          free(reg->filename);
       }
-      free(reg);
    }
 }
 
 void km_guest_mmap_fini(void)
 {
+   km_mmap_slab_t *slab, *next;
+
    km_clean_list(&machine.mmaps.busy);
    km_clean_list(&machine.mmaps.free);
+   machine.mmaps.free_root = machine.mmaps.busy_root = NULL;
+   for (slab = machine.mmaps.pool; slab != NULL; slab = next) {
+      next = slab->next;
+      free(slab);
+   }
+   machine.mmaps.pool = NULL;
+   machine.mmaps.pool_free = NULL;
+}
+
+/*
+ * Each list has an index tree of the same regions, AVL balanced and keyed by start. Regions don't
+ * overlap, so the tree finds the region with an address in O(log n). Each node also keeps the
+ * largest region size in its subtree, which finds the lowest free region fitting a request without
+ * visiting the ones that don't. The lists stay for in order walks and for neighbors.
+ */
+static inline km_mmap_reg_t** km_mmap_root(km_mmap_list_t* list)
+{
+   return list == &machine.mmaps.busy ? &machine.mmaps.busy_root : &machine.mmaps.free_root;
+}
+
+static inline int km_mmap_height(km_mmap_reg_t* reg)
+{
+   return reg == NULL ? 0 : reg->height;
+}
+
+static inline size_t km_mmap_max_size(km_mmap_reg_t* reg)
+{
+   return reg == NULL ? 0 : reg->max_size;
+}
+
+// Recalculates height and max_size of 'reg' from its children
+static inline void km_mmap_node_update(km_mmap_reg_t* reg)
+{
+   reg->height = MAX(km_mmap_height(reg->left), km_mmap_height(reg->right)) + 1;
+   reg->max_size = MAX(reg->size, MAX(km_mmap_max_size(reg->left), km_mmap_max_size(reg->right)));
+}
+
+// Puts 'new' (can be NULL) in place of 'old' under old's parent
+static inline void
+km_mmap_replace_child(km_mmap_reg_t** root, km_mmap_reg_t* old, km_mmap_reg_t* new)
+{
+   km_mmap_reg_t* parent = old->parent;
+
+   if (parent == NULL) {
+      *root = new;
+   } else if (parent->left == old) {
+      parent->left = new;
+   } else {
+      parent->right = new;
+   }
+   if (new != NULL) {
+      new->parent = parent;
+   }
+}
+
+// Rotates subtree 'reg' left, returns the new subtree root
+static km_mmap_reg_t* km_mmap_rotate_left(km_mmap_reg_t** root, km_mmap_reg_t* reg)
+{
+   km_mmap_reg_t* top = reg->right;
+
+   km_mmap_replace_child(root, reg, top);
+   if ((reg->right = top->left) != NULL) {
+      reg->right->parent = reg;
+   }
+   top->left = reg;
+   reg->parent = top;
+   km_mmap_node_update(reg);
+   km_mmap_node_update(top);
+   return top;
+}
+
+// Rotates subtree 'reg' right, returns the new subtree root
+static km_mmap_reg_t* km_mmap_rotate_right(km_mmap_reg_t** root, km_mmap_reg_t* reg)
+{
+   km_mmap_reg_t* top = reg->left;
+
+   km_mmap_replace_child(root, reg, top);
+   if ((reg->left = top->right) != NULL) {
+      reg->left->parent = reg;
+   }
+   top->right = reg;
+   reg->parent = top;
+   km_mmap_node_update(reg);
+   km_mmap_node_update(top);
+   return top;
+}
+
+// Restores balance, height and max_size from 'reg' up to the root
+static void km_mmap_rebalance(km_mmap_reg_t** root, km_mmap_reg_t* reg)
+{
+   while (reg != NULL) {
+      km_mmap_node_update(reg);
+      int balance = km_mmap_height(reg->left) - km_mmap_height(reg->right);
+      if (balance > 1) {
+         if (km_mmap_height(reg->left->left) < km_mmap_height(reg->left->right)) {
+            km_mmap_rotate_left(root, reg->left);
+         }
+         reg = km_mmap_rotate_right(root, reg);
+      } else if (balance < -1) {
+         if (km_mmap_height(reg->right->right) < km_mmap_height(reg->right->left)) {
+            km_mmap_rotate_right(root, reg->right);
+         }
+         reg = km_mmap_rotate_left(root, reg);
+      }
+      reg = reg->parent;
+   }
+}
+
+static void km_mmap_tree_insert(km_mmap_reg_t** root, km_mmap_reg_t* reg)
+{
+   km_mmap_reg_t** link = root;
+   km_mmap_reg_t* parent = NULL;
+
+   while (*link != NULL) {
+      parent = *link;
+      link = reg->start < parent->start ? &parent->left : &parent->right;
+   }
+   reg->parent = parent;
+   reg->left = reg->right = NULL;
+   *link = reg;
+   km_mmap_rebalance(root, reg);
+}
+
+static void km_mmap_tree_remove(km_mmap_reg_t** root, km_mmap_reg_t* reg)
+{
+   km_mmap_reg_t* from;   // lowest node with changed subtree
+
+   if (reg->left != NULL && reg->right != NULL) {   // replace reg with its successor
+      km_mmap_reg_t* succ = reg->right;
+
+      while (succ->left != NULL) {
+         succ = succ->left;
+      }
+      if (succ->parent == reg) {
+         from = succ;
+      } else {
+         from = succ->parent;
+         km_mmap_replace_child(root, succ, succ->right);
+         succ->right = reg->right;
+         succ->right->parent = succ;
+      }
+      succ->left = reg->left;
+      succ->left->parent = succ;
+      km_mmap_replace_child(root, reg, succ);
+   } else {
+      from = reg->parent;
+      km_mmap_replace_child(root, reg, reg->left != NULL ? reg->left : reg->right);
+   }
+   km_mmap_rebalance(root, from);
+}
+
+// Removes 'reg' from the list and its index
+static inline void km_mmap_remove(km_mmap_reg_t* reg, km_mmap_list_t* list)
+{
+   TAILQ_REMOVE(list, reg, link);
+   km_mmap_tree_remove(km_mmap_root(list), reg);
+}
+
+// To be called after 'reg' start or size changed in place, without changing the order
+static inline void km_mmap_resized(km_mmap_reg_t* reg, km_mmap_list_t* list)
+{
+   km_mmap_rebalance(km_mmap_root(list), reg);
+}
+
+// First region in a list that ends above the address, or NULL
+static km_mmap_reg_t* km_mmap_find_first(km_mmap_list_t* list, km_gva_t address)
+{
+   km_mmap_reg_t* reg = *km_mmap_root(list);
+   km_mmap_reg_t* found = NULL;
+
+   while (reg != NULL) {
+      if (reg->start + reg->size > address) {
+         found = reg;
+         reg = reg->left;
+      } else {
+         reg = reg->right;
+      }
+   }
+   return found;
 }
 
 // on ubuntu and older kernels, this is not defined. We need symbol to check (and reject) flags
@@ -103,32 +334,38 @@ static inline int mumap_check_params(km_gva_t addr, size_t size)
    return 0;
 }
 
-// find any free mmap larger or equal to 'size'
+// find the lowest free mmap larger or equal to 'size'
 static km_mmap_reg_t* km_mmap_find_free(size_t size)
 {
-   km_mmap_reg_t* ptr;
+   km_mmap_reg_t* ptr = machine.mmaps.free_root;
 
-   TAILQ_FOREACH (ptr, &machine.mmaps.free, link) {
-      if (ptr->size >= size) {
+   if (km_mmap_max_size(ptr) < size) {
+      return NULL;
+   }
+   while (1) {   // there is a fit in ptr subtree
+      if (km_mmap_max_size(ptr->left) >= size) {
+         ptr = ptr->left;
+      } else if (ptr->size >= size) {
          return ptr;
+      } else {
+         ptr = ptr->right;
       }
    }
-   return NULL;
 }
 
 // find an mmap in a list which includes the address. Returns NULL if not found
 static km_mmap_reg_t* km_mmap_find_address(km_mmap_list_t* list, km_gva_t address)
 {
-   km_mmap_reg_t* ptr;
+   km_mmap_reg_t* ptr = *km_mmap_root(list);
 
-   TAILQ_FOREACH (ptr, list, link) {
-      if (ptr->start + ptr->size <= address) {
-         continue;   // still on the left of address
-      }
-      if (ptr->start > address) {
-         return NULL;   // passed address already
+   while (ptr != NULL) {
+      if (address < ptr->start) {
+         ptr = ptr->left;
+      } else if (address >= ptr->start + ptr->size) {
+         ptr = ptr->right;
+      } else {
+         return ptr;
       }
-      return ptr;
    }
    return NULL;
 }
@@ -165,20 +402,15 @@ static inline void km_mmap_concat(km_mmap_reg_t* reg, km_mmap_list_t* list)
    if (left != NULL && ok_to_concat(left, reg) == 1) {
       reg->start = left->start;
       reg->size += left->size;
-      TAILQ_REMOVE(list, left, link);
-      if (left->filename != NULL) {
-         free(left->filename);
-      }
-      free(left);
+      km_mmap_remove(left, list);
+      km_mmap_reg_free(left);
    }
    if (right != NULL && ok_to_concat(reg, right) == 1) {
       reg->size += right->size;
-      TAILQ_REMOVE(list, right, link);
-      if (right->filename != NULL) {
-         free(right->filename);
-      }
-      free(right);
+      km_mmap_remove(right, list);
+      km_mmap_reg_free(right);
    }
+   km_mmap_resized(reg, list);
 }
 
 static void km_reg_make_clean(km_mmap_reg_t* reg)
@@ -194,7 +426,7 @@ static void km_reg_make_clean(km_mmap_reg_t* reg)
 static void km_mmap_mprotect_region(km_mmap_reg_t* reg)
 {
    if (reg->km_flags.km_mmap_part_of_monitor == 0 &&
-       mprotect(km_gva_to_kma_nocheck(reg->start), reg->size, protection_adjust(reg->protection)) != 0) {
+       km_mem_protect(reg->start, reg->size, reg->protection) != 0) {
       km_warn("Failed to mprotect addr 0x%lx sz 0x%lx prot 0x%x)", reg->start, reg->size, reg->protection);
    }
    km_reg_make_clean(reg);
@@ -212,30 +444,20 @@ static inline void km_mmap_mprotect(km_mmap_reg_t* reg, km_mmap_reg_t* mreg)
  */
 static inline void km_mmap_insert(km_mmap_reg_t* reg, km_mmap_list_t* list)
 {
-   km_mmap_reg_t* ptr;
+   km_mmap_reg_t* ptr = km_mmap_find_first(list, reg->start);   // the map to the right of the 'reg'
 
-   if (TAILQ_EMPTY(list)) {
-      TAILQ_INSERT_HEAD(list, reg, link);
+   if (ptr == TAILQ_END(list)) {
+      TAILQ_INSERT_TAIL(list, reg, link);
    } else {
-      TAILQ_FOREACH (ptr, list, link) {   // find the map to the right of the 'reg'
-         if (ptr->start > reg->start) {
-            km_assert(ptr->start >= reg->start + reg->size);
-            break;
-         }
-         // double check that there are no overlaps (we don't support overlapping mmaps)
-         km_assert(ptr->start < reg->start && (ptr->start + ptr->size <= reg->start));
-      }
-
-      if (ptr == TAILQ_END(list)) {
-         TAILQ_INSERT_TAIL(list, reg, link);
-      } else {
-         TAILQ_INSERT_BEFORE(ptr, reg, link);
-      }
+      // double check that there are no overlaps (we don't support overlapping mmaps)
+      km_assert(ptr->start >= reg->start + reg->size);
+      TAILQ_INSERT_BEFORE(ptr, reg, link);
    }
+   km_mmap_tree_insert(km_mmap_root(list), reg);
    km_mmap_mprotect_region(reg);
 }
 
-// Insert a region into busy mmaps with proper protection. Expects 'reg' to be malloced
+// Insert a region into busy mmaps with proper protection. Expects 'reg' from km_mmap_reg_alloc()
 static inline void km_mmap_insert_busy(km_mmap_reg_t* reg)
 {
    km_mmap_list_t* list = &machine.mmaps.busy;
@@ -247,6 +469,7 @@ static inline void km_mmap_insert_busy(km_mmap_reg_t* reg)
 static inline void km_mmap_insert_busy_after(km_mmap_reg_t* listelem, km_mmap_reg_t* reg)
 {
    TAILQ_INSERT_AFTER(&machine.mmaps.busy, listelem, reg, link);
+   km_mmap_tree_insert(&machine.mmaps.busy_root, reg);
 }
 
 // Inserts 'reg' before 'listelem' in busy. No list traverse and no neighbor concatenation
@@ -254,9 +477,11 @@ static inline void km_mmap_insert_busy_before(km_mmap_reg_t* listelem, km_mmap_r
 {
    // we don't care which list, but keep function name for consistency
    TAILQ_INSERT_BEFORE(listelem, reg, link);
+   km_mmap_tree_insert(&machine.mmaps.busy_root, reg);
 }
 
-// Insert 'reg' into the FREE MMAPS with PROT_NONE, and compress maps/tbrk. Expects 'reg' to be malloced
+// Insert 'reg' into the FREE MMAPS with PROT_NONE, and compress maps/tbrk.
+// Expects 'reg' from km_mmap_reg_alloc()
 static inline void km_mmap_insert_free(km_mmap_reg_t* reg)
 {
    km_mmap_list_t* list = &machine.mmaps.free;
@@ -271,22 +496,22 @@ static inline void km_mmap_insert_free(km_mmap_reg_t* reg)
    reg->km_flags.km_mmap_clean = 0;
    km_mmap_insert(reg, list);
    km_mmap_concat(reg, list);
-   if (reg->start == km_mem_tbrk(0)) {   // adjust tbrk() if needed
+   // adjust tbrk() if needed, a reclaimed neighbor doesn't concat so it may be at tbrk now too
+   while ((reg = TAILQ_FIRST(list)) != NULL && reg->start == km_mem_tbrk(0)) {
       km_mem_tbrk(reg->start + reg->size);
-      TAILQ_REMOVE(list, reg, link);
-      free(reg);
+      km_mmap_remove(reg, list);
+      km_mmap_reg_free(reg);
    }
 }
 
 static inline void km_mmap_remove_busy(km_mmap_reg_t* reg)
 {
-   TAILQ_REMOVE(&machine.mmaps.busy, reg, link);
+   km_mmap_remove(reg, &machine.mmaps.busy);
 }
 
-// Remove an element from a list. In the list, this does not depend on list head
 static inline void km_mmap_remove_free(km_mmap_reg_t* reg)
 {
-   TAILQ_REMOVE(&machine.mmaps.free, reg, link);
+   km_mmap_remove(reg, &machine.mmaps.free);
 }
 
 // moves existing mmap region from busy to free
@@ -296,7 +521,7 @@ static inline void km_mmap_move_to_free(km_mmap_reg_t* reg, km_mmap_reg_t* mreg)
    if ((reg->flags & MAP_SHARED) != 0 || reg->filename != NULL) {
       km_kma_t start_kma = km_gva_to_kma(reg->start);
       int new_flags = (reg->flags & ~MAP_SHARED) | MAP_PRIVATE | MAP_ANONYMOUS;
-      void* tmp = mmap(start_kma, reg->size, reg->protection, new_flags | MAP_FIXED, -1, 0);
+      void* tmp = km_mem_map(reg->start, reg->size, reg->protection, new_flags, -1, 0);
       if (tmp != start_kma) {
          km_warn("Couldn't convert existing mapping at kma %p (%s) to ANONYMOUS\n",
                  start_kma,
@@ -305,6 +530,7 @@ static inline void km_mmap_move_to_free(km_mmap_reg_t* reg, km_mmap_reg_t* mreg)
          reg->flags = new_flags;
       }
    }
+   km_mem_release(reg->start, reg->size, MADV_FREE);
    km_mmap_insert_free(reg);
 }
 
@@ -345,12 +571,12 @@ static int km_mmap_busy_range_apply(km_mmap_reg_t* mreg, km_mmap_action action)
 
    km_assert(action == km_mmap_mprotect || action == km_mmap_move_to_free ||
              action == km_mmap_region_clean_concat);
-   TAILQ_FOREACH_SAFE (reg, &machine.mmaps.busy, link, next) {
+   // start from the first map not to the left of addr
+   for (reg = km_mmap_find_first(&machine.mmaps.busy, addr);
+        reg != TAILQ_END(&machine.mmaps.busy) && (next = TAILQ_NEXT(reg, link), 1);
+        reg = next) {
       km_mmap_reg_t* extra;
 
-      if (reg->start + reg->size <= addr) {
-         continue;   // skip all to the left of addr
-      }
       if (reg->start >= addr + size) {
          break;   // we passed the range and are done
       }
@@ -364,11 +590,12 @@ static int km_mmap_busy_range_apply(km_mmap_reg_t* mreg, km_mmap_action action)
          continue;
       }
       if (reg->start < addr) {   // overlaps on the start
-         if ((extra = calloc(1, sizeof(km_mmap_reg_t))) == NULL) {
+         if ((extra = km_mmap_reg_alloc()) == NULL) {
             return -ENOMEM;
          }
          *extra = *reg;
          reg->size = addr - reg->start;   // left part, to keep in busy
+         km_mmap_resized(reg, &machine.mmaps.busy);
          extra->start = addr;             // right part, to insert in busy
          extra->size -= reg->size;
          if (reg->filename != NULL) {
@@ -380,11 +607,12 @@ static int km_mmap_busy_range_apply(km_mmap_reg_t* mreg, km_mmap_action action)
          continue;
       }
       if (reg->start + reg->size > addr + size) {   // overlaps on the end
-         if ((extra = calloc(1, sizeof(km_mmap_reg_t))) == NULL) {
+         if ((extra = km_mmap_reg_alloc()) == NULL) {
             return -ENOMEM;
          }
          *extra = *reg;
          reg->size = addr + size - reg->start;   // left part , to insert in busy
+         km_mmap_resized(reg, &machine.mmaps.busy);
          extra->start = addr + size;             // right part, to keep in busy
          extra->size -= reg->size;
          if (reg->filename != NULL) {
@@ -405,32 +633,149 @@ static int km_mmap_busy_range_apply(km_mmap_reg_t* mreg, km_mmap_action action)
    return 0;
 }
 
+/*
+ * Lockless readers of busy regions, for calls that only look (madvise, msync, access checks) so
+ * vcpus don't serialize on mmaps mutex. A reader takes an even seq, walks the tree and the list,
+ * and throws the result away if seq moved meanwhile. Region descriptors aren't freed while km
+ * runs (see the pool above), so a reader racing with a writer can see garbage but not unmapped
+ * memory, and it checks seq at each step so it can't loop in a half rotated tree. When a writer
+ * is in, or after KM_MMAP_READ_TRIES stale walks, the reader takes the mutex (without changing
+ * seq) instead.
+ */
+#define KM_MMAP_READ_TRIES 8
+#define KM_MMAP_LOCKED 1ul   // 'seq' for readers holding the mutex. Odd, so never a snapshot
+
+#define KM_MMAP_READ(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+typedef int (*km_mmap_reader_t)(uint64_t seq, void* arg);
+
+static inline int km_mmap_read_stale(uint64_t seq)
+{
+   if (seq == KM_MMAP_LOCKED) {
+      return 0;
+   }
+   __atomic_thread_fence(__ATOMIC_ACQUIRE);
+   return __atomic_load_n(&machine.mmaps.seq, __ATOMIC_RELAXED) != seq;
+}
+
+// Runs 'reader' and returns its result, which can't be -EAGAIN
+static int km_mmap_read(km_mmap_reader_t reader, void* arg)
+{
+   int rc;
+
+   for (int i = 0; i < KM_MMAP_READ_TRIES; i++) {
+      uint64_t seq = __atomic_load_n(&machine.mmaps.seq, __ATOMIC_ACQUIRE);
+
+      if ((seq & 1) != 0) {
+         break;   // a writer is in, wait for it on the mutex rather than spin
+      }
+      if ((rc = reader(seq, arg)) != -EAGAIN) {
+         return rc;
+      }
+   }
+   km_mutex_lock(&machine.mmaps.mutex);
+   rc = reader(KM_MMAP_LOCKED, arg);
+   km_mutex_unlock(&machine.mmaps.mutex);
+   return rc;
+}
+
+// km_mmap_find_first() on busy for readers. Returns 0 or -EAGAIN
+static int km_mmap_read_first(km_gva_t addr, uint64_t seq, km_mmap_reg_t** found)
+{
+   km_mmap_reg_t* reg = KM_MMAP_READ(machine.mmaps.busy_root);
+
+   *found = NULL;
+   while (reg != NULL) {
+      if (km_mmap_read_stale(seq) != 0) {
+         return -EAGAIN;
+      }
+      if (KM_MMAP_READ(reg->start) + KM_MMAP_READ(reg->size) > addr) {
+         *found = reg;
+         reg = KM_MMAP_READ(reg->left);
+      } else {
+         reg = KM_MMAP_READ(reg->right);
+      }
+   }
+   return 0;
+}
+
+typedef struct km_mmap_range {
+   km_gva_t addr;
+   size_t size;
+   km_mmap_reg_t* reg;   // copy of the region found, for km_mmap_read_region()
+} km_mmap_range_t;
+
 /*
  * Checks if busy mmaps are contiguous from `addr' to `addr+size'.
- * Return 0 if they are, -1 if they are not.
+ * Return 0 if they are, -1 if they are not, -EAGAIN if seq got stale.
  */
-static int km_mmap_busy_check_contiguous(km_gva_t addr, size_t size)
+static int km_mmap_read_contiguous(uint64_t seq, void* arg)
 {
+   km_gva_t addr = ((km_mmap_range_t*)arg)->addr;
+   size_t size = ((km_mmap_range_t*)arg)->size;
    km_mmap_reg_t* reg;
    km_gva_t last_end = 0;
+   int rc;
 
-   TAILQ_FOREACH (reg, &machine.mmaps.busy, link) {
-      if (reg->start + reg->size < addr) {
-         continue;
+   if ((rc = km_mmap_read_first(addr, seq, &reg)) != 0) {
+      return rc;
+   }
+   for (rc = -1; reg != TAILQ_END(&machine.mmaps.busy); reg = KM_MMAP_READ(TAILQ_NEXT(reg, link))) {
+      km_gva_t start = KM_MMAP_READ(reg->start);
+      km_mmap_flags_u km_flags = {.data32 = KM_MMAP_READ(reg->km_flags.data32)};
+
+      if (km_mmap_read_stale(seq) != 0) {
+         return -EAGAIN;
       }
-      if (reg->start >= addr + size) {
-         if (last_end >= addr + size) {
-            return 0;
-         }
-         return -1;   // gap at the end of the range
+      if (start >= addr + size) {
+         break;   // gap at the end of the range unless last_end covers it
       }
-      if ((last_end != 0 && last_end != reg->start) || (last_end == 0 && reg->start > addr) ||
-          (reg->km_flags.km_mmap_monitor == 1) || reg->km_flags.km_mmap_part_of_monitor == 1) {
-         return -1;   // gap in the beginning or before current reg, or stepped on monitor
+      if ((last_end != 0 && last_end != start) || (last_end == 0 && start > addr) ||
+          km_flags.km_mmap_monitor == 1 || km_flags.km_mmap_part_of_monitor == 1) {
+         last_end = 0;   // gap in the beginning or before current reg, or stepped on monitor
+         break;
       }
-      last_end = reg->start + reg->size;
+      last_end = start + KM_MMAP_READ(reg->size);
+   }
+   if (last_end != 0 && last_end >= addr + size) {
+      rc = 0;
+   }
+   return km_mmap_read_stale(seq) != 0 ? -EAGAIN : rc;
+}
+
+// Copies the busy region with addr to *reg. Returns 0, -ENOENT if there is none, or -EAGAIN
+static int km_mmap_read_region(uint64_t seq, void* arg)
+{
+   km_mmap_range_t* range = arg;
+   km_mmap_reg_t* reg;
+   int rc;
+
+   if ((rc = km_mmap_read_first(range->addr, seq, &reg)) != 0) {
+      return rc;
    }
-   return last_end == 0 ? -1 : 0;
+   if (reg == NULL) {
+      rc = -ENOENT;
+   } else {
+      range->reg->start = KM_MMAP_READ(reg->start);
+      range->reg->size = KM_MMAP_READ(reg->size);
+      range->reg->protection = KM_MMAP_READ(reg->protection);
+      rc = range->reg->start <= range->addr ? 0 : -ENOENT;
+   }
+   return km_mmap_read_stale(seq) != 0 ? -EAGAIN : rc;
+}
+
+// Writers check, under mmaps mutex
+static int km_mmap_busy_check_contiguous(km_gva_t addr, size_t size)
+{
+   km_mmap_range_t range = {.addr = addr, .size = size};
+   return km_mmap_read_contiguous(KM_MMAP_LOCKED, &range);
+}
+
+// Lockless check
+static int km_mmap_contiguous(km_gva_t addr, size_t size)
+{
+   km_mmap_range_t range = {.addr = addr, .size = size};
+   return km_mmap_read(km_mmap_read_contiguous, &range);
 }
 
 // Guest mprotect implementation. Params should be already checked and locks taken.
@@ -438,10 +783,7 @@ static int km_guest_mprotect_nolock(km_gva_t addr, size_t size, int prot)
 {
    // mprotect allowed on memory under machine.brk
    if (addr + size <= machine.brk && addr >= GUEST_MEM_START_VA) {
-      if (mprotect(km_gva_to_kma_nocheck(addr), size, protection_adjust(prot)) < 0) {
-         return -errno;
-      }
-      return 0;
+      return km_mem_protect(addr, size, prot);
    }
    // Per mprotect(3) if there are un-mmaped pages in the area, error out with ENOMEM
    if (km_mmap_busy_check_contiguous(addr, size) != 0) {
@@ -455,42 +797,107 @@ static int km_guest_mprotect_nolock(km_gva_t addr, size_t size, int prot)
    return 0;
 }
 
+/*
+ * Drops host pages of the free mmaps, for the reclaimer in km_reclaim.c. Dropped ones stay
+ * km_mmap_clean until reused, so they aren't dropped and counted again. Returns bytes dropped now.
+ */
+size_t km_mmap_reclaim(void)
+{
+   km_mmap_reg_t* reg;
+   size_t bytes = 0;
+
+   mmaps_lock();
+   TAILQ_FOREACH (reg, &machine.mmaps.free, link) {
+      if (reg->km_flags.km_mmap_clean != 0 ||
+          madvise(km_gva_to_kma_nocheck(reg->start), reg->size, MADV_DONTNEED) != 0) {
+         continue;
+      }
+      bytes += reg->size;
+      reg->km_flags.km_mmap_clean = 1;
+      km_mmap_concat(reg, &machine.mmaps.free);   // with neighbors dropped earlier, keeps 'reg'
+   }
+   mmaps_unlock();
+   return bytes;
+}
+
+/*
+ * Calls fn(kma, size, arg) for the parts of guest range [addr, addr + size) in each memory region,
+ * as each region is a separate host mapping. km own pages (vdso, km guest code) are skipped, advice
+ * on them doesn't apply. The regions are pinned, so a racing munmap can't unmap them from under the
+ * host call. Returns 0 or -errno.
+ */
+static int
+km_mmap_host_apply(km_gva_t addr, size_t size, int (*fn)(void* kma, size_t size, int arg), int arg)
+{
+   km_gva_t end = addr + size;
+   int ret = 0;
+
+   km_mem_regions_pin();
+   for (km_gva_t gva = addr, top; gva < end && ret == 0; gva = top) {
+      if (km_vdso_gva(gva) != 0) {
+         top = MIN(end, GUEST_VVAR_VDSO_BASE_VA + km_vvar_vdso_size);
+         continue;
+      }
+      if (km_guestmem_gva(gva) != 0) {
+         top = MIN(end,
+                   GUEST_KMGUESTMEM_BASE_VA +
+                       machine.vm_mem_regs[KM_RSRV_KMGUESTMEM_SLOT].memory_size);
+         continue;
+      }
+      km_gva_t gpa = gva_to_gpa(gva);
+      int idx = gva_to_memreg_idx(gva);
+      kvm_mem_reg_t* reg = &machine.vm_mem_regs[idx];
+      uint64_t base = reg->userspace_addr;
+
+      top = MIN(end, gva - gpa + memreg_top(idx));
+      if (base == 0) {
+         ret = -ENOMEM;   // a racing munmap moved tbrk up and the region is gone
+      } else if (fn((void*)base + (gpa - reg->guest_phys_addr), top - gva, arg) != 0) {
+         ret = -errno;
+      }
+   }
+   km_mem_regions_unpin();
+   return ret;
+}
+
+/*
+ * madvise and msync only check the range is mapped, without mmaps mutex. As on Linux, the result of
+ * a munmap racing with them in another thread is up to the payload, but km memory is safe, see
+ * km_mmap_host_apply().
+ *
+ * Host mappings mirror guest ones (private or shared, anonymous or file), so the kernel gives each
+ * advice Linux semantics, including errors: MADV_FREE wants private anonymous memory, MADV_REMOVE
+ * shared. Snapshots read guest memory as it is, so lazily freed pages go in either as they were or
+ * as zeroes, which is what the payload may see too. A forked child has its own copy of the host
+ * mappings, advice in one doesn't affect the other.
+ */
 static int km_guest_madvise_nolock(km_gva_t addr, size_t size, int advise)
 {
-   km_assert(advise == MADV_DONTNEED || advise == MADV_HUGEPAGE || advise == MADV_WILLNEED);
-   if (km_mmap_busy_check_contiguous(addr, size) != 0) {
+   if (km_mmap_contiguous(addr, size) != 0) {
       km_infox(KM_TRACE_MMAP, "madvise area not fully mapped");
       return -ENOMEM;
    }
-   // TODO: assumes linear virt and phys mem. Do in loop by regs instead
-   if (madvise(km_gva_to_kma_nocheck(addr), size, advise) != 0) {
-      return -errno;
+   int ret = km_mmap_host_apply(addr, size, madvise, advise);
+   if (ret == 0 && (advise == MADV_FREE || advise == MADV_DONTNEED || advise == MADV_REMOVE ||
+                    advise == MADV_PAGEOUT)) {
+      __atomic_add_fetch(&km_mem_stats.released, size, __ATOMIC_RELAXED);
    }
-   return 0;
+   return ret;
 }
+
 static int km_guest_msync_nolock(km_gva_t addr, size_t size, int flag)
 {
-   if (km_mmap_busy_check_contiguous(addr, size) != 0) {
+   if (km_mmap_contiguous(addr, size) != 0) {
       km_infox(KM_TRACE_MMAP, "msync area not fully mapped");
       return -ENOMEM;
    }
-   // TODO: assumes linear virt and phys mem. Do in loop by regs instead
-   if (msync(km_gva_to_kma_nocheck(addr), size, flag) != 0) {
-      return -errno;
-   }
-   return 0;
+   return km_mmap_host_apply(addr, size, msync, flag);
 }
 
 // Returns pointer to a region containing <gva>, or NULL
 static km_mmap_reg_t* km_find_reg_nolock(km_gva_t gva)
 {
-   km_mmap_reg_t* reg;
-   TAILQ_FOREACH (reg, &machine.mmaps.busy, link) {
-      if (reg->start <= gva && reg->start + reg->size > gva) {
-         return reg;
-      }
-   }
-   return NULL;
+   return km_mmap_find_address(&machine.mmaps.busy, gva);
 }
 
 // Guest munmap implementation. Params should be already checked and locks taken. Returns 0 or -errno
@@ -506,7 +913,7 @@ km_mmap_change_region_sharing(km_mmap_reg_t* reg, int existing_flags, int desire
    if ((existing_flags & (MAP_PRIVATE | MAP_SHARED)) != (desired_flags & (MAP_PRIVATE | MAP_SHARED))) {
       // change from private to shared or vice versa
       km_kma_t start_kma = km_gva_to_kma(reg->start);
-      void* tmp = mmap(start_kma, reg->size, reg->protection, MAP_FIXED | desired_flags, hostfd, 0);
+      void* tmp = km_mem_map(reg->start, reg->size, reg->protection, desired_flags, hostfd, 0);
       if (tmp != (void*)start_kma) {
          km_warn("Changing page 0x%lx from 0x%x to 0x%x failed, tmp %p",
                  reg->start,
@@ -537,12 +944,13 @@ km_mmap_add_region(km_gva_t gva, size_t size, int prot, int flags, int hostfd, m
       existing_flags = reg->flags;
       if (reg->size > size) {   // free mmap has extra room to be kept in 'free'
          km_mmap_reg_t* busy;
-         if ((busy = calloc(1, sizeof(km_mmap_reg_t))) == NULL) {
+         if ((busy = km_mmap_reg_alloc()) == NULL) {
             return -ENOMEM;
          }
          *busy = *reg;
          reg->start += size;   // patch the region in 'free' list to keep only extra room
          reg->size -= size;
+         km_mmap_resized(reg, &machine.mmaps.free);
          busy->size = size;
          reg = busy;   // it will be inserted into 'busy' list
       } else {         // the 'free' mmap has exactly the requested size
@@ -551,12 +959,12 @@ km_mmap_add_region(km_gva_t gva, size_t size, int prot, int flags, int hostfd, m
       }
    } else {   // nothing useful in the free list, get fresh memory by moving tbrk down
       existing_flags = MAP_ANON | MAP_PRIVATE;
-      if ((reg = calloc(1, sizeof(km_mmap_reg_t))) == NULL) {
+      if ((reg = km_mmap_reg_alloc()) == NULL) {
          return -ENOMEM;
       }
       km_gva_t want = machine.tbrk - size;
       if ((ret = km_mem_tbrk(want)) != want) {
-         free(reg);
+         km_mmap_reg_free(reg);
          return ret;
       }
       reg->start = ret;   //  place requested mmap region in the newly allocated memory
@@ -617,7 +1025,7 @@ static km_gva_t km_guest_mmap_nolock(
    // By now, a contigious region(s) should already exist, so let's ask system to mmap there
    km_kma_t kma = km_gva_to_kma(gva);
    km_assert(kma != NULL);
-   if (mmap(kma, size, prot, flags | MAP_FIXED, hostfd, offset) != kma) {
+   if (km_mem_map(gva, size, prot, flags, hostfd, offset) != kma) {
       km_warn("System mmap failed. gva 0x%lx kma %p host fd %d off 0x%lx", gva, kma, hostfd, offset);
       return -errno;
    }
@@ -639,6 +1047,10 @@ static km_gva_t km_guest_mmap_nolock(
    km_assert(reg->start == gva && reg->size == size);
    reg->flags = flags & ~MAP_FIXED;   // we don't care it was FIXED once
    reg->protection = prot;
+   // the host mapping has the protection, with --pt-mprotect the guest page tables need it
+   if (km_pt_mprotect != 0 && (ret = km_mem_protect(gva, size, prot)) != 0) {
+      return ret;
+   }
    if (reg->filename != NULL) {   // clean up old name, if there is one
       free(reg->filename);
       reg->filename = NULL;
@@ -737,11 +1149,11 @@ int km_monitor_pages_in_guest(km_gva_t gva, size_t size, int protection, char* t
    char* tagcopy = NULL;
 
    km_infox(KM_TRACE_MMAP, "gva 0x%lx, sizeof %ld, protection 0x%x, tag %s", gva, size, protection, tag);
-   if ((reg = calloc(1, sizeof(km_mmap_reg_t))) == NULL) {
+   if ((reg = km_mmap_reg_alloc()) == NULL) {
       return ENOMEM;
    }
    if (tag != NULL && (tagcopy = strdup(tag)) == NULL) {
-      free(reg);
+      km_mmap_reg_free(reg);
       return ENOMEM;
    }
    reg->start = gva;
@@ -827,16 +1239,22 @@ int km_guest_mprotect(km_gva_t addr, size_t size, int prot)
 int km_guest_madvise(km_gva_t addr, size_t size, int advise)
 {
    km_infox(KM_TRACE_MMAP, "madvise guest(0x%lx 0x%lx advise %x)", addr, size, advise);
-   if (advise != MADV_DONTNEED && advise != MADV_HUGEPAGE && advise != MADV_WILLNEED) {
-      return -EINVAL;
+   switch (advise) {
+      case MADV_DONTNEED:
+      case MADV_HUGEPAGE:
+      case MADV_WILLNEED:
+      case MADV_FREE:
+      case MADV_COLD:
+      case MADV_PAGEOUT:
+      case MADV_REMOVE:
+         break;
+      default:
+         return -EINVAL;
    }
    if (addr != rounddown(addr, KM_PAGE_SIZE) || (size = roundup(size, KM_PAGE_SIZE)) == 0) {
       return -EINVAL;
    }
-   mmaps_lock();
-   int ret = km_guest_madvise_nolock(addr, size, advise);
-   mmaps_unlock();
-   return ret;
+   return km_guest_madvise_nolock(addr, size, advise);
 }
 
 int km_guest_msync(km_gva_t addr, size_t size, int flag)
@@ -845,10 +1263,7 @@ int km_guest_msync(km_gva_t addr, size_t size, int flag)
    if (addr != rounddown(addr, KM_PAGE_SIZE)) {
       return -EINVAL;
    }
-   mmaps_lock();
-   int ret = km_guest_msync_nolock(addr, size, flag);
-   mmaps_unlock();
-   return ret;
+   return km_guest_msync_nolock(addr, size, flag);
 }
 
 // Grows a mmap to size. old_addr is expected to be within ptr map. Returns new address or -errno
@@ -881,10 +1296,11 @@ km_mremap_grow(km_mmap_reg_t* ptr, km_gva_t old_addr, size_t old_size, size_t si
       km_mmap_mprotect_region(ptr);
       if (donor->size == needed) {
          km_mmap_remove_free(donor);
-         free(donor);
+         km_mmap_reg_free(donor);
       } else {
          donor->start += needed;
          donor->size -= needed;
+         km_mmap_resized(donor, &machine.mmaps.free);
       }
       km_mmap_concat(ptr, &machine.mmaps.busy);
       return old_addr;
@@ -1022,28 +1438,23 @@ int km_is_gva_accessable(km_gva_t gva, size_t size, int prot)
    }
 
    // Must be in mmap memory.
-   km_mmap_reg_t* reg = NULL;
-   int ret = 1;
-   mmaps_lock();
-   if ((reg = km_find_reg_nolock(gva)) == NULL) {
-      ret = 0;
-      goto done;
+   km_mmap_reg_t reg;
+   km_mmap_range_t range = {.addr = gva, .reg = &reg};
+   if (km_mmap_read(km_mmap_read_region, &range) != 0) {
+      return 0;
    }
    /*
     * The entire requested range must be described by a single region.
     * This is just laziness. Don't feel like checking against multiple
     * regions until there is a compelling reason.
     */
-   if (gva + size > reg->start + reg->size) {
+   if (gva + size > reg.start + reg.size) {
       km_errx(2, "range spanned mmap region gva:0x%lx size:0x%lx", gva, size);
    }
-   if ((reg->protection & prot) != prot) {
-      ret = 0;
-      goto done;
+   if ((reg.protection & prot) != prot) {
+      return 0;
    }
-done:
-   mmaps_unlock();
-   return ret;
+   return 1;
 }
 
 /*
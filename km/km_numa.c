@@ -0,0 +1,262 @@
+/*
+ * Copyright 2021 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * NUMA placement of guest memory and vcpu threads.
+ *
+ * --numa=interleave|local|node:N sets the memory policy of each guest memory region with mbind()
+ * when the region is allocated, before anything faults it in:
+ *    interleave - MPOL_INTERLEAVE over the nodes km may use (Mems_allowed)
+ *    local      - MPOL_PREFERRED, the node km started on, falls back to others when it is full
+ *    node:N     - MPOL_BIND to node N
+ *
+ * --vcpu-pin=none|node|cpu sets the vcpu thread affinity:
+ *    none - vcpu threads float, new ones inherit the affinity of the thread that made them
+ *    node - any CPU of the --numa node, the default with --numa=local and node:N
+ *    cpu  - vcpu N runs on the Nth CPU of the --numa node, or of km affinity, round robin
+ *
+ * The payload sees host CPUs and nodes, see getcpu_hcall() and sched_*affinity_hcall().
+ * We use the system calls directly, there is no libnuma dependency.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+
+#include "km.h"
+#include "km_mem.h"
+
+km_numa_policy_t km_numa_policy = KM_NUMA_NONE;   // --numa
+km_vcpu_pin_t km_vcpu_pin = KM_VCPU_PIN_DEFAULT;   // --vcpu-pin
+
+static int km_numa_node = -1;    // node:N, or the node km started on for 'local'
+static cpu_set_t km_numa_nodes;   // mbind() node mask. Same bitmap as CPU sets, so we use those
+static cpu_set_t km_numa_cpus;    // CPUs vcpu threads are pinned to
+static int km_numa_ncpus;
+static int km_numa_warned;
+
+// "0-3,8,10-11" into 'set'. Returns the number of entries, -1 if the list is bad
+static int km_numa_parse_list(const char* list, cpu_set_t* set)
+{
+   CPU_ZERO(set);
+   list += strspn(list, " \t");
+   while (*list != 0 && *list != '\n') {
+      char* ep;
+      long lo = strtol(list, &ep, 10);
+      long hi = lo;
+
+      if (ep == list) {
+         return -1;
+      }
+      if (*ep == '-') {
+         list = ep + 1;
+         hi = strtol(list, &ep, 10);
+         if (ep == list) {
+            return -1;
+         }
+      }
+      if (lo < 0 || hi < lo || hi >= CPU_SETSIZE) {
+         return -1;
+      }
+      for (long i = lo; i <= hi; i++) {
+         CPU_SET(i, set);
+      }
+      list = ep + (*ep == ',');
+   }
+   return CPU_COUNT(set);
+}
+
+// Parses the list in file 'path', on the line starting with 'prefix' if it isn't NULL
+static int km_numa_read_list(const char* path, const char* prefix, cpu_set_t* set)
+{
+   char line[4096];
+   FILE* fp;
+   int ret = -1;
+
+   if ((fp = fopen(path, "r")) == NULL) {
+      return -1;
+   }
+   while (fgets(line, sizeof(line), fp) != NULL) {
+      if (prefix == NULL) {
+         ret = km_numa_parse_list(line, set);
+         break;
+      }
+      if (strncmp(line, prefix, strlen(prefix)) == 0) {
+         ret = km_numa_parse_list(line + strlen(prefix), set);
+         break;
+      }
+   }
+   fclose(fp);
+   return ret;
+}
+
+// --numa argument. Returns 0, or -1 if it is bad
+int km_numa_parse(const char* arg)
+{
+   char* ep;
+
+   if (strcmp(arg, "interleave") == 0) {
+      km_numa_policy = KM_NUMA_INTERLEAVE;
+   } else if (strcmp(arg, "local") == 0) {
+      km_numa_policy = KM_NUMA_LOCAL;
+   } else if (strncmp(arg, "node:", 5) == 0) {
+      km_numa_node = strtol(arg + 5, &ep, 10);
+      if (ep == arg + 5 || *ep != '\0' || km_numa_node < 0 || km_numa_node >= CPU_SETSIZE) {
+         return -1;
+      }
+      km_numa_policy = KM_NUMA_NODE;
+   } else {
+      return -1;
+   }
+   return 0;
+}
+
+// --vcpu-pin argument. Returns 0, or -1 if it is bad
+int km_vcpu_pin_parse(const char* arg)
+{
+   if (strcmp(arg, "none") == 0) {
+      km_vcpu_pin = KM_VCPU_PIN_NONE;
+   } else if (strcmp(arg, "node") == 0) {
+      km_vcpu_pin = KM_VCPU_PIN_NODE;
+   } else if (strcmp(arg, "cpu") == 0) {
+      km_vcpu_pin = KM_VCPU_PIN_CPU;
+   } else {
+      return -1;
+   }
+   return 0;
+}
+
+void km_numa_init(void)
+{
+   char path[128];
+   cpu_set_t node_cpus;
+   unsigned int cpu;
+   unsigned int node;
+
+   if (km_numa_policy == KM_NUMA_NONE && km_vcpu_pin == KM_VCPU_PIN_DEFAULT) {
+      return;
+   }
+   if (sched_getaffinity(0, sizeof(km_numa_cpus), &km_numa_cpus) != 0) {
+      km_err(1, "--numa: sched_getaffinity");
+   }
+   if (km_numa_policy != KM_NUMA_NONE &&
+       km_numa_read_list("/proc/self/status", "Mems_allowed_list:", &km_numa_nodes) <= 0) {
+      km_warnx("--numa: no NUMA information, not placing guest memory");
+      km_numa_policy = KM_NUMA_NONE;
+   }
+   if (km_numa_policy == KM_NUMA_LOCAL) {
+      if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) {
+         km_err(1, "--numa=local: getcpu");
+      }
+      km_numa_node = node;
+   }
+   if (km_numa_policy == KM_NUMA_LOCAL || km_numa_policy == KM_NUMA_NODE) {
+      if (CPU_ISSET(km_numa_node, &km_numa_nodes) == 0) {
+         km_errx(1, "--numa: node %d has no memory km may use", km_numa_node);
+      }
+      CPU_ZERO(&km_numa_nodes);
+      CPU_SET(km_numa_node, &km_numa_nodes);
+      snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", km_numa_node);
+      if (km_numa_read_list(path, NULL, &node_cpus) > 0) {
+         CPU_AND(&node_cpus, &node_cpus, &km_numa_cpus);
+      }
+      if (CPU_COUNT(&node_cpus) > 0) {
+         km_numa_cpus = node_cpus;
+      } else {
+         km_warnx("--numa: node %d has no CPUs km may use, vcpus run anywhere", km_numa_node);
+      }
+      if (km_vcpu_pin == KM_VCPU_PIN_DEFAULT) {
+         km_vcpu_pin = KM_VCPU_PIN_NODE;
+      }
+   }
+   km_numa_ncpus = CPU_COUNT(&km_numa_cpus);
+   km_infox(KM_TRACE_MEM,
+            "numa: policy %d node %d, %d nodes, vcpu pin %d over %d CPUs",
+            km_numa_policy,
+            km_numa_node,
+            CPU_COUNT(&km_numa_nodes),
+            km_vcpu_pin,
+            km_numa_ncpus);
+}
+
+/*
+ * Sets --numa policy on guest memory region 'idx' mapped at 'addr'. Pages already faulted in stay
+ * where they are, so this has to be done before the region is used.
+ */
+void km_numa_bind(void* addr, size_t size, int idx)
+{
+   int mode;
+
+   switch (km_numa_policy) {
+      case KM_NUMA_INTERLEAVE:
+         mode = MPOL_INTERLEAVE;
+         break;
+      case KM_NUMA_LOCAL:
+         mode = MPOL_PREFERRED;
+         break;
+      case KM_NUMA_NODE:
+         mode = MPOL_BIND;
+         break;
+      default:
+         return;
+   }
+   // maxnode is one more than the number of bits, see 'man 2 mbind'
+   if (syscall(SYS_mbind, addr, size, mode, &km_numa_nodes, CPU_SETSIZE + 1, 0) != 0 &&
+       km_numa_warned++ == 0) {
+      km_warn("--numa: mbind guest memory region %d", idx);
+   }
+}
+
+/*
+ * Sets affinity of the thread for 'vcpu' per --vcpu-pin. With 'att' it is for a new thread,
+ * otherwise vcpu->vcpu_thread is reused for a new guest thread, which gets the affinity of the
+ * calling thread unless vcpus are pinned, like clone() does.
+ */
+void km_numa_vcpu_affinity(km_vcpu_t* vcpu, pthread_attr_t* att)
+{
+   cpu_set_t cpus;
+
+   switch (km_vcpu_pin) {
+      case KM_VCPU_PIN_NODE:
+         cpus = km_numa_cpus;
+         break;
+      case KM_VCPU_PIN_CPU:
+         CPU_ZERO(&cpus);
+         for (int cpu = 0, n = vcpu->vcpu_id % km_numa_ncpus; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &km_numa_cpus) != 0 && n-- == 0) {
+               CPU_SET(cpu, &cpus);
+               break;
+            }
+         }
+         break;
+      default:
+         if (att != NULL || sched_getaffinity(0, sizeof(cpus), &cpus) != 0) {
+            return;   // new threads inherit it
+         }
+         break;
+   }
+   int rc = att != NULL ? pthread_attr_setaffinity_np(att, sizeof(cpus), &cpus)
+                        : pthread_setaffinity_np(vcpu->vcpu_thread, sizeof(cpus), &cpus);
+   if (rc != 0) {
+      km_warnx("failed to set vcpu %d CPU affinity: %s", vcpu->vcpu_id, strerror(rc));
+   }
+}
@@ -0,0 +1,185 @@
+/*
+ * Copyright 2021 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Pre-faulting of guest memory (--prefault or KM_PREFAULT), before the payload starts or resumes
+ * from a snapshot, so the first requests don't pay for host page faults.
+ *
+ * Guest memory in use, i.e. under brk and in mmaps, is cut into chunks that a few threads populate
+ * with madvise(MADV_POPULATE_WRITE), or MADV_POPULATE_READ where the guest can't write. The
+ * threads inherit km CPU affinity and pages are allocated on first touch, so running km on a node
+ * (numactl, taskset) gets guest memory local to it. --numa policy, if any, is set before this.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "km.h"
+#include "km_mem.h"
+
+#define KM_PREFAULT_CHUNK (32 * MIB)
+#define KM_PREFAULT_MAX_THREADS 16
+
+typedef struct km_prefault_chunk {
+   km_kma_t kma;
+   size_t size;
+   int advice;
+} km_prefault_chunk_t;
+
+typedef struct km_prefault {
+   km_prefault_chunk_t* chunks;
+   int count;
+   int max;
+   int next;   // next chunk to take, atomic
+} km_prefault_t;
+
+int km_prefault = 0;   // --prefault
+
+static int km_prefault_add(km_prefault_t* pf, km_gva_t gva, size_t size, int advice)
+{
+   for (size_t off = 0; off < size; off += KM_PREFAULT_CHUNK) {
+      if (pf->count == pf->max) {
+         int max = pf->max == 0 ? 64 : pf->max * 2;
+         km_prefault_chunk_t* c;
+
+         if ((c = realloc(pf->chunks, max * sizeof(km_prefault_chunk_t))) == NULL) {
+            return -ENOMEM;
+         }
+         pf->chunks = c;
+         pf->max = max;
+      }
+      pf->chunks[pf->count++] = (km_prefault_chunk_t){.kma = km_gva_to_kma_nocheck(gva + off),
+                                                      .size = MIN(KM_PREFAULT_CHUNK, size - off),
+                                                      .advice = advice};
+   }
+   return 0;
+}
+
+// Part of the range isn't writable (e.g. text under brk), or not accessible, do what we can
+static void km_prefault_slow(km_prefault_chunk_t* c)
+{
+   for (size_t off = 0; off < c->size; off += 2 * MIB) {
+      size_t size = MIN(2 * MIB, c->size - off);
+
+      if (c->advice == MADV_POPULATE_READ || madvise(c->kma + off, size, MADV_POPULATE_WRITE) != 0) {
+         (void)madvise(c->kma + off, size, MADV_POPULATE_READ);
+      }
+   }
+}
+
+static void* km_prefault_thread(void* arg)
+{
+   km_prefault_t* pf = arg;
+   int i;
+
+   while ((i = __atomic_fetch_add(&pf->next, 1, __ATOMIC_RELAXED)) < pf->count) {
+      km_prefault_chunk_t* c = &pf->chunks[i];
+
+      if (madvise(c->kma, c->size, c->advice) != 0) {
+         km_prefault_slow(c);
+      }
+   }
+   return NULL;
+}
+
+// MADV_POPULATE_* are Linux 5.14 and later
+static int km_prefault_supported(void)
+{
+   void* m = mmap(NULL, KM_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   int ret;
+
+   if (m == MAP_FAILED) {
+      return 0;
+   }
+   ret = madvise(m, KM_PAGE_SIZE, MADV_POPULATE_WRITE) == 0;
+   munmap(m, KM_PAGE_SIZE);
+   return ret;
+}
+
+/*
+ * Populates the guest memory in use. Vcpus must not be running. 'why' goes to the report.
+ */
+void km_mem_prefault(const char* why)
+{
+   km_prefault_t pf = {};
+   struct timespec start, end;
+   pthread_t threads[KM_PREFAULT_MAX_THREADS];
+   cpu_set_t cpus;
+   size_t total = 0;
+   int nthreads;
+
+   if (km_prefault == 0) {
+      return;
+   }
+   if (km_prefault_supported() == 0) {
+      km_warnx("prefault %s: MADV_POPULATE_WRITE isn't supported, needs Linux 5.14 or later", why);
+      return;
+   }
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   size_t brk_size = machine.brk - GUEST_MEM_START_VA;
+   if (km_prefault_add(&pf, GUEST_MEM_START_VA, brk_size, MADV_POPULATE_WRITE) != 0) {
+      goto nomem;
+   }
+   km_mmap_reg_t* reg;
+   TAILQ_FOREACH (reg, &machine.mmaps.busy, link) {
+      if (reg->protection == PROT_NONE || reg->km_flags.km_mmap_part_of_monitor == 1) {
+         continue;
+      }
+      // Writing to shared or file pages would dirty them
+      int advice = ((reg->protection & PROT_WRITE) != 0 && reg->filename == NULL &&
+                    (reg->flags & MAP_SHARED) == 0)
+                       ? MADV_POPULATE_WRITE
+                       : MADV_POPULATE_READ;
+      if (km_prefault_add(&pf, reg->start, reg->size, advice) != 0) {
+         goto nomem;
+      }
+   }
+   for (int i = 0; i < pf.count; i++) {
+      total += pf.chunks[i].size;
+   }
+
+   nthreads = 1;
+   if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0) {
+      nthreads = CPU_COUNT(&cpus);
+   }
+   nthreads = MAX(1, MIN(MIN(nthreads, KM_PREFAULT_MAX_THREADS), pf.count));
+   for (int i = 1; i < nthreads; i++) {
+      if (pthread_create(&threads[i], NULL, km_prefault_thread, &pf) != 0) {
+         nthreads = i;
+         break;
+      }
+   }
+   km_prefault_thread(&pf);
+   for (int i = 1; i < nthreads; i++) {
+      pthread_join(threads[i], NULL);
+   }
+   free(pf.chunks);
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   km_warnx("prefault %s: %ldMB in %ld msec, %d threads",
+            why,
+            total / MIB,
+            (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000,
+            nthreads);
+   return;
+
+nomem:
+   free(pf.chunks);
+   km_warnx("prefault %s: no memory for the chunk list", why);
+}
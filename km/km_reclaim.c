@@ -0,0 +1,217 @@
+/*
+ * Copyright 2021 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Giving freed guest memory back to the host.
+ *
+ * munmap'ed guest memory is MADV_FREE'd, so the host takes the pages when it needs them, and
+ * nothing is lost if the payload maps the range again before that (reuse zeroes it anyway, see
+ * km_reg_make_clean()). Memory below brk given up by moving brk down is MADV_DONTNEED'ed, so it
+ * reads as zeroes when brk grows back, like on Linux. Memory regions left by brk or tbrk are
+ * unplugged and unmapped (km_free_region()).
+ *
+ * With --reclaim a thread watches memory pressure (PSI) of km cgroup, or of the system if there is
+ * no cgroup v2, and MADV_DONTNEEDs free mmaps when the payload stalls on memory, so RSS goes down
+ * right away rather than when the kernel gets to the lazily freed pages.
+ *
+ * km_mem_stats counts the bytes, km_cli -M shows them.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "km.h"
+#include "km_filesys.h"
+#include "km_mem.h"
+
+#define KM_RECLAIM_STALL_USECS 100000     // payload stalled on memory for 100ms ...
+#define KM_RECLAIM_WINDOW_USECS 2000000   // ... within 2 sec. Unprivileged triggers need >= 2 sec
+#define KM_RECLAIM_AVG10 5.0              // 'some avg10' percent, if we can't have a trigger
+
+int km_mem_reclaim = 0;   // --reclaim
+km_mem_stats_t km_mem_stats;
+
+static pthread_t km_reclaim_thread;
+static int km_reclaim_running;
+static int km_reclaim_stop_fd = -1;
+static int km_reclaim_psi_fd = -1;
+static int km_reclaim_trigger;   // km_reclaim_psi_fd has a trigger, otherwise we check avg10
+
+/*
+ * Gives guest memory [gva, gva + size) back to the host with madvise 'advice'.
+ */
+void km_mem_release(km_gva_t gva, size_t size, int advice)
+{
+   if (size != 0 && madvise(km_gva_to_kma_nocheck(gva), size, advice) == 0) {
+      __atomic_add_fetch(&km_mem_stats.released, size, __ATOMIC_RELAXED);
+   }
+}
+
+// memory.pressure of km cgroup v2, or of the system
+static int km_reclaim_psi_open(int flags)
+{
+   char line[PATH_MAX];
+   char path[PATH_MAX + 64];
+   FILE* fp;
+   int fd = -1;
+
+   if ((fp = fopen("/proc/self/cgroup", "r")) != NULL) {
+      while (fgets(line, sizeof(line), fp) != NULL) {
+         if (strncmp(line, "0::", 3) == 0) {
+            line[strcspn(line, "\n")] = 0;
+            snprintf(path, sizeof(path), "/sys/fs/cgroup%s/memory.pressure", line + 3);
+            fd = km_internal_open(path, flags | O_CLOEXEC, 0);
+            break;
+         }
+      }
+      fclose(fp);
+   }
+   if (fd < 0) {
+      fd = km_internal_open("/proc/pressure/memory", flags | O_CLOEXEC, 0);
+   }
+   return fd;
+}
+
+static double km_reclaim_avg10(void)
+{
+   char buf[256];
+   double avg10;
+   ssize_t n;
+
+   if ((n = pread(km_reclaim_psi_fd, buf, sizeof(buf) - 1, 0)) <= 0) {
+      return 0;
+   }
+   buf[n] = 0;
+   return sscanf(buf, "some avg10=%lf", &avg10) == 1 ? avg10 : 0;
+}
+
+static void* km_reclaim_main(void* arg)
+{
+   struct pollfd fds[2] = {{.fd = km_reclaim_stop_fd, .events = POLLIN},
+                           {.fd = km_reclaim_psi_fd, .events = POLLPRI}};
+   uint64_t released = 0;   // km_mem_stats.released at the last reclaim
+   sigset_t all;
+
+   // signals are for vcpu threads
+   sigfillset(&all);
+   pthread_sigmask(SIG_BLOCK, &all, NULL);
+   while (1) {
+      // without a trigger psi fd polls as always ready, so we only wait on the stop fd
+      if (poll(fds,
+               km_reclaim_trigger != 0 ? 2 : 1,
+               km_reclaim_trigger != 0 ? -1 : KM_RECLAIM_WINDOW_USECS / 1000) < 0 &&
+          errno != EINTR) {
+         km_warn("reclaim: poll");
+         break;
+      }
+      if ((fds[0].revents & POLLIN) != 0) {
+         break;
+      }
+      if (km_reclaim_trigger != 0) {
+         if ((fds[1].revents & POLLERR) != 0) {
+            km_warnx("reclaim: memory pressure file went away");
+            break;
+         }
+         if ((fds[1].revents & POLLPRI) == 0) {
+            continue;
+         }
+      } else if (km_reclaim_avg10() < KM_RECLAIM_AVG10) {
+         continue;
+      }
+      uint64_t now = __atomic_load_n(&km_mem_stats.released, __ATOMIC_RELAXED);
+      if (now == released) {
+         continue;   // nothing was freed since the last time
+      }
+      released = now;
+      size_t bytes = km_mmap_reclaim();
+      __atomic_add_fetch(&km_mem_stats.reclaimed, bytes, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&km_mem_stats.reclaims, 1, __ATOMIC_RELAXED);
+      km_infox(KM_TRACE_MEM, "reclaim: dropped 0x%lx bytes of free mmaps", bytes);
+   }
+   return NULL;
+}
+
+void km_mem_reclaim_init(void)
+{
+   char trigger[64];
+   int len;
+
+   km_reclaim_running = 0;   // a forked child doesn't have the parent thread
+   if (km_mem_reclaim == 0) {
+      return;
+   }
+   if ((km_reclaim_psi_fd = km_reclaim_psi_open(O_RDWR | O_NONBLOCK)) < 0 &&
+       (km_reclaim_psi_fd = km_reclaim_psi_open(O_RDONLY)) < 0) {
+      km_warn("--reclaim: no memory pressure info (PSI), not reclaiming");
+      return;
+   }
+   len = snprintf(trigger,
+                  sizeof(trigger),
+                  "some %d %d",
+                  KM_RECLAIM_STALL_USECS,
+                  KM_RECLAIM_WINDOW_USECS);
+   km_reclaim_trigger = write(km_reclaim_psi_fd, trigger, len + 1) > 0;
+   if ((km_reclaim_stop_fd = km_internal_eventfd(0, EFD_CLOEXEC)) < 0) {
+      km_err(1, "KM: Failed to create reclaim eventfd");
+   }
+   if (pthread_create(&km_reclaim_thread, NULL, km_reclaim_main, NULL) != 0) {
+      km_err(1, "KM: Failed to create reclaim thread");
+   }
+   km_reclaim_running = 1;
+   km_infox(KM_TRACE_MEM, "reclaim: %s", km_reclaim_trigger != 0 ? "PSI trigger" : "polling avg10");
+}
+
+void km_mem_reclaim_fini(void)
+{
+   uint64_t one = 1;
+
+   if (km_reclaim_running == 0) {
+      return;
+   }
+   (void)write(km_reclaim_stop_fd, &one, sizeof(one));
+   pthread_join(km_reclaim_thread, NULL);
+   km_reclaim_running = 0;
+   close(km_reclaim_stop_fd);
+   close(km_reclaim_psi_fd);
+   km_reclaim_stop_fd = km_reclaim_psi_fd = -1;
+}
+
+// Management request, see KM_MGMT_REQ_MEM_STATS
+void km_mem_stats_send(int fd)
+{
+   char buf[512];
+   int len = snprintf(buf,
+                      sizeof(buf),
+                      "released  %14ld bytes, freed guest memory given back to the host\n"
+                      "reclaimed %14ld bytes, free mmaps dropped under memory pressure, %ld times\n"
+                      "unplugged %14ld bytes, memory regions removed\n",
+                      __atomic_load_n(&km_mem_stats.released, __ATOMIC_RELAXED),
+                      __atomic_load_n(&km_mem_stats.reclaimed, __ATOMIC_RELAXED),
+                      __atomic_load_n(&km_mem_stats.reclaims, __ATOMIC_RELAXED),
+                      __atomic_load_n(&km_mem_stats.unplugged, __ATOMIC_RELAXED));
+
+   (void)send(fd, buf, len, MSG_NOSIGNAL);
+}
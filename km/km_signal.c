@@ -538,8 +538,6 @@ static inline void restore_signal_context(km_vcpu_t* vcpu, km_signal_frame_t* fr
 static inline void do_guest_handler(km_vcpu_t* vcpu, siginfo_t* info, km_sigaction_t* act)
 {
    km_infox(KM_TRACE_SIGNALS, "Enter: signo=%d", info->si_signo);
-   vcpu->regs_valid = 0;
-   vcpu->sregs_valid = 0;
    km_vcpu_sync_rip(vcpu);   // sync RIP with KVM
    km_read_registers(vcpu);
 
@@ -23,7 +23,9 @@
  */
 #include <assert.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/procfs.h>
 #include <sys/stat.h>
@@ -55,6 +57,80 @@ char* km_get_snapshot_path()
    return snapshot_path;
 }
 
+#define KM_SS_HOLE_MIN (2 * MIB)
+
+/*
+ * Zero pages are holes in the snapshot file, or past its end. Maps them anonymous over the file
+ * mapping of [gva, gva + size) at 'offset', so they don't take page cache. Each one is a VMA, so
+ * holes smaller than KM_SS_HOLE_MIN stay file mapped, except the last one that may be past the end
+ * of the file. Returns 0 or -errno.
+ */
+static int km_ss_map_holes(int fd, km_gva_t gva, size_t size, int prot, off_t offset)
+{
+   off_t end = offset + size;
+   off_t hole = offset;
+
+   while (hole < end) {
+      off_t next = lseek(fd, hole, SEEK_HOLE);
+      if (next < 0 && errno != ENXIO) {
+         return -errno;
+      }
+      if ((hole = MAX(next, hole)) >= end) {   // ENXIO: past the end of the file, all of it is
+         break;
+      }
+      off_t data = lseek(fd, hole, SEEK_DATA);
+      if (data < 0 && errno != ENXIO) {
+         return -errno;
+      }
+      int last = data < 0;
+      data = data < 0 ? end : MIN(data, end);
+      off_t from = roundup(hole, KM_PAGE_SIZE);
+      off_t to = rounddown(data, KM_PAGE_SIZE);
+      if (from < to && (last != 0 || to - from >= KM_SS_HOLE_MIN) &&
+          km_mem_map(gva + (from - offset), to - from, prot, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) ==
+              MAP_FAILED) {
+         return -errno;
+      }
+      hole = data;
+   }
+   return 0;
+}
+
+/*
+ * Maps 'size' bytes at 'gva' from 'offset' in the snapshot. The memory of compressed snapshots is
+ * anonymous instead, km_ss_compress_fill() decompresses it later. hugetlb memory can't be mapped
+ * over in 4K pages, it is read like load_elf.c does, or zeroed for the decompression.
+ */
+static void* km_ss_map_load(int fd, km_gva_t gva, size_t size, int prot, off_t offset)
+{
+   km_kma_t kma = km_gva_to_kma_nocheck(gva);
+   int ret;
+
+   if (km_ss_compressed() != 0) {
+      if (km_ss_compress_select(gva, roundup(size, KM_PAGE_SIZE), prot) != 0) {
+         return MAP_FAILED;
+      }
+      if (km_mem_hugetlb(gva) != 0) {
+         memset(kma, 0, roundup(size, KM_PAGE_SIZE));   // zero chunks aren't written
+         return kma;
+      }
+      return km_mem_map(gva, size, prot | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   }
+   if (km_mem_hugetlb(gva) != 0) {
+      if ((ret = km_ss_pread(fd, kma, size, offset)) != 0) {
+         errno = -ret;
+         return MAP_FAILED;
+      }
+      return kma;
+   }
+   void* m = km_mem_map(gva, size, prot, MAP_PRIVATE, fd, offset);
+   if (m != MAP_FAILED && offset % KM_PAGE_SIZE == 0 &&
+       km_ss_map_holes(fd, gva, size, prot, offset) != 0) {
+      return MAP_FAILED;
+   }
+   return m;
+}
+
 static inline void km_ss_recover_memory(int fd, km_gva_t tbrk_gva, km_payload_t* payload)
 {
    Elf64_Ehdr* ehdr = &payload->km_ehdr;
@@ -75,26 +151,23 @@ static inline void km_ss_recover_memory(int fd, km_gva_t tbrk_gva, km_payload_t*
                   km_err_e(2, -ret, "km_guest_mprotect failed");
                }
                // mmap the data
-               void* m = mmap(km_gva_to_kma(phdr->p_vaddr),
-                              phdr->p_filesz,
-                              prot,
-                              MAP_PRIVATE | MAP_FIXED,
-                              fd,
-                              phdr->p_offset);
+               void* m = km_ss_map_load(fd, phdr->p_vaddr, phdr->p_filesz, prot, phdr->p_offset);
                if (m == MAP_FAILED) {
                   km_err(2, "snapshot mmap[%d]: vaddr=0x%lx offset=0x%lx", i, phdr->p_vaddr, phdr->p_offset);
                }
+               if (km_ss_layer_fill(i) != 0) {
+                  km_errx(2, "snapshot layer fill[%d]: vaddr=0x%lx", i, phdr->p_vaddr);
+               }
             }
          } else {
             // lower
             uint64_t extra = phdr->p_vaddr - rounddown((uint64_t)phdr->p_vaddr, KM_PAGE_SIZE);
             void* addr = km_gva_to_kma(phdr->p_vaddr - extra);
-            void* m = mmap(addr,
-                           phdr->p_filesz + extra,
-                           prot_elf_to_mmap(phdr->p_flags),
-                           MAP_PRIVATE | MAP_FIXED,
-                           fd,
-                           phdr->p_offset - extra);
+            void* m = km_ss_map_load(fd,
+                                     phdr->p_vaddr - extra,
+                                     phdr->p_filesz + extra,
+                                     prot_elf_to_mmap(phdr->p_flags),
+                                     phdr->p_offset - extra);
             if (m == MAP_FAILED) {
                km_err(2,
                       "snapshot mmap[%d]: p_vaddr 0x%lx, extra 0x%lx, addr %p, size %lu, "
@@ -108,6 +181,15 @@ static inline void km_ss_recover_memory(int fd, km_gva_t tbrk_gva, km_payload_t*
                       phdr->p_offset,
                       prot_elf_to_mmap(phdr->p_flags));
             }
+            if (km_ss_layer_fill(i) != 0) {
+               km_errx(2, "snapshot layer fill[%d]: vaddr=0x%lx", i, phdr->p_vaddr);
+            }
+            // the host mapping has the protection, with --pt-mprotect the guest page tables need it
+            if (km_pt_mprotect != 0 && km_mem_protect(phdr->p_vaddr - extra,
+                                                      phdr->p_filesz + extra,
+                                                      prot_elf_to_mmap(phdr->p_flags)) != 0) {
+               km_errx(2, "snapshot mprotect[%d]: vaddr=0x%lx", i, phdr->p_vaddr);
+            }
          }
       }
    }
@@ -201,7 +283,7 @@ static int km_ss_recover_vcpu_info(char* ptr, size_t length)
     * This is a compile time check to remind developers to check
     * for snapshot implications when km_vcpu_t changes.
     */
-   static_assert(sizeof(km_vcpu_t) == 960,
+   static_assert(sizeof(km_vcpu_t) == 968,
                  "sizeof(km_vcpu_t) changed. Check for snapshot implications");
 
    if (length < sizeof(km_nt_vcpu_t)) {
@@ -380,6 +462,15 @@ static inline int km_ss_recover_km_monitor(char* notebuf, size_t notesize)
                current_vmtype[machine.vm_type]);
       return -1;
    }
+   // Memory layout depends on guest physical memory size, see GUEST_MEM_SPAN
+   if (mon->brk >= GUEST_MEM_ZONE_SIZE_VA || mon->tbrk < GUEST_VA_OFFSET ||
+       mon->tbrk > GUEST_MEM_TOP_VA) {
+      km_warnx("snapshot brk 0x%lx tbrk 0x%lx don't fit in 0x%lx guest memory, see --membus-width",
+               mon->brk,
+               mon->tbrk,
+               machine.guest_max_physmem);
+      return -1;
+   }
    km_infox(KM_TRACE_SNAPSHOT, "Recover brk");
    if (km_mem_brk(mon->brk) != mon->brk) {
       km_err(2, "brk recover failure");
@@ -435,8 +526,18 @@ int km_snapshot_restore(km_elf_t* e)
       km_errx(2, "recover monitor failed");
    }
 
-   // Memory is fully described by PT_LOAD sections
+   // Memory is fully described by PT_LOAD sections, and by the parents of incremental snapshots
+   if (km_ss_layer_restore_open(fileno(e->file), e->path) != 0) {
+      km_errx(2, "recover snapshot layers failed");
+   }
+   if (km_ss_compress_restore_open(fileno(e->file)) != 0) {
+      km_errx(2, "recover snapshot chunk index failed");
+   }
    km_ss_recover_memory(fileno(e->file), tbrk_gva, &tmp_payload);
+   km_ss_layer_restore_done();
+   if (km_ss_compress_fill() != 0) {
+      km_errx(2, "decompress snapshot memory failed");
+   }
 
    free((void*)e->path);
    km_close_elf_file(e);   // close now to avoid collision with fd's that need restoring
@@ -489,8 +590,22 @@ int km_snapshot_restore(km_elf_t* e)
    return 0;
 }
 
+int km_snapshot_background;   // --snapshot-background
+
 static pthread_mutex_t snap_mutex = PTHREAD_MUTEX_INITIALIZER;
 static int in_snapshot = 0;
+static int snap_writing;             // a background snapshot is being written
+static struct timespec snap_pause;   // when the vcpus were paused
+static uint64_t snap_pause_usec;     // how long they were, once they run again
+
+static uint64_t km_snapshot_usec_since(struct timespec* start)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
 int km_snapshot_block(km_vcpu_t* vcpu)
 {
    pthread_mutex_lock(&snap_mutex);
@@ -501,20 +616,55 @@ int km_snapshot_block(km_vcpu_t* vcpu)
    }
    in_snapshot = 1;
    pthread_mutex_unlock(&snap_mutex);
+   clock_gettime(CLOCK_MONOTONIC, &snap_pause);
+   snap_pause_usec = 0;
    km_vcpu_pause_all(vcpu, ALL);   // Wait for everyone to get to the pause point.
    return 0;
 }
 void km_snapshot_unblock(void)
 {
+   km_vcpu_resume_all();
+   snap_pause_usec = km_snapshot_usec_since(&snap_pause);
+   km_infox(KM_TRACE_SNAPSHOT, "payload was paused %ld usec", snap_pause_usec);
    pthread_mutex_lock(&snap_mutex);
-   in_snapshot = 0;
+   in_snapshot = snap_writing;   // km_snapshot_wait() ends a background snapshot
    pthread_mutex_unlock(&snap_mutex);
-   km_vcpu_resume_all();
 }
 
-int km_snapshot_create(km_vcpu_t* vcpu, char* label, char* description, char* dumppath)
+/*
+ * Wait for the guest memory of a background snapshot to be written. Returns 0 if it was or there
+ * is nothing to wait for, else an errno.
+ */
+int km_snapshot_wait(void)
+{
+   int rc = km_dump_core_wait();
+
+   pthread_mutex_lock(&snap_mutex);
+   if (snap_writing != 0) {
+      snap_writing = 0;
+      in_snapshot = 0;
+   }
+   pthread_mutex_unlock(&snap_mutex);
+   return rc;
+}
+
+/*
+ * How long the payload was paused for the last snapshot, or has been so far if it still is.
+ */
+uint64_t km_snapshot_pause_usec(void)
+{
+   return snap_pause_usec != 0 ? snap_pause_usec : km_snapshot_usec_since(&snap_pause);
+}
+
+/*
+ * Write a snapshot, called with the vcpus paused by km_snapshot_block(). If live is set and
+ * --snapshot-background is on, the guest memory is written after the vcpus run again, call
+ * km_snapshot_wait() after km_snapshot_unblock() for the result.
+ */
+int km_snapshot_create(km_vcpu_t* vcpu, char* label, char* description, char* dumppath, int live)
 {
    char dumpfile[128];
+   char layerfile[PATH_MAX];
 
    // No snapshots while GDB is running
    if (km_gdb_is_enabled() != 0) {
@@ -534,10 +684,19 @@ int km_snapshot_create(km_vcpu_t* vcpu, char* label, char* description, char* du
          dumppath = km_get_snapshot_path();
       }
    }
+   if ((dumppath = km_ss_layer_path(dumppath, layerfile, sizeof(layerfile))) == NULL) {
+      km_warnx("Cannot create snapshot, all names for it are used by its parents");
+      return -EEXIST;
+   }
    km_infox(KM_TRACE_SNAPSHOT, "Begin snapshot pid %d to %s", getpid(), dumppath);
-   int rc = km_dump_core(dumppath, vcpu, NULL, label, description, KM_DO_SNAP);
+   int background = live != 0 && km_snapshot_background != 0;
+   km_coredump_type_t dumptype = background != 0 ? KM_DO_SNAP_BACKGROUND : KM_DO_SNAP;
+   int rc = km_dump_core(dumppath, vcpu, NULL, label, description, dumptype);
    if (rc != 0) {
       km_warnx("Cannot create snapshot %s, %s", dumppath, strerror(rc));
+   } else if (background != 0) {
+      snap_writing = 1;
+      km_infox(KM_TRACE_SNAPSHOT, "Snapshot memory is being written, pid %d", getpid());
    } else {
       km_infox(KM_TRACE_SNAPSHOT, "Snapshot complete, pid %d", getpid());
    }
@@ -26,9 +26,12 @@
 
 void km_set_snapshot_path(char* path);
 char* km_get_snapshot_path();
+extern int km_snapshot_background;
 int km_snapshot_block(km_vcpu_t* vcpu);
 void km_snapshot_unblock(void);
-int km_snapshot_create(km_vcpu_t* vcpu, char* label, char* description, char* path);
+int km_snapshot_wait(void);
+uint64_t km_snapshot_pause_usec(void);
+int km_snapshot_create(km_vcpu_t* vcpu, char* label, char* description, char* path, int live);
 int km_snapshot_restore(km_elf_t* elf);
 char* km_snapshot_read_notes(int fd, size_t* notesize, km_payload_t* payload);
 int km_snapshot_notes_apply(char* notebuf, size_t notesize, int type, int (*func)(char*, size_t));
@@ -36,6 +39,45 @@ void km_snapshot_fill_km_payload(km_elf_t* e, km_payload_t* p);
 
 void light_snap_listen(km_elf_t* e);
 
+// Incremental snapshots, km_snapshot_layer.c
+extern int km_snapshot_incremental;
+extern char* km_snapshot_flatten_path;
+extern char* km_snapshot_base;
+extern int km_snapshot_info;
+int km_ss_layer_restore_open(int fd, const char* path);
+int km_ss_layer_fill(int phidx);
+void km_ss_layer_restore_done(void);
+char* km_ss_layer_path(char* path, char* buf, size_t size);
+int km_ss_layer_wanted(void);
+int km_ss_layer_set_base(const char* path);
+int km_ss_layer_begin(void);
+int km_ss_layer_active(void);
+int km_ss_layer_add(km_gva_t base, size_t size, off_t offset);
+#define KM_SS_LAYER_SELECT_MAX 256   // pages km_ss_layer_select() takes at once, 1MB
+int km_ss_layer_select(km_gva_t gva, size_t npages, uint8_t* own);
+int km_ss_layer_finish(int fd, off_t phoff);
+void km_ss_layer_end(const char* path, int rc);
+int km_ss_layer_flatten(const char* in, const char* out);
+int km_ss_layer_info(const char* path);
+void km_ss_layer_send(int fd);
+int km_ss_maps_read(void);
+size_t km_ss_maps_run(km_kma_t kma, size_t size, int* readable);
+int km_ss_pread(int fd, void* buf, size_t size, off_t off);
+int km_ss_pwrite(int fd, const void* buf, size_t size, off_t off);
+
+// Compressed snapshots, km_snapshot_compress.c
+extern int km_snapshot_compress;
+int km_ss_compress_begin(int nthreads);
+int km_ss_compress_active(void);
+int km_ss_compress_add(size_t size);
+int km_ss_compress_write(int fd, km_gva_t gva, size_t size);
+int km_ss_compress_finish(int fd, off_t phoff);
+void km_ss_compress_end(void);
+int km_ss_compress_restore_open(int fd);
+int km_ss_compressed(void);
+int km_ss_compress_select(km_gva_t gva, size_t size, int prot);
+int km_ss_compress_fill(void);
+
 #define KM_TRACE_SNAPSHOT "snapshot"
 
 #endif
@@ -0,0 +1,611 @@
+/*
+ * Copyright 2021 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Compressed snapshots (--snapshot-compress).
+ *
+ * Guest memory is cut in KM_SS_CHUNK_SIZE chunks, which a few threads compress in the LZ4 block
+ * format, and the chunks are written in order after the notes. Chunks of zeroes take no space,
+ * chunks that don't compress are written as they are. Memory the host can't read is zeroes, as in
+ * the holes of uncompressed snapshots. The NT_KM_CHUNKS note after the memory has the guest
+ * address, file offset and length of every chunk.
+ *
+ * Restore maps anonymous memory for the PT_LOADs and decompresses the chunks into it with as many
+ * threads, before the payload runs. Decompressing on first touch with userfaultfd would start the
+ * payload sooner, but every vcpu fault on guest memory would then be a round trip through km.
+ *
+ * LZ4 is implemented here so km doesn't need the library. Incremental snapshots are not
+ * compressed, their parents are mapped from the PT_LOAD offsets.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "km.h"
+#include "km_coredump.h"
+#include "km_elf.h"
+#include "km_mem.h"
+#include "km_snapshot.h"
+
+#define KM_SS_CHUNK_SIZE (256 * 1024)
+#define KM_SS_COMPRESS_MAX_THREADS 16
+#define KM_SS_COMPRESS_BATCH 4   // chunks per thread compressed before they are written
+
+#define KM_LZ4_HASH_LOG 12
+#define KM_LZ4_MIN_MATCH 4
+#define KM_LZ4_LAST_LITERALS 5   // a block ends with that many literals
+#define KM_LZ4_MFLIMIT 12        // and its last match starts before that
+#define KM_LZ4_MAX_OFFSET 65535
+
+// Snapshot being written
+typedef struct km_ss_compress {
+   km_nt_chunk_t* chunks;
+   uint64_t nchunks;   // km_ss_compress_add() made room for
+   uint64_t next;      // next chunk to write
+   int nthreads;
+   int nslots;
+   char* slots;      // compressed chunks of a batch, KM_SS_CHUNK_SIZE each
+   uint64_t batch;   // first chunk of the batch
+   int count;        // chunks in the batch
+   int taken;        // next chunk of the batch to compress, atomic
+} km_ss_compress_t;
+
+// Range of guest memory to decompress, and its protection when done
+typedef struct km_ss_range {
+   km_gva_t gva;
+   size_t size;
+   int prot;
+} km_ss_range_t;
+
+// Snapshot being restored
+typedef struct km_ss_decompress {
+   km_nt_chunk_t* chunks;   // sorted by gva
+   uint64_t nchunks;
+   uint8_t* selected;   // chunks to decompress
+   km_ss_range_t* ranges;
+   int nranges;
+   int fd;
+   uint64_t next;   // next chunk to take, atomic
+   int failed;
+} km_ss_decompress_t;
+
+int km_snapshot_compress;   // --snapshot-compress
+
+static km_ss_compress_t km_ss_cmp;
+static km_ss_decompress_t km_ss_dcmp = {.fd = -1};
+
+static inline uint32_t km_lz4_read32(const uint8_t* p)
+{
+   uint32_t v;
+
+   memcpy(&v, p, sizeof(v));
+   return v;
+}
+
+// Writes an LZ4 length continuation, 'len' is what doesn't fit in the token
+static inline uint8_t* km_lz4_put_length(uint8_t* op, size_t len)
+{
+   for (; len >= 255; len -= 255) {
+      *op++ = 255;
+   }
+   *op++ = len;
+   return op;
+}
+
+/*
+ * LZ4 block compression with a greedy single entry hash table. Returns the compressed length, or
+ * 0 if it would be more than 'cap'.
+ */
+static size_t km_lz4_compress(const uint8_t* src, size_t size, uint8_t* dst, size_t cap)
+{
+   uint32_t table[1 << KM_LZ4_HASH_LOG];
+   const uint8_t* ip = src;
+   const uint8_t* anchor = src;
+   const uint8_t* end = src + size;
+   uint8_t* op = dst;
+   uint8_t* oend = dst + cap;
+
+   memset(table, 0, sizeof(table));
+   while (size > KM_LZ4_MFLIMIT && ip < end - KM_LZ4_MFLIMIT) {
+      uint32_t seq = km_lz4_read32(ip);
+      uint32_t h = (seq * 2654435761u) >> (32 - KM_LZ4_HASH_LOG);
+      const uint8_t* ref = src + table[h];
+
+      table[h] = ip - src;
+      if (ref >= ip || ip - ref > KM_LZ4_MAX_OFFSET || km_lz4_read32(ref) != seq) {
+         ip += 1 + ((ip - anchor) >> 6);   // skip faster over what doesn't compress
+         continue;
+      }
+      while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+         ip--;
+         ref--;
+      }
+      const uint8_t* m = ip + KM_LZ4_MIN_MATCH;
+      const uint8_t* r = ref + KM_LZ4_MIN_MATCH;
+      while (m < end - KM_LZ4_LAST_LITERALS && *m == *r) {
+         m++;
+         r++;
+      }
+      size_t lit = ip - anchor;
+      size_t mlen = m - ip - KM_LZ4_MIN_MATCH;
+      if (op + 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1 > oend) {
+         return 0;
+      }
+      uint8_t* token = op++;
+      *token = (MIN(lit, 15) << 4) | MIN(mlen, 15);
+      if (lit >= 15) {
+         op = km_lz4_put_length(op, lit - 15);
+      }
+      memcpy(op, anchor, lit);
+      op += lit;
+      *op++ = (ip - ref) & 0xff;
+      *op++ = (ip - ref) >> 8;
+      if (mlen >= 15) {
+         op = km_lz4_put_length(op, mlen - 15);
+      }
+      ip = anchor = m;
+   }
+   size_t lit = end - anchor;
+   if (op + 1 + lit / 255 + 1 + lit > oend) {
+      return 0;
+   }
+   *op++ = MIN(lit, 15) << 4;
+   if (lit >= 15) {
+      op = km_lz4_put_length(op, lit - 15);
+   }
+   memcpy(op, anchor, lit);
+   return op + lit - dst;
+}
+
+// Reads an LZ4 length continuation. Returns 0, or -EINVAL if the block ends in it
+static inline int km_lz4_get_length(const uint8_t** ipp, const uint8_t* iend, size_t* lenp)
+{
+   uint8_t b;
+
+   do {
+      if (*ipp >= iend) {
+         return -EINVAL;
+      }
+      b = *(*ipp)++;
+      *lenp += b;
+   } while (b == 255);
+   return 0;
+}
+
+/*
+ * LZ4 block decompression of 'size' bytes of 'src' into exactly 'dsize' bytes of 'dst'. Returns 0,
+ * or -EINVAL if the block is corrupt.
+ */
+static int km_lz4_decompress(const uint8_t* src, size_t size, uint8_t* dst, size_t dsize)
+{
+   const uint8_t* ip = src;
+   const uint8_t* iend = src + size;
+   uint8_t* op = dst;
+   uint8_t* oend = dst + dsize;
+
+   while (ip < iend) {
+      uint8_t token = *ip++;
+      size_t lit = token >> 4;
+      if (lit == 15 && km_lz4_get_length(&ip, iend, &lit) != 0) {
+         return -EINVAL;
+      }
+      if (lit > iend - ip || lit > oend - op) {
+         return -EINVAL;
+      }
+      memcpy(op, ip, lit);
+      ip += lit;
+      op += lit;
+      if (ip == iend) {
+         break;   // the last sequence has no match
+      }
+      if (iend - ip < 2) {
+         return -EINVAL;
+      }
+      size_t offset = ip[0] | ip[1] << 8;
+      ip += 2;
+      size_t mlen = token & 15;
+      if (mlen == 15 && km_lz4_get_length(&ip, iend, &mlen) != 0) {
+         return -EINVAL;
+      }
+      mlen += KM_LZ4_MIN_MATCH;
+      if (offset == 0 || offset > op - dst || mlen > oend - op) {
+         return -EINVAL;
+      }
+      const uint8_t* m = op - offset;
+      if (offset >= mlen) {
+         memcpy(op, m, mlen);
+         op += mlen;
+      } else {
+         // overlapping match repeats the last 'offset' bytes
+         for (size_t i = 0; i < mlen; i++) {
+            *op++ = *m++;
+         }
+      }
+   }
+   return op == oend ? 0 : -EINVAL;
+}
+
+// Copies guest memory the host can read, zeroes the rest like the holes of uncompressed snapshots
+static void km_ss_compress_copy(uint8_t* to, const uint8_t* from, size_t size)
+{
+   size_t n;
+   int readable;
+
+   for (size_t done = 0; done < size; done += n) {
+      n = km_ss_maps_run((km_kma_t)from + done, size - done, &readable);
+      if (readable != 0) {
+         memcpy(to + done, from + done, n);
+      } else {
+         memset(to + done, 0, n);
+      }
+   }
+}
+
+static int km_ss_compress_nthreads(int limit)
+{
+   cpu_set_t cpus;
+   int nthreads = 1;
+
+   if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0) {
+      nthreads = CPU_COUNT(&cpus);
+   }
+   return MAX(1, MIN(MIN(nthreads, KM_SS_COMPRESS_MAX_THREADS), limit));
+}
+
+// Runs 'func' on 'nthreads' threads, this one included
+static void km_ss_compress_run(void* (*func)(void*), void* arg, int nthreads)
+{
+   pthread_t threads[KM_SS_COMPRESS_MAX_THREADS];
+
+   for (int i = 1; i < nthreads; i++) {
+      if (pthread_create(&threads[i], NULL, func, arg) != 0) {
+         nthreads = i;
+         break;
+      }
+   }
+   func(arg);
+   for (int i = 1; i < nthreads; i++) {
+      pthread_join(threads[i], NULL);
+   }
+}
+
+/*
+ * Starts writing a compressed snapshot. 'nthreads' 0 is as many as we can run, the background
+ * snapshot writer can't start threads. Returns 0 or errno.
+ */
+int km_ss_compress_begin(int nthreads)
+{
+   km_ss_compress_t* cmp = &km_ss_cmp;
+
+   cmp->nthreads = nthreads != 0 ? nthreads : km_ss_compress_nthreads(KM_SS_COMPRESS_MAX_THREADS);
+   cmp->nslots = cmp->nthreads * KM_SS_COMPRESS_BATCH;
+   if ((cmp->slots = malloc((size_t)cmp->nslots * KM_SS_CHUNK_SIZE)) == NULL) {
+      km_warnx("no memory for snapshot compression buffers");
+      return ENOMEM;
+   }
+   return 0;
+}
+
+int km_ss_compress_active(void)
+{
+   return km_ss_cmp.slots != NULL;
+}
+
+// Makes room for the chunks of a PT_LOAD, called with its program header
+int km_ss_compress_add(size_t size)
+{
+   km_ss_compress_t* cmp = &km_ss_cmp;
+   uint64_t n = cmp->nchunks + (size + KM_SS_CHUNK_SIZE - 1) / KM_SS_CHUNK_SIZE;
+   km_nt_chunk_t* chunks;
+
+   if ((chunks = realloc(cmp->chunks, n * sizeof(km_nt_chunk_t))) == NULL) {
+      return ENOMEM;
+   }
+   cmp->chunks = chunks;
+   cmp->nchunks = n;
+   return 0;
+}
+
+static void* km_ss_compress_thread(void* arg)
+{
+   km_ss_compress_t* cmp = arg;
+   int i;
+
+   while ((i = __atomic_fetch_add(&cmp->taken, 1, __ATOMIC_RELAXED)) < cmp->count) {
+      km_nt_chunk_t* c = &cmp->chunks[cmp->batch + i];
+      uint8_t* mem = km_gva_to_kma_nocheck(c->gva);
+      uint8_t* slot = (uint8_t*)cmp->slots + (size_t)i * KM_SS_CHUNK_SIZE;
+      int readable;
+
+      if (km_ss_maps_run(mem, c->size, &readable) < c->size || readable == 0) {
+         km_ss_compress_copy(slot, mem, c->size);
+         c->length = c->size;
+      } else if (km_mem_is_zero(mem, c->size) != 0) {
+         c->length = 0;
+      } else if ((c->length = km_lz4_compress(mem, c->size, slot, c->size - 1)) == 0) {
+         memcpy(slot, mem, c->size);
+         c->length = c->size;
+      }
+   }
+   return NULL;
+}
+
+/*
+ * Writes 'size' bytes of guest memory at 'gva', the next PT_LOAD, at the current offset of 'fd'.
+ * Doesn't log, it runs in the background writer too. Returns 0 or errno.
+ */
+int km_ss_compress_write(int fd, km_gva_t gva, size_t size)
+{
+   km_ss_compress_t* cmp = &km_ss_cmp;
+   uint64_t n = (size + KM_SS_CHUNK_SIZE - 1) / KM_SS_CHUNK_SIZE;
+   off_t off;
+   int ret;
+
+   if (cmp->next + n > cmp->nchunks) {
+      return EINVAL;   // the chunk index is short
+   }
+   if ((off = lseek(fd, 0, SEEK_CUR)) < 0) {
+      return errno;
+   }
+   for (uint64_t i = 0; i < n; i++) {
+      size_t done = i * KM_SS_CHUNK_SIZE;
+      cmp->chunks[cmp->next + i] =
+          (km_nt_chunk_t){.gva = gva + done, .size = MIN(KM_SS_CHUNK_SIZE, size - done)};
+   }
+   while (n > 0) {
+      cmp->batch = cmp->next;
+      cmp->count = MIN(n, cmp->nslots);
+      cmp->taken = 0;
+      km_ss_compress_run(km_ss_compress_thread, cmp, MIN(cmp->nthreads, cmp->count));
+      for (int i = 0; i < cmp->count; i++) {
+         km_nt_chunk_t* c = &cmp->chunks[cmp->batch + i];
+         char* slot = cmp->slots + (size_t)i * KM_SS_CHUNK_SIZE;
+         c->offset = off;
+         if (c->length != 0 && (ret = km_ss_pwrite(fd, slot, c->length, off)) != 0) {
+            return -ret;
+         }
+         off += c->length;
+      }
+      cmp->next += cmp->count;
+      n -= cmp->count;
+   }
+   if (lseek(fd, off, SEEK_SET) < 0) {
+      return errno;
+   }
+   return 0;
+}
+
+/*
+ * Memory of the snapshot being written to 'fd' is done. Writes the chunk index note after it, and
+ * its program header at 'phoff'. Doesn't log or allocate memory, it runs in the background writer
+ * too. Returns 0 or errno.
+ */
+int km_ss_compress_finish(int fd, off_t phoff)
+{
+   km_ss_compress_t* cmp = &km_ss_cmp;
+   size_t hdrsize = km_nt_chunk_roundup(km_note_header_size(KM_NT_NAME));
+   size_t descsz = sizeof(km_nt_chunks_t) + cmp->next * sizeof(km_nt_chunk_t);
+   char hdr[hdrsize + sizeof(km_nt_chunks_t)];
+   km_nt_chunks_t* nt = (km_nt_chunks_t*)(hdr + hdrsize);
+   off_t off;
+   int ret;
+
+   if ((off = lseek(fd, 0, SEEK_CUR)) < 0) {
+      return errno;
+   }
+   off = roundup(off, sizeof(uint64_t));
+   memset(hdr, 0, sizeof(hdr));
+   km_add_note_header(hdr, sizeof(hdr), KM_NT_NAME, NT_KM_CHUNKS, descsz);
+   nt->size = sizeof(km_nt_chunks_t);
+   nt->chunksize = KM_SS_CHUNK_SIZE;
+   nt->nchunks = cmp->next;
+   Elf64_Phdr phdr = {.p_type = PT_NOTE, .p_offset = off, .p_filesz = hdrsize + descsz};
+   size_t indexsz = cmp->next * sizeof(km_nt_chunk_t);
+   if ((ret = km_ss_pwrite(fd, hdr, sizeof(hdr), off)) != 0 ||
+       (ret = km_ss_pwrite(fd, cmp->chunks, indexsz, off + sizeof(hdr))) != 0 ||
+       (ret = km_ss_pwrite(fd, &phdr, sizeof(phdr), phoff)) != 0) {
+      return -ret;
+   }
+   return 0;
+}
+
+void km_ss_compress_end(void)
+{
+   km_ss_compress_t* cmp = &km_ss_cmp;
+
+   free(cmp->slots);
+   free(cmp->chunks);
+   *cmp = (km_ss_compress_t){};
+}
+
+static int km_ss_chunk_cmp(const void* a, const void* b)
+{
+   const km_nt_chunk_t* ca = a;
+   const km_nt_chunk_t* cb = b;
+
+   return ca->gva < cb->gva ? -1 : ca->gva > cb->gva;
+}
+
+/*
+ * Reads the chunk index of snapshot file 'fd', if it has one. Returns 0, or -errno.
+ */
+int km_ss_compress_restore_open(int fd)
+{
+   km_ss_decompress_t* d = &km_ss_dcmp;
+   Elf64_Ehdr ehdr;
+   Elf64_Phdr phdr;
+   Elf64_Nhdr nhdr;
+   km_nt_chunks_t nt;
+   int ret;
+
+   if ((ret = km_ss_pread(fd, &ehdr, sizeof(ehdr), 0)) != 0) {
+      return ret;
+   }
+   for (int i = ehdr.e_phnum - 1; i >= 0; i--) {
+      if ((ret = km_ss_pread(fd, &phdr, sizeof(phdr), ehdr.e_phoff + i * sizeof(phdr))) != 0) {
+         return ret;
+      }
+      if (phdr.p_type != PT_NOTE || phdr.p_filesz < sizeof(nhdr) + sizeof(nt) ||
+          km_ss_pread(fd, &nhdr, sizeof(nhdr), phdr.p_offset) != 0 || nhdr.n_type != NT_KM_CHUNKS) {
+         continue;
+      }
+      off_t off = phdr.p_offset + sizeof(nhdr) + km_nt_chunk_roundup(nhdr.n_namesz);
+      if ((ret = km_ss_pread(fd, &nt, sizeof(nt), off)) != 0) {
+         return ret;
+      }
+      if (nt.size != sizeof(nt) || nt.chunksize == 0 || nt.chunksize > KM_SS_CHUNK_SIZE ||
+          nhdr.n_descsz < sizeof(nt) ||
+          nt.nchunks > (nhdr.n_descsz - sizeof(nt)) / sizeof(km_nt_chunk_t)) {
+         return -EINVAL;
+      }
+      if ((d->chunks = malloc(nt.nchunks * sizeof(km_nt_chunk_t) + 1)) == NULL ||
+          (d->selected = calloc(1, nt.nchunks + 1)) == NULL) {
+         return -ENOMEM;
+      }
+      d->nchunks = nt.nchunks;
+      size_t indexsz = nt.nchunks * sizeof(km_nt_chunk_t);
+      if ((ret = km_ss_pread(fd, d->chunks, indexsz, off + sizeof(nt))) != 0) {
+         return ret;
+      }
+      for (uint64_t c = 0; c < d->nchunks; c++) {
+         if (d->chunks[c].size > nt.chunksize || d->chunks[c].length > d->chunks[c].size ||
+             d->chunks[c].gva + d->chunks[c].size < d->chunks[c].gva) {
+            return -EINVAL;
+         }
+      }
+      qsort(d->chunks, d->nchunks, sizeof(km_nt_chunk_t), km_ss_chunk_cmp);
+      // km_ss_compress_select() checks the chunks are in a PT_LOAD
+      for (uint64_t c = 1; c < d->nchunks; c++) {
+         if (d->chunks[c - 1].gva + d->chunks[c - 1].size > d->chunks[c].gva) {
+            return -EINVAL;
+         }
+      }
+      d->fd = fd;
+      km_infox(KM_TRACE_SNAPSHOT, "compressed snapshot, %ld chunks", d->nchunks);
+      return 0;
+   }
+   return 0;
+}
+
+int km_ss_compressed(void)
+{
+   return km_ss_dcmp.chunks != NULL;
+}
+
+/*
+ * The PT_LOAD at 'gva' is mapped anonymous and writable. Its chunks will be decompressed by
+ * km_ss_compress_fill(), which then sets its protection to 'prot'. Returns 0 or -errno.
+ */
+int km_ss_compress_select(km_gva_t gva, size_t size, int prot)
+{
+   km_ss_decompress_t* d = &km_ss_dcmp;
+   km_ss_range_t* ranges;
+   uint64_t lo = 0;
+   uint64_t hi = d->nchunks;
+
+   if ((ranges = realloc(d->ranges, (d->nranges + 1) * sizeof(km_ss_range_t))) == NULL) {
+      return -ENOMEM;
+   }
+   d->ranges = ranges;
+   d->ranges[d->nranges++] = (km_ss_range_t){.gva = gva, .size = size, .prot = prot};
+   while (lo < hi) {
+      uint64_t mid = (lo + hi) / 2;
+      if (d->chunks[mid].gva < gva) {
+         lo = mid + 1;
+      } else {
+         hi = mid;
+      }
+   }
+   for (; lo < d->nchunks && d->chunks[lo].gva < gva + size; lo++) {
+      if (d->chunks[lo].gva + d->chunks[lo].size > gva + size) {
+         return -EINVAL;
+      }
+      d->selected[lo] = 1;
+   }
+   return 0;
+}
+
+static void* km_ss_decompress_thread(void* arg)
+{
+   km_ss_decompress_t* d = arg;
+   uint8_t* buf = malloc(KM_SS_CHUNK_SIZE);
+   uint64_t i;
+
+   if (buf == NULL) {
+      d->failed = -ENOMEM;
+      return NULL;
+   }
+   while ((i = __atomic_fetch_add(&d->next, 1, __ATOMIC_RELAXED)) < d->nchunks) {
+      km_nt_chunk_t* c = &d->chunks[i];
+      uint8_t* mem = km_gva_to_kma_nocheck(c->gva);
+      int ret = 0;
+
+      if (d->selected[i] == 0 || c->length == 0) {
+         continue;   // not restored, or zeroes
+      }
+      if (c->length == c->size) {
+         ret = km_ss_pread(d->fd, mem, c->size, c->offset);
+      } else if ((ret = km_ss_pread(d->fd, buf, c->length, c->offset)) == 0) {
+         ret = km_lz4_decompress(buf, c->length, mem, c->size);
+      }
+      if (ret != 0) {
+         km_warnx("snapshot chunk at 0x%lx, %s", c->gva, strerror(-ret));
+         d->failed = ret;
+      }
+   }
+   free(buf);
+   return NULL;
+}
+
+/*
+ * Decompresses the chunks of the PT_LOADs km_ss_compress_select() was called for and sets their
+ * protection. Returns 0, or -errno.
+ */
+int km_ss_compress_fill(void)
+{
+   km_ss_decompress_t* d = &km_ss_dcmp;
+   struct timespec start, end;
+   int nthreads;
+   int ret;
+
+   if (d->chunks == NULL) {
+      return 0;
+   }
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   nthreads = km_ss_compress_nthreads(d->nchunks);
+   km_ss_compress_run(km_ss_decompress_thread, d, nthreads);
+   ret = d->failed;
+   for (int i = 0; i < d->nranges && ret == 0; i++) {
+      km_ss_range_t* r = &d->ranges[i];
+      ret = km_mem_protect(r->gva, r->size, r->prot);
+   }
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   km_infox(KM_TRACE_SNAPSHOT,
+            "decompressed %ld chunks in %ld msec, %d threads",
+            d->nchunks,
+            (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000,
+            nthreads);
+   free(d->chunks);
+   free(d->selected);
+   free(d->ranges);
+   *d = (km_ss_decompress_t){.fd = -1};
+   return ret;
+}
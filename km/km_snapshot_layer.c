@@ -0,0 +1,1358 @@
+/*
+ * Copyright 2021 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Incremental snapshots (--snapshot-incremental).
+ *
+ * Each snapshot gets a memory layer note (NT_KM_LAYER) with a hash of every guest page in it. The
+ * snapshot km resumed from, or the last one it wrote, is the parent of the next one, which only
+ * has the pages whose hash differs from the parent's. The other pages are holes in the file. The
+ * first snapshot is a full one, and so is every KM_SS_LAYER_MAX_DEPTH'th.
+ *
+ * We don't use KVM dirty page logging to find changed pages: km and the host kernel write guest
+ * memory too, e.g. read(2) into a payload buffer or a signal frame, and KVM doesn't see that.
+ * Instead we hash the pages, and use /proc/self/pagemap to skip the ones that can't have changed:
+ * pages never faulted in are zero, and pages still mapped from the snapshot files we resumed from
+ * have the hash we resumed with.
+ *
+ * Restore maps the pages a layer doesn't have from its parent, or the parent's parent and so on
+ * (km_ss_layer_fill()). The parent is found by the name in the note, or by the same base name in
+ * the directory of the child, and has to have the id the child expects. 'km --snapshot-flatten'
+ * merges a layer and its parents into a standalone snapshot.
+ *
+ * With --snapshot-base, or km_cli -b, snapshots are layers of a given base snapshot instead, so
+ * many of them can share one base image and only keep the pages they changed. The base is known by
+ * its id, a hash of its page hashes. When the file isn't where the layer says, the base km was
+ * given is tried too. 'km --snapshot-info' and km_cli -L print the layers.
+ *
+ * We never overwrite a snapshot file in the chain we use. When the snapshot path is one,
+ * "<path>.1", "<path>.2" and so on are used instead.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "km.h"
+#include "km_coredump.h"
+#include "km_elf.h"
+#include "km_mem.h"
+#include "km_snapshot.h"
+
+#define KM_SS_LAYER_MAX_DEPTH 64                 // longest chain of snapshot files
+#define KM_SS_LAYER_MMAP_MIN (64 * KM_PAGE_SIZE)   // shorter runs are read, to save host VMAs
+#define KM_SS_HASH_UNKNOWN 0                     // page wasn't hashed, it's never shared
+#define KM_SS_HASH_MUL 0x9e3779b97f4a7c15ul
+
+// /proc/self/pagemap bits, see Documentation/admin-guide/mm/pagemap.rst
+#define KM_PM_PRESENT (1ul << 63)
+#define KM_PM_SWAP (1ul << 62)
+#define KM_PM_FILE (1ul << 61)
+
+// A PT_LOAD of a snapshot
+typedef struct km_ss_extent {
+   km_gva_t gva;
+   uint64_t npages;
+   uint64_t first;   // index of the first page in the layer
+   off_t offset;     // in the file
+   int prot;
+   int phidx;   // program header index
+} km_ss_extent_t;
+
+typedef struct km_ss_layer {
+   char* path;
+   dev_t dev;
+   ino_t ino;
+   int fd;
+   uint64_t id;
+   uint64_t parent_id;
+   char* parent_name;            // as recorded in the note
+   struct km_ss_layer* parent;   // the files the snapshot needs, to the full one
+   uint64_t npages;
+   uint64_t* hashes;
+   uint64_t* bitmap;   // pages in this file, NULL if it has all of them
+   int nextents;
+   km_ss_extent_t* extents;   // in program header order
+   km_ss_extent_t** byaddr;   // sorted by gva
+   int note_phidx;            // NT_KM_LAYER program header
+   uint64_t next;             // next page to write
+} km_ss_layer_t;
+
+// Host mapping of guest memory, from /proc/self/maps
+typedef struct km_ss_map {
+   uintptr_t start;
+   uintptr_t end;
+   dev_t dev;
+   ino_t ino;   // 0 for anonymous memory
+   int readable;
+} km_ss_map_t;
+
+int km_snapshot_incremental;      // --snapshot-incremental
+char* km_snapshot_flatten_path;   // --snapshot-flatten
+char* km_snapshot_base;           // --snapshot-base
+int km_snapshot_info;             // --snapshot-info
+
+static km_ss_layer_t* km_ss_restored;   // the snapshot we resumed from and its parents
+static km_ss_layer_t* km_ss_parent;     // parent of the next snapshot
+static km_ss_layer_t* km_ss_new;        // snapshot being written
+static km_ss_layer_t* km_ss_base;       // parent of the snapshots when there is a base snapshot
+static km_ss_layer_t* km_ss_chain[KM_SS_LAYER_MAX_DEPTH];   // being restored or flattened
+static int km_ss_chain_len;
+
+static km_ss_map_t* km_ss_maps;
+static int km_ss_nmaps;
+static int km_ss_pagemap_fd = -1;
+static uint64_t km_ss_zero_hash;
+
+/*
+ * Four lanes of xor-multiply-xorshift over 64 bit words, about as fast as reading the memory. A
+ * change in one word always changes the hash, but pages that differ more can collide, so a match
+ * only says the page may be unchanged, km_ss_layer_same_page() compares the bytes.
+ */
+static uint64_t km_ss_hash(const void* buf, size_t size, uint64_t seed)
+{
+   const uint64_t* w = buf;
+   size_t n = size / sizeof(uint64_t);
+   uint64_t h[4] = {seed ^ 1, seed ^ 2, seed ^ 3, seed ^ 4};
+   uint64_t ret = size;
+   size_t i;
+
+   for (i = 0; i + 4 <= n; i += 4) {
+      for (int l = 0; l < 4; l++) {
+         h[l] = (h[l] ^ w[i + l]) * KM_SS_HASH_MUL;
+         h[l] ^= h[l] >> 32;
+      }
+   }
+   for (; i < n; i++) {
+      h[0] = (h[0] ^ w[i]) * KM_SS_HASH_MUL;
+      h[0] ^= h[0] >> 32;
+   }
+   for (int l = 0; l < 4; l++) {
+      ret = (ret ^ h[l]) * KM_SS_HASH_MUL;
+      ret ^= ret >> 29;
+   }
+   return ret;
+}
+
+static uint64_t km_ss_page_hash(const void* page)
+{
+   uint64_t h = km_ss_hash(page, KM_PAGE_SIZE, 0);
+   return h == KM_SS_HASH_UNKNOWN ? 1 : h;
+}
+
+static inline int km_ss_bit(uint64_t* bitmap, uint64_t idx)
+{
+   return bitmap == NULL || (bitmap[idx / 64] & (1ul << (idx % 64))) != 0;
+}
+
+static void km_ss_layer_free(km_ss_layer_t* ly)
+{
+   if (ly->fd >= 0) {
+      close(ly->fd);
+   }
+   free(ly->path);
+   free(ly->parent_name);
+   free(ly->hashes);
+   free(ly->bitmap);
+   free(ly->extents);
+   free(ly->byaddr);
+   free(ly);
+}
+
+static km_ss_layer_t* km_ss_layer_alloc(void)
+{
+   km_ss_layer_t* ly = calloc(1, sizeof(km_ss_layer_t));
+
+   if (ly != NULL) {
+      ly->fd = -1;
+   }
+   return ly;
+}
+
+// Page tables aren't needed once a snapshot isn't a parent anymore, the file identity still is
+static void km_ss_layer_trim(km_ss_layer_t* ly)
+{
+   if (ly->fd >= 0) {
+      close(ly->fd);
+      ly->fd = -1;
+   }
+   free(ly->hashes);
+   free(ly->bitmap);
+   free(ly->extents);
+   free(ly->byaddr);
+   ly->hashes = ly->bitmap = NULL;
+   ly->extents = NULL;
+   ly->byaddr = NULL;
+   ly->nextents = 0;
+}
+
+static int km_ss_extent_cmp(const void* a, const void* b)
+{
+   km_gva_t ga = (*(km_ss_extent_t**)a)->gva;
+   km_gva_t gb = (*(km_ss_extent_t**)b)->gva;
+
+   return ga < gb ? -1 : ga > gb;
+}
+
+static int km_ss_layer_sort(km_ss_layer_t* ly)
+{
+   if ((ly->byaddr = malloc(ly->nextents * sizeof(km_ss_extent_t*) + 1)) == NULL) {
+      return -ENOMEM;
+   }
+   for (int i = 0; i < ly->nextents; i++) {
+      ly->byaddr[i] = &ly->extents[i];
+   }
+   qsort(ly->byaddr, ly->nextents, sizeof(km_ss_extent_t*), km_ss_extent_cmp);
+   return 0;
+}
+
+// Finds the page at 'gva' in 'ly'. Returns its index, or -1 if the layer doesn't have the address
+static int64_t km_ss_layer_lookup(km_ss_layer_t* ly, km_gva_t gva, off_t* offp)
+{
+   int lo = 0;
+   int hi = ly->nextents - 1;
+   km_ss_extent_t* e = NULL;
+
+   while (lo <= hi) {
+      int mid = (lo + hi) / 2;
+      if (ly->byaddr[mid]->gva <= gva) {
+         e = ly->byaddr[mid];
+         lo = mid + 1;
+      } else {
+         hi = mid - 1;
+      }
+   }
+   if (e == NULL || gva >= e->gva + e->npages * KM_PAGE_SIZE) {
+      return -1;
+   }
+   if (offp != NULL) {
+      *offp = e->offset + rounddown(gva - e->gva, KM_PAGE_SIZE);
+   }
+   return e->first + (gva - e->gva) / KM_PAGE_SIZE;
+}
+
+/*
+ * pread()/pwrite() all of 'size' bytes. Return 0 or -errno, pread() returns -EINVAL at the end of
+ * the file.
+ */
+int km_ss_pread(int fd, void* buf, size_t size, off_t off)
+{
+   char* cur = buf;
+
+   while (size > 0) {
+      ssize_t rc = pread(fd, cur, size, off);
+      if (rc < 0) {
+         return -errno;
+      }
+      if (rc == 0) {
+         return -EINVAL;   // truncated file
+      }
+      cur += rc;
+      off += rc;
+      size -= rc;
+   }
+   return 0;
+}
+
+int km_ss_pwrite(int fd, const void* buf, size_t size, off_t off)
+{
+   const char* cur = buf;
+
+   while (size > 0) {
+      ssize_t rc = pwrite(fd, cur, size, off);
+      if (rc < 0) {
+         return -errno;
+      }
+      cur += rc;
+      off += rc;
+      size -= rc;
+   }
+   return 0;
+}
+
+/*
+ * Reads PT_LOADs and the NT_KM_LAYER note of snapshot file 'fd'. Returns 0, -ENODATA if the
+ * snapshot has no layer note, or other -errno.
+ */
+static int km_ss_layer_load(km_ss_layer_t* ly, int fd)
+{
+   Elf64_Ehdr ehdr;
+   Elf64_Phdr* phdrs;
+   Elf64_Nhdr nhdr;
+   km_nt_layer_t nt;
+   int ret;
+
+   if ((ret = km_ss_pread(fd, &ehdr, sizeof(ehdr), 0)) != 0) {
+      return ret;
+   }
+   if (memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0 || ehdr.e_type != ET_CORE ||
+       ehdr.e_phentsize != sizeof(Elf64_Phdr)) {
+      return -EINVAL;
+   }
+   if ((phdrs = malloc(ehdr.e_phnum * sizeof(Elf64_Phdr))) == NULL ||
+       (ly->extents = calloc(ehdr.e_phnum, sizeof(km_ss_extent_t))) == NULL) {
+      free(phdrs);
+      return -ENOMEM;
+   }
+   if ((ret = km_ss_pread(fd, phdrs, ehdr.e_phnum * sizeof(Elf64_Phdr), ehdr.e_phoff)) != 0) {
+      goto out;
+   }
+   ly->note_phidx = -1;
+   for (int i = 0; i < ehdr.e_phnum; i++) {
+      Elf64_Phdr* phdr = &phdrs[i];
+      if (phdr->p_type == PT_LOAD) {
+         km_ss_extent_t* e = &ly->extents[ly->nextents++];
+         e->gva = phdr->p_vaddr;
+         e->npages = roundup(phdr->p_filesz, KM_PAGE_SIZE) / KM_PAGE_SIZE;
+         e->first = ly->npages;
+         e->offset = phdr->p_offset;
+         e->prot = prot_elf_to_mmap(phdr->p_flags);
+         e->phidx = i;
+         ly->npages += e->npages;
+      } else if (phdr->p_type == PT_NOTE && phdr->p_filesz >= sizeof(nhdr) + 4 + sizeof(nt) &&
+                 km_ss_pread(fd, &nhdr, sizeof(nhdr), phdr->p_offset) == 0 &&
+                 nhdr.n_type == NT_KM_LAYER) {
+         ly->note_phidx = i;
+      }
+   }
+   if (ly->note_phidx < 0) {
+      ret = -ENODATA;
+      goto out;
+   }
+   off_t off = phdrs[ly->note_phidx].p_offset + sizeof(nhdr) + km_nt_chunk_roundup(nhdr.n_namesz);
+   if ((ret = km_ss_pread(fd, &nt, sizeof(nt), off)) != 0) {
+      goto out;
+   }
+   size_t words = nt.parent_id != 0 ? (nt.npages + 63) / 64 : 0;
+   if (nt.size != sizeof(nt) || nt.npages != ly->npages ||
+       nhdr.n_descsz < sizeof(nt) + (nt.npages + words) * sizeof(uint64_t) + nt.namelength) {
+      ret = -EINVAL;
+      goto out;
+   }
+   ly->id = nt.id;
+   ly->parent_id = nt.parent_id;
+   off += sizeof(nt);
+   if ((ly->hashes = malloc(nt.npages * sizeof(uint64_t) + 1)) == NULL) {
+      ret = -ENOMEM;
+      goto out;
+   }
+   if ((ret = km_ss_pread(fd, ly->hashes, nt.npages * sizeof(uint64_t), off)) != 0) {
+      goto out;
+   }
+   off += nt.npages * sizeof(uint64_t);
+   if (words > 0) {
+      if ((ly->bitmap = malloc(words * sizeof(uint64_t))) == NULL ||
+          (ly->parent_name = calloc(1, nt.namelength + 1)) == NULL) {
+         ret = -ENOMEM;
+         goto out;
+      }
+      if ((ret = km_ss_pread(fd, ly->bitmap, words * sizeof(uint64_t), off)) != 0 ||
+          (ret = km_ss_pread(fd, ly->parent_name, nt.namelength, off + words * sizeof(uint64_t))) !=
+              0) {
+         goto out;
+      }
+   }
+   ret = km_ss_layer_sort(ly);
+out:
+   free(phdrs);
+   return ret;
+}
+
+/*
+ * Opens the next file that may be the parent of 'child': the recorded name, the same base name next
+ * to the child, or the base snapshot. '*tried' counts the ones tried. Its name goes to 'path'.
+ */
+static int km_ss_layer_open_parent(km_ss_layer_t* child, int* tried, char* path, size_t size)
+{
+   char* name = strdup(child->parent_name);
+   char* dir = strdup(child->path);
+   int fd = -1;
+
+   if (name == NULL || dir == NULL) {
+      free(name);
+      free(dir);
+      return -ENOMEM;
+   }
+   for (; fd < 0 && *tried < 3; (*tried)++) {
+      if (*tried == 0) {
+         snprintf(path, size, "%s", child->parent_name);
+      } else if (*tried == 1) {
+         snprintf(path, size, "%s/%s", dirname(dir), basename(name));
+      } else if (km_ss_base != NULL) {
+         snprintf(path, size, "%s", km_ss_base->path);
+      } else {
+         continue;
+      }
+      fd = open(path, O_RDONLY | O_CLOEXEC);
+   }
+   free(name);
+   free(dir);
+   if (fd < 0) {
+      km_warnx("cannot find parent snapshot '%s' id 0x%lx of '%s'",
+               child->parent_name,
+               child->parent_id,
+               child->path);
+      return -ENOENT;
+   }
+   return fd;
+}
+
+static int km_ss_layer_identify(km_ss_layer_t* ly, int fd, const char* path)
+{
+   struct stat st;
+
+   ly->fd = fd;
+   if (fstat(fd, &st) != 0) {
+      return -errno;
+   }
+   ly->dev = st.st_dev;
+   ly->ino = st.st_ino;
+   if ((ly->path = realpath(path, NULL)) == NULL && (ly->path = strdup(path)) == NULL) {
+      return -ENOMEM;
+   }
+   return 0;
+}
+
+/*
+ * Loads snapshot 'fd' named 'path' and all its parents into km_ss_chain[]. Returns 0, -ENODATA if
+ * the snapshot has no layer note, or other -errno. km_ss_layer_close() undoes it.
+ */
+static int km_ss_layer_open(int fd, const char* path)
+{
+   char parent_path[PATH_MAX];
+   km_ss_layer_t* ly;
+   int tried = 0;
+   int ret;
+
+   if ((fd = dup(fd)) < 0) {
+      return -errno;
+   }
+   for (;;) {
+      if ((ly = km_ss_layer_alloc()) == NULL) {
+         close(fd);
+         return -ENOMEM;
+      }
+      if (km_ss_chain_len > 0) {
+         km_ss_chain[km_ss_chain_len - 1]->parent = ly;
+      }
+      km_ss_chain[km_ss_chain_len++] = ly;
+      if ((ret = km_ss_layer_identify(ly, fd, path)) != 0) {
+         return ret;
+      }
+      if ((ret = km_ss_layer_load(ly, fd)) != 0 && (ret != -ENODATA || km_ss_chain_len == 1)) {
+         return ret;
+      }
+      km_ss_layer_t* child = km_ss_chain_len > 1 ? km_ss_chain[km_ss_chain_len - 2] : NULL;
+      if (child != NULL && (ret != 0 || ly->id != child->parent_id)) {
+         // Not the parent, try the next file it may be in
+         km_infox(KM_TRACE_SNAPSHOT, "'%s' is not the parent of '%s'", ly->path, child->path);
+         km_ss_layer_free(ly);
+         km_ss_chain[--km_ss_chain_len] = NULL;
+         child->parent = NULL;
+         ly = child;
+      } else {
+         if (ly->parent_id == 0) {
+            return 0;
+         }
+         if (km_ss_chain_len == KM_SS_LAYER_MAX_DEPTH) {
+            km_warnx("snapshot '%s' has more than %d parents",
+                     km_ss_chain[0]->path,
+                     km_ss_chain_len);
+            return -ELOOP;
+         }
+         tried = 0;
+      }
+      if ((fd = km_ss_layer_open_parent(ly, &tried, parent_path, sizeof(parent_path))) < 0) {
+         return fd;
+      }
+      path = parent_path;
+   }
+}
+
+// Closes the files of km_ss_chain[], and frees everything but the snapshot we keep, if any
+static void km_ss_layer_close(km_ss_layer_t* keep)
+{
+   for (int i = 0; i < km_ss_chain_len; i++) {
+      km_ss_layer_t* ly = km_ss_chain[i];
+      if (keep == NULL) {
+         km_ss_layer_free(ly);
+      } else if (ly == keep) {
+         close(ly->fd);
+         ly->fd = -1;
+      } else {
+         km_ss_layer_trim(ly);
+      }
+      km_ss_chain[i] = NULL;
+   }
+   km_ss_chain_len = 0;
+}
+
+/*
+ * Finds the file the page at 'gva' comes from, starting at km_ss_chain[level]. Returns the chain
+ * index and sets *offp to the file offset, or returns -1 if no file has it.
+ */
+static int km_ss_layer_find(int level, km_gva_t gva, off_t* offp)
+{
+   for (int l = level; l < km_ss_chain_len; l++) {
+      int64_t idx = km_ss_layer_lookup(km_ss_chain[l], gva, offp);
+      if (idx < 0) {
+         return -1;
+      }
+      if (km_ss_bit(km_ss_chain[l]->bitmap, idx) != 0) {
+         return l;
+      }
+   }
+   return -1;
+}
+
+typedef int (*km_ss_layer_copy_t)(km_ss_layer_t* from,
+                                  off_t off,
+                                  km_ss_extent_t* e,
+                                  km_gva_t gva,
+                                  size_t size);
+
+/*
+ * Calls 'copy' for the runs of pages of extent 'e' of km_ss_chain[0] that come from its parents,
+ * with the file and the offset each run is in.
+ */
+static int km_ss_layer_resolve(km_ss_extent_t* e, km_ss_layer_copy_t copy)
+{
+   km_ss_layer_t* ly = km_ss_chain[0];
+   uint64_t i = 0;
+
+   while (i < e->npages) {
+      if (km_ss_bit(ly->bitmap, e->first + i) != 0) {
+         i++;
+         continue;
+      }
+      km_gva_t gva = e->gva + i * KM_PAGE_SIZE;
+      off_t off;
+      off_t next;
+      int l = km_ss_layer_find(1, gva, &off);
+      if (l < 0) {
+         km_warnx("page 0x%lx of '%s' is in none of its parents", gva, ly->path);
+         return -EINVAL;
+      }
+      uint64_t n = 1;
+      while (i + n < e->npages && km_ss_bit(ly->bitmap, e->first + i + n) == 0 &&
+             km_ss_layer_find(1, gva + n * KM_PAGE_SIZE, &next) == l &&
+             next == off + n * KM_PAGE_SIZE) {
+         n++;
+      }
+      int ret = copy(km_ss_chain[l], off, e, gva, n * KM_PAGE_SIZE);
+      if (ret != 0) {
+         return ret;
+      }
+      i += n;
+   }
+   return 0;
+}
+
+/*
+ * Restore: PT_LOADs are mapped from the snapshot file. Map or read the pages the snapshot doesn't
+ * have over the holes, hugetlb memory is always read.
+ */
+static int km_ss_layer_restore_copy(km_ss_layer_t* from,
+                                    off_t off,
+                                    km_ss_extent_t* e,
+                                    km_gva_t gva,
+                                    size_t size)
+{
+   km_kma_t kma = km_gva_to_kma_nocheck(gva);
+   int ret;
+
+   if (size >= KM_SS_LAYER_MMAP_MIN && km_mem_hugetlb(gva) == 0) {
+      if (km_mem_map(gva, size, e->prot, MAP_PRIVATE, from->fd, off) == MAP_FAILED) {
+         ret = -errno;
+         km_warn("snapshot mmap 0x%lx size 0x%lx from '%s'", gva, size, from->path);
+         return ret;
+      }
+      return 0;
+   }
+   if ((e->prot & PROT_WRITE) == 0 && km_mem_hugetlb(gva) == 0 &&
+       mprotect(kma, size, PROT_READ | PROT_WRITE) != 0) {
+      return -errno;
+   }
+   if ((ret = km_ss_pread(from->fd, kma, size, off)) != 0) {
+      km_warnx("snapshot read 0x%lx size 0x%lx from '%s'", gva, size, from->path);
+      return ret;
+   }
+   if ((e->prot & PROT_WRITE) == 0 && (ret = km_mem_protect(gva, size, e->prot)) != 0) {
+      return ret;
+   }
+   return 0;
+}
+
+/*
+ * Called by snapshot restore before the memory is mapped. Loads the layer note and the parents of
+ * snapshot 'fd' if it has them. Returns 0 or -errno.
+ */
+int km_ss_layer_restore_open(int fd, const char* path)
+{
+   int ret = km_ss_layer_open(fd, path);
+
+   if (ret == -ENODATA) {
+      km_ss_layer_close(NULL);
+      return 0;
+   }
+   if (ret != 0) {
+      km_ss_layer_close(NULL);
+      return ret;
+   }
+   km_infox(KM_TRACE_SNAPSHOT, "snapshot '%s' has %d parents", path, km_ss_chain_len - 1);
+   return 0;
+}
+
+// Fills in the pages of PT_LOAD 'phidx', just mapped from the snapshot, that come from the parents
+int km_ss_layer_fill(int phidx)
+{
+   if (km_ss_chain_len == 0 || km_ss_chain[0]->bitmap == NULL) {
+      return 0;
+   }
+   for (int i = 0; i < km_ss_chain[0]->nextents; i++) {
+      if (km_ss_chain[0]->extents[i].phidx == phidx) {
+         return km_ss_layer_resolve(&km_ss_chain[0]->extents[i], km_ss_layer_restore_copy);
+      }
+   }
+   return 0;
+}
+
+/*
+ * Restore is done. The snapshot we resumed from is the parent of the next one, and pages still
+ * mapped from its files have the hashes it has.
+ */
+void km_ss_layer_restore_done(void)
+{
+   if (km_ss_chain_len == 0) {
+      return;
+   }
+   km_ss_restored = km_ss_parent = km_ss_chain[0];
+   km_ss_layer_close(km_ss_restored);
+}
+
+// Snapshots are written as layers
+int km_ss_layer_wanted(void)
+{
+   return km_snapshot_incremental != 0 || km_ss_base != NULL;
+}
+
+// Parent of the next snapshot: the base snapshot, or the last one if they are incremental
+static km_ss_layer_t* km_ss_layer_next_parent(void)
+{
+   if (km_ss_base != NULL && (km_snapshot_incremental == 0 || km_ss_parent == NULL)) {
+      return km_ss_base;
+   }
+   return km_snapshot_incremental != 0 ? km_ss_parent : NULL;
+}
+
+static int km_ss_layer_in_use(struct stat* st)
+{
+   km_ss_layer_t* chains[] = {km_ss_layer_next_parent(), km_ss_restored, km_ss_base};
+
+   for (int i = 0; i < sizeof(chains) / sizeof(chains[0]); i++) {
+      for (km_ss_layer_t* ly = chains[i]; ly != NULL; ly = ly->parent) {
+         if (ly->dev == st->st_dev && ly->ino == st->st_ino) {
+            return 1;
+         }
+      }
+   }
+   return 0;
+}
+
+/*
+ * Makes snapshot file 'path' the base of the next snapshots, which only have the pages that differ
+ * from it, or from the snapshot before with --snapshot-incremental. Returns 0 or -errno.
+ */
+int km_ss_layer_set_base(const char* path)
+{
+   km_ss_layer_t* old = km_ss_base;
+   int fd;
+   int ret;
+
+   if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+      ret = -errno;
+      km_warn("cannot open base snapshot '%s'", path);
+      return ret;
+   }
+   ret = km_ss_layer_open(fd, path);
+   close(fd);
+   if (ret != 0) {
+      if (ret == -ENODATA) {
+         km_warnx("base snapshot '%s' is not a snapshot layer", path);
+      }
+      km_ss_layer_close(NULL);
+      return ret;
+   }
+   km_ss_base = km_ss_chain[0];
+   km_ss_layer_close(km_ss_base);
+   // The next snapshot is a layer of the new base, the last one and the old base aren't needed
+   for (km_ss_layer_t *ly = km_ss_parent, *next; ly != NULL && ly != km_ss_restored; ly = next) {
+      next = ly->parent;
+      if (ly == old) {
+         old = NULL;
+      }
+      km_ss_layer_free(ly);
+   }
+   km_ss_parent = NULL;
+   for (km_ss_layer_t* next; old != NULL; old = next) {
+      next = old->parent;
+      km_ss_layer_free(old);
+   }
+   km_infox(KM_TRACE_SNAPSHOT, "base snapshot '%s' id 0x%lx", km_ss_base->path, km_ss_base->id);
+   return 0;
+}
+
+/*
+ * Returns the file name to write snapshot 'path' to: 'path', or "<path>.N" if 'path' is a snapshot
+ * we need. NULL if there is no name we can use.
+ */
+char* km_ss_layer_path(char* path, char* buf, size_t size)
+{
+   struct stat st;
+
+   if (km_ss_layer_wanted() == 0 || stat(path, &st) != 0 || km_ss_layer_in_use(&st) == 0) {
+      return path;
+   }
+   for (int i = 1; i <= 2 * KM_SS_LAYER_MAX_DEPTH; i++) {
+      snprintf(buf, size, "%s.%d", path, i);
+      if (stat(buf, &st) != 0 || km_ss_layer_in_use(&st) == 0) {
+         km_infox(KM_TRACE_SNAPSHOT, "'%s' is in use by snapshot layers, writing '%s'", path, buf);
+         return buf;
+      }
+   }
+   return NULL;
+}
+
+/*
+ * Reads the km mappings from /proc/self/maps, for the layer page hashes and for the sparse writes
+ * of snapshots and cores. Returns 0 or -errno.
+ */
+int km_ss_maps_read(void)
+{
+   FILE* fp;
+   char* line = NULL;
+   size_t len = 0;
+   int size = 0;
+
+   km_ss_nmaps = 0;
+   if ((fp = fopen("/proc/self/maps", "r")) == NULL) {
+      return -errno;
+   }
+   while (getline(&line, &len, fp) > 0) {
+      unsigned long start, end, ino;
+      unsigned int major, minor;
+      char perms[5];
+      int n = 0;
+
+      if (sscanf(line,
+                 "%lx-%lx %4s %*x %x:%x %lu %n",
+                 &start,
+                 &end,
+                 perms,
+                 &major,
+                 &minor,
+                 &ino,
+                 &n) < 6) {
+         continue;
+      }
+      if (km_ss_nmaps == size) {
+         size = size == 0 ? 256 : size * 2;
+         km_ss_map_t* maps = realloc(km_ss_maps, size * sizeof(km_ss_map_t));
+         if (maps == NULL) {
+            free(line);
+            fclose(fp);
+            return -ENOMEM;
+         }
+         km_ss_maps = maps;
+      }
+      km_ss_map_t* m = &km_ss_maps[km_ss_nmaps++];
+      m->start = start;
+      m->end = end;
+      m->dev = makedev(major, minor);
+      // hugetlb guest memory shows as a file, but it is anonymous memory to us
+      m->ino = strncmp(line + n, "/anon_hugepage", strlen("/anon_hugepage")) == 0 ? 0 : ino;
+      m->readable = perms[0] == 'r';
+   }
+   free(line);
+   fclose(fp);
+   return 0;
+}
+
+static km_ss_map_t* km_ss_map_find(uintptr_t addr)
+{
+   int lo = 0;
+   int hi = km_ss_nmaps - 1;
+
+   while (lo <= hi) {
+      int mid = (lo + hi) / 2;
+      if (addr < km_ss_maps[mid].start) {
+         hi = mid - 1;
+      } else if (addr >= km_ss_maps[mid].end) {
+         lo = mid + 1;
+      } else {
+         return &km_ss_maps[mid];
+      }
+   }
+   return NULL;
+}
+
+/*
+ * Returns the length of the run of bytes at 'kma', up to 'size', that are all readable or all
+ * not, as of the last km_ss_maps_read(). Sets '*readable' to which it is.
+ */
+size_t km_ss_maps_run(km_kma_t kma, size_t size, int* readable)
+{
+   uintptr_t addr = (uintptr_t)kma;
+   uintptr_t end = addr + size;
+   km_ss_map_t* m = km_ss_map_find(addr);
+
+   *readable = m != NULL && m->readable != 0;
+   if (m == NULL) {
+      return size;   // not mapped, write() fails with EFAULT there too
+   }
+   for (;; m++) {
+      if (m->end >= end) {
+         return size;
+      }
+      if (m + 1 == km_ss_maps + km_ss_nmaps || m[1].start != m->end || m[1].readable != *readable) {
+         return m->end - addr;
+      }
+   }
+}
+
+static int km_ss_map_restored(km_ss_map_t* m)
+{
+   for (km_ss_layer_t* ly = km_ss_restored; ly != NULL && m->ino != 0; ly = ly->parent) {
+      if (ly->dev == m->dev && ly->ino == m->ino) {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+// Starts a layer for the snapshot about to be written. Returns 0 or errno
+int km_ss_layer_begin(void)
+{
+   static uint64_t zero_page[KM_PAGE_SIZE / sizeof(uint64_t)];
+   km_ss_layer_t* parent = km_ss_layer_next_parent();
+   int depth = 0;
+   int ret;
+
+   km_assert(km_ss_new == NULL);
+   if (km_ss_zero_hash == 0) {
+      km_ss_zero_hash = km_ss_page_hash(zero_page);
+   }
+   if ((km_ss_new = km_ss_layer_alloc()) == NULL) {
+      return ENOMEM;
+   }
+   for (km_ss_layer_t* ly = parent; ly != NULL; ly = ly->parent) {
+      depth++;
+   }
+   // The parent files, for km_ss_layer_same_page()
+   km_assert(km_ss_chain_len == 0);
+   if (parent != NULL && depth < KM_SS_LAYER_MAX_DEPTH) {
+      int fd = open(parent->path, O_RDONLY | O_CLOEXEC);
+      if (fd >= 0 && km_ss_layer_open(fd, parent->path) == 0 && km_ss_chain[0]->id == parent->id) {
+         km_ss_new->parent = parent;
+      } else {
+         km_warnx("cannot read parent snapshot '%s', writing a full snapshot", parent->path);
+         km_ss_layer_close(NULL);
+      }
+      if (fd >= 0) {
+         close(fd);
+      }
+   }
+   if ((ret = km_ss_maps_read()) != 0) {
+      km_ss_layer_close(NULL);
+      km_ss_layer_free(km_ss_new);
+      km_ss_new = NULL;
+      return -ret;
+   }
+   if ((km_ss_pagemap_fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC)) < 0) {
+      km_warn("cannot open /proc/self/pagemap, reading all guest pages");
+   }
+   return 0;
+}
+
+int km_ss_layer_active(void)
+{
+   return km_ss_new != NULL;
+}
+
+// A PT_LOAD was added to the snapshot being written. Returns 0 or errno
+int km_ss_layer_add(km_gva_t base, size_t size, off_t offset)
+{
+   km_ss_layer_t* ly = km_ss_new;
+   km_ss_extent_t* extents = realloc(ly->extents, (ly->nextents + 1) * sizeof(km_ss_extent_t));
+
+   if (extents == NULL) {
+      return ENOMEM;
+   }
+   ly->extents = extents;
+   extents[ly->nextents++] = (km_ss_extent_t){.gva = base,
+                                               .npages = roundup(size, KM_PAGE_SIZE) / KM_PAGE_SIZE,
+                                               .first = ly->npages,
+                                               .offset = offset};
+   ly->npages += roundup(size, KM_PAGE_SIZE) / KM_PAGE_SIZE;
+   return 0;
+}
+
+/*
+ * Hash of the guest page at 'gva'. Sets *restored if the page is still the one from the snapshot we
+ * resumed from.
+ */
+static uint64_t
+km_ss_layer_hash_page(km_gva_t gva, km_kma_t kma, uint64_t pm, int havepm, int* restored)
+{
+   km_ss_map_t* m = km_ss_map_find((uintptr_t)kma);
+   int64_t idx;
+
+   *restored = 0;
+   if (m == NULL || m->readable == 0) {
+      return KM_SS_HASH_UNKNOWN;
+   }
+   if (havepm != 0) {
+      if (m->ino == 0 && (pm & (KM_PM_PRESENT | KM_PM_SWAP)) == 0) {
+         return km_ss_zero_hash;
+      }
+      // Not written to since restore: the file page or not faulted in. A swapped out page is a copy.
+      if (km_ss_map_restored(m) != 0 && (pm & KM_PM_SWAP) == 0 &&
+          ((pm & KM_PM_PRESENT) == 0 || (pm & KM_PM_FILE) != 0) &&
+          (idx = km_ss_layer_lookup(km_ss_restored, gva, NULL)) >= 0 &&
+          km_ss_restored->hashes[idx] != KM_SS_HASH_UNKNOWN) {
+         *restored = 1;
+         return km_ss_restored->hashes[idx];
+      }
+   }
+   return km_ss_page_hash(kma);
+}
+
+/*
+ * The page hash isn't collision resistant, so a page whose hash is the same as the parent's is
+ * compared with the parent's copy, in the file of km_ss_chain[] that has it.
+ */
+static int km_ss_layer_same_page(km_gva_t gva, km_kma_t kma)
+{
+   static uint64_t buf[KM_PAGE_SIZE / sizeof(uint64_t)];
+   off_t off;
+   int l = km_ss_layer_find(0, gva, &off);
+
+   return l >= 0 && km_ss_pread(km_ss_chain[l]->fd, buf, KM_PAGE_SIZE, off) == 0 &&
+          memcmp(buf, kma, KM_PAGE_SIZE) == 0;
+}
+
+/*
+ * Hashes 'npages' guest pages at 'gva', the next ones in the snapshot being written, and sets
+ * own[] for the ones the snapshot has to have. The others are in the parent. Returns 0 or errno.
+ */
+int km_ss_layer_select(km_gva_t gva, size_t npages, uint8_t* own)
+{
+   km_ss_layer_t* ly = km_ss_new;
+   km_ss_layer_t* parent = ly->parent;
+   km_kma_t kma = km_gva_to_kma_nocheck(gva);
+   uint64_t pm[KM_SS_LAYER_SELECT_MAX];
+   int havepm;
+
+   km_assert(npages <= KM_SS_LAYER_SELECT_MAX);
+   if (ly->hashes == NULL) {
+      if ((ly->hashes = malloc(ly->npages * sizeof(uint64_t) + 1)) == NULL ||
+          (ly->bitmap = calloc((ly->npages + 63) / 64 + 1, sizeof(uint64_t))) == NULL ||
+          km_ss_layer_sort(ly) != 0) {
+         return ENOMEM;
+      }
+   }
+   km_assert(ly->next + npages <= ly->npages);
+   havepm = km_ss_pagemap_fd >= 0 &&
+            km_ss_pread(km_ss_pagemap_fd,
+                        pm,
+                        npages * sizeof(uint64_t),
+                        (uintptr_t)kma / KM_PAGE_SIZE * sizeof(uint64_t)) == 0;
+   for (size_t i = 0; i < npages; i++, gva += KM_PAGE_SIZE, kma += KM_PAGE_SIZE) {
+      int restored;
+      uint64_t h = km_ss_layer_hash_page(gva, kma, pm[i], havepm, &restored);
+      int64_t idx = parent != NULL ? km_ss_layer_lookup(parent, gva, NULL) : -1;
+
+      ly->hashes[ly->next + i] = h;
+      // a restored page not written since is the parent's page, unless the parent is the base
+      restored = restored != 0 && parent == km_ss_restored;
+      own[i] = idx < 0 || h == KM_SS_HASH_UNKNOWN || parent->hashes[idx] != h ||
+               (restored == 0 && km_ss_layer_same_page(gva, kma) == 0);
+      if (own[i] != 0) {
+         ly->bitmap[(ly->next + i) / 64] |= 1ul << ((ly->next + i) % 64);
+      }
+   }
+   ly->next += npages;
+   return 0;
+}
+
+// Builds the NT_KM_LAYER note of 'ly'. Returns the buffer, to be freed by the caller
+static char* km_ss_layer_note(km_ss_layer_t* ly, size_t* sizep)
+{
+   size_t words = ly->parent_name != NULL ? (ly->npages + 63) / 64 : 0;
+   size_t namelength = ly->parent_name != NULL ? strlen(ly->parent_name) + 1 : 0;
+   size_t descsz = sizeof(km_nt_layer_t) + (ly->npages + words) * sizeof(uint64_t) +
+                   km_nt_chunk_roundup(namelength);
+   size_t size = km_nt_chunk_roundup(km_note_header_size(KM_NT_NAME)) + descsz;
+   char* buf = calloc(1, size);
+   char* cur = buf;
+
+   if (buf == NULL) {
+      return NULL;
+   }
+   cur += km_nt_chunk_roundup(km_add_note_header(cur, size, KM_NT_NAME, NT_KM_LAYER, descsz));
+   km_nt_layer_t* nt = (km_nt_layer_t*)cur;
+   nt->size = sizeof(km_nt_layer_t);
+   nt->namelength = namelength;
+   nt->id = ly->id;
+   nt->parent_id = ly->parent_id;
+   nt->npages = ly->npages;
+   cur += sizeof(km_nt_layer_t);
+   memcpy(cur, ly->hashes, ly->npages * sizeof(uint64_t));
+   cur += ly->npages * sizeof(uint64_t);
+   if (words > 0) {
+      memcpy(cur, ly->bitmap, words * sizeof(uint64_t));
+      cur += words * sizeof(uint64_t);
+      memcpy(cur, ly->parent_name, namelength);
+   }
+   *sizep = size;
+   return buf;
+}
+
+// Writes 'ly' layer note at the end of file 'fd', and its program header at 'phoff'
+static int km_ss_layer_write_note(km_ss_layer_t* ly, int fd, off_t off, off_t phoff)
+{
+   Elf64_Phdr phdr = {.p_type = PT_NOTE, .p_offset = off};
+   size_t size;
+   char* note;
+   int ret;
+
+   if ((note = km_ss_layer_note(ly, &size)) == NULL) {
+      return -ENOMEM;
+   }
+   phdr.p_filesz = size;
+   if ((ret = km_ss_pwrite(fd, note, size, off)) == 0) {
+      ret = km_ss_pwrite(fd, &phdr, sizeof(phdr), phoff);
+   }
+   free(note);
+   return ret;
+}
+
+/*
+ * Memory of the snapshot being written to 'fd' is done, the file offset is at its end. Writes the
+ * layer note, its program header goes to 'phoff'. Returns 0 or errno.
+ */
+int km_ss_layer_finish(int fd, off_t phoff)
+{
+   km_ss_layer_t* ly = km_ss_new;
+   off_t off;
+
+   km_assert(ly->next == ly->npages);
+   if ((off = lseek(fd, 0, SEEK_CUR)) < 0) {
+      return errno;
+   }
+   ly->id = ly->npages;
+   for (int i = 0; i < ly->nextents; i++) {
+      ly->id = km_ss_hash(&ly->extents[i].gva, sizeof(km_gva_t), ly->id);
+   }
+   ly->id = km_ss_hash(ly->hashes, ly->npages * sizeof(uint64_t), ly->id) | 1;
+   if (ly->parent != NULL) {
+      ly->parent_id = ly->parent->id;
+      if ((ly->parent_name = strdup(ly->parent->path)) == NULL) {
+         return ENOMEM;
+      }
+   } else {
+      free(ly->bitmap);
+      ly->bitmap = NULL;
+   }
+   int ret = km_ss_layer_write_note(ly, fd, roundup(off, sizeof(uint64_t)), phoff);
+   if (ret != 0) {
+      km_warnx("cannot write snapshot layer note, %s", strerror(-ret));
+      return -ret;
+   }
+   return 0;
+}
+
+/*
+ * Snapshot writing is over. If it succeeded the new snapshot, now in file 'path', is the parent of
+ * the next one.
+ */
+void km_ss_layer_end(const char* path, int rc)
+{
+   km_ss_layer_t* ly = km_ss_new;
+   struct stat st;
+
+   km_ss_new = NULL;
+   km_ss_layer_close(NULL);
+   if (km_ss_pagemap_fd >= 0) {
+      close(km_ss_pagemap_fd);
+      km_ss_pagemap_fd = -1;
+   }
+   free(km_ss_maps);
+   km_ss_maps = NULL;
+   km_ss_nmaps = 0;
+   if (rc != 0 || stat(path, &st) != 0 || (ly->path = realpath(path, NULL)) == NULL) {
+      km_ss_layer_free(ly);
+      return;
+   }
+   ly->dev = st.st_dev;
+   ly->ino = st.st_ino;
+   /*
+    * The last snapshot is the parent of the new one, or isn't needed anymore if the new one is a
+    * full snapshot or a layer of the base. Restored ones are still mapped.
+    */
+   for (km_ss_layer_t *p = km_ss_parent, *next; p != NULL && p != km_ss_restored && p != km_ss_base;
+        p = next) {
+      next = p->parent;
+      if (p == ly->parent) {
+         km_ss_layer_trim(p);
+         break;
+      }
+      km_ss_layer_free(p);
+   }
+   km_ss_parent = ly;
+   km_infox(KM_TRACE_SNAPSHOT,
+            "snapshot layer '%s' id 0x%lx parent 0x%lx",
+            ly->path,
+            ly->id,
+            ly->parent_id);
+}
+
+/*
+ * Flatten: copy the pages of the layer from its parents to the same offsets in the output file.
+ */
+static int km_ss_flatten_fd = -1;
+
+static int km_ss_layer_flatten_copy(km_ss_layer_t* from,
+                                    off_t off,
+                                    km_ss_extent_t* e,
+                                    km_gva_t gva,
+                                    size_t size)
+{
+   static char buf[KM_SS_LAYER_SELECT_MAX * KM_PAGE_SIZE];
+   off_t to = e->offset + (gva - e->gva);
+
+   while (size > 0) {
+      // holes in the parent are zero pages, they stay holes in the output
+      off_t data = lseek(from->fd, off, SEEK_DATA);
+      if (data < 0 && errno != ENXIO) {
+         return -errno;
+      }
+      if (data < 0 || data >= off + size) {
+         break;
+      }
+      to += data - off;
+      size -= data - off;
+      off = data;
+      off_t hole = lseek(from->fd, off, SEEK_HOLE);
+      if (hole < 0) {
+         return -errno;
+      }
+      size_t len = MIN(MIN(size, sizeof(buf)), hole - off);
+      int ret;
+      if ((ret = km_ss_pread(from->fd, buf, len, off)) != 0 ||
+          (ret = km_ss_pwrite(km_ss_flatten_fd, buf, len, to)) != 0) {
+         return ret;
+      }
+      off += len;
+      to += len;
+      size -= len;
+   }
+   return 0;
+}
+
+// Copies file 'in' to 'out' keeping the holes
+static int km_ss_copy_sparse(int in, int out)
+{
+   static char buf[KM_SS_LAYER_SELECT_MAX * KM_PAGE_SIZE];
+   off_t end = lseek(in, 0, SEEK_END);
+   off_t data = 0;
+   int ret;
+
+   if (end < 0 || ftruncate(out, end) != 0) {
+      return -errno;
+   }
+   while ((data = lseek(in, data, SEEK_DATA)) >= 0) {
+      off_t hole = lseek(in, data, SEEK_HOLE);
+      if (hole < 0) {
+         return -errno;
+      }
+      for (; data < hole; data += MIN(hole - data, sizeof(buf))) {
+         size_t len = MIN(hole - data, sizeof(buf));
+         if ((ret = km_ss_pread(in, buf, len, data)) != 0 ||
+             (ret = km_ss_pwrite(out, buf, len, data)) != 0) {
+            return ret;
+         }
+      }
+   }
+   return errno == ENXIO ? 0 : -errno;
+}
+
+/*
+ * km --snapshot-flatten=<out> <snapshot>: writes snapshot with the pages it has from its parents
+ * to file 'out', which doesn't need them. Returns 0 or -errno.
+ */
+int km_ss_layer_flatten(const char* in, const char* out)
+{
+   Elf64_Ehdr ehdr;
+   km_ss_layer_t* ly;
+   int fd;
+   int ret;
+
+   if ((fd = open(in, O_RDONLY | O_CLOEXEC)) < 0) {
+      ret = -errno;
+      km_warn("cannot open '%s'", in);
+      return ret;
+   }
+   ret = km_ss_layer_open(fd, in);
+   close(fd);
+   if (ret != 0) {
+      if (ret == -ENODATA) {
+         km_warnx("'%s' is not a snapshot layer", in);
+      }
+      goto out;
+   }
+   ly = km_ss_chain[0];
+   if ((km_ss_flatten_fd = open(out, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0) {
+      ret = -errno;
+      km_warn("cannot create '%s'", out);
+      goto out;
+   }
+   if ((ret = km_ss_copy_sparse(ly->fd, km_ss_flatten_fd)) != 0) {
+      km_warnx("cannot copy '%s' to '%s', %s", in, out, strerror(-ret));
+      goto out;
+   }
+   for (int i = 0; i < ly->nextents && ly->bitmap != NULL; i++) {
+      if ((ret = km_ss_layer_resolve(&ly->extents[i], km_ss_layer_flatten_copy)) != 0) {
+         goto out;
+      }
+   }
+   // Same memory image, without the parent
+   if ((ret = km_ss_pread(ly->fd, &ehdr, sizeof(ehdr), 0)) == 0) {
+      Elf64_Phdr phdr;
+      off_t phoff = ehdr.e_phoff + ly->note_phidx * sizeof(Elf64_Phdr);
+      if ((ret = km_ss_pread(ly->fd, &phdr, sizeof(phdr), phoff)) == 0) {
+         free(ly->parent_name);
+         free(ly->bitmap);
+         ly->parent_name = NULL;
+         ly->bitmap = NULL;
+         ly->parent_id = 0;
+         ret = km_ss_layer_write_note(ly, km_ss_flatten_fd, phdr.p_offset, phoff);
+      }
+   }
+   if (ret == 0) {
+      km_infox(KM_TRACE_SNAPSHOT,
+               "flattened '%s' and %d parents to '%s'",
+               in,
+               km_ss_chain_len - 1,
+               out);
+   }
+out:
+   if (km_ss_flatten_fd >= 0) {
+      close(km_ss_flatten_fd);
+      km_ss_flatten_fd = -1;
+      if (ret != 0) {
+         unlink(out);
+      }
+   }
+   km_ss_layer_close(NULL);
+   return ret;
+}
+
+// Prints the snapshot files from 'ly' to the full one
+static void km_ss_layer_print(FILE* fp, const char* what, km_ss_layer_t* ly)
+{
+   if (ly == NULL) {
+      return;
+   }
+   fprintf(fp, "%s:\n", what);
+   for (; ly != NULL; ly = ly->parent) {
+      fprintf(fp,
+              "   %s id 0x%lx parent 0x%lx, %lu pages",
+              ly->path,
+              ly->id,
+              ly->parent_id,
+              ly->npages);
+      if (ly->parent_id == 0) {
+         fprintf(fp, ", all in the file\n");
+      } else if (ly->bitmap != NULL) {
+         uint64_t own = 0;
+         for (uint64_t i = 0; i < (ly->npages + 63) / 64; i++) {
+            own += __builtin_popcountl(ly->bitmap[i]);
+         }
+         fprintf(fp, ", %lu in the file\n", own);
+      } else {
+         fprintf(fp, "\n");
+      }
+   }
+}
+
+// km --snapshot-info <snapshot>: prints the snapshot files it needs. Returns 0 or -errno
+int km_ss_layer_info(const char* path)
+{
+   int fd;
+   int ret;
+
+   if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+      ret = -errno;
+      km_warn("cannot open '%s'", path);
+      return ret;
+   }
+   ret = km_ss_layer_open(fd, path);
+   close(fd);
+   if (ret == 0) {
+      km_ss_layer_print(stdout, "snapshot", km_ss_chain[0]);
+   } else if (ret == -ENODATA) {
+      printf("%s is a snapshot without layers\n", path);
+      ret = 0;
+   }
+   km_ss_layer_close(NULL);
+   return ret;
+}
+
+// Management request, see KM_MGMT_REQ_SNAPSHOT_LAYERS
+void km_ss_layer_send(int fd)
+{
+   char* buf = NULL;
+   size_t len = 0;
+   FILE* fp;
+
+   if ((fp = open_memstream(&buf, &len)) == NULL) {
+      return;
+   }
+   if (km_ss_restored == NULL && km_ss_parent == NULL && km_ss_base == NULL) {
+      fprintf(fp, "no snapshot layers\n");
+   }
+   km_ss_layer_print(fp, "resumed from", km_ss_restored);
+   km_ss_layer_print(fp, "last snapshot", km_ss_parent != km_ss_restored ? km_ss_parent : NULL);
+   km_ss_layer_print(fp, "base", km_ss_base);
+   if (km_ss_layer_wanted() != 0) {
+      km_ss_layer_t* parent = km_ss_layer_next_parent();
+      fprintf(fp, "next snapshot parent: %s\n", parent != NULL ? parent->path : "none");
+   }
+   if (fclose(fp) == 0) {
+      (void)send(fd, buf, len, MSG_NOSIGNAL);
+   }
+   free(buf);
+}
@@ -0,0 +1,768 @@
+/*
+ * Copyright 2021 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * io_uring for payloads.
+ *
+ * Each guest ring is backed by a host ring. The CQ ring is the host one, mapped into the guest as
+ * is, so the payload reaps completions without exits. SQEs carry pointers which the kernel has to
+ * see as km addresses, so the SQ ring and the SQE array the guest maps are km owned guest memory
+ * (the "shadow"). On io_uring_enter() km moves the guest entries to the host SQ, translating
+ * buffers, iovecs and fds on the way, and submits them. Operations km can't translate, or that
+ * would create or close fds behind km's back, complete with -EINVAL.
+ *
+ * With IORING_SETUP_SQPOLL a km thread polls the guest SQ and the payload doesn't need to exit to
+ * submit either, except to wake the thread up after it went idle.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "bsd_queue.h"
+#include "km.h"
+#include "km_filesys.h"
+#include "km_iovec.h"
+#include "km_mem.h"
+#include "km_syscall.h"
+#include "km_uring.h"
+
+/*
+ * Guest SQ ring. The guest gets these offsets in io_uring_params.sq_off.
+ */
+typedef struct km_uring_sq {
+   uint32_t head;
+   uint32_t tail;
+   uint32_t ring_mask;
+   uint32_t ring_entries;
+   uint32_t flags;
+   uint32_t dropped;
+   uint32_t pad[10];
+   uint32_t array[];
+} km_uring_sq_t;
+
+// km copies of what a host SQE points to. The kernel is done with them once it consumes the SQE.
+typedef struct km_uring_slot {
+   struct iovec* iov;
+   size_t iov_cnt;   // allocated
+   struct msghdr msg;
+} km_uring_slot_t;
+
+typedef struct km_uring {
+   TAILQ_ENTRY(km_uring) link;
+   int fd;                  // guest and host
+   int refs;                // protected by km_urings_mutex
+   pthread_mutex_t mutex;   // serializes moving entries to the host SQ
+   uint32_t entries;        // SQ size, the same for the guest and the host
+   void* sq_ring;           // host SQ ring, mapped in km only
+   size_t sq_ring_size;
+   uint32_t* sq_head;
+   uint32_t* sq_tail;
+   uint32_t* sq_flags;
+   uint32_t sq_tail_local;
+   struct io_uring_sqe* sqes;   // host SQEs
+   km_uring_slot_t* slots;      // one per host SQE
+   km_gva_t gsq;                // guest SQ ring and SQEs, 0 until the guest maps them
+   km_gva_t gsqes;
+   int host_sqpoll;   // kernel thread polls the host SQ
+   int sqpoll;        // km thread polls the guest SQ
+   unsigned int idle_ms;
+   pthread_t thread;
+   int efd;   // wakes up the km thread
+   int stop;
+} km_uring_t;
+
+static TAILQ_HEAD(km_uring_list, km_uring) km_urings = TAILQ_HEAD_INITIALIZER(km_urings);
+static pthread_mutex_t km_urings_mutex = PTHREAD_MUTEX_INITIALIZER;
+unsigned int km_uring_count;
+
+static const uint8_t KM_URING_OP_INVALID = 0xff;   // the kernel completes it with -EINVAL
+static const uint64_t KM_URING_EFAULT = -4096ul;   // not a user address, completes with -EFAULT
+
+// Setup flags and features we pass through
+static const uint32_t KM_URING_SETUP_FLAGS = IORING_SETUP_IOPOLL | IORING_SETUP_SQPOLL |
+                                             IORING_SETUP_SQ_AFF | IORING_SETUP_CQSIZE |
+                                             IORING_SETUP_CLAMP | IORING_SETUP_SUBMIT_ALL |
+                                             IORING_SETUP_COOP_TASKRUN;
+static const uint32_t KM_URING_FEATURES = IORING_FEAT_NODROP | IORING_FEAT_SUBMIT_STABLE |
+                                          IORING_FEAT_RW_CUR_POS | IORING_FEAT_CUR_PERSONALITY |
+                                          IORING_FEAT_FAST_POLL | IORING_FEAT_POLL_32BITS |
+                                          IORING_FEAT_SQPOLL_NONFIXED | IORING_FEAT_NATIVE_WORKERS |
+                                          IORING_FEAT_CQE_SKIP | IORING_FEAT_LINKED_FILE;
+
+#define KM_URING_OK 0x01           // supported
+#define KM_URING_FD 0x02           // sqe->fd is a file
+#define KM_URING_BUF 0x04          // addr, len is a buffer
+#define KM_URING_IOV 0x08          // addr, len is an iovec array
+#define KM_URING_MSG 0x10          // addr is a struct msghdr
+#define KM_URING_TS 0x20           // addr is a struct __kernel_timespec
+#define KM_URING_SOCKADDR 0x40     // addr, off is a struct sockaddr
+#define KM_URING_PBUF 0x80         // addr is fd buffers of len bytes each
+#define KM_URING_SPLICE_IN 0x100   // splice_fd_in is a file
+
+static const uint16_t km_uring_ops[IORING_OP_LAST] = {
+    [IORING_OP_NOP] = KM_URING_OK,
+    [IORING_OP_READV] = KM_URING_OK | KM_URING_FD | KM_URING_IOV,
+    [IORING_OP_WRITEV] = KM_URING_OK | KM_URING_FD | KM_URING_IOV,
+    [IORING_OP_FSYNC] = KM_URING_OK | KM_URING_FD,
+    [IORING_OP_READ_FIXED] = KM_URING_OK | KM_URING_FD | KM_URING_BUF,
+    [IORING_OP_WRITE_FIXED] = KM_URING_OK | KM_URING_FD | KM_URING_BUF,
+    [IORING_OP_POLL_ADD] = KM_URING_OK | KM_URING_FD,
+    [IORING_OP_POLL_REMOVE] = KM_URING_OK,
+    [IORING_OP_SYNC_FILE_RANGE] = KM_URING_OK | KM_URING_FD,
+    [IORING_OP_SENDMSG] = KM_URING_OK | KM_URING_FD | KM_URING_MSG,
+    [IORING_OP_TIMEOUT] = KM_URING_OK | KM_URING_TS,
+    [IORING_OP_TIMEOUT_REMOVE] = KM_URING_OK,
+    [IORING_OP_ASYNC_CANCEL] = KM_URING_OK,
+    [IORING_OP_LINK_TIMEOUT] = KM_URING_OK | KM_URING_TS,
+    [IORING_OP_CONNECT] = KM_URING_OK | KM_URING_FD | KM_URING_SOCKADDR,
+    [IORING_OP_FALLOCATE] = KM_URING_OK | KM_URING_FD,
+    [IORING_OP_READ] = KM_URING_OK | KM_URING_FD | KM_URING_BUF,
+    [IORING_OP_WRITE] = KM_URING_OK | KM_URING_FD | KM_URING_BUF,
+    [IORING_OP_FADVISE] = KM_URING_OK | KM_URING_FD,
+    [IORING_OP_SEND] = KM_URING_OK | KM_URING_FD | KM_URING_BUF,
+    [IORING_OP_RECV] = KM_URING_OK | KM_URING_FD | KM_URING_BUF,
+    [IORING_OP_SPLICE] = KM_URING_OK | KM_URING_FD | KM_URING_SPLICE_IN,
+    [IORING_OP_PROVIDE_BUFFERS] = KM_URING_OK | KM_URING_PBUF,
+    [IORING_OP_REMOVE_BUFFERS] = KM_URING_OK,
+    [IORING_OP_TEE] = KM_URING_OK | KM_URING_FD | KM_URING_SPLICE_IN,
+    [IORING_OP_SHUTDOWN] = KM_URING_OK | KM_URING_FD,
+};
+
+/*
+ * Translates guest buffer [gva, gva + len) to a km address, or KM_URING_EFAULT if it isn't all
+ * guest memory.
+ */
+static uint64_t km_uring_xlate(uint64_t gva, size_t len)
+{
+   km_kma_t kma;
+
+   if (gva == 0 && len == 0) {
+      return 0;
+   }
+   if ((kma = km_gva_range_to_kma(gva, len)) == NULL) {
+      return KM_URING_EFAULT;
+   }
+   return (uint64_t)kma;
+}
+
+// Returns the host fd for guest fd, or -1 (the kernel fails the request with -EBADF)
+static int km_uring_fd(int fd)
+{
+   km_file_ops_t* ops;
+   int hostfd = km_fs_g2h_fd(fd, &ops);
+
+   // files with km ops have to go through km
+   return (hostfd < 0 || ops != NULL) ? -1 : hostfd;
+}
+
+static int km_uring_iov(km_uring_slot_t* slot, uint64_t gva, size_t cnt, struct iovec** iovp)
+{
+   struct iovec* giov;
+
+   if (cnt > IOV_MAX ||
+       (uint64_t)(giov = (struct iovec*)km_uring_xlate(gva, cnt * sizeof(struct iovec))) == KM_URING_EFAULT) {
+      return -EFAULT;
+   }
+   if (cnt > slot->iov_cnt) {
+      struct iovec* iov = realloc(slot->iov, cnt * sizeof(struct iovec));
+      if (iov == NULL) {
+         return -ENOMEM;
+      }
+      slot->iov = iov;
+      slot->iov_cnt = cnt;
+   }
+   for (size_t i = 0; i < cnt; i++) {
+      slot->iov[i].iov_base = (void*)km_uring_xlate((uint64_t)giov[i].iov_base, giov[i].iov_len);
+      slot->iov[i].iov_len = giov[i].iov_len;
+   }
+   *iovp = slot->iov;
+   return 0;
+}
+
+static int km_uring_msg(km_uring_slot_t* slot, uint64_t gva)
+{
+   struct msghdr* gmsg;
+
+   if ((uint64_t)(gmsg = (struct msghdr*)km_uring_xlate(gva, sizeof(struct msghdr))) == KM_URING_EFAULT) {
+      return -EFAULT;
+   }
+   slot->msg = *gmsg;
+   slot->msg.msg_name = (void*)km_uring_xlate((uint64_t)gmsg->msg_name, gmsg->msg_namelen);
+   slot->msg.msg_control = (void*)km_uring_xlate((uint64_t)gmsg->msg_control, gmsg->msg_controllen);
+   return km_uring_iov(slot, (uint64_t)gmsg->msg_iov, gmsg->msg_iovlen, &slot->msg.msg_iov);
+}
+
+/*
+ * Turns a copy of a guest SQE into one the kernel can execute for us. Errors are left for the
+ * kernel to report in the CQE, the same way it does for the payload running natively.
+ */
+static void km_uring_sqe_xlate(km_uring_slot_t* slot, struct io_uring_sqe* sqe)
+{
+   uint16_t op = sqe->opcode < IORING_OP_LAST ? km_uring_ops[sqe->opcode] : 0;
+   struct iovec* iov;
+
+   if ((op & KM_URING_OK) == 0) {
+      km_infox(KM_TRACE_HC, "io_uring op %d not supported", sqe->opcode);
+      sqe->opcode = KM_URING_OP_INVALID;
+      return;
+   }
+   if ((op & KM_URING_FD) != 0 && (sqe->flags & IOSQE_FIXED_FILE) == 0) {
+      sqe->fd = km_uring_fd(sqe->fd);
+   }
+   if ((op & KM_URING_SPLICE_IN) != 0 && (sqe->splice_flags & SPLICE_F_FD_IN_FIXED) == 0) {
+      sqe->splice_fd_in = km_uring_fd(sqe->splice_fd_in);
+   }
+   if ((op & KM_URING_BUF) != 0 && (sqe->flags & IOSQE_BUFFER_SELECT) == 0) {
+      sqe->addr = km_uring_xlate(sqe->addr, sqe->len);
+   }
+   if ((op & KM_URING_PBUF) != 0) {
+      sqe->addr = km_uring_xlate(sqe->addr, (size_t)sqe->len * (uint32_t)sqe->fd);
+   }
+   if ((op & KM_URING_TS) != 0) {
+      sqe->addr = km_uring_xlate(sqe->addr, sizeof(struct __kernel_timespec));
+   }
+   if (sqe->opcode == IORING_OP_TIMEOUT_REMOVE && (sqe->timeout_flags & IORING_TIMEOUT_UPDATE) != 0) {
+      sqe->addr2 = km_uring_xlate(sqe->addr2, sizeof(struct __kernel_timespec));
+   }
+   if ((op & KM_URING_SOCKADDR) != 0) {
+      sqe->addr = km_uring_xlate(sqe->addr, sqe->addr2);
+   }
+   if ((op & KM_URING_IOV) != 0 && km_uring_iov(slot, sqe->addr, sqe->len, &iov) == 0) {
+      sqe->addr = (uint64_t)iov;
+   } else if ((op & KM_URING_IOV) != 0) {
+      sqe->addr = KM_URING_EFAULT;   // the kernel checks len first, so too many iovecs is -EINVAL
+   }
+   if ((op & KM_URING_MSG) != 0) {
+      sqe->addr = km_uring_msg(slot, sqe->addr) == 0 ? (uint64_t)&slot->msg : KM_URING_EFAULT;
+   }
+}
+
+static inline km_uring_sq_t* km_uring_gsq(km_uring_t* r)
+{
+   km_gva_t gsq = __atomic_load_n(&r->gsq, __ATOMIC_ACQUIRE);
+   return gsq == 0 ? NULL : km_gva_to_kma(gsq);
+}
+
+/*
+ * Moves up to max entries from the guest SQ to the host SQ and has the kernel pick them up.
+ * Returns the number of guest entries consumed, or -errno if the kernel refused and nothing was.
+ * Called with r->mutex held.
+ */
+static int km_uring_submit(km_uring_t* r, uint32_t max)
+{
+   km_uring_sq_t* gsq = km_uring_gsq(r);
+   struct io_uring_sqe* gsqes = r->gsqes == 0 ? NULL : km_gva_to_kma(r->gsqes);
+   uint32_t mask = r->entries - 1;
+   int ret = 0;
+   int n = 0;
+
+   if (gsq == NULL || gsqes == NULL) {
+      return 0;
+   }
+   uint32_t head = __atomic_load_n(&gsq->head, __ATOMIC_RELAXED);
+   uint32_t avail = __atomic_load_n(&gsq->tail, __ATOMIC_ACQUIRE) - head;
+   uint32_t host_head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+   if (avail > r->entries) {   // guest corrupted the ring, take what can be there
+      avail = r->entries;
+   }
+   for (; avail != 0 && n < max && r->sq_tail_local - host_head < r->entries; avail--, head++) {
+      uint32_t idx = gsq->array[head & mask];
+      if (idx >= r->entries) {
+         gsq->dropped++;
+         continue;
+      }
+      uint32_t slot = r->sq_tail_local++ & mask;
+      r->sqes[slot] = gsqes[idx];
+      km_uring_sqe_xlate(&r->slots[slot], &r->sqes[slot]);
+      n++;
+   }
+   __atomic_store_n(r->sq_tail, r->sq_tail_local, __ATOMIC_RELEASE);
+   __atomic_store_n(&gsq->head, head, __ATOMIC_RELEASE);
+
+   uint32_t pending = r->sq_tail_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+   if (r->host_sqpoll == 0 && pending != 0) {
+      ret = __syscall_6(SYS_io_uring_enter, r->fd, pending, 0, 0, 0, 0);
+   } else if (r->host_sqpoll != 0 && n != 0 &&
+              (__atomic_load_n(r->sq_flags, __ATOMIC_SEQ_CST) & IORING_SQ_NEED_WAKEUP) != 0) {
+      ret = __syscall_6(SYS_io_uring_enter, r->fd, 0, 0, IORING_ENTER_SQ_WAKEUP, 0, 0);
+   }
+   // entries the kernel didn't take stay in the host SQ for the next time
+   return (ret < 0 && n == 0) ? ret : n;
+}
+
+// The guest may need to enter to flush overflowed completions, tell it.
+static void km_uring_flags_sync(km_uring_t* r)
+{
+   km_uring_sq_t* gsq = km_uring_gsq(r);
+
+   if (gsq == NULL) {
+      return;
+   }
+   if ((__atomic_load_n(r->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW) != 0) {
+      __atomic_or_fetch(&gsq->flags, IORING_SQ_CQ_OVERFLOW, __ATOMIC_RELAXED);
+   } else {
+      __atomic_and_fetch(&gsq->flags, ~IORING_SQ_CQ_OVERFLOW, __ATOMIC_RELAXED);
+   }
+}
+
+static inline uint64_t km_uring_msecs(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+   return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * SQPOLL thread. Polls the guest SQ until it's idle for sq_thread_idle, then sets
+ * IORING_SQ_NEED_WAKEUP and sleeps until the guest calls io_uring_enter(IORING_ENTER_SQ_WAKEUP).
+ */
+static void* km_uring_sqpoll(void* data)
+{
+   km_uring_t* r = data;
+   uint64_t last = km_uring_msecs();
+   sigset_t all;
+
+   // signals are for vcpu threads
+   sigfillset(&all);
+   pthread_sigmask(SIG_BLOCK, &all, NULL);
+   while (__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE) == 0) {
+      km_mutex_lock(&r->mutex);
+      int n = km_uring_submit(r, UINT32_MAX);
+      km_mutex_unlock(&r->mutex);
+      if (n > 0) {
+         last = km_uring_msecs();
+         continue;
+      }
+      if (km_uring_msecs() - last < r->idle_ms) {
+         __builtin_ia32_pause();
+         continue;
+      }
+      km_uring_sq_t* gsq = km_uring_gsq(r);
+      if (gsq != NULL) {
+         __atomic_or_fetch(&gsq->flags, IORING_SQ_NEED_WAKEUP, __ATOMIC_SEQ_CST);
+         if (__atomic_load_n(&gsq->tail, __ATOMIC_SEQ_CST) != __atomic_load_n(&gsq->head, __ATOMIC_SEQ_CST)) {
+            __atomic_and_fetch(&gsq->flags, ~IORING_SQ_NEED_WAKEUP, __ATOMIC_SEQ_CST);
+            continue;
+         }
+      }
+      uint64_t val;
+      (void)read(r->efd, &val, sizeof(val));
+      if (gsq != NULL) {
+         __atomic_and_fetch(&gsq->flags, ~IORING_SQ_NEED_WAKEUP, __ATOMIC_SEQ_CST);
+      }
+      last = km_uring_msecs();
+   }
+   return NULL;
+}
+
+static void km_uring_wakeup(km_uring_t* r)
+{
+   uint64_t val = 1;
+
+   if (r->sqpoll != 0) {
+      (void)write(r->efd, &val, sizeof(val));
+   }
+}
+
+static void km_uring_free(km_uring_t* r)
+{
+   if (r->sq_ring != NULL) {
+      munmap(r->sq_ring, r->sq_ring_size);
+   }
+   if (r->sqes != NULL) {
+      munmap(r->sqes, r->entries * sizeof(struct io_uring_sqe));
+   }
+   if (r->slots != NULL) {
+      for (int i = 0; i < r->entries; i++) {
+         free(r->slots[i].iov);
+      }
+      free(r->slots);
+   }
+   if (r->efd >= 0) {
+      close(r->efd);
+   }
+   free(r);
+}
+
+static km_uring_t* km_uring_get(int fd)
+{
+   km_uring_t* r;
+
+   if (__atomic_load_n(&km_uring_count, __ATOMIC_ACQUIRE) == 0) {
+      return NULL;
+   }
+   km_mutex_lock(&km_urings_mutex);
+   TAILQ_FOREACH (r, &km_urings, link) {
+      if (r->fd == fd) {
+         r->refs++;
+         break;
+      }
+   }
+   km_mutex_unlock(&km_urings_mutex);
+   return r;
+}
+
+static void km_uring_put(km_uring_t* r)
+{
+   km_mutex_lock(&km_urings_mutex);
+   int refs = --r->refs;
+   km_mutex_unlock(&km_urings_mutex);
+   if (refs == 0) {
+      km_uring_free(r);
+   }
+}
+
+int km_uring_setup(km_vcpu_t* vcpu, unsigned int entries, struct io_uring_params* p)
+{
+   struct io_uring_params hp = {.flags = p->flags,
+                                .cq_entries = p->cq_entries,
+                                .sq_thread_cpu = p->sq_thread_cpu,
+                                .sq_thread_idle = p->sq_thread_idle};
+   km_uring_t* r;
+   int ret;
+   int fd;
+
+   if ((p->flags & ~KM_URING_SETUP_FLAGS) != 0) {
+      return -EINVAL;
+   }
+   fd = __syscall_2(SYS_io_uring_setup, entries, (uint64_t)&hp);
+   if (fd == -EPERM && (p->flags & IORING_SETUP_SQPOLL) != 0) {
+      // older kernels want privileges for SQPOLL, the km thread still saves the exits
+      hp = (struct io_uring_params){.flags = p->flags & ~(IORING_SETUP_SQPOLL | IORING_SETUP_SQ_AFF),
+                                    .cq_entries = p->cq_entries};
+      fd = __syscall_2(SYS_io_uring_setup, entries, (uint64_t)&hp);
+   }
+   if (fd < 0) {
+      return fd;
+   }
+   if ((hp.features & IORING_FEAT_SUBMIT_STABLE) == 0) {
+      // the iovec copies in km_uring_slot_t are reused as soon as the kernel consumes the SQE
+      km_infox(KM_TRACE_HC, "io_uring: kernel doesn't have IORING_FEAT_SUBMIT_STABLE");
+      close(fd);
+      return -ENOSYS;
+   }
+   km_uring_close(fd);   // stale, if the guest closed the previous ring with this fd via dup2()
+   if ((r = calloc(1, sizeof(km_uring_t))) == NULL) {
+      close(fd);
+      return -ENOMEM;
+   }
+   r->fd = fd;
+   r->refs = 1;
+   r->mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+   r->efd = -1;
+   r->entries = hp.sq_entries;
+   r->sq_ring_size = hp.sq_off.array + hp.sq_entries * sizeof(uint32_t);
+   r->sq_ring =
+       mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+   r->sqes = mmap(NULL,
+                  r->entries * sizeof(struct io_uring_sqe),
+                  PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE,
+                  fd,
+                  IORING_OFF_SQES);
+   r->slots = calloc(r->entries, sizeof(km_uring_slot_t));
+   if (r->sq_ring == MAP_FAILED || r->sqes == MAP_FAILED || r->slots == NULL) {
+      r->sq_ring = r->sq_ring == MAP_FAILED ? NULL : r->sq_ring;
+      r->sqes = r->sqes == MAP_FAILED ? NULL : r->sqes;
+      ret = -ENOMEM;
+      goto fail;
+   }
+   r->sq_head = r->sq_ring + hp.sq_off.head;
+   r->sq_tail = r->sq_ring + hp.sq_off.tail;
+   r->sq_flags = r->sq_ring + hp.sq_off.flags;
+   r->sq_tail_local = *r->sq_tail;
+   uint32_t* array = r->sq_ring + hp.sq_off.array;
+   for (uint32_t i = 0; i < r->entries; i++) {
+      array[i] = i;   // host SQE slots are used in order, see km_uring_submit()
+   }
+   r->host_sqpoll = (hp.flags & IORING_SETUP_SQPOLL) != 0;
+   if ((p->flags & IORING_SETUP_SQPOLL) != 0) {
+      r->sqpoll = 1;
+      r->idle_ms = p->sq_thread_idle != 0 ? p->sq_thread_idle : 1000;
+      if ((r->efd = km_internal_eventfd(0, 0)) < 0) {
+         ret = -errno;
+         goto fail;
+      }
+      if ((ret = -pthread_create(&r->thread, NULL, km_uring_sqpoll, r)) != 0) {
+         goto fail;
+      }
+   }
+   km_fs_add_io_uring_fd(vcpu, fd);
+
+   uint32_t flags = p->flags;
+   *p = hp;
+   p->flags = flags;
+   p->features &= KM_URING_FEATURES;   // no SINGLE_MMAP, SQ and CQ rings are different memory
+   p->sq_off = (struct io_sqring_offsets){.head = offsetof(km_uring_sq_t, head),
+                                          .tail = offsetof(km_uring_sq_t, tail),
+                                          .ring_mask = offsetof(km_uring_sq_t, ring_mask),
+                                          .ring_entries = offsetof(km_uring_sq_t, ring_entries),
+                                          .flags = offsetof(km_uring_sq_t, flags),
+                                          .dropped = offsetof(km_uring_sq_t, dropped),
+                                          .array = offsetof(km_uring_sq_t, array)};
+
+   km_mutex_lock(&km_urings_mutex);
+   TAILQ_INSERT_TAIL(&km_urings, r, link);
+   __atomic_add_fetch(&km_uring_count, 1, __ATOMIC_SEQ_CST);
+   km_mutex_unlock(&km_urings_mutex);
+   km_infox(KM_TRACE_HC,
+            "io_uring fd %d entries %d/%d sqpoll %d/%d",
+            fd,
+            hp.sq_entries,
+            hp.cq_entries,
+            r->sqpoll,
+            r->host_sqpoll);
+   return fd;
+
+fail:
+   km_uring_free(r);
+   close(fd);
+   return ret;
+}
+
+/*
+ * The signal mask argument is ignored, payload signals are delivered by km once we are back in
+ * the guest.
+ */
+int km_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+   km_uring_t* r;
+   int ret;
+
+   if ((flags & ~(IORING_ENTER_GETEVENTS | IORING_ENTER_SQ_WAKEUP | IORING_ENTER_SQ_WAIT)) != 0) {
+      return -EINVAL;   // no EXT_ARG in the features we return
+   }
+   if ((r = km_uring_get(fd)) == NULL) {
+      return km_fs_g2h_fd(fd, NULL) < 0 ? -EBADF : -EOPNOTSUPP;
+   }
+   km_mutex_lock(&r->mutex);
+   int submitted = km_uring_submit(r, r->sqpoll != 0 ? UINT32_MAX : to_submit);
+   km_mutex_unlock(&r->mutex);
+   if ((flags & IORING_ENTER_SQ_WAKEUP) != 0) {
+      km_uring_wakeup(r);
+   }
+   ret = submitted;
+   if (ret >= 0 && (flags & IORING_ENTER_GETEVENTS) != 0) {
+      // don't hold r->mutex while waiting, other vcpus and the SQPOLL thread keep submitting
+      ret = __syscall_6(SYS_io_uring_enter, fd, 0, min_complete, IORING_ENTER_GETEVENTS, 0, 0);
+   }
+   km_uring_flags_sync(r);
+   if (r->sqpoll != 0 && ret >= 0) {
+      ret = to_submit;   // like the kernel does for SQPOLL
+   } else if (submitted > 0) {
+      ret = submitted;
+   }
+   km_uring_put(r);
+   return ret;
+}
+
+static int km_uring_register_buffers(int fd, km_gva_t arg, unsigned int nr_args)
+{
+   struct iovec* giov;
+   struct iovec* iov;
+   int ret;
+
+   if ((uint64_t)(giov = (struct iovec*)km_uring_xlate(arg, nr_args * sizeof(struct iovec))) ==
+       KM_URING_EFAULT) {
+      return -EFAULT;
+   }
+   if ((iov = calloc(nr_args, sizeof(struct iovec))) == NULL) {
+      return -ENOMEM;
+   }
+   for (int i = 0; i < nr_args; i++) {
+      iov[i].iov_base = (void*)km_uring_xlate((uint64_t)giov[i].iov_base, giov[i].iov_len);
+      iov[i].iov_len = giov[i].iov_len;
+      if ((uint64_t)iov[i].iov_base == KM_URING_EFAULT) {
+         free(iov);
+         return -EFAULT;
+      }
+   }
+   ret = __syscall_4(SYS_io_uring_register, fd, IORING_REGISTER_BUFFERS, (uint64_t)iov, nr_args);
+   free(iov);
+   return ret;
+}
+
+int km_uring_register(int fd, unsigned int opcode, km_gva_t arg, unsigned int nr_args)
+{
+   km_uring_t* r;
+   int* fds;
+   struct io_uring_probe* probe;
+   int ret;
+
+   if ((r = km_uring_get(fd)) == NULL) {
+      return km_fs_g2h_fd(fd, NULL) < 0 ? -EBADF : -EOPNOTSUPP;
+   }
+   switch (opcode) {
+      case IORING_REGISTER_BUFFERS:
+         ret = km_uring_register_buffers(fd, arg, nr_args);
+         break;
+
+      case IORING_REGISTER_FILES:
+      case IORING_REGISTER_EVENTFD:
+      case IORING_REGISTER_EVENTFD_ASYNC:
+         if ((uint64_t)(fds = (int*)km_uring_xlate(arg, nr_args * sizeof(int))) == KM_URING_EFAULT) {
+            ret = -EFAULT;
+            break;
+         }
+         ret = 0;
+         for (int i = 0; i < nr_args; i++) {
+            if (fds[i] != -1 && km_uring_fd(fds[i]) < 0) {   // -1 is a sparse file table slot
+               ret = -EBADF;
+               break;
+            }
+         }
+         if (ret == 0) {
+            ret = __syscall_4(SYS_io_uring_register, fd, opcode, (uint64_t)fds, nr_args);
+         }
+         break;
+
+      case IORING_REGISTER_PROBE:
+         if ((uint64_t)(probe = (struct io_uring_probe*)km_uring_xlate(
+                            arg,
+                            sizeof(struct io_uring_probe) + nr_args * sizeof(struct io_uring_probe_op))) ==
+             KM_URING_EFAULT) {
+            ret = -EFAULT;
+            break;
+         }
+         if ((ret = __syscall_4(SYS_io_uring_register, fd, opcode, (uint64_t)probe, nr_args)) == 0) {
+            for (int i = 0; i < probe->ops_len && i < nr_args; i++) {
+               uint8_t op = probe->ops[i].op;
+               if (op >= IORING_OP_LAST || (km_uring_ops[op] & KM_URING_OK) == 0) {
+                  probe->ops[i].flags &= ~IO_URING_OP_SUPPORTED;
+               }
+            }
+         }
+         break;
+
+      case IORING_UNREGISTER_BUFFERS:
+      case IORING_UNREGISTER_FILES:
+      case IORING_UNREGISTER_EVENTFD:
+         ret = __syscall_4(SYS_io_uring_register, fd, opcode, arg, nr_args);
+         break;
+
+      default:
+         km_infox(KM_TRACE_HC, "io_uring_register opcode %d not supported", opcode);
+         ret = -EINVAL;
+         break;
+   }
+   km_uring_put(r);
+   return ret;
+}
+
+/*
+ * mmap() of an io_uring fd. The SQ ring and the SQEs are guest memory km reads the entries from,
+ * the CQ ring is mapped from the host ring as usual. Returns 1 if the call was handled here and
+ * the result is in *ret.
+ */
+int km_uring_mmap(km_gva_t gva, size_t size, int prot, int flags, int fd, off_t offset, km_gva_t* ret)
+{
+   km_uring_t* r;
+   km_gva_t* mapped;
+   size_t need;
+
+   if (fd < 0 || (flags & MAP_ANONYMOUS) != 0 || (r = km_uring_get(fd)) == NULL) {
+      return 0;
+   }
+   switch (offset) {
+      case IORING_OFF_SQ_RING:
+         need = offsetof(km_uring_sq_t, array) + r->entries * sizeof(uint32_t);
+         mapped = &r->gsq;
+         break;
+      case IORING_OFF_SQES:
+         need = r->entries * sizeof(struct io_uring_sqe);
+         mapped = &r->gsqes;
+         break;
+      default:
+         km_uring_put(r);
+         return 0;
+   }
+   km_mutex_lock(&r->mutex);
+   if (*mapped != 0 || size < need) {
+      *ret = -EINVAL;
+   } else if (km_syscall_ok(*ret = km_guest_mmap(
+                                gva, size, prot, (flags & ~MAP_TYPE) | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) >= 0) {
+      if (offset == IORING_OFF_SQ_RING) {
+         km_uring_sq_t* gsq = km_gva_to_kma(*ret);
+         memset(gsq, 0, need);
+         gsq->ring_mask = r->entries - 1;
+         gsq->ring_entries = r->entries;
+      }
+      __atomic_store_n(mapped, *ret, __ATOMIC_RELEASE);
+   }
+   km_mutex_unlock(&r->mutex);
+   if (offset == IORING_OFF_SQ_RING) {
+      km_uring_wakeup(r);   // the SQPOLL thread had nothing to poll so far
+   }
+   km_uring_put(r);
+   return 1;
+}
+
+/*
+ * Called on guest close() of any fd.
+ */
+void km_uring_close(int fd)
+{
+   km_uring_t* r;
+
+   if (__atomic_load_n(&km_uring_count, __ATOMIC_ACQUIRE) == 0) {
+      return;
+   }
+   km_mutex_lock(&km_urings_mutex);
+   TAILQ_FOREACH (r, &km_urings, link) {
+      if (r->fd == fd) {
+         TAILQ_REMOVE(&km_urings, r, link);
+         __atomic_sub_fetch(&km_uring_count, 1, __ATOMIC_SEQ_CST);
+         break;
+      }
+   }
+   km_mutex_unlock(&km_urings_mutex);
+   if (r == NULL) {
+      return;
+   }
+   if (r->sqpoll != 0) {
+      __atomic_store_n(&r->stop, 1, __ATOMIC_RELEASE);
+      km_uring_wakeup(r);
+      pthread_join(r->thread, NULL);
+   }
+   km_uring_put(r);
+}
+
+/*
+ * Fork child. The rings are shared with the parent which keeps using them, and the SQPOLL threads
+ * stayed there. Forget them, io_uring_enter() on the inherited fds fails with -EOPNOTSUPP.
+ */
+void km_uring_fork_child(void)
+{
+   km_uring_t* r;
+
+   while ((r = TAILQ_FIRST(&km_urings)) != NULL) {
+      TAILQ_REMOVE(&km_urings, r, link);
+      km_uring_free(r);
+   }
+   km_uring_count = 0;
+   km_urings_mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+}
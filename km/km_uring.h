@@ -0,0 +1,33 @@
+/*
+ * Copyright 2021 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __KM_URING_H__
+#define __KM_URING_H__
+
+#include <linux/io_uring.h>
+
+#include "km.h"
+
+extern unsigned int km_uring_count;   // number of open io_uring instances
+
+int km_uring_setup(km_vcpu_t* vcpu, unsigned int entries, struct io_uring_params* p);
+int km_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags);
+int km_uring_register(int fd, unsigned int opcode, km_gva_t arg, unsigned int nr_args);
+int km_uring_mmap(km_gva_t gva, size_t size, int prot, int flags, int fd, off_t offset, km_gva_t* ret);
+void km_uring_close(int fd);
+void km_uring_fork_child(void);
+
+#endif   // !defined(__KM_URING_H__)
@@ -255,7 +255,9 @@ static char* dump_events(km_vcpu_t* vcpu, char* buf, size_t len)
    char* cur = buf;
    size_t rem = len;
 
-   if (ioctl(vcpu->kvm_vcpu_fd, KVM_GET_VCPU_EVENTS, &events) < 0) {
+   if (km_vcpu_sync_regs(vcpu) != 0) {
+      events = vcpu->cpu_run->s.regs.events;
+   } else if (ioctl(vcpu->kvm_vcpu_fd, KVM_GET_VCPU_EVENTS, &events) < 0) {
       fprintf(stderr, "KVM_GET_VCPU_EVENTS failed: %d - %s\n", errno, strerror(errno));
       return NULL;
    }
@@ -329,7 +331,9 @@ void km_read_registers(km_vcpu_t* vcpu)
    if (vcpu->regs_valid != 0) {
       return;
    }
-   if (ioctl(vcpu->kvm_vcpu_fd, KVM_GET_REGS, &vcpu->regs) < 0) {
+   if (km_vcpu_sync_regs(vcpu) != 0) {
+      vcpu->regs = vcpu->cpu_run->s.regs.regs;
+   } else if (ioctl(vcpu->kvm_vcpu_fd, KVM_GET_REGS, &vcpu->regs) < 0) {
       km_warn("KVM_GET_REGS failed");
       return;
    }
@@ -341,6 +345,11 @@ void km_write_registers(km_vcpu_t* vcpu)
    if (vcpu->regs_valid == 0) {
       km_errx(2, "registers not valid");
    }
+   if (km_vcpu_sync_regs(vcpu) != 0) {
+      vcpu->cpu_run->s.regs.regs = vcpu->regs;   // KVM picks it up on the next KVM_RUN
+      vcpu->cpu_run->kvm_dirty_regs |= KVM_SYNC_X86_REGS;
+      return;
+   }
    if (ioctl(vcpu->kvm_vcpu_fd, KVM_SET_REGS, &vcpu->regs) < 0) {
       km_warn("KVM_SET_REGS failed");
       return;
@@ -355,7 +364,9 @@ void km_read_sregisters(km_vcpu_t* vcpu)
    if (vcpu->sregs_valid != 0) {
       return;
    }
-   if (ioctl(vcpu->kvm_vcpu_fd, KVM_GET_SREGS, &vcpu->sregs) < 0) {
+   if (km_vcpu_sync_regs(vcpu) != 0) {
+      vcpu->sregs = vcpu->cpu_run->s.regs.sregs;
+   } else if (ioctl(vcpu->kvm_vcpu_fd, KVM_GET_SREGS, &vcpu->sregs) < 0) {
       km_warn("KVM_GET_SREGS failed");
       return;
    }
@@ -367,6 +378,11 @@ void km_write_sregisters(km_vcpu_t* vcpu)
    if (vcpu->sregs_valid == 0) {
       km_errx(2, "sregisters not valid");
    }
+   if (km_vcpu_sync_regs(vcpu) != 0) {
+      vcpu->cpu_run->s.regs.sregs = vcpu->sregs;
+      vcpu->cpu_run->kvm_dirty_regs |= KVM_SYNC_X86_SREGS;
+      return;
+   }
    if (ioctl(vcpu->kvm_vcpu_fd, KVM_SET_SREGS, &vcpu->sregs) < 0) {
       km_warn("KVM_SET_SREGS failed");
       return;
@@ -389,6 +405,48 @@ void km_write_xcrs(km_vcpu_t* vcpu)
    }
 }
 
+/*
+ * Hypercalls are "outl %eax, (%dx)", see km_hcall() and km_guest_asmcode.s.
+ */
+static const uint8_t KM_HCALL_OUT_OPCODE = 0xef;
+
+/*
+ * Make vcpu RIP point to the instruction after the hypercall OUT, so we can build signal frames,
+ * start clones, take snapshots or restart the hypercall from a consistent state.
+ *
+ * Where RIP is on KVM_EXIT_IO depends on the host. Recent KVM leaves it on the OUT and skips the
+ * instruction on the next KVM_RUN, but only if RIP wasn't changed in the meantime. Older kernels
+ * and some nested hosts (azure) advance RIP before the exit. With KVM_CAP_SYNC_REGS we have the
+ * exit RIP for free, so we look at the opcode and advance it ourselves if needed, the write goes
+ * back with the next KVM_RUN. Our hypercalls are never followed by another OUT so the check is
+ * unambiguous, and repeated calls are harmless. Only KVM_EXIT_IO leaves an OUT in flight, on other
+ * exits RIP points to an instruction that hasn't run yet, even if it is an OUT.
+ *
+ * Without sync regs (KKM, old kernels) we use an extra KVM_RUN with immediate_exit, which doesn't
+ * run guest code but completes the OUT and sets RIP to the right location.
+ */
+void km_vcpu_sync_rip(km_vcpu_t* vcpu)
+{
+   if (km_vcpu_sync_regs(vcpu) != 0) {
+      if (vcpu->cpu_run->exit_reason != KVM_EXIT_IO) {
+         return;   // not in a hypercall, RIP is where the guest stopped
+      }
+      km_read_registers(vcpu);
+      uint8_t* op = km_gva_to_kma(vcpu->regs.rip);
+      if (op != NULL && *op == KM_HCALL_OUT_OPCODE) {
+         vcpu->regs.rip++;
+         km_write_registers(vcpu);
+      }
+      return;
+   }
+   vcpu->cpu_run->immediate_exit = 1;
+   (void)ioctl(vcpu->kvm_vcpu_fd, KVM_RUN, NULL);
+   errno = 0;   // reset EINTR from ioctl above
+   vcpu->cpu_run->immediate_exit = 0;
+   vcpu->regs_valid = 0;   // cached copy is stale
+   vcpu->sregs_valid = 0;
+}
+
 /*
  * return non-zero and set status if guest halted
  */
@@ -438,11 +496,22 @@ static int hypercall(km_vcpu_t* vcpu, int* hc_ret)
       clock_gettime(CLOCK_MONOTONIC, &start);
    }
    km_hc_ret_t ret = HC_CONTINUE;
-   if (km_hcalls_table[hc] != NULL) {
+   // calls queued in the submission ring go before this one
+   if (hc != HC_hcall_ring && km_hcall_ring_pending(vcpu) != 0) {
+      (void)km_hcall_ring_drain(vcpu);
+   }
+   // so do asynchronous calls on the same fd, and their errors are returned instead
+   int async_err = km_hc_async_fence(hc, ga_kma);
+   if (async_err != 0 && hc != SYS_close) {
+      ga_kma->hc_ret = async_err;
+      vcpu->restart = 0;
+   } else if (km_hcalls_table[hc] != NULL) {
       ret = km_hcalls_table[hc](vcpu, hc, ga_kma);
+      if (async_err != 0 && ga_kma->hc_ret == 0) {
+         ga_kma->hc_ret = async_err;   // close() still closes the fd
+      }
       // check for interrupted hypercall, set restart if needed
       if (ga_kma->hc_ret == -EINTR && vcpu->state == HCALL_INT) {
-         vcpu->regs_valid = 0;
          km_vcpu_sync_rip(vcpu);   // sync RIP with KVM
          vcpu->restart = 1;
       } else {
@@ -455,13 +524,9 @@ static int hypercall(km_vcpu_t* vcpu, int* hc_ret)
    *hc_ret = ga_kma->hc_ret;
    if (km_collect_hc_stats != 0) {
       clock_gettime(CLOCK_MONOTONIC, &stop);
-      uint64_t msecs = (stop.tv_sec - start.tv_sec) * 1000000000 + stop.tv_nsec - start.tv_nsec;
-      km_infox(KM_TRACE_HC, "calling hc = %d (%s) time=%ld", hc, km_hc_name_get(hc), msecs);
-      km_hc_stats_t* hstat = &km_hcalls_stats[hc];
-      hstat->min = MIN(msecs, hstat->min);
-      hstat->max = MAX(msecs, hstat->max);
-      hstat->total += msecs;
-      hstat->count++;
+      uint64_t nsecs = (stop.tv_sec - start.tv_sec) * 1000000000 + stop.tv_nsec - start.tv_nsec;
+      km_infox(KM_TRACE_HC, "calling hc = %d (%s) time=%ld", hc, km_hc_name_get(hc), nsecs);
+      km_hc_stats_record(vcpu, hc, nsecs);
    }
    return ret;
 }
@@ -494,6 +559,7 @@ static void km_vcpu_one_kvm_run(km_vcpu_t* vcpu)
    vcpu->cpu_run->exit_reason = KVM_EXIT_UNKNOWN;   // Clear exit_reason from the preceding ioctl
    vcpu->regs_valid = 0;                            // Invalidate cached registers
    vcpu->sregs_valid = 0;
+   km_vcpu_sync_regs_request(vcpu);
    km_infox(KM_TRACE_VCPU, "about to ioctl( KVM_RUN )");
    errno = 0;
    rc = ioctl(vcpu->kvm_vcpu_fd, KVM_RUN, NULL);
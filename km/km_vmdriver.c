@@ -41,6 +41,12 @@ void km_vmdriver_machine_init(void)
          if (ioctl(machine.mach_fd, KVM_CHECK_EXTENSION, KVM_CAP_XSAVE) == 1) {
             machine.vmtype_u.kvm.xsave = 1;
          }
+         // can registers come with KVM_RUN exit? Returns the mask of supported fields
+         int sync = ioctl(machine.mach_fd, KVM_CHECK_EXTENSION, KVM_CAP_SYNC_REGS);
+         if (sync > 0 && (sync & KM_SYNC_REGS_FIELDS) == KM_SYNC_REGS_FIELDS) {
+            machine.vmtype_u.kvm.sync_regs = 1;
+         }
+         km_infox(KM_TRACE_KVM, "KVM_CAP_SYNC_REGS 0x%x", sync);
          break;
       case VM_TYPE_KKM:
          // Anything for KKM?
@@ -33,12 +33,23 @@ km_payload_t km_guest;
 km_payload_t km_dynlinker;
 
 /*
- * Setup mmap for described by ELF file Phdr.
+ * Setup mmap for described by ELF file Phdr. hugetlb memory under brk (see km_mem.c) can't be
+ * partially replaced, so it is read there.
  */
-static void map_program_section(int fd, void* buf, size_t count, off_t offset)
+static void map_program_section(int fd, km_gva_t gva, size_t count, off_t offset)
 {
+   void* buf = km_gva_to_kma_nocheck(gva);
+
    if (count > 0) {
-      if (mmap(buf, count, PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset) == MAP_FAILED) {
+      if (km_mem_hugetlb(gva) != 0) {
+         for (size_t done = 0; done < count;) {
+            ssize_t rc = pread(fd, buf + done, count - done, offset + done);
+            if (rc <= 0) {
+               km_err(2, "error reading elf");
+            }
+            done += rc;
+         }
+      } else if (km_mem_map(gva, count, PROT_WRITE, MAP_PRIVATE, fd, offset) == MAP_FAILED) {
          km_err(2, "error mmap elf");
       }
       if (count != roundup(count, KM_PAGE_SIZE)) {
@@ -84,12 +95,13 @@ static void load_extent(int fd, const Elf64_Phdr* phdr, km_gva_t base)
     */
    Elf64_Xword p_memsz = phdr->p_memsz;
    Elf64_Xword p_filesz = phdr->p_filesz;
-   km_kma_t addr = km_gva_to_kma_nocheck(phdr->p_paddr) + base;
-   uint64_t extra = addr - (km_kma_t)rounddown((uint64_t)addr, KM_PAGE_SIZE);
-   map_program_section(fd, addr - extra, p_filesz + extra, phdr->p_offset - extra);
+   km_gva_t gva = phdr->p_paddr + base;
+   km_kma_t addr = km_gva_to_kma_nocheck(gva);
+   uint64_t extra = gva - rounddown(gva, KM_PAGE_SIZE);
+   map_program_section(fd, gva - extra, p_filesz + extra, phdr->p_offset - extra);
    memset(addr + p_filesz, 0, p_memsz - p_filesz);
    int pr = prot_elf_to_mmap(phdr->p_flags);
-   if (mprotect(addr - extra, p_memsz + extra, protection_adjust(pr)) < 0) {
+   if (km_mem_protect(gva - extra, p_memsz + extra, pr) != 0) {
       km_err(2, "failed to set guest memory protection");
    }
 }
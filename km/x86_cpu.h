@@ -159,6 +159,16 @@ typedef struct x86_pte_4k {
    uint64_t xd : 1;          // execute disable
 } x86_pte_4k_t;
 
+/*
+ * The same bits in all of the above, for code that handles entries as uint64_t
+ */
+#define X86_PTE_P (1ul << 0)                // present
+#define X86_PTE_RW (1ul << 1)               // read/write
+#define X86_PTE_US (1ul << 2)               // user/supervisor
+#define X86_PTE_PS (1ul << 7)               // page size, in pdpte and pde
+#define X86_PTE_G (1ul << 8)                // global, in entries that map a page
+#define X86_PTE_ADDR 0x000ffffffffff000ul   // physical address of the page or the next table
+
 /*
  * Intel SDM, Vol3, 2.5 CONTROL REGISTERS, Figure 2-7 and surrounding text
  */
@@ -283,6 +293,10 @@ typedef struct x86_pte_4k {
 // 21-31 Intel Reserved
 // 32-255 User Defined.
 
+// Page fault error code, Intel SDM, Vol3, Figure 4-12
+#define X86_PF_P (1ul << 0)   // protection violation, otherwise page not present
+#define X86_PF_W (1ul << 1)   // write access
+
 #define X86_IDT_NENTRY (256)
 
 /*
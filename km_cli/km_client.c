@@ -17,7 +17,8 @@
 /*
  * Command line description:
  *
- * km_cli [-c cmdname] [-p processid] [-d snapshotdir] [-s socket_name] [-l] [-t] [-r]
+ * km_cli [-c cmdname] [-p processid] [-d snapshotdir] [-s socket_name] [-b base_snapshot] [-l] [-t]
+ *        [-r] [-H] [-M] [-L]
  *
  * There are 2 parts to this command, selection of processes to snapshot and then
  * snapshotting the selected processes.
@@ -40,6 +41,12 @@
  *
  * The -l flag causes debug logging to stderr to happen.
  * The -t flag causes the km payload to terminate after the snapshot is taken.
+ * The -H flag prints the hypercall latency stats of the selected processes instead of taking
+ * snapshots. km has to run with --hcall-stats.
+ * The -M flag prints how much guest memory the selected processes gave back to the host instead.
+ * The -b flag makes the snapshot, and the later ones of the same km, a layer of snapshot file
+ * base_snapshot, named as km sees it. It only has the pages that differ from the base.
+ * The -L flag prints the snapshot files the selected processes resumed from and use as parents.
  */
 
 /*
@@ -96,6 +103,8 @@ size_t pnul = 0;
 
 int debug = 0;
 int terminate_app = 1;   // by default the payload is terminated after the snapshot is taken
+int stats = 0;           // -H, -M or -L, print these stats instead of taking a snapshot
+char* base_snapshot = NULL;   // -b, snapshots are layers of this one
 
 // Upper limit of -c and -p arguments
 #define MAXPIDS 32    // -p limit
@@ -113,7 +122,7 @@ void usage(void)
 {
    fprintf(stderr,
            "Usage: %s [-l] [-c commandname] [-d snapshot_dirname] [-p processid] [-s "
-           "socket_name] [-t] [-r]\n",
+           "socket_name] [-b base_snapshot] [-t] [-r] [-H] [-M] [-L]\n",
            cmdname);
    fprintf(stderr, "       -l   = turn on debug logging\n");
    fprintf(stderr,
@@ -122,12 +131,20 @@ void usage(void)
    fprintf(stderr, "       -p   = search for km processes with a process id (max of %d pids)\n", MAXPIDS);
    fprintf(stderr, "       -d   = place snapshots in the specified directory\n");
    fprintf(stderr, "       -s   = use socket_name to request a snapshot\n");
+   fprintf(stderr, "       -b   = snapshots only have memory that differs from base_snapshot\n");
    fprintf(stderr, "       -t   = terminate the km payload after the snapshot completes (default)\n");
    fprintf(stderr, "       -r   = the payload resumes after the snapshot completes\n");
+   fprintf(stderr, "       -H   = print hypercall latency stats instead of taking a snapshot\n");
+   fprintf(stderr, "       -M   = print guest memory returned to the host instead of taking a snapshot\n");
+   fprintf(stderr, "       -L   = print the snapshot layers instead of taking a snapshot\n");
    fprintf(stderr, "       -c and -p flags may be specified multiplte times\n");
 }
 
-int send_request(char* sock_name, void* reqp, size_t reqlen)
+/*
+ * Send a request to km and wait for the reply. If out is not NULL, whatever km sends after a
+ * successful reply is copied to it. If replyp is not NULL it gets the reply.
+ */
+int send_request(char* sock_name, void* reqp, size_t reqlen, FILE* out, mgmtreply_t* replyp)
 {
    int sockfd;
    int rc;
@@ -171,9 +188,17 @@ int send_request(char* sock_name, void* reqp, size_t reqlen)
    } else if (br != sizeof(reply)) {
       fprintf(stderr, "reply too small, got %ld bytes, expected %ld bytes\n", br, sizeof(reply));
       reply.request_status = EINVAL;
+   } else if (out != NULL && reply.request_status == 0) {
+      char buf[4096];
+      while ((br = recv(sockfd, buf, sizeof(buf), 0)) > 0) {
+         fwrite(buf, 1, br, out);
+      }
    }
 
    close(sockfd);
+   if (replyp != NULL) {
+      *replyp = reply;
+   }
    return reply.request_status;
 }
 
@@ -213,13 +238,25 @@ int snapshot_process(char* sockname, char* snapshot_file, char* label, char* des
               snapshot_file,
               sizeof(req.requests.snapshot_req.snapshot_path));
    }
+   req.requests.snapshot_req.base_path[0] = 0;
+   if (base_snapshot != NULL) {
+      if (strlen(base_snapshot) >= sizeof(req.requests.snapshot_req.base_path)) {
+         fprintf(stderr, "base snapshot filename %s is too long\n", base_snapshot);
+         return EINVAL;
+      }
+      strcpy(req.requests.snapshot_req.base_path, base_snapshot);
+   }
    int rc;
+   mgmtreply_t reply;
    for (int i = 0; i < MAX_RETRIES; i++) {
       if (i != 0) {
          fprintf(stdout, "Retrying snapshot request after transient error\n");
       }
-      rc = send_request(sockname, &req, sizeof(req));
+      rc = send_request(sockname, &req, sizeof(req), NULL, &reply);
       if (rc == 0) {
+         if (live != 0) {
+            fprintf(stdout, "payload was paused %lu usec for the snapshot\n", reply.pause_usec);
+         }
          break;
       }
       if (rc != EAGAIN) {
@@ -231,6 +268,19 @@ int snapshot_process(char* sockname, char* snapshot_file, char* label, char* des
    return rc;
 }
 
+/*
+ * Print the -H, -M or -L stats of km listening on sockname.
+ */
+int stats_process(char* sockname)
+{
+   mgmtrequest_t req = {.opcode = stats == 'H'   ? KM_MGMT_REQ_HC_STATS
+                                  : stats == 'M' ? KM_MGMT_REQ_MEM_STATS
+                                                 : KM_MGMT_REQ_SNAPSHOT_LAYERS,
+                        .length = 2 * sizeof(int)};
+
+   return send_request(sockname, &req, sizeof(req), stdout, NULL);
+}
+
 struct found_process {
    char commandname[256];
    int processid;
@@ -544,7 +594,7 @@ int main(int argc, char* argv[])
       return 1;
    }
 
-   while ((c = getopt(argc, argv, "ltrc:d:p:s:")) != -1) {
+   while ((c = getopt(argc, argv, "ltrHMLb:c:d:p:s:")) != -1) {
       switch (c) {
          case 'c':   // snapshot processes with this unix command name
             if (nameindex >= MAXNAMES) {
@@ -553,6 +603,9 @@ int main(int argc, char* argv[])
             }
             commandnames[nameindex++] = strdup(optarg);
             break;
+         case 'b':   // snapshots are layers of this snapshot file
+            base_snapshot = optarg;
+            break;
          case 'd':   // deposit snapshot in this directory in the container
             snapdir = optarg;
             break;
@@ -578,6 +631,11 @@ int main(int argc, char* argv[])
             // Resume payload after snapshot completes
             terminate_app = 0;
             break;
+         case 'H':
+         case 'M':
+         case 'L':
+            stats = c;
+            break;
          default:
             fprintf(stderr, "unrecognized option %c\n", c);
             usage();
@@ -588,8 +646,17 @@ int main(int argc, char* argv[])
    commandpids[pidindex] = 0;
    commandnames[nameindex] = NULL;
 
-   // Take a payload snapshot using the km mgmt pipename supplied on the cmd line.
-   if (socket_name != NULL) {
+   // Get stats or take a payload snapshot using the km mgmt pipename supplied on the cmd line.
+   if (socket_name != NULL && stats != 0) {
+      int rc = stats_process(socket_name);
+      if (rc != 0) {
+         fprintf(stderr, "Stats via management pipe %s failed, %s\n", socket_name, strerror(rc));
+         return 1;
+      }
+      if (pidindex == 0 && nameindex == 0) {
+         return 0;
+      }
+   } else if (socket_name != NULL) {
       int rc = snapshot_process(socket_name, NULL, NULL, NULL, terminate_app == 0);
       if (rc != 0) {
          fprintf(stderr, "Snapshot via management pipe %s failed, %s\n", socket_name, strerror(rc));
@@ -610,7 +677,25 @@ int main(int argc, char* argv[])
    struct found_processes found_processes = {0, 0, NULL};
    int rc = find_processes_to_snap(commandnames, commandpids, &found_processes);
    if (rc == 0) {
-      for (int i = 0; i < found_processes.used_elements; i++) {
+      for (int i = 0; i < found_processes.used_elements && stats != 0; i++) {
+         fprintf(stdout,
+                 "%s for %s:%d\n",
+                 stats == 'H'   ? "hypercall stats"
+                 : stats == 'M' ? "memory stats"
+                                : "snapshot layers",
+                 found_processes.elements[i].commandname,
+                 found_processes.elements[i].processid);
+         fflush(stdout);
+         if ((rc = stats_process(found_processes.elements[i].cmdpipename)) != 0) {
+            fprintf(stderr,
+                    "Cannot get stats: cmd %s, pid %d, %s\n",
+                    found_processes.elements[i].commandname,
+                    found_processes.elements[i].processid,
+                    strerror(rc));
+            return 3;
+         }
+      }
+      for (int i = 0; i < found_processes.used_elements && stats == 0; i++) {
          char snapfilename[SNAPPATHMAX];
          char label[SNAPLABELMAX];
          char description[SNAPDESCMAX];
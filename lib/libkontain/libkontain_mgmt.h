@@ -2,7 +2,10 @@
 #define __LIBKONTAIN_MGMT_H__
 
 typedef enum km_mgmt_request {
-   KM_MGMT_REQ_SNAPSHOT			// request a payload snapshot
+   KM_MGMT_REQ_SNAPSHOT,		// request a payload snapshot
+   KM_MGMT_REQ_HC_STATS,		// hypercall latency stats, km --hcall-stats
+   KM_MGMT_REQ_MEM_STATS,		// guest memory given back to the host
+   KM_MGMT_REQ_SNAPSHOT_LAYERS		// snapshot files the next snapshot is a layer of
 } km_mgmt_request_t;
 
 /*
@@ -21,13 +24,21 @@ typedef struct mgmtrequest {
          char description[SNAPDESCMAX];	// a description placed in the snapshot (coredump)
          int live;			// if non-zero, the payload keeps running after the snapshot, if zero payload terminates
          char snapshot_path[SNAPPATHMAX];// path to where the snapshot should be placed.
+         char base_path[SNAPPATHMAX];	// if set, this and later snapshots are layers of this one
       } snapshot_req;
    } requests;
 } mgmtrequest_t;
 
 typedef struct mgmtreply {
    int request_status;			// 0 = success, non-zero is a unix errno
+   unsigned long pause_usec;		// KM_MGMT_REQ_SNAPSHOT: how long the payload was paused
    // for requests that return information, add structure definitions here
 } mgmtreply_t;
 
+/*
+ * KM_MGMT_REQ_HC_STATS is followed by the stats as text, one line per hypercall, until km closes
+ * the socket. KM_MGMT_REQ_MEM_STATS is the same, one line per counter, and so is
+ * KM_MGMT_REQ_SNAPSHOT_LAYERS, one line per snapshot file.
+ */
+
 #endif // !defined(__LIBKONTAIN_MGMT_H__)
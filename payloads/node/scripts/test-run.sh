@@ -77,6 +77,24 @@ if [[ "$1" == "test" || "$1" == "test-all" ]]; then
    curl localhost:8080
    curl -X POST localhost:8080 || echo Forcing srv to exit and ignoring curl 'empty reply'
    wait $pid
+
+   # snapshot size vs time to the first response after resume, without and with compression
+   for compress in "" --snapshot-compress ; do
+      rm -rf ${MGMTPIPE} kmsnap
+      ${KM_BIN} ${compress} --mgtpipe=${MGMTPIPE} ${PAYLOAD_KM} ./scripts/micro-srv.js &
+      pid=$!
+      curl -4 -s localhost:8080 --retry-connrefused  --retry $tries --retry-delay 1
+      ${KM_CLI_BIN} -s ${MGMTPIPE} -t
+      wait $pid
+      start=$(date +%s%N)
+      ${KM_BIN} kmsnap &
+      pid=$!
+      for i in $(seq 500) ; do curl -4 -s localhost:8080 && break ; sleep 0.01 ; done
+      echo "snapshot ${compress:-uncompressed}: $(du -k kmsnap | cut -f1)KB, first response after $(( ($(date +%s%N) - start) / 1000000 )) msec"
+      curl -X POST localhost:8080 || echo Forcing srv to exit and ignoring curl 'empty reply'
+      wait $pid
+   done
+   rm -f kmsnap
 fi
 
 if [[ "$1" == "test-all" ]]; then
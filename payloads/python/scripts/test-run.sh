@@ -30,3 +30,12 @@ rm -f kmsnap
 ${KM_BIN} ${PYTHON} ./test_snapshot.py
 [ ! -f kmsnap ] && echo No test_snapshot
 rm -f kmsnap
+
+# snapshot size vs resume time, without and with compression
+for compress in "" --snapshot-compress ; do
+   ${KM_BIN} ${compress} ${PYTHON} ./test_snapshot.py
+   start=$(date +%s%N)
+   ${KM_BIN} kmsnap
+   echo "snapshot ${compress:-uncompressed}: $(du -k kmsnap | cut -f1)KB, resumed and exited in $(( ($(date +%s%N) - start) / 1000000 )) msec"
+   rm -f kmsnap
+done
@@ -19,10 +19,67 @@
 #define __SYSCALL_LL_E(x) (x)
 #define __SYSCALL_LL_O(x) (x)
 
+/*
+ * Short writes to stdout/stderr are queued to km when --async-hcalls is on, see km_hcalls.h.
+ *
+ * getpid() and friends are answered from the values km publishes in the guest, no hypercall.
+ * __km_fast_nr() is usually folded at compile time so other syscalls don't pay for it.
+ */
+static __inline int __km_fast_nr(long n)
+{
+   return n == SYS_getpid || n == SYS_gettid || n == SYS_getppid || n == SYS_getuid ||
+          n == SYS_geteuid || n == SYS_getgid || n == SYS_getegid || n == SYS_umask;
+}
+
+static __inline int __km_fast_syscall(long n, long a1, long* ret)
+{
+   km_guest_info_t* gi;
+
+   __asm__("mov %%gs:%c1,%0" : "=r"(gi) : "i"(KM_GS_INFO_OFFSET));
+   if (__atomic_load_n(&gi->valid, __ATOMIC_ACQUIRE) == 0) {
+      return 0;
+   }
+   switch (n) {
+      case SYS_getpid:
+         *ret = gi->pid;
+         return 1;
+      case SYS_gettid:
+         __asm__("mov %%gs:%c1,%0" : "=r"(*ret) : "i"(KM_GS_TID_OFFSET));
+         return 1;
+      case SYS_getppid:
+         *ret = gi->ppid;
+         return 1;
+      case SYS_getuid:
+         *ret = gi->uid;
+         return 1;
+      case SYS_geteuid:
+         *ret = gi->euid;
+         return 1;
+      case SYS_getgid:
+         *ret = gi->gid;
+         return 1;
+      case SYS_getegid:
+         *ret = gi->egid;
+         return 1;
+      case SYS_umask:   // only when the mask doesn't change
+         if (a1 == gi->umask) {
+            *ret = a1;
+            return 1;
+         }
+         return 0;
+   }
+   return 0;
+}
+
 static __inline long __syscall0(long n)
 {
    km_hc_args_t arg;
 
+   long ret;
+   if (__km_fast_nr(n) && __km_fast_syscall(n, 0, &ret)) {
+      return ret;
+   }
+
    __asm__ __volatile__("mov %0,%%gs:0;"
                         "outl %1, %2"
                         :
@@ -41,6 +98,11 @@ static __inline long __syscall1(long n, long a1)
 {
    km_hc_args_t arg;
 
+   long ret;
+   if (__km_fast_nr(n) && __km_fast_syscall(n, a1, &ret)) {
+      return ret;
+   }
+
    arg.arg1 = a1;
    __asm__ __volatile__("mov %0,%%gs:0;"
                         "outl %1, %2"
@@ -80,6 +142,11 @@ static __inline long __syscall3(long n, long a1, long a2, long a3)
 {
    km_hc_args_t arg;
 
+   long ret;
+   if ((n == SYS_write || n == SYS_writev) && km_hcall_async_write(n, a1, a2, a3, &ret)) {
+      return ret;
+   }
+
    arg.arg1 = a1;
    arg.arg2 = a2;
    arg.arg3 = a3;
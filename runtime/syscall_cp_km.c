@@ -37,6 +37,10 @@ long __syscall_cp_asm(int* c, long n, long a1, long a2, long a3, long a4, long a
    if (*c == 0) {
       km_hc_args_t arg;
 
+      long ret;
+      if ((n == SYS_write || n == SYS_writev) && km_hcall_async_write(n, a1, a2, a3, &ret)) {
+         return ret;
+      }
       arg.arg1 = a1;
       arg.arg2 = a2;
       arg.arg3 = a3;
@@ -0,0 +1,118 @@
+/*
+ * Copyright 2021 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * sched_{get,set}affinity() on the calling thread and on another one (km --numa, --vcpu-pin).
+ * Masks are host CPUs, what's set comes back.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "greatest/greatest.h"
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int done;
+
+static void* waiter(void* arg)
+{
+   pthread_mutex_lock(&lock);
+   while (done == 0) {
+      pthread_cond_wait(&cond, &lock);
+   }
+   pthread_mutex_unlock(&lock);
+   return NULL;
+}
+
+static int first_cpu(cpu_set_t* set)
+{
+   for (int i = 0; i < CPU_SETSIZE; i++) {
+      if (CPU_ISSET(i, set)) {
+         return i;
+      }
+   }
+   return -1;
+}
+
+TEST self(void)
+{
+   cpu_set_t all, one, got;
+
+   ASSERT_EQ(0, sched_getaffinity(0, sizeof(all), &all));
+   ASSERT(CPU_COUNT(&all) > 0);
+   CPU_ZERO(&one);
+   CPU_SET(first_cpu(&all), &one);
+   ASSERT_EQ(0, sched_setaffinity(0, sizeof(one), &one));
+   ASSERT_EQ(0, sched_getaffinity(0, sizeof(got), &got));
+   ASSERT(CPU_EQUAL(&one, &got));
+   ASSERT_EQ(first_cpu(&all), sched_getcpu());
+   ASSERT_EQ(0, sched_setaffinity(0, sizeof(all), &all));
+   ASSERT_EQ(0, sched_getaffinity(0, sizeof(got), &got));
+   ASSERT(CPU_EQUAL(&all, &got));
+   PASS();
+}
+
+TEST other_thread(void)
+{
+   pthread_t t;
+   cpu_set_t all, one, got;
+
+   done = 0;
+   ASSERT_EQ(0, pthread_create(&t, NULL, waiter, NULL));
+   ASSERT_EQ(0, pthread_getaffinity_np(t, sizeof(all), &all));
+   CPU_ZERO(&one);
+   CPU_SET(first_cpu(&all), &one);
+   ASSERT_EQ(0, pthread_setaffinity_np(t, sizeof(one), &one));
+   ASSERT_EQ(0, pthread_getaffinity_np(t, sizeof(got), &got));
+   ASSERT(CPU_EQUAL(&one, &got));
+   pthread_mutex_lock(&lock);
+   done = 1;
+   pthread_cond_signal(&cond);
+   pthread_mutex_unlock(&lock);
+   ASSERT_EQ(0, pthread_join(t, NULL));
+   PASS();
+}
+
+// The mask has to be all guest memory, a larger size than the kernel's cpumask is fine
+TEST bad_mask(void)
+{
+   static char big[64 * 1024];
+
+   long size = syscall(SYS_sched_getaffinity, 0, sizeof(big), big);
+   ASSERT(size > 0 && size <= sizeof(big));
+   ASSERT_EQ(-1, syscall(SYS_sched_getaffinity, 0, sizeof(cpu_set_t), (void*)16));
+   ASSERT_EQ(EFAULT, errno);
+   PASS();
+}
+
+GREATEST_MAIN_DEFS();
+
+int main(int argc, char** argv)
+{
+   GREATEST_MAIN_BEGIN();
+
+   RUN_TEST(self);
+   RUN_TEST(other_thread);
+   RUN_TEST(bad_mask);
+
+   GREATEST_PRINT_REPORT();
+   return greatest_info.failed;
+}
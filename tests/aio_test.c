@@ -21,7 +21,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/uio.h>
@@ -31,6 +33,7 @@
  * A simple test to exercise the io_*() system calls.
  * Usage:
  *   aio_test -f number_of_files -c number_of_iocontexts [-s]
+ *   aio_test -b
  *
  * Env vars:
  *  AIO_TEST_WORKDIR - the path to an existing directory where the
@@ -58,14 +61,23 @@
 #define CHUNKSIZE 4096
 // Upper limit on the number of io contexts this program will create
 #define MAX_IOCONTEXTS 100
+// Benchmark: random 4k reads from a BENCH_FILESIZE file, BENCH_DEPTH in flight,
+// submitted BENCH_BATCH at a time. BENCH_BATCH is larger than what km submits to
+// the host in one go.
+#define BENCH_FILESIZE (64 * 1024 * 1024)
+#define BENCH_DEPTH 256
+#define BENCH_BATCH 128
+#define BENCH_IOS 200000
 char* progname = "noname";
 void usage(void)
 {
    fprintf(stderr, "Usage: %s [-f number_of_files] [-c number_of_contexts] [-s]\n", progname);
+   fprintf(stderr, "       %s -b\n", progname);
    fprintf(stderr, "       -f - number_of_files can be 1 - %d, default is 100\n", MAX_FDS);
    fprintf(stderr, "       -c - number_of_contexts is limited to %d, default is 1\n", MAX_IOCONTEXTS);
    fprintf(stderr, "       -ss - pause to wait for a snapshot request, defaul to no pause\n");
    fprintf(stderr, "       -sf - pause to wait for a failing snapshot request, defaul to no pause\n");
+   fprintf(stderr, "       -b - run the random read benchmark instead of the tests\n");
 }
 
 char* workdir = NULL;
@@ -287,9 +299,77 @@ int io_submit_pread(aio_context_t iocontext,
       return rc;
    }
    fprintf(stdout, "%ld of %ld pread's have completed\n", rc, nf);
+
+   // the events must point back at our iocb's
+   for (int i = 0; i < rc; i++) {
+      if (eventlist[i].data >= nf || eventlist[i].obj != (__u64)iocblist[eventlist[i].data]) {
+         fprintf(stderr,
+                 "io_event[%d]: data %llu, obj 0x%llx doesn't match the submitted iocb\n",
+                 i,
+                 eventlist[i].data,
+                 eventlist[i].obj);
+         return EINVAL;
+      }
+   }
    return 0;
 }
 
+// Same as io_submit_pread() but with completions signaled through an eventfd
+int io_submit_resfd(aio_context_t iocontext,
+                    long nf,
+                    int fdlist[],
+                    struct iocb** iocblist,
+                    struct io_event* eventlist,
+                    unsigned char* buffer,
+                    int chunksize)
+{
+   long rc;
+   uint64_t count = 0;
+   int efd = eventfd(0, 0);
+
+   if (efd < 0) {
+      rc = errno;
+      fprintf(stderr, "eventfd failed, %s\n", strerror(errno));
+      return rc;
+   }
+   for (int i = 0; i < nf; i++) {
+      struct iocb* iocbp = iocblist[i];
+      iocbp->aio_data = i;
+      iocbp->aio_rw_flags = 0;
+      iocbp->aio_lio_opcode = IOCB_CMD_PREAD;
+      iocbp->aio_reqprio = 0;
+      iocbp->aio_fildes = fdlist[i];
+      iocbp->aio_buf = (__u64)&buffer[i * chunksize];
+      iocbp->aio_nbytes = chunksize;
+      iocbp->aio_offset = i * chunksize;
+      iocbp->aio_flags = IOCB_FLAG_RESFD;
+      iocbp->aio_resfd = efd;
+      iocbp->aio_reserved2 = 0;
+   }
+   rc = syscall(SYS_io_submit, iocontext, nf, iocblist);
+   if (rc < 0) {
+      rc = errno;
+      fprintf(stderr, "io_submit for IOCB_FLAG_RESFD pread's failed, %s\n", strerror(errno));
+      goto done;
+   }
+   rc = syscall(SYS_io_getevents, iocontext, nf, nf, eventlist, NULL);
+   if (rc < 0) {
+      rc = errno;
+      fprintf(stderr, "io_getevent for IOCB_FLAG_RESFD pread's failed, %s\n", strerror(errno));
+      goto done;
+   }
+   if (read(efd, &count, sizeof(count)) != sizeof(count) || count != nf) {
+      fprintf(stderr, "eventfd count %lu, expected %ld\n", count, nf);
+      rc = EINVAL;
+      goto done;
+   }
+   fprintf(stdout, "%ld IOCB_FLAG_RESFD pread's signaled the eventfd\n", nf);
+   rc = 0;
+done:
+   close(efd);
+   return rc;
+}
+
 int io_submit_preadv(aio_context_t iocontext,
                      long nf,
                      int fdlist[],
@@ -487,6 +567,11 @@ int do_iocontext_test(aio_context_t iocontext,
       goto done;
    }
 
+   // Try IOCB_FLAG_RESFD
+   if ((rc = io_submit_resfd(iocontext, nf, fdlist, iocblist, eventlist, buffer, chunksize)) != 0) {
+      goto done;
+   }
+
    // Try IOCB_CMD_POLL
    int pollflags = POLLIN | POLLOUT;
    if ((rc = io_submit_poll(iocontext, nf, fdlist, iocblist, eventlist, pollflags)) != 0) {
@@ -510,10 +595,102 @@ done:;
    return rc;
 }
 
+/*
+ * Keep BENCH_DEPTH random 4k reads in flight until BENCH_IOS have completed and report the rate.
+ */
+int aio_bench(void)
+{
+   static unsigned char buffer[BENCH_DEPTH * CHUNKSIZE];
+   static struct iocb iocb[BENCH_DEPTH];
+   struct iocb* iocblist[BENCH_DEPTH];
+   struct io_event eventlist[BENCH_DEPTH];
+   aio_context_t iocontext = 0;
+   char filename[128];
+   struct timespec start, end;
+   long submitted = 0, completed = 0, pending = 0;
+   int rc = 1;
+
+   snprintf(filename, sizeof(filename), TEST_FILENAME, workdir, getpid(), 0);
+   int fd = open(filename, O_CREAT | O_RDWR | O_TRUNC, 0777);
+   if (fd < 0) {
+      fprintf(stderr, "Can't create %s, %s\n", filename, strerror(errno));
+      return 1;
+   }
+   unlink(filename);
+   memset(buffer, 0x5a, sizeof(buffer));
+   for (off_t off = 0; off < BENCH_FILESIZE; off += sizeof(buffer)) {
+      if (pwrite(fd, buffer, sizeof(buffer), off) != sizeof(buffer)) {
+         fprintf(stderr, "Can't fill %s, %s\n", filename, strerror(errno));
+         goto done;
+      }
+   }
+   if (syscall(SYS_io_setup, BENCH_DEPTH, &iocontext) != 0) {
+      fprintf(stderr, "SYS_io_setup failed, %s\n", strerror(errno));
+      goto done;
+   }
+   for (int i = 0; i < BENCH_DEPTH; i++) {
+      iocb[i] = (struct iocb){.aio_lio_opcode = IOCB_CMD_PREAD,
+                              .aio_fildes = fd,
+                              .aio_buf = (__u64)&buffer[i * CHUNKSIZE],
+                              .aio_nbytes = CHUNKSIZE,
+                              .aio_data = i};
+      iocblist[pending++] = &iocb[i];
+   }
+
+   srandom(getpid());
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   while (completed < BENCH_IOS) {
+      // resubmit whatever completed, BENCH_BATCH at a time
+      for (long i = 0; i < pending && submitted < BENCH_IOS; i += BENCH_BATCH) {
+         long nr = pending - i < BENCH_BATCH ? pending - i : BENCH_BATCH;
+         for (long j = i; j < i + nr; j++) {
+            iocblist[j]->aio_offset = (random() % (BENCH_FILESIZE / CHUNKSIZE)) * CHUNKSIZE;
+         }
+         long ret = syscall(SYS_io_submit, iocontext, nr, &iocblist[i]);
+         if (ret != nr) {
+            fprintf(stderr, "SYS_io_submit returned %ld, %s\n", ret, strerror(errno));
+            goto done;
+         }
+         submitted += nr;
+      }
+      long ret = syscall(SYS_io_getevents, iocontext, 1, BENCH_DEPTH, eventlist, NULL);
+      if (ret < 0) {
+         fprintf(stderr, "SYS_io_getevents failed, %s\n", strerror(errno));
+         goto done;
+      }
+      pending = 0;
+      for (long i = 0; i < ret; i++) {
+         if (eventlist[i].res != CHUNKSIZE) {
+            fprintf(stderr, "read returned %lld\n", (long long)eventlist[i].res);
+            goto done;
+         }
+         iocblist[pending++] = (struct iocb*)eventlist[i].obj;
+      }
+      completed += ret;
+   }
+   clock_gettime(CLOCK_MONOTONIC, &end);
+
+   double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+   fprintf(stdout,
+           "aio: %d random 4k reads, depth %d, batch %d: %.0f IOPS\n",
+           BENCH_IOS,
+           BENCH_DEPTH,
+           BENCH_BATCH,
+           completed / secs);
+   rc = 0;
+done:
+   if (iocontext != 0) {
+      syscall(SYS_io_destroy, iocontext);
+   }
+   close(fd);
+   return rc;
+}
+
 int main(int argc, char* argv[])
 {
    int nf = 100;
    int nc = 1;
+   int bench = 0;
    long rc = 0;
    int chunksize = CHUNKSIZE;
    unsigned char buffer[MAX_FDS * CHUNKSIZE];
@@ -548,6 +725,8 @@ int main(int argc, char* argv[])
             return 1;
          }
          i++;
+      } else if (strcmp(argv[i], "-b") == 0) {
+         bench = 1;
       } else if (strcmp(argv[i], "-ss") == 0) {
          waitforsnap = 1;
          snprintf(filename, sizeof(filename), "%s/waiting", workdir);
@@ -568,12 +747,14 @@ int main(int argc, char* argv[])
          return 1;
       }
    }
-   fprintf(stdout, "Using %d files and %d io contexts for this test run\n", nf, nc);
-
    if (stat(workdir, &statb) != 0) {
       fprintf(stderr, "workdir %s must exist\n", workdir);
       return 1;
    }
+   if (bench != 0) {
+      return aio_bench();
+   }
+   fprintf(stdout, "Using %d files and %d io contexts for this test run\n", nf, nc);
    fprintf(stdout, "Using %s as our work directory\n", workdir);
 
    // create data for test file contents and open test files
@@ -615,6 +796,14 @@ int main(int argc, char* argv[])
       }
    }
 
+   // Bad iocb pointer arrays are refused, not read
+   if (nc > 0 && (syscall(SYS_io_submit, iocontext[0], -1L, iocblist) != -1 || errno != EINVAL ||
+                  syscall(SYS_io_submit, iocontext[0], 1L, NULL) != -1 || errno != EFAULT)) {
+      rc = 1;
+      fprintf(stderr, "io_submit with a bad iocb array didn't fail\n");
+      goto done;
+   }
+
    // Try io_cancel()  (someday)
    // We need to find a very slow disk type device or swamp a fast one so that
    // requests are delayed long enough for us to cancel them.  One wonders how we
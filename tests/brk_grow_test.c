@@ -0,0 +1,61 @@
+/*
+ * Copyright 2021 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * brk heavy allocation benchmark: brk grows to <MB> megabytes in 1MB steps, touching each step,
+ * and shrinks back, <rounds> times. Crossing memory region boundaries is what costs, compare
+ *
+ *    km brk_grow_test.km 1024 20
+ *    km --single-memslot brk_grow_test.km 1024 20
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STEP (1024 * 1024)
+
+int main(int argc, char** argv)
+{
+   struct timespec start, end;
+
+   if (argc != 3) {
+      errx(1, "usage: %s MB rounds", argv[0]);
+   }
+   long steps = atol(argv[1]);
+   long rounds = atol(argv[2]);
+   char* base = sbrk(0);
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (long r = 0; r < rounds; r++) {
+      for (long i = 0; i < steps; i++) {
+         char* p = sbrk(STEP);
+         if (p == (void*)-1) {
+            err(1, "sbrk to %ldMB", i + 1);
+         }
+         p[0] = p[STEP - 1] = 1;
+      }
+      if (brk(base) != 0) {
+         err(1, "brk back to %p", base);
+      }
+   }
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   double usecs = (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3;
+   printf("%ldMB: %.0f usec/round\n", steps, usecs / rounds);
+   return 0;
+}
@@ -27,6 +27,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/param.h>
 
 #include "greatest/greatest.h"
 #include "syscall.h"
@@ -209,6 +210,38 @@ TEST brk_map_to_limit(void)
    PASS();
 }
 
+// mmap 1/2 physical memory, SYS_break to 1GIB less than mmap base, and touch every GIB of both.
+// Above 512GIB of physical memory that is more than one PML4 entry worth each.
+TEST touch_every_gib(void)
+{
+   size_t mapsz = max_pmem / 2;
+   char* ptr = simple_mmap(mapsz);
+   ASSERT_NEQ_FMT(MAP_FAILED, (void*)ptr, "%p");
+
+   char* prev = SYS_break(NULL);
+   // Note: assming va == pa in 'brk' region.
+   size_t brklim = ((size_t)ptr) & (max_pmem - 1);
+   char* curbrk = SYS_break((void*)(brklim - GIB));
+   ASSERT_NEQ_FMT((void*)-1, (void*)curbrk, "%p");
+
+   for (char* p = ptr; p < ptr + mapsz; p += GIB) {
+      *(size_t*)p = (size_t)p;
+   }
+   for (char* p = (char*)roundup((size_t)prev, GIB); p < curbrk; p += GIB) {
+      *(size_t*)p = (size_t)p;
+   }
+   for (char* p = ptr; p < ptr + mapsz; p += GIB) {
+      ASSERT_EQ_FMT((size_t)p, *(size_t*)p, "0x%lx");
+   }
+   for (char* p = (char*)roundup((size_t)prev, GIB); p < curbrk; p += GIB) {
+      ASSERT_EQ_FMT((size_t)p, *(size_t*)p, "0x%lx");
+   }
+
+   SYS_break(prev);
+   munmap(ptr, mapsz);
+   PASS();
+}
+
 GREATEST_MAIN_DEFS();
 int main(int argc, char** argv)
 {
@@ -239,6 +272,7 @@ int main(int argc, char** argv)
 
    RUN_TEST(map_brk_to_limit);
    RUN_TEST(brk_map_to_limit);
+   RUN_TEST(touch_every_gib);
 
    GREATEST_PRINT_REPORT();
    exit(greatest_info.failed);   // return count of errors (or 0 if all is good)
@@ -15,9 +15,11 @@
  */
 
 #include <err.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include <sys/syscall.h>
@@ -70,6 +72,81 @@ TEST test(void)
    PASS();
 }
 
+static void* thread_clock(void* arg)
+{
+   clock_gettime(CLOCK_MONOTONIC, arg);
+   return NULL;
+}
+
+// New threads get new vcpus, that mustn't make the clock go back for the ones running
+TEST threads_test(void)
+{
+   pthread_t threads[8];
+   struct timespec ts[8], before, after;
+
+   for (int i = 0; i < 8; i++) {
+      clock_gettime(CLOCK_MONOTONIC, &before);
+      ASSERT_EQ(0, pthread_create(&threads[i], NULL, thread_clock, &ts[i]));
+      clock_gettime(CLOCK_MONOTONIC, &after);
+      ASSERT(nsecs(before) <= nsecs(after));
+   }
+   for (int i = 0; i < 8; i++) {
+      ASSERT_EQ(0, pthread_join(threads[i], NULL));
+      clock_gettime(CLOCK_MONOTONIC, &after);
+      ASSERT(nsecs(ts[i]) <= nsecs(after));
+   }
+   PASS();
+}
+
+/*
+ * ns/call for clock_gettime() and for the syscall, per clock. Run it natively and in km to compare,
+ * e.g. 'clock_gettime_test -t bench' and 'km clock_gettime_test.km -t bench'.
+ */
+static const int bench_count = 1000000;
+
+TEST bench(void)
+{
+   static const struct {
+      clockid_t clk;
+      char* name;
+   } clocks[] = {{CLOCK_REALTIME, "REALTIME"},
+                 {CLOCK_MONOTONIC, "MONOTONIC"},
+                 {CLOCK_MONOTONIC_RAW, "MONOTONIC_RAW"},
+                 {CLOCK_BOOTTIME, "BOOTTIME"},
+                 {CLOCK_REALTIME_COARSE, "REALTIME_COARSE"},
+                 {CLOCK_PROCESS_CPUTIME_ID, "PROCESS_CPUTIME"},
+                 {CLOCK_THREAD_CPUTIME_ID, "THREAD_CPUTIME"}};
+   struct timespec start, end, ts, prev = {};
+
+   for (int c = 0; c < sizeof(clocks) / sizeof(clocks[0]); c++) {
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      for (int i = 0; i < bench_count; i++) {
+         clock_gettime(clocks[c].clk, &ts);
+         if (i != 0 && clocks[c].clk != CLOCK_REALTIME && clocks[c].clk != CLOCK_REALTIME_COARSE) {
+            ASSERT(nsecs(prev) <= nsecs(ts));
+         }
+         prev = ts;
+      }
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      uint64_t lib = (nsecs(end) - nsecs(start)) / bench_count;
+
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      for (int i = 0; i < bench_count / 10; i++) {
+         syscall(SYS_clock_gettime, clocks[c].clk, &ts);
+      }
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      uint64_t sys = (nsecs(end) - nsecs(start)) / (bench_count / 10);
+      printf("%-16s clock_gettime %5ld ns/call, syscall %5ld ns/call\n", clocks[c].name, lib, sys);
+   }
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (int i = 0; i < bench_count; i++) {
+      (void)time(NULL);
+   }
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   printf("%-16s %5ld ns/call\n", "time()", (nsecs(end) - nsecs(start)) / bench_count);
+   PASS();
+}
+
 GREATEST_MAIN_DEFS();
 
 int main(int argc, char** argv)
@@ -77,6 +154,13 @@ int main(int argc, char** argv)
    GREATEST_MAIN_BEGIN();
 
    RUN_TEST(test);
+   RUN_TEST(threads_test);
+   // the benchmark takes a while, only run it when asked for
+   for (int i = 1; i + 1 < argc; i++) {
+      if (strcmp(argv[i], "-t") == 0 && strcmp(argv[i + 1], "bench") == 0) {
+         RUN_TEST(bench);
+      }
+   }
    GREATEST_PRINT_REPORT();
    return greatest_info.failed;
 }
@@ -776,6 +776,65 @@ TEST test_fcntl_fsetown()
    PASS();
 }
 
+/*
+ * Many small adjacent buffers, empty buffers and bad buffers in readv/writev/sendmsg/recvmsg
+ */
+TEST test_iovec()
+{
+   static char data[4096];
+   static char buf[sizeof(data)];
+   struct iovec iov[256];
+   struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 256};
+   int fd[2];
+
+   for (int i = 0; i < sizeof(data); i++) {
+      data[i] = i * 7;
+   }
+   ASSERT_EQ(0, pipe(fd));
+   for (int i = 0; i < 256; i++) {
+      iov[i].iov_base = data + i * 16;
+      iov[i].iov_len = 16;
+   }
+   ASSERT_EQ(sizeof(data), writev(fd[1], iov, 256));
+   // every other buffer is empty
+   for (int i = 0; i < 256; i++) {
+      iov[i].iov_base = buf + i / 2 * 32;
+      iov[i].iov_len = i % 2 == 0 ? 32 : 0;
+   }
+   ASSERT_EQ(sizeof(buf), readv(fd[0], iov, 256));
+   ASSERT_MEM_EQ(data, buf, sizeof(data));
+
+   // a bad buffer after a good one is a short write, a bad first one fails
+   iov[0].iov_base = data;
+   iov[0].iov_len = 5;
+   iov[1].iov_base = (void*)8;
+   iov[1].iov_len = 5;
+   ASSERT_EQ(5, writev(fd[1], iov, 2));
+   ASSERT_EQ(5, read(fd[0], buf, sizeof(buf)));
+   ASSERT_EQ(-1, writev(fd[1], &iov[1], 1));
+   ASSERT_EQ(EFAULT, errno);
+   ASSERT_EQ(-1, writev(fd[1], iov, UIO_MAXIOV + 1));
+   ASSERT_EQ(EINVAL, errno);
+   ASSERT_EQ(0, close(fd[0]));
+   ASSERT_EQ(0, close(fd[1]));
+
+   ASSERT_EQ(0, socketpair(PF_LOCAL, SOCK_STREAM, 0, fd));
+   for (int i = 0; i < 256; i++) {
+      iov[i].iov_base = data + i * 16;
+      iov[i].iov_len = 16;
+   }
+   ASSERT_EQ(sizeof(data), sendmsg(fd[0], &msg, 0));
+   memset(buf, 0, sizeof(buf));
+   for (int i = 0; i < 256; i++) {
+      iov[i].iov_base = buf + i * 16;
+   }
+   ASSERT_EQ(sizeof(buf), recvmsg(fd[1], &msg, MSG_WAITALL));
+   ASSERT_MEM_EQ(data, buf, sizeof(data));
+   ASSERT_EQ(0, close(fd[0]));
+   ASSERT_EQ(0, close(fd[1]));
+   PASS();
+}
+
 GREATEST_MAIN_DEFS();
 
 int main(int argc, char** argv)
@@ -807,6 +866,7 @@ int main(int argc, char** argv)
    RUN_TEST(test_close_stdio);
    RUN_TEST(test_pselect6);
    RUN_TEST(test_fcntl_fsetown);
+   RUN_TEST(test_iovec);
 
    GREATEST_PRINT_REPORT();
    exit(greatest_info.failed);   // return count of errors (or 0 if all is good)
@@ -0,0 +1,200 @@
+/*
+ * Copyright 2021 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Asynchronous stdout/stderr writes (km --async-hcalls, see km_hcalls.h). The tests pass with the
+ * mode on or off, the benchmark compares writes to stdout with writes to another fd, which always
+ * take the regular hypercall.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "greatest/greatest.h"
+
+static const int bench_loops = 100000;
+static const int order_lines = 1000;
+
+static inline uint64_t nsecs(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000l + ts.tv_nsec;
+}
+
+// Lines written to stdout come out in order and before the next synchronous call on stdout
+TEST ordering(void)
+{
+   int fd[2];
+   char line[16];
+   char buf[16];
+   int out = dup(1);
+
+   ASSERT(out >= 0);
+   ASSERT_EQ(0, pipe(fd));
+   ASSERT_EQ(1, dup2(fd[1], 1));
+   for (int i = 0; i < order_lines; i++) {
+      int len = snprintf(line, sizeof(line), "%06d\n", i);
+      ASSERT_EQ(len, write(1, line, len));
+   }
+   ASSERT(fcntl(1, F_GETFL) >= 0);
+   ASSERT_EQ(1, dup2(out, 1));
+   close(fd[1]);
+   for (int i = 0; i < order_lines; i++) {
+      int len = snprintf(line, sizeof(line), "%06d\n", i);
+      ASSERT_EQ(len, read(fd[0], buf, len));
+      ASSERT_MEM_EQ(line, buf, len);
+   }
+   ASSERT_EQ(0, read(fd[0], buf, sizeof(buf)));
+   close(fd[0]);
+   close(out);
+   PASS();
+}
+
+// A failed queued write is reported by the next synchronous call on the fd
+TEST deferred_error(void)
+{
+   int out = dup(1);
+   int rdonly = open("/dev/null", O_RDONLY);
+
+   ASSERT(out >= 0 && rdonly >= 0);
+   ASSERT_EQ(1, dup2(rdonly, 1));
+   int rc = write(1, "x", 1);
+   int err = errno;
+   if (rc == 1) {   // queued
+      rc = fcntl(1, F_GETFL);
+      err = errno;
+   }
+   ASSERT_EQ(1, dup2(out, 1));
+   ASSERT_EQ(-1, rc);
+   ASSERT_EQ(EBADF, err);
+   ASSERT(fcntl(1, F_GETFL) >= 0);
+   close(rdonly);
+   close(out);
+   PASS();
+}
+
+// writev() lengths adding up to more than SSIZE_MAX fail, even if they wrap to a small total
+TEST writev_overflow(void)
+{
+   char buf[16] = "0123456789abcdef";
+   struct iovec iov[2] = {{.iov_base = buf, .iov_len = sizeof(buf)},
+                          {.iov_base = buf, .iov_len = SIZE_MAX - 7}};   // 8 when it wraps
+
+   ASSERT_EQ(-1, writev(1, iov, 2));
+   ASSERT_EQ(EINVAL, errno);
+   PASS();
+}
+
+static volatile sig_atomic_t sigpipes;
+
+static void sigpipe_handler(int sig)
+{
+   sigpipes++;
+}
+
+// Writes into a closed pipe fail with EPIPE and raise SIGPIPE, even when they were queued
+TEST closed_pipe(void)
+{
+   int fd[2];
+   int out = dup(1);
+   struct sigaction sa = {.sa_handler = sigpipe_handler};
+   struct sigaction old;
+   int rc = 0;
+
+   ASSERT(out >= 0);
+   ASSERT_EQ(0, sigaction(SIGPIPE, &sa, &old));
+   ASSERT_EQ(0, pipe(fd));
+   ASSERT_EQ(1, dup2(fd[1], 1));
+   close(fd[1]);
+   close(fd[0]);
+   sigpipes = 0;
+   // a few writes may be queued before the first one fails, after that they must not be
+   for (int i = 0; i < 1000 && rc >= 0; i++) {
+      rc = write(1, "x", 1);
+   }
+   int err = errno;
+   if (rc >= 0) {
+      rc = fsync(1);
+      err = errno;
+   }
+   ASSERT_EQ(1, dup2(out, 1));
+   ASSERT_EQ(0, sigaction(SIGPIPE, &old, NULL));
+   close(out);
+   ASSERT_EQ(-1, rc);
+   ASSERT_EQ(EPIPE, err);
+   ASSERT(sigpipes > 0);
+   PASS();
+}
+
+TEST bench(void)
+{
+   int out = dup(1);
+   int null = open("/dev/null", O_WRONLY);
+   static const char msg[] = "2021-06-01 12:00:00.000 INFO some log line\n";
+
+   ASSERT(out >= 0 && null >= 0);
+   int other = dup(null);
+   ASSERT(other > 2);
+   ASSERT_EQ(1, dup2(null, 1));
+
+   uint64_t start = nsecs();
+   for (int i = 0; i < bench_loops; i++) {
+      write(other, msg, sizeof(msg) - 1);
+   }
+   uint64_t sync = nsecs() - start;
+
+   start = nsecs();
+   for (int i = 0; i < bench_loops; i++) {
+      write(1, msg, sizeof(msg) - 1);
+   }
+   uint64_t queued = nsecs() - start;
+   fsync(1);   // waits for the queued writes
+   uint64_t drained = nsecs() - start;
+
+   ASSERT_EQ(1, dup2(out, 1));
+   printf("write: sync %ld ns/call, stdout %ld ns/call (%ld ns/call with drain)\n",
+          sync / bench_loops,
+          queued / bench_loops,
+          drained / bench_loops);
+   close(other);
+   close(null);
+   close(out);
+   PASS();
+}
+
+GREATEST_MAIN_DEFS();
+
+int main(int argc, char** argv)
+{
+   GREATEST_MAIN_BEGIN();
+   setvbuf(stdout, NULL, _IONBF, 0);   // so greatest output goes through write() too
+
+   RUN_TEST(ordering);
+   RUN_TEST(deferred_error);
+   RUN_TEST(closed_pipe);
+   RUN_TEST(writev_overflow);
+   RUN_TEST(bench);
+
+   GREATEST_PRINT_REPORT();
+   return greatest_info.failed;
+}
@@ -0,0 +1,127 @@
+/*
+ * Copyright 2021 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Exercise the hypercall submission ring (see km_hcalls.h), and compare the cost of
+ * queued writev() with the regular one hypercall per call path.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include "greatest/greatest.h"
+#include "km_hcalls.h"
+
+static const int bench_loops = 100000;
+
+static inline uint64_t nsecs(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000l + ts.tv_nsec;
+}
+
+TEST queue_flush(void)
+{
+   int fd[2];
+   char buf[KM_HC_RING_ENTRIES];
+   int slot[KM_HC_RING_ENTRIES];
+
+   ASSERT_EQ(0, pipe(fd));
+   for (int i = 0; i < KM_HC_RING_ENTRIES; i++) {
+      buf[i] = 'a' + i;
+      slot[i] = km_hcall_ring_queue(SYS_write, fd[1], (uint64_t)&buf[i], 1, 0, 0, 0);
+   }
+   ASSERT_EQ(KM_HC_RING_ENTRIES, km_hcall_ring_flush());
+   for (int i = 0; i < KM_HC_RING_ENTRIES; i++) {
+      ASSERT_EQ(1, km_hcall_ring_result(slot[i]));
+   }
+   char rbuf[KM_HC_RING_ENTRIES];
+   ASSERT_EQ(KM_HC_RING_ENTRIES, read(fd[0], rbuf, sizeof(rbuf)));
+   ASSERT_MEM_EQ(buf, rbuf, sizeof(buf));
+
+   // calls that may block are refused
+   int s = km_hcall_ring_queue(SYS_read, fd[0], (uint64_t)rbuf, 1, 0, 0, 0);
+   ASSERT_EQ(1, km_hcall_ring_flush());
+   ASSERT_EQ(-ENOSYS, km_hcall_ring_result(s));
+
+   close(fd[0]);
+   close(fd[1]);
+   PASS();
+}
+
+// Queued calls are executed before the next synchronous one, even without explicit flush
+TEST ordering(void)
+{
+   int fd[2];
+
+   ASSERT_EQ(0, pipe(fd));
+   int s = km_hcall_ring_queue(SYS_close, fd[1], 0, 0, 0, 0, 0);
+   ASSERT_EQ(-1, write(fd[1], "x", 1));
+   ASSERT_EQ(EBADF, errno);
+   ASSERT_EQ(0, km_hcall_ring_result(s));
+   ASSERT_EQ(0, km_hcall_ring_flush());
+   close(fd[0]);
+   PASS();
+}
+
+TEST bench(void)
+{
+   int fd = open("/dev/null", O_WRONLY);
+   ASSERT(fd >= 0);
+   char c = 'x';
+   struct iovec iov = {.iov_base = &c, .iov_len = 1};
+
+   uint64_t start = nsecs();
+   for (int i = 0; i < bench_loops; i++) {
+      writev(fd, &iov, 1);
+   }
+   uint64_t sync = nsecs() - start;
+
+   start = nsecs();
+   for (int i = 0; i < bench_loops; i++) {
+      km_hcall_ring_queue(SYS_writev, fd, (uint64_t)&iov, 1, 0, 0, 0);
+   }
+   km_hcall_ring_flush();
+   uint64_t ring = nsecs() - start;
+
+   printf("writev: sync %ld ns/call, ring %ld ns/call (%d entries per doorbell)\n",
+          sync / bench_loops,
+          ring / bench_loops,
+          KM_HC_RING_ENTRIES);
+   close(fd);
+   PASS();
+}
+
+GREATEST_MAIN_DEFS();
+
+int main(int argc, char** argv)
+{
+   GREATEST_MAIN_BEGIN();
+
+   RUN_TEST(queue_flush);
+   RUN_TEST(ordering);
+   RUN_TEST(bench);
+
+   GREATEST_PRINT_REPORT();
+   return greatest_info.failed;
+}
@@ -0,0 +1,409 @@
+/*
+ * Copyright 2021 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * io_uring passthrough (km_uring.c), using the raw syscalls. The benchmark does fio style random 4k
+ * reads from a file in the page cache, with pread() and with io_uring at queue depth 32, with and
+ * without SQPOLL.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include "greatest/greatest.h"
+
+#ifndef SYS_io_uring_setup
+#define SYS_io_uring_setup 425
+#define SYS_io_uring_enter 426
+#define SYS_io_uring_register 427
+#endif
+
+static const int bench_ops = 100000;
+static const int bench_qd = 32;
+static const size_t bench_file_size = 16 * 1024 * 1024;
+static const size_t blk = 4096;
+
+typedef struct ring {
+   int fd;
+   struct io_uring_params p;
+   void* sq_ptr;
+   size_t sq_size;
+   unsigned* sq_head;
+   unsigned* sq_tail;
+   unsigned* sq_mask;
+   unsigned* sq_flags;
+   unsigned* sq_array;
+   unsigned sq_local_tail;
+   struct io_uring_sqe* sqes;
+   void* cq_ptr;
+   size_t cq_size;
+   unsigned* cq_head;
+   unsigned* cq_tail;
+   unsigned* cq_mask;
+   struct io_uring_cqe* cqes;
+   int enters;   // io_uring_enter() calls, each is a VM exit
+} ring_t;
+
+static char* file_name;
+static int file_fd;
+
+static inline uint64_t nsecs(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000l + ts.tv_nsec;
+}
+
+static int ring_init(ring_t* r, unsigned entries, unsigned flags)
+{
+   memset(r, 0, sizeof(*r));
+   r->p.flags = flags;
+   r->p.sq_thread_idle = 100;
+   if ((r->fd = syscall(SYS_io_uring_setup, entries, &r->p)) < 0) {
+      return -errno;
+   }
+   r->sq_size = r->p.sq_off.array + r->p.sq_entries * sizeof(unsigned);
+   r->cq_size = r->p.cq_off.cqes + r->p.cq_entries * sizeof(struct io_uring_cqe);
+   r->sq_ptr =
+       mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+   r->cq_ptr =
+       mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+   r->sqes = mmap(NULL,
+                  r->p.sq_entries * sizeof(struct io_uring_sqe),
+                  PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE,
+                  r->fd,
+                  IORING_OFF_SQES);
+   if (r->sq_ptr == MAP_FAILED || r->cq_ptr == MAP_FAILED || r->sqes == MAP_FAILED) {
+      return -errno;
+   }
+   r->sq_head = r->sq_ptr + r->p.sq_off.head;
+   r->sq_tail = r->sq_ptr + r->p.sq_off.tail;
+   r->sq_mask = r->sq_ptr + r->p.sq_off.ring_mask;
+   r->sq_flags = r->sq_ptr + r->p.sq_off.flags;
+   r->sq_array = r->sq_ptr + r->p.sq_off.array;
+   r->sq_local_tail = *r->sq_tail;
+   r->cq_head = r->cq_ptr + r->p.cq_off.head;
+   r->cq_tail = r->cq_ptr + r->p.cq_off.tail;
+   r->cq_mask = r->cq_ptr + r->p.cq_off.ring_mask;
+   r->cqes = r->cq_ptr + r->p.cq_off.cqes;
+   return 0;
+}
+
+static void ring_fini(ring_t* r)
+{
+   munmap(r->sqes, r->p.sq_entries * sizeof(struct io_uring_sqe));
+   munmap(r->cq_ptr, r->cq_size);
+   munmap(r->sq_ptr, r->sq_size);
+   close(r->fd);
+}
+
+static struct io_uring_sqe* ring_sqe(ring_t* r, int op, int fd, void* addr, unsigned len, off_t off)
+{
+   unsigned idx = r->sq_local_tail & *r->sq_mask;
+
+   if (r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) == r->p.sq_entries) {
+      return NULL;
+   }
+   struct io_uring_sqe* sqe = &r->sqes[idx];
+   memset(sqe, 0, sizeof(*sqe));
+   sqe->opcode = op;
+   sqe->fd = fd;
+   sqe->addr = (uint64_t)addr;
+   sqe->len = len;
+   sqe->off = off;
+   r->sq_array[idx] = idx;
+   r->sq_local_tail++;
+   return sqe;
+}
+
+// Publishes the new SQEs, and enters the kernel if it has to. Returns what io_uring_enter() did.
+static int ring_submit(ring_t* r, unsigned wait)
+{
+   unsigned n = r->sq_local_tail - *r->sq_tail;
+   unsigned flags = wait != 0 ? IORING_ENTER_GETEVENTS : 0;
+
+   __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+   if ((r->p.flags & IORING_SETUP_SQPOLL) != 0) {
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      if ((__atomic_load_n(r->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP) != 0) {
+         flags |= IORING_ENTER_SQ_WAKEUP;
+      }
+      if (flags == 0) {
+         return n;
+      }
+   }
+   r->enters++;
+   int rc = syscall(SYS_io_uring_enter, r->fd, n, wait, flags, NULL, 0);
+   return rc < 0 ? -errno : rc;
+}
+
+static struct io_uring_cqe* ring_peek(ring_t* r)
+{
+   unsigned head = *r->cq_head;
+
+   if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+      return NULL;
+   }
+   return &r->cqes[head & *r->cq_mask];
+}
+
+static void ring_seen(ring_t* r)
+{
+   __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+static int ring_wait(ring_t* r, struct io_uring_cqe* cqe)
+{
+   struct io_uring_cqe* c;
+
+   while ((c = ring_peek(r)) == NULL) {
+      int rc = ring_submit(r, 1);
+      if (rc < 0 && rc != -EINTR) {
+         return rc;
+      }
+   }
+   *cqe = *c;
+   ring_seen(r);
+   return 0;
+}
+
+#define RING_INIT(r, entries, flags)                                                               \
+   do {                                                                                            \
+      int __rc = ring_init(r, entries, flags);                                                     \
+      if (__rc == -ENOSYS || __rc == -EPERM) {                                                     \
+         SKIPm("io_uring is not available");                                                       \
+      }                                                                                            \
+      ASSERT_EQ(0, __rc);                                                                          \
+   } while (0)
+
+TEST read_write(void)
+{
+   ring_t r;
+   struct io_uring_cqe cqe;
+   static char wbuf[4][4096];
+   static char rbuf[2][8192];
+
+   RING_INIT(&r, 8, 0);
+   for (int i = 0; i < 4; i++) {
+      memset(wbuf[i], 'a' + i, sizeof(wbuf[i]));
+      ASSERT(ring_sqe(&r, IORING_OP_WRITE, file_fd, wbuf[i], blk, i * blk) != NULL);
+   }
+   ASSERT_EQ(4, ring_submit(&r, 0));
+   for (int i = 0; i < 4; i++) {
+      ASSERT_EQ(0, ring_wait(&r, &cqe));
+      ASSERT_EQ(blk, cqe.res);
+   }
+
+   struct iovec iov[2] = {{.iov_base = rbuf[0], .iov_len = 8192}, {.iov_base = rbuf[1], .iov_len = 8192}};
+   ring_sqe(&r, IORING_OP_READV, file_fd, iov, 2, 0);
+   ASSERT_EQ(1, ring_submit(&r, 1));
+   ASSERT_EQ(0, ring_wait(&r, &cqe));
+   ASSERT_EQ(4 * blk, cqe.res);
+   ASSERT_MEM_EQ(wbuf, rbuf, 4 * blk);
+   ring_fini(&r);
+   PASS();
+}
+
+TEST fixed_buffers(void)
+{
+   ring_t r;
+   struct io_uring_cqe cqe;
+   static char buf[2][4096];
+   struct iovec iov[2] = {{.iov_base = buf[0], .iov_len = blk}, {.iov_base = buf[1], .iov_len = blk}};
+
+   RING_INIT(&r, 4, 0);
+   ASSERT_EQ(0, syscall(SYS_io_uring_register, r.fd, IORING_REGISTER_BUFFERS, iov, 2));
+   memset(buf[0], 'x', blk);
+   ring_sqe(&r, IORING_OP_WRITE_FIXED, file_fd, buf[0], blk, 0)->buf_index = 0;
+   ASSERT_EQ(1, ring_submit(&r, 1));
+   ASSERT_EQ(0, ring_wait(&r, &cqe));
+   ASSERT_EQ(blk, cqe.res);
+   ring_sqe(&r, IORING_OP_READ_FIXED, file_fd, buf[1], blk, 0)->buf_index = 1;
+   ASSERT_EQ(1, ring_submit(&r, 1));
+   ASSERT_EQ(0, ring_wait(&r, &cqe));
+   ASSERT_EQ(blk, cqe.res);
+   ASSERT_MEM_EQ(buf[0], buf[1], blk);
+   ASSERT_EQ(0, syscall(SYS_io_uring_register, r.fd, IORING_UNREGISTER_BUFFERS, NULL, 0));
+   ring_fini(&r);
+   PASS();
+}
+
+// Requests km can't pass through fail in the CQE, like requests the kernel rejects
+TEST errors(void)
+{
+   ring_t r;
+   struct io_uring_cqe cqe;
+   static char buf[4096];
+
+   RING_INIT(&r, 4, 0);
+   ring_sqe(&r, IORING_OP_OPENAT, AT_FDCWD, "/etc/passwd", 0, 0);   // would create an fd behind km
+   ring_sqe(&r, IORING_OP_READ, 1000, buf, blk, 0);
+   ring_sqe(&r, IORING_OP_READ, file_fd, (void*)0x10, blk, 0);
+   ASSERT_EQ(3, ring_submit(&r, 0));
+   ASSERT_EQ(0, ring_wait(&r, &cqe));
+   ASSERT_EQ(-EINVAL, cqe.res);
+   ASSERT_EQ(0, ring_wait(&r, &cqe));
+   ASSERT_EQ(-EBADF, cqe.res);
+   ASSERT_EQ(0, ring_wait(&r, &cqe));
+   ASSERT_EQ(-EFAULT, cqe.res);
+
+   // and the probe says so
+   size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+   struct io_uring_probe* probe = calloc(1, size);
+   ASSERT_EQ(0, syscall(SYS_io_uring_register, r.fd, IORING_REGISTER_PROBE, probe, 256));
+   ASSERT(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+   ASSERT_FALSE(probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED);
+   free(probe);
+   ring_fini(&r);
+   PASS();
+}
+
+// With SQPOLL the payload submits without io_uring_enter(), it only waits with it
+TEST sqpoll(void)
+{
+   ring_t r;
+   struct io_uring_cqe cqe;
+   static char buf[4096];
+   const int loops = 1000;
+
+   RING_INIT(&r, 8, IORING_SETUP_SQPOLL);
+   for (int i = 0; i < loops; i++) {
+      ring_sqe(&r, IORING_OP_READ, file_fd, buf, blk, 0);
+      ring_submit(&r, 0);
+      while (ring_peek(&r) == NULL) {
+         __builtin_ia32_pause();
+      }
+      cqe = *ring_peek(&r);
+      ring_seen(&r);
+      ASSERT_EQ(blk, cqe.res);
+   }
+   ASSERT(r.enters < loops / 10);
+   ring_fini(&r);
+   PASS();
+}
+
+// Random 4k reads, returns IOPS
+static uint64_t bench_ring(ring_t* r, char* bufs)
+{
+   struct io_uring_cqe cqe;
+   int inflight = 0;
+   int done = 0;
+   int sent = 0;
+
+   uint64_t start = nsecs();
+   while (done < bench_ops) {
+      while (inflight < bench_qd && sent < bench_ops) {
+         off_t off = (random() % (bench_file_size / blk)) * blk;
+         if (ring_sqe(r, IORING_OP_READ, file_fd, bufs + inflight * blk, blk, off) == NULL) {
+            break;
+         }
+         inflight++;
+         sent++;
+      }
+      ring_submit(r, 0);
+      if (ring_wait(r, &cqe) != 0 || cqe.res != blk) {
+         return 0;
+      }
+      inflight--;
+      done++;
+      while (ring_peek(r) != NULL) {
+         ring_seen(r);
+         inflight--;
+         done++;
+      }
+   }
+   return bench_ops * 1000000000l / (nsecs() - start);
+}
+
+TEST bench(void)
+{
+   ring_t r;
+   static char bufs[32][4096];
+   uint64_t sqpoll_iops = 0;
+   int sqpoll_enters = 0;
+
+   uint64_t start = nsecs();
+   for (int i = 0; i < bench_ops; i++) {
+      off_t off = (random() % (bench_file_size / blk)) * blk;
+      ASSERT_EQ(blk, pread(file_fd, bufs[0], blk, off));
+   }
+   uint64_t pread_iops = bench_ops * 1000000000l / (nsecs() - start);
+
+   RING_INIT(&r, bench_qd * 2, 0);
+   uint64_t ring_iops = bench_ring(&r, &bufs[0][0]);
+   int ring_enters = r.enters;
+   ring_fini(&r);
+   ASSERT(ring_iops != 0);
+
+   if (ring_init(&r, bench_qd * 2, IORING_SETUP_SQPOLL) == 0) {
+      sqpoll_iops = bench_ring(&r, &bufs[0][0]);
+      sqpoll_enters = r.enters;
+      ring_fini(&r);
+      ASSERT(sqpoll_iops != 0);
+   }
+   printf("io_uring: pread %ld IOPS, ring %ld IOPS (%d enters), sqpoll %ld IOPS (%d enters), 4k "
+          "random reads, qd %d\n",
+          pread_iops,
+          ring_iops,
+          ring_enters,
+          sqpoll_iops,
+          sqpoll_enters,
+          bench_qd);
+   PASS();
+}
+
+GREATEST_MAIN_DEFS();
+
+int main(int argc, char** argv)
+{
+   GREATEST_MAIN_BEGIN();
+   static char name[] = "/tmp/io_uring_testXXXXXX";
+   static char block[4096];
+
+   if ((file_fd = mkstemp(name)) < 0) {
+      perror("mkstemp");
+      return 1;
+   }
+   file_name = name;
+   for (size_t off = 0; off < bench_file_size; off += blk) {
+      memset(block, off / blk, blk);
+      if (pwrite(file_fd, block, blk, off) != blk) {
+         perror("pwrite");
+         return 1;
+      }
+   }
+
+   RUN_TEST(read_write);
+   RUN_TEST(fixed_buffers);
+   RUN_TEST(errors);
+   RUN_TEST(sqpoll);
+   RUN_TEST(bench);
+
+   unlink(file_name);
+   close(file_fd);
+   GREATEST_PRINT_REPORT();
+   return greatest_info.failed;
+}
@@ -635,6 +635,102 @@ fi
    assert_success
 }
 
+@test "madvise_purge($test_type): allocator style purge with each madvise advice (madvise_purge_test$ext)" {
+   run km_with_timeout madvise_purge_test$ext 64 20000 none
+   assert_success
+   local kept=$(echo "$output" | sed -n -e 's/.* rss \([0-9]*\)MB .*/\1/p')
+   # freed spans given back with MADV_DONTNEED leave the rss, the others may stay until needed
+   run km_with_timeout madvise_purge_test$ext 64 20000 dontneed
+   assert_success
+   local rss=$(echo "$output" | sed -n -e 's/.* rss \([0-9]*\)MB .*/\1/p')
+   assert [ $rss -lt $kept ]
+   for advice in free cold pageout ; do
+      run km_with_timeout madvise_purge_test$ext 64 20000 $advice
+      assert_success
+      assert_line --partial "64MB $advice: "
+   done
+}
+
+@test "pt_mprotect($test_type): guest mprotect in guest page tables (wx_flip_test$ext)" {
+   run km_with_timeout --pt-mprotect mprotect_test$ext -v
+   assert_success
+   run km_with_timeout --pt-mprotect madvise_test$ext -v
+   assert_success
+   # a write to a read/exec page faults, one made read/write again takes it
+   run km_with_timeout --pt-mprotect wx_flip_test$ext 16 1000
+   assert_success
+   assert_line --partial "16 pages: "
+}
+
+@test "single_memslot($test_type): brk growth and startup with one memslot (brk_grow_test$ext)" {
+   run km_with_timeout --single-memslot mprotect_test$ext -v
+   assert_success
+   # brk grows over many memory regions and back, with nothing to plug into KVM
+   run km_with_timeout --single-memslot brk_grow_test$ext 1024 2
+   assert_success
+   assert_line --partial "1024MB: "
+   run km_with_timeout --single-memslot hello_test$ext
+   assert_success
+}
+
+@test "numa($test_type): --numa placement and vcpu affinity (affinity_test$ext)" {
+   nodes=$(ls -d /sys/devices/system/node/node[0-9]* | wc -l)
+   # affinity set on a guest thread comes back, pinned or not
+   for mode in "" --numa=interleave --numa=local "--numa=local --vcpu-pin=cpu" --numa=node:0 ; do
+      run km_with_timeout $mode affinity_test$ext
+      assert_success
+   done
+   run km_with_timeout --numa=node:0 stream_test$ext 16 1 1
+   assert_line --partial "node 0"
+   run km_with_timeout --numa=node:$nodes hello_test$ext
+   assert_failure
+   run km_with_timeout --numa=far hello_test$ext
+   assert_failure
+}
+
+@test "mmap_scale($test_type): madvise on many vcpus while mmaps change (mmap_scale_test$ext)" {
+   for threads in 1 8 64 ; do
+      run km_with_timeout mmap_scale_test$ext $threads 10000
+      assert_success
+      assert_line --partial "$threads threads: "
+   done
+}
+
+@test "hugepages($test_type): guest memory backed by huge pages (tlb_test$ext)" {
+   local SNAP=/tmp/snap_hugepages.$$
+   local pool=/sys/kernel/mm/hugepages/hugepages-2048kB/nr_hugepages
+
+   run km_with_timeout tlb_test$ext 64 10000
+   assert_success
+   refute_line --partial "guest memory in huge pages"
+   run km_with_timeout --hugepages=thp tlb_test$ext 64 10000 brk
+   assert_success
+   assert_line --regexp "hugepages=thp: .*hugetlb 0MB\)"
+
+   # brk memory is hugetlb when the host has the pages, 64MB of it takes 32 2MB ones
+   for mode in 2M 1G ; do
+      run km_with_timeout --hugepages=$mode tlb_test$ext 64 10000 brk
+      assert_success
+      assert_line --partial "hugepages=$mode: "
+      if [ $(cat $pool 2>/dev/null || echo 0) -ge 32 ] ; then
+         assert_line --regexp "hugepages=$mode: .*hugetlb [1-9][0-9]*MB\)"
+      fi
+   done
+
+   # snapshots are read into hugetlb memory, it can't be mapped over in 4K pages
+   for compress in "" --snapshot-compress ; do
+      run km_with_timeout --hugepages=2M $compress --snapshot=${SNAP} snapshot_incr_test$ext 16 1
+      assert_success
+      run km_with_timeout --hugepages=2M ${SNAP}
+      assert_success
+      assert_line "resumed round 0 ok"
+   done
+   rm -f ${SNAP}
+
+   run km_with_timeout --hugepages=4K tlb_test$ext 64 10000
+   assert_failure
+}
+
 @test "threads_basic($test_type): threads with TLS, create, exit and join (hello_2_loops_tls_test$ext)" {
    run km_with_timeout hello_2_loops_tls_test$ext
    assert_success
@@ -695,6 +791,19 @@ fi
    assert_failure
 }
 
+@test "bigmem($test_type): guest physical memory above 512GiB (brk_map_test$ext)" {
+   bw=$(bus_width)
+   if [ $bw -lt 40 ] ; then
+      skip "needs a 40 bit or wider memory bus, have $bw"
+   fi
+   for bits in 40 $(( bw < 42 ? bw : 42 )) ; do
+      run km_with_timeout --overcommit-memory -P$bits brk_map_test$ext -- $bits
+      assert_success
+   done
+   run km_with_timeout -P43 hello_test$ext
+   assert_failure
+}
+
 @test "cli($test_type): test 'km -v' and other small tests" {
    run km_with_timeout -v
    assert_success
@@ -1156,12 +1265,31 @@ fi
    ls -l ${MGTDIR}
    tries=5; while [ ! -S ${MGTDIR}/kmpipe.* ] && [ $tries -gt 0 ]; do sleep 1; tries=`expr $tries - 1`; done
    assert [ $tries -gt 0 ]
+   # stats need --hcall-stats
+   run ${KM_CLI_BIN} -H -s ${MGTDIR}/kmpipe.*
+   assert_failure
    run ${KM_CLI_BIN} -s ${MGTDIR}/kmpipe.*
    assert_success
    local -a tmp=($(echo ${MGTDIR}/kmsnap.hello_html_test$ext.[0-9]*))
    assert [ -f ${tmp[0]} ]
    rm -fr ${MGTDIR}
 
+   # Hypercall latency stats from a running payload
+   mkdir -p ${MGTDIR}
+   KM_MGTDIR=${MGTDIR} km_with_timeout --hcall-stats hello_html_test$ext $snapshot_test_port &
+   local stats_pid=$!
+   tries=5; while [ ! -S ${MGTDIR}/kmpipe.* ] && [ $tries -gt 0 ]; do sleep 1; tries=`expr $tries - 1`; done
+   assert [ $tries -gt 0 ]
+   run curl -4 -s localhost:$snapshot_test_port --retry-connrefused  --retry 3 --retry-delay 1
+   assert_success
+   run ${KM_CLI_BIN} -H -s ${MGTDIR}/kmpipe.*
+   assert_success
+   assert_line --regexp "accept.*called .* p99 .* max"
+   run ${KM_CLI_BIN} -s ${MGTDIR}/kmpipe.*
+   assert_success
+   wait $stats_pid
+   rm -fr ${MGTDIR}
+
    # Verify that certain conditions cause the snapshot operation to fail
    run km_with_timeout --snapshot=${SNAP} snapshot_fail_test$ext -e
    assert_failure
@@ -1303,6 +1431,244 @@ fi
    [ $status -eq 0 ] && rm -f ${SNAP} ${KMLOG}
 }
 
+@test "snapshot_prefault($test_type): first request latency after resume with --prefault (hello_html_test$ext)" {
+   local port_id=34
+   local port=$(( $port_range_start + $port_id))
+   local MGTDIR=/tmp/mgtdir_prefault.$$
+   local cnt=20
+
+   run km_with_timeout --prefault hello_test$ext
+   assert_success
+   assert_line --regexp "prefault start: .* msec"
+   KM_PREFAULT=1 run km_with_timeout hello_test$ext
+   assert_success
+   assert_line --regexp "prefault start: .* msec"
+
+   mkdir -p ${MGTDIR}
+   KM_MGTDIR=${MGTDIR} km_with_timeout hello_html_test$ext $port &
+   local pid=$!
+   tries=5; while [ ! -S ${MGTDIR}/kmpipe.* ] && [ $tries -gt 0 ]; do sleep 1; tries=`expr $tries - 1`; done
+   assert [ $tries -gt 0 ]
+   run ${KM_CLI_BIN} -s ${MGTDIR}/kmpipe.*
+   assert_success
+   wait $pid
+   local -a snap=($(echo ${MGTDIR}/kmsnap.hello_html_test$ext.[0-9]*))
+   assert [ -f ${snap[0]} ]
+
+   # msec from connect to response of the first request after resume, p99 over $cnt resumes
+   for prefault in "" "--prefault" ; do
+      local -a times=()
+      for i in $(seq $cnt) ; do
+         km_with_timeout $prefault ${snap[0]} >${MGTDIR}/resume.log 2>&1 &
+         pid=$!
+         until t=$(curl -4 -s -o /dev/null -w '%{time_total}' localhost:$port) ; do sleep 0.01 ; done
+         times+=($(awk "BEGIN { print $t * 1000 }"))
+         wait $pid
+         if [ -n "$prefault" ] ; then
+            assert grep -q "prefault restore: .* msec" ${MGTDIR}/resume.log
+         fi
+      done
+      local p99=$(printf "%s\n" "${times[@]}" | sort -n | tail -1)
+      echo "# first request after resume ${prefault:-without --prefault}: p99 ${p99} msec" >&3
+   done
+   rm -fr ${MGTDIR}
+}
+
+@test "mem_release($test_type): freed guest memory goes back to the host (mmap_test$ext)" {
+   local port_id=35
+   local port=$(( $port_range_start + $port_id))
+   local MGTDIR=/tmp/mgtdir_mem.$$
+
+   run km_with_timeout --reclaim mmap_test$ext
+   assert_success
+
+   mkdir -p ${MGTDIR}
+   KM_MGTDIR=${MGTDIR} km_with_timeout --reclaim hello_html_test$ext $port &
+   local pid=$!
+   tries=5; while [ ! -S ${MGTDIR}/kmpipe.* ] && [ $tries -gt 0 ]; do sleep 1; tries=`expr $tries - 1`; done
+   assert [ $tries -gt 0 ]
+   run ${KM_CLI_BIN} -M -s ${MGTDIR}/kmpipe.*
+   assert_success
+   assert_line --regexp "^released +[0-9]+ bytes"
+   assert_line --regexp "^reclaimed +[0-9]+ bytes"
+   assert_line --regexp "^unplugged +[0-9]+ bytes"
+   run curl -4 -s localhost:$port --retry-connrefused  --retry 3 --retry-delay 1
+   assert_success
+   wait $pid
+   rm -fr ${MGTDIR}
+}
+
+@test "snapshot_incremental($test_type): snapshots with only the changed memory (snapshot_incr_test$ext)" {
+   local SNAP=/tmp/snap_incr.$$
+
+   rm -f ${SNAP}*
+   run km_with_timeout --snapshot-incremental --snapshot=${SNAP} snapshot_incr_test$ext 64 3
+   assert_success
+   assert_line --partial "round 2: snapshot"
+   assert [ -f ${SNAP} ]
+   assert [ -f ${SNAP}.1 ]
+   assert [ -f ${SNAP}.2 ]
+   local full=$(du -k ${SNAP} | cut -f1)
+   local layer=$(du -k ${SNAP}.2 | cut -f1)
+   echo "# full snapshot ${full}KB, incremental ${layer}KB" >&3
+   assert [ $layer -lt $(($full / 4)) ]
+   for i in "" .1 .2 ; do
+      run km_with_timeout ${SNAP}$i
+      assert_success
+   done
+   assert_line "resumed round 2 ok"
+
+   # a standalone snapshot from a layer and its parents
+   run km_with_timeout --snapshot-flatten=${SNAP}.flat ${SNAP}.2
+   assert_success
+   rm -f ${SNAP} ${SNAP}.1
+   run km_with_timeout ${SNAP}.2
+   assert_failure
+   run km_with_timeout ${SNAP}.flat
+   assert_success
+   assert_line "resumed round 2 ok"
+   rm -f ${SNAP}*
+}
+
+@test "snapshot_background($test_type): live snapshots written while the payload runs (hello_html_test$ext)" {
+   local port_id=36
+   local port=$(( $port_range_start + $port_id))
+   local MGTDIR=/tmp/mgtdir_bg.$$
+   local SNAP=/tmp/snap_bg.$$
+
+   run km_with_timeout --snapshot-background --snapshot=${SNAP} snapshot_incr_test$ext 64 1
+   assert_success
+   assert_line --partial "round 0: snapshot"
+   run km_with_timeout ${SNAP}
+   assert_success
+   assert_line "resumed round 0 ok"
+   rm -f ${SNAP}
+
+   mkdir -p ${MGTDIR}
+   KM_MGTDIR=${MGTDIR} km_with_timeout --snapshot-background hello_html_test$ext $port &
+   local pid=$!
+   tries=5; while [ ! -S ${MGTDIR}/kmpipe.* ] && [ $tries -gt 0 ]; do sleep 1; tries=`expr $tries - 1`; done
+   assert [ $tries -gt 0 ]
+   for i in 1 2 ; do
+      run ${KM_CLI_BIN} -r -s ${MGTDIR}/kmpipe.*
+      assert_success
+      assert_line --regexp "^payload was paused [0-9]+ usec for the snapshot"
+      echo "# ${lines[0]}" >&3
+   done
+   run curl -4 -s localhost:$port --retry-connrefused  --retry 3 --retry-delay 1
+   assert_success
+   wait $pid
+   local -a snap=($(echo ${MGTDIR}/kmsnap.hello_html_test$ext.[0-9]*))
+   assert [ -f ${snap[0]} ]
+   rm -fr ${MGTDIR}
+}
+
+@test "snapshot_sparse($test_type): zero pages are holes in snapshots (snapshot_incr_test$ext)" {
+   local SNAP=/tmp/snap_sparse.$$
+
+   run km_with_timeout --snapshot=${SNAP} snapshot_incr_test$ext 16 1 64
+   assert_success
+   assert_line --partial "round 0: snapshot"
+   local size=$(( $(stat -c %s ${SNAP}) / 1024 ))
+   local used=$(du -k ${SNAP} | cut -f1)
+   echo "# snapshot ${size}KB, ${used}KB on disk" >&3
+   assert [ $used -lt $(($size / 2)) ]
+   run km_with_timeout ${SNAP}
+   assert_success
+   assert_line "resumed round 0 ok"
+
+   # copies keep the holes
+   run km_with_timeout --snapshot-incremental --snapshot=${SNAP}.i snapshot_incr_test$ext 16 2 64
+   assert_success
+   run km_with_timeout --snapshot-flatten=${SNAP}.flat ${SNAP}.i.1
+   assert_success
+   assert [ $(du -k ${SNAP}.flat | cut -f1) -lt $(( $(stat -c %s ${SNAP}.flat) / 2048 )) ]
+   run km_with_timeout ${SNAP}.flat
+   assert_success
+   assert_line "resumed round 1 ok"
+   rm -f ${SNAP}*
+}
+
+@test "snapshot_compress($test_type): snapshots with compressed guest memory (snapshot_incr_test$ext)" {
+   local SNAP=/tmp/snap_compress.$$
+
+   run km_with_timeout --snapshot=${SNAP} snapshot_incr_test$ext 64 1
+   assert_success
+   run km_with_timeout --snapshot-compress --snapshot=${SNAP}.lz4 snapshot_incr_test$ext 64 1
+   assert_success
+   assert_line --partial "round 0: snapshot"
+   local full=$(du -k ${SNAP} | cut -f1)
+   local compressed=$(du -k ${SNAP}.lz4 | cut -f1)
+   echo "# snapshot ${full}KB, compressed ${compressed}KB" >&3
+   assert [ $compressed -lt $(($full * 3 / 4)) ]
+   run km_with_timeout ${SNAP}.lz4
+   assert_success
+   assert_line "resumed round 0 ok"
+
+   run km_with_timeout --snapshot-compress --snapshot-background --snapshot=${SNAP}.bg snapshot_incr_test$ext 64 1
+   assert_success
+   run km_with_timeout ${SNAP}.bg
+   assert_success
+   assert_line "resumed round 0 ok"
+   rm -f ${SNAP}*
+}
+
+@test "snapshot_base($test_type): snapshots layered on a shared base snapshot (snapshot_incr_test$ext)" {
+   local port_id=37
+   local port=$(( $port_range_start + $port_id))
+   local MGTDIR=/tmp/mgtdir_base.$$
+   local SNAP=/tmp/snap_base.$$
+
+   rm -fr ${SNAP}*
+   run km_with_timeout --snapshot-incremental --snapshot=${SNAP} snapshot_incr_test$ext 64 1
+   assert_success
+   run km_with_timeout --snapshot-base=${SNAP} --snapshot=${SNAP}.d snapshot_incr_test$ext 64 3
+   assert_success
+   assert_line --partial "round 2: snapshot"
+   local full=$(du -k ${SNAP} | cut -f1)
+   local layer=$(du -k ${SNAP}.d | cut -f1)
+   echo "# base snapshot ${full}KB, layer ${layer}KB" >&3
+   assert [ $layer -lt $(($full / 2)) ]
+   run km_with_timeout --snapshot-info ${SNAP}.d
+   assert_success
+   assert_line --regexp "^   ${SNAP}.d id 0x[0-9a-f]+ parent 0x[0-9a-f]+, [0-9]+ pages, [0-9]+ in the file"
+   assert_line --regexp "^   ${SNAP} id .*, all in the file"
+   run km_with_timeout ${SNAP}.d
+   assert_success
+   assert_line "resumed round 2 ok"
+
+   # the base is found by its id when it isn't where the layer says
+   mkdir ${SNAP}.dir
+   mv ${SNAP} ${SNAP}.dir/base
+   run km_with_timeout ${SNAP}.d
+   assert_failure
+   run km_with_timeout --snapshot-base=${SNAP}.dir/base ${SNAP}.d
+   assert_success
+   assert_line "resumed round 2 ok"
+   rm -fr ${SNAP}*
+
+   # km_cli makes snapshots layers of the first one and prints the layers
+   mkdir -p ${MGTDIR}
+   KM_MGTDIR=${MGTDIR} km_with_timeout --snapshot-incremental hello_html_test$ext $port &
+   local pid=$!
+   tries=5; while [ ! -S ${MGTDIR}/kmpipe.* ] && [ $tries -gt 0 ]; do sleep 1; tries=`expr $tries - 1`; done
+   assert [ $tries -gt 0 ]
+   run ${KM_CLI_BIN} -r -s ${MGTDIR}/kmpipe.*
+   assert_success
+   local -a snap=($(echo ${MGTDIR}/kmsnap.hello_html_test$ext.[0-9]*))
+   mv ${snap[0]} ${MGTDIR}/base
+   run ${KM_CLI_BIN} -r -b ${MGTDIR}/base -s ${MGTDIR}/kmpipe.*
+   assert_success
+   run ${KM_CLI_BIN} -L -s ${MGTDIR}/kmpipe.*
+   assert_success
+   assert_line "base:"
+   assert_line --regexp "^   ${MGTDIR}/base id 0x[0-9a-f]+ parent 0x0, [0-9]+ pages, all in the file"
+   run curl -4 -s localhost:$port --retry-connrefused  --retry 3 --retry-delay 1
+   assert_success
+   wait $pid
+   rm -fr ${MGTDIR}
+}
+
 @test "futex_snapshot($test_type): futex_snapshot and resume (futex_test$ext)" {
    SNAP=/tmp/snap.$$
    CORE=/tmp/core.$$
@@ -1416,6 +1782,54 @@ fi
       if [ $status == 0 ] ; then break; fi
    done
    assert_success
+
+   for mode in "" thp 2M 1G ; do
+      for from in mmap brk ; do
+         run km_with_timeout ${mode:+--hugepages=$mode} tlb_test$ext 256 1000000 $from
+         assert_success
+         assert_line --partial "256MB $from: "
+      done
+   done
+   for advice in none dontneed free cold pageout ; do
+      run km_with_timeout madvise_purge_test$ext 256 200000 $advice
+      assert_success
+      assert_line --partial "256MB $advice: "
+   done
+   for mode in "" --pt-mprotect ; do
+      run km_with_timeout $mode wx_flip_test$ext 4096 200000
+      assert_success
+      assert_line --partial "4096 pages: "
+   done
+   for mode in "" --single-memslot ; do
+      run km_with_timeout $mode brk_grow_test$ext 1024 20
+      assert_success
+      assert_line --partial "1024MB: "
+   done
+   for mode in "" --numa=interleave --numa=local "--numa=local --vcpu-pin=cpu" --numa=node:0 ; do
+      run km_with_timeout $mode stream_test$ext 256 4 3
+      assert_success
+      assert_line --partial "256MB 4 threads: "
+   done
+}
+
+@test "hcall_ring($test_type): hypercall submission ring and batching benchmark (hcring_test$ext)" {
+   run km_with_timeout hcring_test$ext
+   assert_success
+   assert_line --partial "writev: sync"
+}
+
+@test "hcall_async($test_type): asynchronous stdout writes and benchmark (hcasync_test$ext)" {
+   run km_with_timeout --async-hcalls hcasync_test$ext
+   assert_success
+   assert_line --partial "write: sync"
+   run km_with_timeout hcasync_test$ext
+   assert_success
+}
+
+@test "io_uring($test_type): io_uring passthrough and random read benchmark (io_uring_test$ext)" {
+   run km_with_timeout io_uring_test$ext
+   assert_success
+   assert_line --partial "io_uring: pread"
 }
 
 @test "popen($test_type): popen pclose test (popen_test$ext)" {
@@ -1808,6 +2222,11 @@ EOF
    AIO_TEST_WORKDIR=$WORKDIR run km_with_timeout aio_test$ext -f 13 -c 1
    assert_success
 
+   # io_submit() throughput, batches larger than km submits to the host at once
+   AIO_TEST_WORKDIR=$WORKDIR run km_with_timeout aio_test$ext -b
+   assert_success
+   assert_line --partial "aio:"
+
    # Now try snapshotting and resuming a payload with io contexts
    # This snapshot should succeed because there will be no active asynch
    # i/o requests
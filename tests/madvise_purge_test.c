@@ -0,0 +1,124 @@
+/*
+ * Copyright 2021 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Allocator purge benchmark: spans of an mmap'ed arena are allocated (touched) and freed at random,
+ * and freed spans are given back with <advice>, the way mimalloc, jemalloc or glibc purge. Prints
+ * throughput and RSS, e.g.
+ *
+ *    km madvise_purge_test.km 1024 1000000 none
+ *    km madvise_purge_test.km 1024 1000000 free
+ *    km madvise_purge_test.km 1024 1000000 dontneed
+ *
+ * To see the same for a real allocator run a payload with mimalloc, e.g.
+ * km --putenv LD_PRELOAD=/opt/kontain/lib/libmimalloc.so --putenv MIMALLOC_PAGE_RESET=1 ...
+ */
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#define SPAN (64 * 1024)
+
+static const struct {
+   const char* name;
+   int advice;
+} advices[] = {{"none", -1},
+               {"dontneed", MADV_DONTNEED},
+               {"free", MADV_FREE},
+               {"cold", MADV_COLD},
+               {"pageout", MADV_PAGEOUT}};
+
+static long rss_kb(void)
+{
+   char line[128];
+   long kb = -1;
+   FILE* fp;
+
+   if ((fp = fopen("/proc/self/status", "r")) == NULL) {
+      return -1;
+   }
+   while (fgets(line, sizeof(line), fp) != NULL) {
+      if (sscanf(line, "VmRSS: %ld kB", &kb) == 1) {
+         break;
+      }
+   }
+   fclose(fp);
+   return kb;
+}
+
+int main(int argc, char** argv)
+{
+   struct timespec start, end;
+   int advice = -2;
+
+   if (argc != 4) {
+      errx(1, "usage: %s MB ops none|dontneed|free|cold|pageout", argv[0]);
+   }
+   size_t size = atol(argv[1]) << 20;
+   long ops = atol(argv[2]);
+   for (int i = 0; i < sizeof(advices) / sizeof(advices[0]); i++) {
+      if (strcmp(argv[3], advices[i].name) == 0) {
+         advice = advices[i].advice;
+      }
+   }
+   if (advice == -2) {
+      errx(1, "unknown advice %s", argv[3]);
+   }
+   char* arena = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (arena == MAP_FAILED) {
+      err(1, "mmap %ldMB", size >> 20);
+   }
+   size_t spans = size / SPAN;
+   char* used = calloc(spans, 1);
+   if (used == NULL) {
+      err(1, "calloc");
+   }
+
+   uint64_t x = 88172645463325252ul;   // xorshift64
+   long peak = 0;
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (long i = 0; i < ops; i++) {
+      x ^= x << 13;
+      x ^= x >> 7;
+      x ^= x << 17;
+      size_t s = x % spans;
+      char* p = arena + s * SPAN;
+      if (used[s] == 0) {
+         memset(p, (char)i | 1, SPAN);
+      } else if (advice != -1 && madvise(p, SPAN, advice) != 0) {
+         err(1, "madvise %s", argv[3]);
+      }
+      used[s] ^= 1;
+      if (i % (ops / 16 + 1) == 0) {
+         long kb = rss_kb();
+         peak = kb > peak ? kb : peak;
+      }
+   }
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+   printf("%ldMB %s: %.0f ops/sec, rss %ldMB peak %ldMB\n",
+          size >> 20,
+          argv[3],
+          ops / secs,
+          rss_kb() >> 10,
+          peak >> 10);
+   return 0;
+}
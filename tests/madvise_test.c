@@ -43,11 +43,39 @@ TEST simple_test()
          flags,
          ENOMEM,
          MADV_DONTNEED},
-        {__LINE__, "3a. madvise MADV_FREE, EINVAL fail", TYPE_MADVISE, 8 * MIB, 10 * MIB, 0, flags, EINVAL, MADV_FREE},
+        {__LINE__, "3a. madvise MADV_COLD", TYPE_MADVISE, 8 * MIB, 10 * MIB, 0, flags, OK, MADV_COLD},
         {__LINE__, "3b. OK to READ, should read in not 0", TYPE_READ, 9 * MIB, 1 * MIB, '2', 0, OK, 0},
-        {__LINE__, "3c. madvise MADV_DONTNEED", TYPE_MADVISE, 8 * MIB, 10 * MIB, 0, flags, OK, MADV_DONTNEED},
-        {__LINE__, "3d. madvise MADV_WILLNEED", TYPE_MADVISE, 9 * MIB, 1 * MIB, 0, 0, OK, MADV_WILLNEED},
+        {__LINE__, "3c. madvise MADV_PAGEOUT", TYPE_MADVISE, 8 * MIB, 10 * MIB, 0, flags, OK, MADV_PAGEOUT},
+        {__LINE__, "3d. OK to READ, paged back in", TYPE_READ, 17 * MIB, 1 * MIB, '2', 0, OK, 0},
+        {__LINE__, "3e. madvise MADV_DONTNEED", TYPE_MADVISE, 8 * MIB, 10 * MIB, 0, flags, OK, MADV_DONTNEED},
+        {__LINE__, "3f. madvise MADV_WILLNEED", TYPE_MADVISE, 9 * MIB, 1 * MIB, 0, 0, OK, MADV_WILLNEED},
         {__LINE__, "4.  OK to READ", TYPE_READ, 10 * MIB, 1 * MIB, 0, 0, OK, 0},
+        {__LINE__, "5a. madvise MADV_FREE", TYPE_MADVISE, 0, 64 * MIB, 0, flags, OK, MADV_FREE},
+        {__LINE__, "5b. OK to WRITE after MADV_FREE", TYPE_WRITE, 20 * MIB, 10 * MIB, '5', 0, OK},
+        {__LINE__, "5c. OK to READ", TYPE_READ, 21 * MIB, 1 * MIB, '5', 0, OK, 0},
+        {__LINE__, "5d. madvise MADV_REMOVE, private EINVAL", TYPE_MADVISE, 0, 64 * MIB, 0, flags, EINVAL, MADV_REMOVE},
+        {__LINE__, "6.  munmap", TYPE_MUNMAP, 0, 64 * MIB, 0, 0, OK},
+        {0}};
+   if (greatest_get_verbosity() != 0) {
+      printf("Running %s\n", __FUNCTION__);
+   }
+   CHECK_CALL(mmap_test(madvice_tests));
+   PASS();
+}
+
+// MADV_REMOVE punches a hole in shared memory, MADV_FREE wants private
+TEST shared_test()
+{
+   static mmap_test_t madvice_tests[] =
+       {{__LINE__, "1. Shared mmap", TYPE_MMAP, 0, 8 * MIB, PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, OK},
+        {__LINE__, "2. OK to WRITE", TYPE_WRITE, 0, 8 * MIB, '6', 0, OK},
+        {__LINE__, "3a. madvise MADV_FREE, shared EINVAL", TYPE_MADVISE, 0, 8 * MIB, 0, 0, EINVAL, MADV_FREE},
+        {__LINE__, "3b. madvise MADV_REMOVE", TYPE_MADVISE, 2 * MIB, 2 * MIB, 0, 0, OK, MADV_REMOVE},
+        {__LINE__, "3c. READ the hole", TYPE_READ, 2 * MIB, 2 * MIB, 0, 0, OK, 0},
+        {__LINE__, "3d. READ the rest", TYPE_READ, 5 * MIB, 1 * MIB, '6', 0, OK, 0},
+        {__LINE__, "4a. madvise MADV_PAGEOUT", TYPE_MADVISE, 0, 8 * MIB, 0, 0, OK, MADV_PAGEOUT},
+        {__LINE__, "4b. OK to READ, paged back in", TYPE_READ, 6 * MIB, 1 * MIB, '6', 0, OK, 0},
+        {__LINE__, "5.  munmap", TYPE_MUNMAP, 0, 8 * MIB, 0, 0, OK},
         {0}};
    if (greatest_get_verbosity() != 0) {
       printf("Running %s\n", __FUNCTION__);
@@ -62,6 +90,7 @@ int main(int argc, char** argv)
    GREATEST_MAIN_BEGIN();
 
    RUN_TEST(simple_test);
+   RUN_TEST(shared_test);
    GREATEST_PRINT_REPORT();
    exit(greatest_info.failed);   // return count of errors (or 0 if all is good)
 }
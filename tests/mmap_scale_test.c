@@ -0,0 +1,103 @@
+/*
+ * Copyright 2021 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Measure how mmaps lookups scale with vcpus: <threads> threads call madvise() on their own page
+ * <count> times each, while one more thread keeps changing mmaps with mmap/mprotect/munmap.
+ * Compare `mmap_scale_test 1 100000`, `mmap_scale_test 8 100000` and `mmap_scale_test 64 100000`.
+ */
+
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/mman.h>
+
+static const size_t sz = 0x1000;
+static long count;
+static int done;
+
+static void* advise_thread(void* arg)
+{
+   void* m = mmap(0, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+   if (m == MAP_FAILED) {
+      err(1, "mmap");
+   }
+   for (long i = 0; i < count; i++) {
+      if (madvise(m, sz, MADV_WILLNEED) != 0) {
+         err(1, "madvise");
+      }
+   }
+   munmap(m, sz);
+   return NULL;
+}
+
+static void* churn_thread(void* arg)
+{
+   long churns = 0;
+
+   while (__atomic_load_n(&done, __ATOMIC_RELAXED) == 0) {
+      void* m = mmap(0, 2 * sz, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (m == MAP_FAILED) {
+         err(1, "mmap");
+      }
+      if (mprotect(m, sz, PROT_READ | PROT_WRITE) != 0 || munmap(m, 2 * sz) != 0) {
+         err(1, "mprotect/munmap");
+      }
+      churns++;
+   }
+   *(long*)arg = churns;
+   return NULL;
+}
+
+int main(int argc, char** argv)
+{
+   struct timespec start, end;
+   pthread_t churner;
+   long churns;
+
+   if (argc < 3) {
+      errx(1, "usage: mmap_scale_test threads count");
+   }
+   int nthreads = atoi(argv[1]);
+   count = atol(argv[2]);
+   pthread_t threads[nthreads];
+
+   if (pthread_create(&churner, NULL, churn_thread, &churns) != 0) {
+      err(1, "pthread_create");
+   }
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (int i = 0; i < nthreads; i++) {
+      if (pthread_create(&threads[i], NULL, advise_thread, NULL) != 0) {
+         err(1, "pthread_create");
+      }
+   }
+   for (int i = 0; i < nthreads; i++) {
+      pthread_join(threads[i], NULL);
+   }
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   __atomic_store_n(&done, 1, __ATOMIC_RELAXED);
+   pthread_join(churner, NULL);
+
+   double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+   printf("%d threads: %.0f madvise/sec, %ld mmap changes meanwhile\n",
+          nthreads,
+          nthreads * count / secs,
+          churns);
+   return 0;
+}
@@ -27,6 +27,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -431,6 +432,54 @@ TEST mmap_file2_test(void)
    PASS();
 }
 
+/*
+ * Lots of small maps, like JVM or Go runtimes create. Neighbors get different protection so they
+ * don't merge, then every other one is unmapped and mapped again from the free list, and the rest
+ * changes protection. Prints the time it took, as a rough benchmark of mmaps bookkeeping.
+ */
+#define STRESS_MAPS 100000
+
+TEST mmap_stress_test(void)
+{
+   static const size_t sz = 0x1000;
+   struct timespec start, end;
+   int initial_busy_count;
+   void** maps;
+
+   ASSERT_MMAPS_INIT(initial_busy_count);
+   ASSERT_NEQ(NULL, maps = calloc(STRESS_MAPS, sizeof(void*)));
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (int i = 0; i < STRESS_MAPS; i++) {
+      int prot = (i & 1) == 0 ? PROT_READ | PROT_WRITE : PROT_READ;
+      maps[i] = mmap(0, sz, prot, flags, -1, 0);
+      ASSERT_NEQ_FMT(MAP_FAILED, maps[i], "%p");
+   }
+   for (int i = 0; i < STRESS_MAPS; i += 2) {
+      ASSERT_EQ_FMT(0, munmap(maps[i], sz), "%d");
+   }
+   for (int i = 0; i < STRESS_MAPS; i += 2) {
+      maps[i] = mmap(0, sz, PROT_READ | PROT_WRITE, flags, -1, 0);
+      ASSERT_NEQ_FMT(MAP_FAILED, maps[i], "%p");
+      *(int*)maps[i] = i;
+   }
+   for (int i = 1; i < STRESS_MAPS; i += 2) {
+      ASSERT_EQ_FMT(0, mprotect(maps[i], sz, PROT_NONE), "%d");
+   }
+   for (int i = 0; i < STRESS_MAPS; i += 2) {
+      ASSERT_EQ_FMT(i, *(int*)maps[i], "%d");
+   }
+   for (int i = 0; i < STRESS_MAPS; i++) {
+      ASSERT_EQ_FMT(0, munmap(maps[i], sz), "%d");
+   }
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   printf("%d maps: %ld msec\n",
+          STRESS_MAPS,
+          (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000);
+   free(maps);
+   ASSERT_MMAPS_CHANGE(0, initial_busy_count);
+   PASS();
+}
+
 GREATEST_MAIN_DEFS();
 int main(int argc, char** argv)
 {
@@ -444,6 +493,7 @@ int main(int argc, char** argv)
    RUN_TEST(mmap_file_test);
    RUN_TEST1(mmap_file_test_ex, argv[0]);
    RUN_TEST(mmap_file2_test);
+   RUN_TEST(mmap_stress_test);
 
    GREATEST_PRINT_REPORT();
    exit(greatest_info.failed);   // return count of errors (or 0 if all is good)
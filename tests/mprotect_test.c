@@ -26,6 +26,7 @@
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/param.h>
 #include "syscall.h"
@@ -165,6 +166,39 @@ TEST concat_test()
    PASS();
 }
 
+// memory km maps with the guest protection is writable after mprotect, by the guest and by km
+TEST widen_test()
+{
+   static char path[] = "/tmp/mprotect_test_XXXXXX";
+   static const char data[] = "read into widened mapping";
+   int fd;
+   int pipefd[2];
+   char* m;
+
+   printf("Running %s\n", __FUNCTION__);
+   ASSERT_NEQ(-1, fd = mkstemp(path));
+   unlink(path);
+   ASSERT_EQ(0, ftruncate(fd, 2 * 4096));
+   ASSERT_NEQ(MAP_FAILED, m = mmap(NULL, 2 * 4096, PROT_READ, MAP_PRIVATE, fd, 0));
+   ASSERT_NEQ(MAP_FAILED,
+              mmap(m + 4096, 4096, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0));
+   ASSERT_EQ(0, mprotect(m, 2 * 4096, PROT_READ | PROT_WRITE));
+   ASSERT_EQ(0, pipe(pipefd));
+   for (int i = 0; i < 2; i++) {
+      char* p = m + i * 4096;
+      p[0] = 'x';
+      ASSERT_EQ(sizeof(data), write(pipefd[1], data, sizeof(data)));
+      ASSERT_EQ(sizeof(data), read(pipefd[0], p + 1, sizeof(data)));
+      ASSERT_EQ('x', p[0]);
+      ASSERT_STR_EQ(data, p + 1);
+   }
+   close(pipefd[0]);
+   close(pipefd[1]);
+   ASSERT_EQ(0, munmap(m, 2 * 4096));
+   close(fd);
+   PASS();
+}
+
 GREATEST_MAIN_DEFS();
 int main(int argc, char** argv)
 {
@@ -175,6 +209,7 @@ int main(int argc, char** argv)
    RUN_TEST(simple_test);
    RUN_TEST(concat_test);
    RUN_TEST(complex_test);
+   RUN_TEST(widen_test);
 
    GREATEST_PRINT_REPORT();
    exit(greatest_info.failed);   // return count of errors (or 0 if all is good)
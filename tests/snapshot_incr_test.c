@@ -0,0 +1,176 @@
+/*
+ * Copyright 2021 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Incremental snapshot test: fills <MB> megabytes, then takes <snapshots> live snapshots. Before
+ * each it changes every 16th page, reads from a pipe into a page (so km writes the memory, not
+ * the payload), and drops a range with MADV_DONTNEED. Run with
+ *
+ *    km --snapshot-incremental --snapshot=snap snapshot_incr_test.km 64 3
+ *
+ * Resuming any of the snapshot files checks the memory has what it had when it was taken, an EXEC
+ * only mapping included. With a third argument it also writes zeroes to that many megabytes, which
+ * should be holes in the file.
+ */
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "km_hcalls.h"
+
+#define PAGE 4096
+#define XPAGES 16   // EXEC only pages
+
+static uint64_t* mem;
+static size_t npages;
+static uint64_t* xmem;
+static int round_no;
+static uint64_t checksum;
+static uint64_t xchecksum;
+
+static uint64_t sum_pages(const uint64_t* p, size_t n)
+{
+   uint64_t s = 0;
+
+   for (size_t i = 0; i < n * PAGE / sizeof(uint64_t); i++) {
+      s = s * 31 + p[i];
+   }
+   return s;
+}
+
+static uint64_t sum(void)
+{
+   return sum_pages(mem, npages);
+}
+
+/*
+ * /proc/self/stat is not virtualized, so it has the pid of km. A resumed snapshot runs in a
+ * different km process.
+ */
+static long km_pid(void)
+{
+   FILE* f;
+   long pid = -1;
+
+   if ((f = fopen("/proc/self/stat", "r")) != NULL) {
+      if (fscanf(f, "%ld", &pid) != 1) {
+         pid = -1;
+      }
+      fclose(f);
+   }
+   return pid;
+}
+
+static double now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv)
+{
+   int fds[2];
+
+   if (argc != 3 && argc != 4) {
+      errx(1, "usage: %s MB snapshots [zero MB]", argv[0]);
+   }
+   npages = (atol(argv[1]) << 20) / PAGE;
+   int snapshots = atoi(argv[2]);
+   if (npages < 16) {
+      errx(1, "MB must be at least 1");
+   }
+   mem = mmap(NULL, npages * PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (mem == MAP_FAILED) {
+      err(1, "mmap %sMB", argv[1]);
+   }
+   if (pipe(fds) != 0) {
+      err(1, "pipe");
+   }
+   if (argc == 4) {
+      size_t zero = atol(argv[3]) << 20;
+      char* z = mmap(NULL, zero, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (z == MAP_FAILED) {
+         err(1, "mmap %sMB", argv[3]);
+      }
+      for (size_t i = 0; i < zero; i += PAGE) {
+         z[i] = 0;   // the page is there, with zeroes
+      }
+   }
+   for (size_t i = 0; i < npages * PAGE / sizeof(uint64_t); i++) {
+      mem[i] = i;
+   }
+   xmem = mmap(NULL, XPAGES * PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (xmem == MAP_FAILED) {
+      err(1, "mmap exec only pages");
+   }
+   for (size_t i = 0; i < XPAGES * PAGE / sizeof(uint64_t); i++) {
+      xmem[i] = i * 3 + 1;
+   }
+   xchecksum = sum_pages(xmem, XPAGES);
+   if (mprotect(xmem, XPAGES * PAGE, PROT_EXEC) != 0) {
+      err(1, "mprotect PROT_EXEC");
+   }
+   for (round_no = 0; round_no < snapshots; round_no++) {
+      uint64_t* page = mem + (round_no * 7 % npages) * PAGE / sizeof(uint64_t);
+      char msg[64];
+
+      for (size_t i = round_no % 16; i < npages; i += 16) {
+         mem[i * PAGE / sizeof(uint64_t) + round_no] += round_no + 1;
+      }
+      snprintf(msg, sizeof(msg), "round %d", round_no);
+      if (write(fds[1], msg, sizeof(msg)) != sizeof(msg) ||
+          read(fds[0], page, sizeof(msg)) != sizeof(msg)) {
+         err(1, "pipe write/read");
+      }
+      size_t drop = (round_no * 13 + 5) % (npages - 4);
+      if (madvise(mem + drop * PAGE / sizeof(uint64_t), 4 * PAGE, MADV_DONTNEED) != 0) {
+         err(1, "madvise");
+      }
+      checksum = sum();
+
+      km_hc_args_t snapshotargs = {.arg1 = (uint64_t) "snapshot_incr_test", .arg3 = 1};
+      long pid = km_pid();
+      double start = now();
+      km_hcall(HC_snapshot, &snapshotargs);
+      if (km_pid() != pid) {
+         if (sum() != checksum) {
+            errx(1, "resumed round %d: memory differs", round_no);
+         }
+         if (mprotect(xmem, XPAGES * PAGE, PROT_READ) != 0 ||
+             sum_pages(xmem, XPAGES) != xchecksum) {
+            errx(1, "resumed round %d: exec only memory differs", round_no);
+         }
+         printf("resumed round %d ok\n", round_no);
+         return 0;
+      }
+      if (snapshotargs.hc_ret != 0) {
+         errx(1, "round %d: snapshot failed %ld", round_no, (long)snapshotargs.hc_ret);
+      }
+      printf("round %d: snapshot %.0f msec ok\n", round_no, (now() - start) * 1000);
+      if (sum() != checksum) {
+         errx(1, "round %d: memory changed by the snapshot", round_no);
+      }
+   }
+   return 0;
+}
@@ -0,0 +1,151 @@
+/*
+ * Copyright 2021 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * STREAM style memory bandwidth benchmark: <threads> threads run copy, scale, add and triad over
+ * three arrays of <MB> megabytes each, <rounds> times, and the best round is printed in GB/s. Each
+ * thread first touches its own part of the arrays. Compare guest memory placement, e.g.
+ *
+ *    km stream_test.km 1024 16 10
+ *    km --numa=interleave stream_test.km 1024 16 10
+ *    km --numa=local --vcpu-pin=cpu stream_test.km 1024 16 10
+ */
+
+#include <err.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define SCALAR 3.0
+
+static const char* kernels[] = {"copy", "scale", "add", "triad"};
+static const int arrays[] = {2, 2, 3, 3};   // arrays each kernel reads and writes
+
+static double *a, *b, *c;
+static long count;
+static int nthreads;
+static long rounds;
+static pthread_barrier_t barrier;
+static double best[4];
+
+static double now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void* stream_thread(void* arg)
+{
+   long id = (long)arg;
+   long lo = count / nthreads * id;
+   long hi = id == nthreads - 1 ? count : lo + count / nthreads;
+   double start = 0;
+
+   for (long i = lo; i < hi; i++) {
+      a[i] = 1.0;
+      b[i] = 2.0;
+      c[i] = 0.0;
+   }
+   for (long r = 0; r < rounds; r++) {
+      for (int k = 0; k < 4; k++) {
+         pthread_barrier_wait(&barrier);
+         if (id == 0) {
+            start = now();
+         }
+         switch (k) {
+            case 0:
+               for (long i = lo; i < hi; i++) {
+                  c[i] = a[i];
+               }
+               break;
+            case 1:
+               for (long i = lo; i < hi; i++) {
+                  b[i] = SCALAR * c[i];
+               }
+               break;
+            case 2:
+               for (long i = lo; i < hi; i++) {
+                  c[i] = a[i] + b[i];
+               }
+               break;
+            case 3:
+               for (long i = lo; i < hi; i++) {
+                  a[i] = b[i] + SCALAR * c[i];
+               }
+               break;
+         }
+         pthread_barrier_wait(&barrier);
+         if (id == 0) {
+            double gbs = arrays[k] * count * sizeof(double) / (now() - start) / 1e9;
+            best[k] = gbs > best[k] ? gbs : best[k];
+         }
+      }
+   }
+   return NULL;
+}
+
+int main(int argc, char** argv)
+{
+   pthread_t threads[256];
+   unsigned int cpu, node;
+
+   if (argc != 4) {
+      errx(1, "usage: %s MB threads rounds", argv[0]);
+   }
+   count = (atol(argv[1]) << 20) / sizeof(double);
+   nthreads = atoi(argv[2]);
+   rounds = atol(argv[3]);
+   if (nthreads < 1 || nthreads > sizeof(threads) / sizeof(threads[0])) {
+      errx(1, "threads must be between 1 and %ld", sizeof(threads) / sizeof(threads[0]));
+   }
+   a = malloc(count * sizeof(double));
+   b = malloc(count * sizeof(double));
+   c = malloc(count * sizeof(double));
+   if (a == NULL || b == NULL || c == NULL) {
+      err(1, "malloc 3 x %sMB", argv[1]);
+   }
+   if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) {
+      err(1, "getcpu");
+   }
+   pthread_barrier_init(&barrier, NULL, nthreads);
+   for (long i = 1; i < nthreads; i++) {
+      if (pthread_create(&threads[i], NULL, stream_thread, (void*)i) != 0) {
+         errx(1, "pthread_create %ld", i);
+      }
+   }
+   stream_thread(0);
+   for (long i = 1; i < nthreads; i++) {
+      pthread_join(threads[i], NULL);
+   }
+   // every element went through the same kernels
+   for (long i = 0; i < count; i += count / 16 + 1) {
+      if (a[i] != a[0]) {
+         errx(1, "a[%ld] is %g, expected %g", i, a[i], a[0]);
+      }
+   }
+   printf("%sMB %d threads:", argv[1], nthreads);
+   for (int k = 0; k < 4; k++) {
+      printf(" %s %.1f", kernels[k], best[k]);
+   }
+   printf(" GB/s, main on cpu %u node %u\n", cpu, node);
+   return 0;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2021 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * TLB heavy benchmark: random 8 byte reads and writes over <MB> megabytes of memory from mmap
+ * (default) or brk. Compare km --hugepages modes, e.g.
+ *
+ *    km tlb_test.km 4096 100000000
+ *    km --hugepages=thp tlb_test.km 4096 100000000
+ *    km --hugepages=2M tlb_test.km 4096 100000000 brk
+ *    km --hugepages=1G tlb_test.km 4096 100000000 brk
+ *
+ * hugetlb pages back brk memory only, and need /proc/sys/vm/nr_hugepages (or
+ * /sys/kernel/mm/hugepages/hugepages-1048576kB/nr_hugepages) on the host.
+ */
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+int main(int argc, char** argv)
+{
+   struct timespec start, end;
+   uint64_t* mem;
+
+   if (argc < 3 || (argc == 4 && strcmp(argv[3], "brk") != 0 && strcmp(argv[3], "mmap") != 0)) {
+      errx(1, "usage: %s MB accesses [brk|mmap]", argv[0]);
+   }
+   size_t size = atol(argv[1]) << 20;
+   long accesses = atol(argv[2]);
+   const char* from = argc == 4 ? argv[3] : "mmap";
+
+   if (strcmp(from, "brk") == 0) {
+      mem = sbrk(size);
+   } else {
+      mem = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   }
+   if (mem == (void*)-1) {
+      err(1, "%s %ldMB", from, size >> 20);
+   }
+   memset(mem, 0, size);   // fault it all in, not part of the measurement
+
+   size_t words = size / sizeof(uint64_t);
+   uint64_t x = 88172645463325252ul;   // xorshift64
+   uint64_t sum = 0;
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (long i = 0; i < accesses; i++) {
+      x ^= x << 13;
+      x ^= x >> 7;
+      x ^= x << 17;
+      sum += mem[x % words]++;
+   }
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   double nsecs = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+   printf("%ldMB %s: %.2f ns/access (%lu)\n", size >> 20, from, nsecs / accesses, sum);
+   return 0;
+}
@@ -19,6 +19,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/fsuid.h>
 #include <sys/types.h>
 
 #include "greatest/greatest.h"
@@ -107,6 +108,72 @@ TEST getgroups_print(void)
    PASS();
 }
 
+/*
+ * Real and effective ids from the "Uid:" or "Gid:" line of /proc/thread-self/status, km's thread
+ * that made the set*id() call.
+ */
+static int status_ids(const char* key, unsigned int* real, unsigned int* effective)
+{
+   char line[256];
+   FILE* fp = fopen("/proc/thread-self/status", "r");
+   int found = 0;
+
+   if (fp == NULL) {
+      return -1;
+   }
+   while (found == 0 && fgets(line, sizeof(line), fp) != NULL) {
+      found = strncmp(line, key, strlen(key)) == 0 &&
+              sscanf(line + strlen(key), "%u %u", real, effective) == 2;
+   }
+   fclose(fp);
+   return found != 0 ? 0 : -1;
+}
+
+/*
+ * getpid(), getuid() and geteuid() are answered in the guest without a hypercall. Check they
+ * follow the set*id() calls.
+ */
+TEST setXid_fastpath(void)
+{
+   pid_t pid = getpid();
+   uid_t uid = getuid();
+   uid_t euid = geteuid();
+   unsigned int real;
+   unsigned int effective;
+
+   ASSERT_EQ(setresuid(-1, -1, -1), 0);
+   ASSERT_EQ(setresgid(-1, -1, -1), 0);
+   ASSERT_EQ(setreuid(-1, -1), 0);
+   ASSERT_EQ(setregid(-1, -1), 0);
+   ASSERT_EQ(setfsuid(euid), euid);
+   ASSERT_EQ(setfsgid(getegid()), getegid());
+   // an invalid id changes nothing, the call still returns the current one
+   ASSERT_EQ(setfsuid(-1), euid);
+   ASSERT_EQ(getpid(), pid);
+   ASSERT_EQ(getuid(), uid);
+   ASSERT_EQ(geteuid(), euid);
+
+   if (euid == 0) {
+      // nobody, the saved uid stays 0 so we can come back
+      ASSERT_EQ(setresuid(-1, 65534, -1), 0);
+      ASSERT_EQ(getuid(), uid);
+      ASSERT_EQ(geteuid(), 65534);
+      ASSERT_EQ(status_ids("Uid:", &real, &effective), 0);
+      ASSERT_EQ(effective, 65534);
+      ASSERT_EQ(setresuid(-1, 0, -1), 0);
+      ASSERT_EQ(geteuid(), 0);
+      ASSERT_EQ(getpid(), pid);
+   }
+   ASSERT_EQ(status_ids("Uid:", &real, &effective), 0);
+   ASSERT_EQ(real, getuid());
+   ASSERT_EQ(effective, geteuid());
+   ASSERT_EQ(status_ids("Gid:", &real, &effective), 0);
+   ASSERT_EQ(real, getgid());
+   ASSERT_EQ(effective, getegid());
+
+   PASS();
+}
+
 GREATEST_MAIN_DEFS();
 
 int main(int argc, char* argv[])
@@ -116,6 +183,7 @@ int main(int argc, char* argv[])
    RUN_TEST(getgroups_smoke);
    RUN_TEST(getgroups_print);
    RUN_TEST(getXXid);
+   RUN_TEST(setXid_fastpath);
 
    GREATEST_PRINT_REPORT();
    return greatest_info.failed;
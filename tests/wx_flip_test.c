@@ -0,0 +1,93 @@
+/*
+ * Copyright 2021 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * JIT style W^X benchmark: pages of a code arena are made writable, patched, and made read/exec
+ * again, at random. Checks that a write to a read/exec page faults, then prints flips per second.
+ * Compare host and guest page table mprotect, e.g.
+ *
+ *    km wx_flip_test.km 4096 1000000
+ *    km --pt-mprotect wx_flip_test.km 4096 1000000
+ */
+
+#include <err.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#define PAGE 4096
+
+static sigjmp_buf jbuf;
+static void* volatile fault_addr;
+
+static void segv_handler(int sig, siginfo_t* info, void* ucontext)
+{
+   fault_addr = info->si_addr;
+   siglongjmp(jbuf, 1);
+}
+
+int main(int argc, char** argv)
+{
+   struct sigaction sa = {.sa_sigaction = segv_handler, .sa_flags = SA_SIGINFO};
+   struct timespec start, end;
+
+   if (argc != 3) {
+      errx(1, "usage: %s pages flips", argv[0]);
+   }
+   long pages = atol(argv[1]);
+   long flips = atol(argv[2]);
+   char* arena = mmap(0, pages * PAGE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (arena == MAP_FAILED) {
+      err(1, "mmap %ld pages", pages);
+   }
+
+   sigaction(SIGSEGV, &sa, NULL);
+   char* target = arena + pages / 2 * PAGE + 8;
+   if (sigsetjmp(jbuf, 1) == 0) {
+      *(volatile char*)target = 1;
+      errx(1, "write to a read/exec page didn't fault");
+   }
+   if (fault_addr != target) {
+      errx(1, "fault at %p, expected %p", fault_addr, target);
+   }
+   signal(SIGSEGV, SIG_DFL);
+
+   uint64_t x = 88172645463325252ul;   // xorshift64
+   uint64_t sum = 0;
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (long i = 0; i < flips; i++) {
+      x ^= x << 13;
+      x ^= x >> 7;
+      x ^= x << 17;
+      char* p = arena + x % pages * PAGE;
+      if (mprotect(p, PAGE, PROT_READ | PROT_WRITE) != 0) {
+         err(1, "mprotect rw %p", p);
+      }
+      p[i % PAGE] = (char)i;
+      if (mprotect(p, PAGE, PROT_READ | PROT_EXEC) != 0) {
+         err(1, "mprotect rx %p", p);
+      }
+      sum += (unsigned char)p[i % PAGE];
+   }
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+   printf("%ld pages: %.0f flips/sec (%lu)\n", pages, flips / secs, sum);
+   return 0;
+}